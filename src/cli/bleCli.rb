@@ -48,8 +48,55 @@ ACTIONS = {
 
 TASKS = {
     :short => "-t",
-    :large => "--tasks",
-    :help  => "Obtain a json with tasks info",
+    :large => "--tasks [prefix]",
+    :help  => "Obtain the tasks info with their runtime stats, only the tasks whose name starts with prefix if given",
+    :type  => String
+}
+
+STATS = {
+    :short => "-s",
+    :large => "--stats",
+    :help  => "Obtain gateway statistics (callback durations, rx ring counters)",
+}
+
+NODES = {
+    :short => "-n",
+    :large => "--nodes",
+    :help  => "Obtain per node link statistics (timeouts, retries, RTT percentiles)",
+}
+
+FLUSH = {
+    :short => "-f",
+    :large => "--flush-descriptors [addr]",
+    :help  => "Forget the cached sensor descriptors of a node, of every node without addr",
+    :type  => String
+}
+
+RULES = {
+    :short => "-r",
+    :large => "--rules [FILE]",
+    :help  => "Replace the alert rules of the gateway with the json array of FILE, list them without FILE",
+    :type  => String
+}
+
+DECODE_BENCH = {
+    :short => "-D",
+    :large => "--decode-bench FILE",
+    :help  => "Time on the gateway the decode of the actions of FILE as json and as binary, without running them",
+    :type  => String
+}
+
+BINARY = {
+    :short => "-B",
+    :large => "--binary",
+    :help  => "Send the actions in the compact binary format instead of json",
+}
+
+BATCH = {
+    :short => "-b",
+    :large => "--batch FILE",
+    :help  => "Send every line of FILE, a json with actions or a json with a cmd, without waiting between them",
+    :type  => String
 }
 
 EDITOR = {
@@ -67,6 +114,11 @@ HELP = {
 
 CMD = {
     :tasks => {'cmd' => 'tasks'},
+    :stats => {'cmd' => 'stats'},
+    :nodes => {'cmd' => 'nodes'},
+    :flush => {'cmd' => 'flush_descriptors'},
+    :rules => {'cmd' => 'rules'},
+    :decode_bench => {'cmd' => 'decode_bench', 'runs' => 100},
 }
 
 options = {}
@@ -76,8 +128,43 @@ command optparser, ACTIONS do
     options[:actions] = true
 end
 
-command optparser, TASKS do
+command optparser, TASKS do |prefix|
     options[:tasks] = true
+    CMD[:tasks]['prefix'] = prefix if !prefix.nil?
+end
+
+command optparser, STATS do
+    options[:stats] = true
+end
+
+command optparser, NODES do
+    options[:nodes] = true
+end
+
+command optparser, FLUSH do |addr|
+    options[:flush] = true
+    CMD[:flush]['addr'] = addr.upcase if !addr.nil?
+end
+
+command optparser, RULES do |file|
+    options[:rules] = true
+    CMD[:rules]['rules'] = JSON.parse(File.read(file)) if !file.nil?
+end
+
+command optparser, DECODE_BENCH do |file|
+    options[:decode_bench] = true
+    json = JSON.parse(File.read(file))
+    ActionParser.new.load_json(json)
+    CMD[:decode_bench]['json'] = json
+    CMD[:decode_bench]['bin'] = ActionEncoder.new.encode(json).unpack1('H*')
+end
+
+command optparser, BINARY do
+    options[:binary] = true
+end
+
+command optparser, BATCH do |file|
+    options[:batch] = file
 end
 
 command optparser, EDITOR do |elems|
@@ -109,50 +196,64 @@ end
 
 config = YAML::load_file(CONFIG_FILE)
 
-if options[:actions]
-    begin
+# [topic, json, format] of every request, all of them go through one connection
+requests = []
+
+# actions go as json or binary, commands always as json
+actions_topic  = options[:binary] ? config[:mqtt_ble][:topics][:topic_bin] : config[:mqtt_ble][:topics][:topic_pub]
+actions_format = options[:binary] ? :binary : :json
 
+begin
+    if options[:actions]
         # Build json
         actions = ActionParser.new
         actions.create_json(editor)
         puts
 
-        # create mqtt object
-        mqtt_client = MQTT.new(config[:mqtt_ble])
+        requests << [actions_topic, actions.actions_json, actions_format]
+    end
 
-        # Send json and prompt response
-        mqtt_client.send_json(actions.actions_json)
-    rescue PahoMqtt::Exception => e
-        STDERR.puts "#{"Exception".bold.red} => #{e.class}: #{e.message}\n"\
-                    "Ensule that mqtt is powered on."
-        exit 1
-    rescue Timeout::Error => e
-        STDERR.puts "#{"Exception".bold.red} => #{e.class}: #{e.message}\n"\
-                    "The client spent more time than #{mqtt_client.time_to_wait} seconds. Set more timeout in #{CONFIG_FILE}"
-        exit 1
-    rescue Exception => e
-        STDERR.puts "#{"Exception".bold.red} => #{e.class}: #{e.message}\n#{e.backtrace.join("\n")}."
-        exit 1
+    if options[:batch]
+        File.foreach(options[:batch]) do |line|
+            next if line.strip.empty?
+
+            json = JSON.parse(line)
+            if json.key? 'cmd'
+                requests << [config[:mqtt_cmd][:topics][:topic_pub], json]
+            else
+                ActionParser.new.load_json(json)
+                requests << [actions_topic, json, actions_format]
+            end
+        end
     end
+
+    CMD.each_key do |cmd|
+        requests << [config[:mqtt_cmd][:topics][:topic_pub], CMD[cmd]] if options[cmd]
+    end
+rescue Exception => e
+    STDERR.puts "#{"Exception".bold.red} => #{e.class}: #{e.message}"
+    exit 1
 end
 
-if options[:tasks]
-    begin
-        # create mqtt object
-        mqtt_client = MQTT.new(config[:mqtt_cmd])
+exit 0 if requests.empty?
 
-        # Send json and prompt response
-        mqtt_client.send_json(CMD[:tasks])
-    rescue PahoMqtt::Exception => e
-        STDERR.puts "#{"Exception".bold.red} => #{e.class}: #{e.message}\n"\
-                    "Ensule that mqtt is powered on."
-        exit 1
-    rescue Timeout::Error => e
-        STDERR.puts "#{"Exception".bold.red} => #{e.class}: #{e.message}\n"\
-                    "The client spent more time than #{mqtt_client.time_to_wait} seconds. Set more timeout in #{CONFIG_FILE}"
-        exit 1
-    rescue Exception => e
-        STDERR.puts "#{"Exception".bold.red} => #{e.class}: #{e.message}\n#{e.backtrace.join("\n")}."
-        exit 1
-    end
-end
\ No newline at end of file
+begin
+    # create mqtt object, it waits as long as the slowest kind of request
+    mqtt_client = MQTT.new(config[:mqtt_ble])
+    mqtt_client.time_to_wait = [config[:mqtt_ble][:time_to_wait_response], config[:mqtt_cmd][:time_to_wait_response]].compact.max || mqtt_client.time_to_wait
+
+    # Send every json and prompt their responses
+    mqtt_client.send_all(requests)
+    mqtt_client.disconnect
+rescue PahoMqtt::Exception => e
+    STDERR.puts "#{"Exception".bold.red} => #{e.class}: #{e.message}\n"\
+                "Ensule that mqtt is powered on."
+    exit 1
+rescue Timeout::Error => e
+    STDERR.puts "#{"Exception".bold.red} => #{e.class}: #{e.message}\n"\
+                "The client spent more time than #{mqtt_client.time_to_wait} seconds. Set more timeout in #{CONFIG_FILE}"
+    exit 1
+rescue Exception => e
+    STDERR.puts "#{"Exception".bold.red} => #{e.class}: #{e.message}\n#{e.backtrace.join("\n")}."
+    exit 1
+end
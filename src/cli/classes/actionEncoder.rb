@@ -0,0 +1,109 @@
+# Encode the json of the actions in the binary format of /sensors/actions/ble/bin:
+# a subset of CBOR (RFC 8949) with integer keys, see action_bin.h in the gateway.
+
+class ActionEncoder
+
+    KEYS = {
+        'opcode'         => 1,
+        'addr'           => 2,
+        'sensor_prop_id' => 3,
+        'auto'           => 4,
+        'delay'          => 5,
+        'name'           => 6,
+        'group'          => 7,
+        'max_age'        => 8,
+        'refresh'        => 9,
+        'op'             => 10,
+        'prefix'         => 11,
+        'addr_min'       => 12,
+        'addr_max'       => 13,
+        'all'            => 14,
+        'set'            => 15
+    }
+    private_constant :KEYS
+
+    OPCODES = {
+        'GET_DESCRIPTOR' => 0x8230,
+        'GET_STATUS'     => 0x8231
+    }
+    private_constant :OPCODES
+
+    OPS = {
+        'update' => 1,
+        'pause'  => 2,
+        'resume' => 3,
+        'remove' => 4
+    }
+    private_constant :OPS
+
+    public
+
+    def encode(json)
+        message = {}
+        message[0] = json['request_id'] if json.key? 'request_id' # it goes first
+        message[1] = json['actions'].map { |action| encode_action(action) }
+        item(message)
+    end
+
+    private
+
+    def encode_action(action)
+        encoded = {}
+
+        action.each do |key, value|
+            raise Exception, "#{key} can not be sent in binary" if !KEYS.key? key
+
+            encoded[KEYS[key]] = case key
+                when 'opcode'                 then OPCODES.fetch(value)
+                when 'op'                     then OPS.fetch(value)
+                when 'max_age'                then (value * 1000).round # seconds -> ms
+                when 'addr', 'sensor_prop_id' then hex_values(value)
+                when 'addr_min', 'addr_max'   then value.to_i(16)
+                when 'set'                    then value.map { |k, v| [KEYS.fetch(k), k == 'delay' ? v : v.to_i(16)] }.to_h
+                else value
+            end
+        end
+        encoded
+    end
+
+    # "0102", ["0102", "0104"] or {"from": "0100", "to": "01FF"}
+    def hex_values(value)
+        case value
+        when Array then value.map { |hex| hex.to_i(16) }
+        when Hash  then { 0 => value['from'].to_i(16), 1 => value['to'].to_i(16) }
+        else value.to_i(16)
+        end
+    end
+
+    def item(value)
+        case value
+        when Integer
+            raise Exception, "#{value} does not fit in 32 bits" if value < 0 || value >= 2**32
+            head(0, value)
+        when String
+            head(3, value.bytesize) + value.b
+        when true
+            "\xF5".b
+        when false
+            "\xF4".b
+        when Array
+            value.inject(head(4, value.length)) { |out, elem| out + item(elem) }
+        when Hash
+            value.inject(head(5, value.length)) { |out, (k, v)| out + item(k) + item(v) }
+        else
+            raise Exception, "#{value.class} can not be sent in binary"
+        end
+    end
+
+    def head(major, value)
+        if value < 24
+            [(major << 5) | value].pack('C')
+        elsif value < 2**8
+            [(major << 5) | 24, value].pack('CC')
+        elsif value < 2**16
+            [(major << 5) | 25, value].pack('Cn')
+        else
+            [(major << 5) | 26, value].pack('CN')
+        end
+    end
+end
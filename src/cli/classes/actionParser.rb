@@ -17,6 +17,25 @@ class ActionParser
     ]
     private_constant :OPCODES
 
+    # actions on the tasks already created, selected by SELECTORS
+    OPS = [
+        'update',
+        'pause',
+        'resume',
+        'remove'
+    ]
+    private_constant :OPS
+
+    SELECTORS = [
+        'name',
+        'prefix',
+        'addr',
+        'addr_min',
+        'addr_max',
+        'group'
+    ]
+    private_constant :SELECTORS
+
     HEX_VALUES = [
         '0', '1',
         '2', '3',
@@ -53,6 +72,12 @@ class ActionParser
         #File.delete TEMP_FILE
     end
 
+    # Check a json built without the editor, a line of a batch file
+    def load_json(json)
+        @actions_json = json
+        check_json
+    end
+
     private
 
     def parse_json
@@ -71,8 +96,15 @@ class ActionParser
         else
             @actions_json['actions'].each do |elem|
 
+                # update, pause, resume or remove the selected tasks
+                if elem.key? 'op'
+                    raise Exception, "op value invalid. Has to be within #{OPS.to_s}" if !OPS.include? elem['op']
+                    raise Exception, "op needs a selection within #{SELECTORS.to_s} or all" if (SELECTORS & elem.keys).empty? && elem['all'] != true
+                    if elem['op'] == 'update'
+                        raise Exception, "update needs set with delay, addr or sensor_prop_id" if !elem['set'].is_a?(Hash) || (['delay', 'addr', 'sensor_prop_id'] & elem['set'].keys).empty?
+                    end
                 # remove task
-                if elem.keys.length == 1
+                elsif elem.keys.length == 1
                     raise Exception, "To remove a task only add name field in json" if !elem.keys.include? 'name'
                 else
 
@@ -80,10 +112,22 @@ class ActionParser
                     raise Exception, "Missing opcode. Has to be within #{OPCODES.to_s}" if !elem.key? 'opcode'
                     raise Exception, "Opcode value invalid. Has to be within #{OPCODES.to_s}" if !OPCODES.include? elem['opcode']
 
-                    # addr
+                    # addr: "0102", a list ["0102", "0104"] or a range {"from": "0100", "to": "01FF"}
                     raise Exception, "Missing addr param. Contains the addr to send the message" if !elem.key? 'addr'
-                    raise Exception, "addr is not correct. Has to be 4 length" if elem['addr'].length != 4
-                    raise Exception, "addr contains an invalid character. Has to be a value within #{HEX_VALUES.to_s}" if !addr_hex_correct? elem['addr']
+                    case elem['addr']
+                    when String
+                        check_hex('addr', elem['addr'])
+                    when Array
+                        raise Exception, "addr list is empty" if elem['addr'].empty?
+                        elem['addr'].each { |addr| check_hex('addr', addr) }
+                    when Hash
+                        raise Exception, "addr range needs from and to" if !elem['addr'].key?('from') || !elem['addr'].key?('to')
+                        check_hex('addr', elem['addr']['from'])
+                        check_hex('addr', elem['addr']['to'])
+                        raise Exception, "addr range from is greater than to" if elem['addr']['from'].hex > elem['addr']['to'].hex
+                    else
+                        raise Exception, "addr has to be a string, a list or a range"
+                    end
 
                     # if auto is required then delay, name
                     if is_auto_required?(elem['opcode']) && elem.key?('auto') && elem['auto']
@@ -96,16 +140,32 @@ class ActionParser
 
                         # name
                         raise Exception, "Missing name param. Contains the task's name" if !elem.key? 'name'
+
+                        # max_age and refresh only apply to one-time tasks
+                        elem.delete 'max_age'
+                        elem.delete 'refresh'
                     else
                         # Remove, if they are, to not send unnecesary data
                         elem.delete 'auto'
                         elem.delete 'delay'
                         elem.delete 'name'
+
+                        # max_age, in seconds. Answer from the gateway cache if the last value is newer
+                        if elem.key? 'max_age'
+                            raise Exception, "max_age is only valid for GET_STATUS" if !is_auto_required?(elem['opcode'])
+                            raise Exception, "max_age has to be a positive number of seconds" if !elem['max_age'].is_a?(Numeric) || elem['max_age'] <= 0
+                        end
+
+                        # refresh, GET_DESCRIPTOR is answered from the gateway cache unless it is true
+                        if elem.key? 'refresh'
+                            raise Exception, "refresh is only valid for GET_DESCRIPTOR" if elem['opcode'] != 'GET_DESCRIPTOR'
+                            raise Exception, "refresh has to be true or false" if ![true, false].include? elem['refresh']
+                        end
                     end
 
+                    # sensor_prop_id: "0056" or a list ["0056", "0057"]
                     if elem.key? 'sensor_prop_id'
-                        raise Exception, "sensor_prop_id is not correct. Has to be 4 length" if elem['sensor_prop_id'].length != 4
-                        raise Exception, "sensor_prop_id contains an invalid character. Has to be a value within #{HEX_VALUES.to_s}" if !addr_hex_correct? elem['sensor_prop_id']
+                        Array(elem['sensor_prop_id']).each { |prop| check_hex('sensor_prop_id', prop) }
                     end
 
                 end
@@ -116,6 +176,11 @@ class ActionParser
         end
     end
 
+    def check_hex(param, value)
+        raise Exception, "#{param} is not correct. Has to be 4 length" if !value.is_a?(String) || value.length != 4
+        raise Exception, "#{param} contains an invalid character. Has to be a value within #{HEX_VALUES.to_s}" if !addr_hex_correct? value
+    end
+
     def addr_hex_correct?(addr)
         addr.each_char do |char|
             if !(HEX_VALUES.include? char.upcase)
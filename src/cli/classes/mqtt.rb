@@ -1,11 +1,13 @@
 require 'timeout'
+require 'actionEncoder'
 
 class MQTT
 
     DEFAULT_TIME = 5
     private_constant :DEFAULT_TIME
 
-    attr_reader :time_to_wait
+    attr_reader :topic_pub
+    attr_accessor :time_to_wait
 
     public
 
@@ -22,73 +24,134 @@ class MQTT
         @topic_pub    = config_mqtt[:topics][:topic_pub]
         @topic_sub    = config_mqtt[:topics][:topic_sub]
         @time_to_wait = config_mqtt[:time_to_wait_response] || DEFAULT_TIME
-        @client       = PahoMqtt::Client.new({:host => @ip, :port => @port, :ssl => false})
 
+        # one connection for every request, it reconnects by itself
+        @client       = PahoMqtt::Client.new({:host => @ip, :port => @port, :ssl => false, :persistent => true})
+        @connected    = false
+
+        # replies are matched with their request by request_id
+        @lock         = Mutex.new
+        @replied      = ConditionVariable.new
+        @pending      = {} # request_id => reply types still expected
+        @sent         = {} # every request_id of this session
+        @next_id      = 0
     end
 
+    # Send one json and prompt its responses
     def send_json(json)
-        puts "Sending json over mqtt..."
-
-        keys_to_wait = wait_keys(json) # condition to stop to receive message
+        send_all([[@topic_pub, json]])
+    end
 
-        ### Register a callback on message event to display messages
-        wait_message = true
-        @client.on_message do |message|
+    # Send every [topic, json, format] without waiting between them, then prompt
+    # the responses until all of them are answered. format is :json or
+    # :binary, the actions encoded by ActionEncoder.
+    def send_all(requests)
+        connect
 
-            response = JSON.parse(message.payload)
-            pp response
+        puts "Sending #{requests.length} json over mqtt..."
 
-            if keys_to_wait.empty?
-                wait_message = false
-            elsif (response.key? "type" and keys_to_wait.include? response["type"])
-                keys_to_wait.delete(response["type"])
-                wait_message = false
-            elsif response.key? "error_message" and response["error_message"] == true
-                wait_message = false
+        ids = requests.map do |topic, json, format|
+            request_id = "#{Process.pid}-#{@next_id += 1}"
+            @lock.synchronize do
+                @pending[request_id] = wait_keys(json)
+                @sent[request_id]    = true
             end
+
+            json    = json.merge('request_id' => request_id)
+            payload = format == :binary ? ActionEncoder.new.encode(json) : JSON[json]
+
+            ### Publlish a message on the topic with "retain == false" and "qos == 1"
+            @client.publish(topic, payload, false, 1)
+            request_id
+        end
+
+        wait_until("#{ids.length} responses") { ids.none? { |request_id| @pending.key? request_id } }
+    end
+
+    def disconnect
+        @client.disconnect if @connected
+        @connected = false
+    end
+
+    private
+
+    def connect
+        return if @connected
+
+        ### Register a callback on message event to display messages
+        @client.on_message do |message|
+            receive(JSON.parse(message.payload))
         end
 
         ### Register a callback on suback to assert the subcription
-        waiting_suback = true
+        subscribed = false
         @client.on_suback do
-            waiting_suback = false
+            @lock.synchronize do
+                subscribed = true
+                @replied.broadcast
+            end
         end
 
-        ### Connect to the eclipse test server on port 1883 (Unencrypted mode)
         @client.connect
 
         ### Subscribe to a topic
-        @client.subscribe(@topic_sub, 1) # accept a list with [topic, qos]
+        @client.subscribe([@topic_sub, 1])
 
         ### Waiting for the suback answer and excute the previously set on_suback callback
-        while waiting_suback do
-            sleep 0.001
+        wait_until("the subscription") { subscribed }
+        @connected = true
+    end
+
+    # Wait, without polling, until the block is true or the time is over
+    def wait_until(what)
+        deadline = Time.now + @time_to_wait
+        @lock.synchronize do
+            until yield
+                left = deadline - Time.now
+                raise Timeout::Error, "No #{what} in #{@time_to_wait} seconds" if left <= 0
+                @replied.wait(@lock, left)
+            end
         end
+    end
+
+    # Called by the client thread on every message of topic_sub
+    def receive(response)
+        request_id = response["request_id"]
+
+        @lock.synchronize do
+            # answers of other clients
+            return if request_id.nil? or !@sent.key? request_id
 
-        ### Publlish a message on the topic @topic with "retain == false" and "qos == 1"
-        @client.publish(@topic_pub, JSON[json], false, 1)
+            pp response
+
+            keys_to_wait = @pending[request_id]
+            return if keys_to_wait.nil? # already answered, a late reply
 
-        Timeout::timeout(@time_to_wait) do
-            while wait_message do
-                sleep 0.001
+            if response["type"] == "TASKS" and response["page"] + 1 < response["pages"]
+                # the tasks list comes in pages, wait for the last one
+                return
+            elsif response.key? "error_message" and response["error_message"] == true
+                keys_to_wait.clear
+            elsif response.key? "type" and keys_to_wait.include? response["type"]
+                keys_to_wait.delete_at(keys_to_wait.index(response["type"]))
             end
-        end
 
-        ### Calling an explicit disconnect
-        @client.disconnect
+            if keys_to_wait.empty?
+                @pending.delete(request_id)
+                @replied.broadcast
+            end
+        end
     end
 
-    private
-
     def wait_keys(json)
         keys = []
 
         if json.key? "actions"
             json["actions"].each do |elem|
-                keys << elem["opcode"] if elem["opcode"] != "GET_STATUS"
+                keys << elem["opcode"] if elem.key? "opcode" and elem["opcode"] != "GET_STATUS"
             end
         end
 
         return keys
     end
-end
\ No newline at end of file
+end
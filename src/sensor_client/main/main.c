@@ -8,6 +8,12 @@
 
 #include "source/sensor_model_client.h"
 #include "source/mqtt.h"
+#include "source/ble_cmd.h"
+#include "source/tasks_manager.h"
+#include "source/gateway_storage.h"
+#include "source/boot.h"
+#include "source/benchmark.h"
+#include "source/wall_clock.h"
 
 static const char *TAG = "Main-Client";
 
@@ -16,18 +22,16 @@ static const char *TAG = "Main-Client";
 /* Wifi */
 #define AP_RECONN_ATTEMPTS CONFIG_MAXIMUM_RETRY
 
-static bool connected = false;
-static SemaphoreHandle_t xSem_connected = NULL;
-
-static bool get_connected();
-static void set_connected(bool con);
 static void wifi_init_sta(void);
 static void wifi_event_handler(void* arg, esp_event_base_t event_base, int event_id, void* event_data);
 
 void app_main(void)
 {
+    init_boot();
+
     /* NVS */
     ESP_LOGI(TAG, "Initialising NVS");
+    boot_phase_begin(BOOT_NVS);
 
     esp_err_t err = nvs_flash_init();
     if (err == ESP_ERR_NVS_NO_FREE_PAGES) {
@@ -35,40 +39,43 @@ void app_main(void)
         err = nvs_flash_init();
     }
     ESP_ERROR_CHECK(err);
+    ESP_ERROR_CHECK(init_gateway_storage());
+    boot_phase_end(BOOT_NVS);
 
-    /* Wifi */
-    xSem_connected = xSemaphoreCreateMutex();
+    /* Wifi, it associates while the mesh is initialised */
+    boot_phase_begin(BOOT_WIFI);
     wifi_init_sta();
-    ESP_LOGI(TAG, "Waiting for wifi connection...");
-    while(!get_connected());
+    init_wall_clock();
+
+    // Queues and tasks to publish first, so what is produced during the boot is kept until MQTT is connected
+    ESP_ERROR_CHECK(init_mqtt());
 
     // BLE
     ESP_LOGI(TAG, "Initialising Ble and Bluetooth with sensor model -> client");
+    boot_phase_begin(BOOT_MESH);
     ESP_ERROR_CHECK(ble_mesh_init());
+    boot_phase_end(BOOT_MESH);
+
+    // Auto tasks saved before the reboot
+    boot_phase_begin(BOOT_TASKS);
+    init_tasks_manager();
+    init_task_scheduler();
+    boot_phase_end(BOOT_TASKS);
+
+#if CONFIG_GATEWAY_BENCHMARK
+    init_benchmark();
+#endif
 
     // MQTT
-    ESP_ERROR_CHECK(init_mqtt());
+    ESP_LOGI(TAG, "Waiting for wifi connection...");
+    boot_wait(BOOT_WIFI, portMAX_DELAY);
+    boot_phase_begin(BOOT_MQTT);
+    ESP_ERROR_CHECK(start_mqtt());
     /*****************************/
 
     vTaskDelete(NULL);
 }
 
-static bool get_connected()
-{
-    bool con;
-    while(xSemaphoreTake( xSem_connected, ( TickType_t ) 10 ) != pdTRUE);
-    con = connected;
-    xSemaphoreGive(xSem_connected);
-    return con;
-}
-
-static void set_connected(bool con)
-{
-    while(xSemaphoreTake( xSem_connected, ( TickType_t ) 10 ) != pdTRUE);
-    connected = con;
-    xSemaphoreGive(xSem_connected);
-}
-
 static void wifi_init_sta(void)
 {
 
@@ -114,10 +121,11 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base, int event
             ESP_LOGI(TAG, "retry to connect to the AP");
         }
         ESP_LOGI(TAG,"connect to the AP fail");
+        boot_phase_reset(BOOT_WIFI);
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
         s_retry_num = 0;
-        set_connected(true);
+        boot_phase_end(BOOT_WIFI);
     }
 }
\ No newline at end of file
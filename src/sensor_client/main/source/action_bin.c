@@ -0,0 +1,573 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_ble_mesh_sensor_model_api.h"
+
+#include "source/action_bin.h"
+
+static const char *TAG = "ActionBin";
+
+// CBOR major types
+#define MAJOR_UINT   0
+#define MAJOR_BYTES  2
+#define MAJOR_TEXT   3
+#define MAJOR_ARRAY  4
+#define MAJOR_MAP    5
+#define MAJOR_SIMPLE 7
+
+#define SIMPLE_FALSE 20
+#define SIMPLE_TRUE  21
+
+// keys of an action, see action_bin.h
+enum {
+    KEY_OPCODE = 1,
+    KEY_ADDR,
+    KEY_SENSOR_PROP_ID,
+    KEY_AUTO,
+    KEY_DELAY,
+    KEY_NAME,
+    KEY_GROUP,
+    KEY_MAX_AGE,
+    KEY_REFRESH,
+    KEY_OP,
+    KEY_PREFIX,
+    KEY_ADDR_MIN,
+    KEY_ADDR_MAX,
+    KEY_ALL,
+    KEY_SET
+};
+
+#define HAS(key) (1u << (key))
+
+/**
+ * @brief Read the head of an item: its major type and its value or length
+ * @retval false if the buffer ends or it uses 64 bits or indefinite lengths
+ */
+static bool read_head(action_bin_t *bin, uint8_t *major, uint32_t *value)
+{
+    if(bin->pos >= bin->len)
+        return false;
+
+    uint8_t initial = bin->data[bin->pos++];
+    uint8_t info = initial & 0x1F;
+    size_t extra = 0;
+
+    *major = initial >> 5;
+    if(info < 24)
+    {
+        *value = info;
+        return true;
+    }
+
+    if(info == 24)
+        extra = 1;
+    else if(info == 25)
+        extra = 2;
+    else if(info == 26)
+        extra = 4;
+    else
+        return false;
+
+    if(bin->len - bin->pos < extra)
+        return false;
+
+    *value = 0;
+    for(size_t i = 0; i < extra; i++)
+        *value = (*value << 8) | bin->data[bin->pos++];
+    return true;
+}
+
+static uint8_t peek_major(const action_bin_t *bin)
+{
+    return bin->pos < bin->len ? bin->data[bin->pos] >> 5 : 0xFF;
+}
+
+static bool read_of(action_bin_t *bin, uint8_t expected, uint32_t *value)
+{
+    uint8_t major;
+    return read_head(bin, &major, value) && major == expected;
+}
+
+static bool read_uint(action_bin_t *bin, uint32_t max, uint32_t *value)
+{
+    return read_of(bin, MAJOR_UINT, value) && *value <= max;
+}
+
+static bool read_bool(action_bin_t *bin, bool *value)
+{
+    uint32_t simple;
+    if(!read_of(bin, MAJOR_SIMPLE, &simple) || (simple != SIMPLE_FALSE && simple != SIMPLE_TRUE))
+        return false;
+    *value = simple == SIMPLE_TRUE;
+    return true;
+}
+
+/**
+ * @brief Read a text string and end it with \0, moving it one byte
+ * back over the last byte of its head
+ */
+static bool read_text(action_bin_t *bin, const char **text)
+{
+    uint32_t len;
+    if(!read_of(bin, MAJOR_TEXT, &len) || len > bin->len - bin->pos)
+        return false;
+
+    char *start = (char *) bin->data + bin->pos - 1;
+    memmove(start, bin->data + bin->pos, len);
+    start[len] = '\0';
+    bin->pos += len;
+
+    *text = start;
+    return true;
+}
+
+/**
+ * @brief Skip an item of a key that is not used
+ */
+static bool skip(action_bin_t *bin, int depth)
+{
+    uint8_t major;
+    uint32_t value;
+
+    if(depth > ACTION_BIN_MAX_DEPTH || !read_head(bin, &major, &value))
+        return false;
+
+    switch(major)
+    {
+        case MAJOR_BYTES:
+        case MAJOR_TEXT:
+            if(value > bin->len - bin->pos)
+                return false;
+            bin->pos += value;
+            return true;
+        case MAJOR_MAP:
+            // every item takes one byte at least
+            if(value > (bin->len - bin->pos) / 2)
+                return false;
+            value *= 2;
+            // fall through
+        case MAJOR_ARRAY:
+            for(uint32_t i = 0; i < value; i++)
+            {
+                if(!skip(bin, depth + 1))
+                    return false;
+            }
+            return true;
+        default:
+            return true; // integers and simple values, their head is all
+    }
+}
+
+/**
+ * @brief Read an array of uint16 values into a list
+ */
+static bool read_list(action_bin_t *bin, value_list_t *list)
+{
+    uint32_t count;
+    uint32_t value;
+
+    if(!read_of(bin, MAJOR_ARRAY, &count) || count == 0 || count > UINT16_MAX || count > bin->len - bin->pos)
+        return false;
+
+    list->bin = bin->data + bin->pos;
+    list->count = count;
+    for(uint32_t i = 0; i < count; i++)
+    {
+        if(!read_uint(bin, UINT16_MAX, &value))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Read the addr of a task: a value, a list or a range {0: from, 1: to}
+ */
+static bool read_addr(action_bin_t *bin, ble_task_t *task)
+{
+    uint32_t value;
+    uint32_t keys;
+    bool from = false;
+    bool to = false;
+
+    memset(&task->addr_list, 0, sizeof(value_list_t));
+
+    if(peek_major(bin) == MAJOR_ARRAY)
+        return read_list(bin, &task->addr_list);
+
+    if(peek_major(bin) == MAJOR_UINT)
+    {
+        if(!read_uint(bin, UINT16_MAX, &value))
+            return false;
+        task->addr = task->addr_last = value;
+        return true;
+    }
+
+    if(!read_of(bin, MAJOR_MAP, &keys))
+        return false;
+
+    for(uint32_t i = 0; i < keys; i++)
+    {
+        uint32_t key;
+        if(!read_uint(bin, 1, &key) || !read_uint(bin, UINT16_MAX, &value))
+            return false;
+        if(key == 0)
+        {
+            task->addr = value;
+            from = true;
+        }
+        else
+        {
+            task->addr_last = value;
+            to = true;
+        }
+    }
+    return from && to && task->addr <= task->addr_last;
+}
+
+static bool read_sensor_prop_id(action_bin_t *bin, ble_task_t *task)
+{
+    uint32_t value;
+
+    memset(&task->prop_list, 0, sizeof(value_list_t));
+
+    if(peek_major(bin) == MAJOR_ARRAY)
+        return read_list(bin, &task->prop_list);
+
+    if(!read_uint(bin, UINT16_MAX, &value))
+        return false;
+    task->sensor_prop_id = value;
+    return true;
+}
+
+/**
+ * @brief Read the "set" map of an update
+ */
+static bool read_set(action_bin_t *bin, task_update_t *update)
+{
+    uint32_t keys;
+    uint32_t key;
+    uint32_t value;
+
+    memset(update, 0, sizeof(task_update_t));
+    if(!read_of(bin, MAJOR_MAP, &keys))
+        return false;
+
+    for(uint32_t i = 0; i < keys; i++)
+    {
+        if(!read_uint(bin, UINT16_MAX, &key))
+            return false;
+
+        if(key == KEY_DELAY)
+        {
+            if(!read_uint(bin, TASK_MAX_DELAY, &value))
+                return false;
+            update->delay = value;
+        }
+        else if(key == KEY_ADDR || key == KEY_SENSOR_PROP_ID)
+        {
+            if(!read_uint(bin, UINT16_MAX, &value))
+                return false;
+            if(key == KEY_ADDR)
+            {
+                update->set_addr = true;
+                update->addr = value;
+            }
+            else
+            {
+                update->set_sensor_prop_id = true;
+                update->sensor_prop_id = value;
+            }
+        }
+        else if(!skip(bin, 1))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Read one action map and build it like build_task does with a json one
+ * @retval -1 if the buffer is malformed, 0 if the action is not valid, 1 if it is built
+ */
+static int read_action(action_bin_t *bin, action_t *action, message_t *messages)
+{
+    uint32_t keys;
+    uint32_t has = 0;
+    uint32_t opcode = 0;
+    uint32_t op = 0;
+    uint32_t delay = 0;
+    uint32_t group = 0;
+    uint32_t max_age = 0;
+    uint32_t addr_min = 0x0000;
+    uint32_t addr_max = 0xFFFF;
+    bool auto_task = false;
+    bool refresh = false;
+    bool all = false;
+    const char *name = NULL;
+    const char *prefix = NULL;
+
+    if(!read_of(bin, MAJOR_MAP, &keys))
+        return -1;
+
+    for(uint32_t i = 0; i < keys; i++)
+    {
+        uint32_t key;
+        bool ok;
+
+        if(!read_uint(bin, UINT16_MAX, &key))
+            return -1;
+
+        switch(key)
+        {
+            case KEY_OPCODE:         ok = read_uint(bin, UINT32_MAX, &opcode); break;
+            case KEY_ADDR:           ok = read_addr(bin, &action->task); break;
+            case KEY_SENSOR_PROP_ID: ok = read_sensor_prop_id(bin, &action->task); break;
+            case KEY_AUTO:           ok = read_bool(bin, &auto_task); break;
+            case KEY_DELAY:          ok = read_uint(bin, TASK_MAX_DELAY, &delay); break;
+            case KEY_NAME:           ok = read_text(bin, &name); break;
+            case KEY_GROUP:          ok = read_uint(bin, UINT8_MAX, &group); break;
+            case KEY_MAX_AGE:        ok = read_uint(bin, UINT32_MAX, &max_age); break;
+            case KEY_REFRESH:        ok = read_bool(bin, &refresh); break;
+            case KEY_OP:             ok = read_uint(bin, ACTION_BIN_OP_REMOVE, &op); break;
+            case KEY_PREFIX:         ok = read_text(bin, &prefix); break;
+            case KEY_ADDR_MIN:       ok = read_uint(bin, UINT16_MAX, &addr_min); break;
+            case KEY_ADDR_MAX:       ok = read_uint(bin, UINT16_MAX, &addr_max); break;
+            case KEY_ALL:            ok = read_bool(bin, &all); break;
+            case KEY_SET:            ok = read_set(bin, &action->update); break;
+            default:                 ok = skip(bin, 1); break;
+        }
+        if(!ok)
+            return -1;
+        if(key < 32)
+            has |= HAS(key);
+    }
+
+    // Action on the tasks already created
+    if(has & HAS(KEY_OP))
+    {
+        task_filter_t *filter = &action->filter;
+        task_filter_init(filter);
+
+        // one addr, a list or a range do not select tasks
+        if((has & HAS(KEY_ADDR)) && (action->task.addr_list.count > 0 || action->task.addr != action->task.addr_last))
+        {
+            add_message_text_plain(messages, true, "Op needs one addr, or addr_min and addr_max");
+            return 0;
+        }
+
+        filter->name = name;
+        filter->prefix = prefix;
+        if(has & HAS(KEY_ADDR))
+        {
+            filter->addr_min = filter->addr_max = action->task.addr;
+        }
+        if(has & HAS(KEY_ADDR_MIN))
+            filter->addr_min = addr_min;
+        if(has & HAS(KEY_ADDR_MAX))
+            filter->addr_max = addr_max;
+        filter->group = group;
+
+        if(!(has & (HAS(KEY_NAME) | HAS(KEY_PREFIX) | HAS(KEY_ADDR) | HAS(KEY_ADDR_MIN) | HAS(KEY_ADDR_MAX))) && group == 0 && !all)
+        {
+            add_message_text_plain(messages, true, "Op needs name, prefix, addr, addr_min, addr_max, group or all");
+            return 0;
+        }
+
+        switch(op)
+        {
+            case ACTION_BIN_OP_UPDATE: action->opmode = UPDATE; break;
+            case ACTION_BIN_OP_PAUSE:  action->opmode = PAUSE;  break;
+            case ACTION_BIN_OP_RESUME: action->opmode = RESUME; break;
+            case ACTION_BIN_OP_REMOVE: action->opmode = REMOVE; break;
+            default:
+                add_message_text_plain(messages, true, "Unknown op %u", op);
+                return 0;
+        }
+
+        if(action->opmode == UPDATE && action->update.delay == 0
+           && !action->update.set_addr && !action->update.set_sensor_prop_id)
+        {
+            add_message_text_plain(messages, true, "Op update needs set with delay, addr or sensor_prop_id");
+            return 0;
+        }
+        return 1;
+    }
+
+    // Task to delete
+    if(has == HAS(KEY_NAME))
+    {
+        action->opmode = REMOVE;
+        task_filter_init(&action->filter);
+        action->filter.name = name;
+        return 1;
+    }
+
+    // Task to create
+    if((has & HAS(KEY_OPCODE)) && (has & HAS(KEY_ADDR)))
+    {
+        ble_task_t *task = &action->task;
+
+        if(opcode != ESP_BLE_MESH_MODEL_OP_SENSOR_DESCRIPTOR_GET && opcode != ESP_BLE_MESH_MODEL_OP_SENSOR_GET)
+        {
+            add_message_text_plain(messages, true, "Unknown opcode 0x%04x", opcode);
+            return 0;
+        }
+
+        action->opmode  = CREATE;
+        task->opcode    = opcode;
+        task->max_age   = max_age;
+        task->refresh   = refresh;
+        task->auto_task = false;
+
+        // only GET_STATUS can be periodic, as with json
+        if(auto_task && opcode == ESP_BLE_MESH_MODEL_OP_SENSOR_GET)
+        {
+            if(name == NULL)
+            {
+                ESP_LOGE(TAG, "Auto task without name");
+                add_message_text_plain(messages, true, "Auto task without name");
+                return 0;
+            }
+            task->auto_task = true;
+            task->name  = strdup(name);
+            task->delay = delay > 0 ? delay : 1;
+            task->group = group;
+        }
+        return 1;
+    }
+
+    ESP_LOGE(TAG, "Error processing a task!");
+    add_message_text_plain(messages, true, "Error processing a task!");
+    return 0;
+}
+
+/**
+ * @brief Start reading a binary message
+ * @param bin: reader to init
+ * @param data: message, it is modified
+ * @param len: bytes of data
+ * @param request_id: its request_id, NULL if it has none
+ * @retval false if it is not a map
+ */
+bool action_bin_open(action_bin_t *bin, uint8_t *data, size_t len, const char **request_id)
+{
+    bin->data = data;
+    bin->len  = len;
+    bin->pos  = 0;
+    *request_id = NULL;
+
+    if(!read_of(bin, MAJOR_MAP, &bin->keys))
+        return false;
+
+    // key 0, encoded as the byte 0x00
+    if(bin->keys > 0 && bin->pos < bin->len && bin->data[bin->pos] == 0x00)
+    {
+        bin->pos++;
+        bin->keys--;
+        if(!read_text(bin, request_id))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Build the actions of a message opened with action_bin_open
+ * @param bin: reader
+ * @param messages: struct to store messages for giving feedback to the user
+ * @param size: number of actions built
+ * @retval array of actions, NULL if there are none
+ */
+action_t* action_bin_actions(action_bin_t *bin, message_t *messages, int *size)
+{
+    action_t *acts = NULL;
+    uint32_t count = 0;
+    int index = 0;
+    bool found = false;
+
+    *size = 0;
+    for(uint32_t i = 0; i < bin->keys; i++)
+    {
+        uint32_t key;
+        if(!read_uint(bin, UINT16_MAX, &key))
+            goto malformed;
+
+        if(key != 1 || found)
+        {
+            if(!skip(bin, 1))
+                goto malformed;
+            continue;
+        }
+
+        // every action takes one byte at least
+        found = true;
+        if(!read_of(bin, MAJOR_ARRAY, &count) || count > bin->len - bin->pos)
+            goto malformed;
+        if(count == 0)
+            break;
+
+        acts = (action_t *) calloc(count, sizeof(action_t));
+        if(acts == NULL)
+        {
+            add_message_text_plain(messages, true, "No memory for %u actions", count);
+            return NULL;
+        }
+
+        for(uint32_t a = 0; a < count; a++)
+        {
+            int built = read_action(bin, &acts[index], messages);
+            if(built < 0)
+                goto malformed;
+            if(built > 0)
+                index++;
+            else
+                memset(&acts[index], 0, sizeof(action_t));
+        }
+    }
+
+    if(!found)
+    {
+        ESP_LOGE(TAG, "Action list required");
+        add_message_text_plain(messages, true, "Action list required");
+    }
+    else if(count == 0)
+    {
+        ESP_LOGE(TAG, "Action size is zero");
+        add_message_text_plain(messages, true, "Action size is zero");
+    }
+
+    *size = index;
+    return acts;
+
+malformed:
+    // nothing after a wrong length can be trusted, none of the actions is run
+    ESP_LOGE(TAG, "Malformed binary actions at byte %u", (unsigned) bin->pos);
+    add_message_text_plain(messages, true, "Malformed binary actions at byte %u", (unsigned) bin->pos);
+    for(int a = 0; a < index; a++)
+    {
+        if(acts[a].opmode == CREATE && acts[a].task.auto_task)
+            free(acts[a].task.name);
+    }
+    free(acts);
+    return NULL;
+}
+
+/**
+ * @brief Values of a list of an action, see value_list_t
+ * @param items: first item of the array, already checked by action_bin_actions
+ * @param count: items of the array
+ * @param values: count values
+ */
+void action_bin_values(const uint8_t *items, uint16_t count, uint16_t *values)
+{
+    // the heads were checked, an uint16 takes 3 bytes at most
+    action_bin_t bin = { .data = (uint8_t *) items, .len = (size_t) count * 3, .pos = 0 };
+    uint32_t value = 0;
+
+    for(uint16_t i = 0; i < count; i++)
+    {
+        read_uint(&bin, UINT16_MAX, &value);
+        values[i] = value;
+    }
+}
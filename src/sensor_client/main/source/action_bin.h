@@ -0,0 +1,76 @@
+#ifndef _ACTION_BIN_H_
+#define _ACTION_BIN_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "source/ble_cmd.h"
+#include "source/messages_parser.h"
+
+/*
+ * Binary actions received in /sensors/actions/ble/bin, the same actions as
+ * the json ones in a subset of CBOR (RFC 8949): unsigned integers, text
+ * strings, arrays, maps and true/false, always with definite lengths.
+ * Maps use integer keys:
+ *
+ *   message: {0: request_id, 1: [action, ...]}, request_id is optional and goes first
+ *   action:  1 opcode (uint, BLE Mesh opcode: 0x8230 GET_DESCRIPTOR, 0x8231 GET_STATUS)
+ *            2 addr (uint, [uint, ...] or {0: from, 1: to})
+ *            3 sensor_prop_id (uint or [uint, ...])
+ *            4 auto (bool)     5 delay (uint, s)    6 name (text)    7 group (uint)
+ *            8 max_age (uint, ms)                   9 refresh (bool)
+ *            10 op (uint: 1 update, 2 pause, 3 resume, 4 remove)
+ *            11 prefix (text)  12 addr_min (uint)   13 addr_max (uint)  14 all (bool)
+ *            15 set ({5: delay, 2: addr, 3: sensor_prop_id})
+ *
+ * Unknown keys are skipped. The actions are built while the buffer is read,
+ * there is no tree: every length is checked against the buffer and text
+ * strings are ended with \0 in place, moving them one byte back over their
+ * header. The actions point into the buffer, it has to outlive them.
+ */
+#define ACTION_BIN_MAX_DEPTH 4 // nesting of the items skipped
+
+typedef enum {
+    ACTION_BIN_OP_UPDATE = 1,
+    ACTION_BIN_OP_PAUSE  = 2,
+    ACTION_BIN_OP_RESUME = 3,
+    ACTION_BIN_OP_REMOVE = 4
+} action_bin_op_t;
+
+/* reader of a binary message */
+typedef struct action_bin_t {
+    uint8_t *data;
+    size_t len;
+    size_t pos;
+    uint32_t keys; // keys left in the message map
+} action_bin_t;
+
+/**
+ * @brief Start reading a binary message
+ * @param bin: reader to init
+ * @param data: message, it is modified
+ * @param len: bytes of data
+ * @param request_id: its request_id, NULL if it has none
+ * @retval false if it is not a map
+ */
+bool action_bin_open(action_bin_t *bin, uint8_t *data, size_t len, const char **request_id);
+
+/**
+ * @brief Build the actions of a message opened with action_bin_open
+ * @param bin: reader
+ * @param messages: struct to store messages for giving feedback to the user
+ * @param size: number of actions built
+ * @retval array of actions, NULL if there are none
+ */
+action_t* action_bin_actions(action_bin_t *bin, message_t *messages, int *size);
+
+/**
+ * @brief Values of a list of an action, see value_list_t
+ * @param items: first item of the array, already checked by action_bin_actions
+ * @param count: items of the array
+ * @param values: count values
+ */
+void action_bin_values(const uint8_t *items, uint16_t count, uint16_t *values);
+
+#endif
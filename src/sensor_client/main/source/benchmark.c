@@ -0,0 +1,149 @@
+#include "sdkconfig.h"
+
+#if CONFIG_GATEWAY_BENCHMARK
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_ble_mesh_sensor_model_api.h"
+
+#include "source/benchmark.h"
+#include "source/mesh_rx_ring.h"
+#include "source/histogram.h"
+#include "source/messages_parser.h"
+#include "source/task_placement.h"
+
+static const char* TAG = "Benchmark";
+
+#define BENCHMARK_PROPERTY   0x0056
+#define BENCHMARK_LOG_PERIOD 10000000 // us
+
+static uint32_t injected;
+static uint32_t lost;      // the rx ring was full
+static uint32_t published;
+static histogram_t latency; // ms, from the callback time to the publish
+static uint32_t jitter;     // us, RFC 3550 interarrival jitter of the latency
+static int64_t last_latency;
+static int64_t started;
+
+/**
+ * @brief Build a Sensor Status with one marshalled reading
+ */
+static void fill_status(mesh_rx_t *rx, uint16_t addr, uint8_t value)
+{
+    uint16_t mpid = ESP_BLE_MESH_SENSOR_DATA_FORMAT_A_MPID(0, BENCHMARK_PROPERTY); // 1 byte of data
+
+    memset(rx, 0, sizeof(mesh_rx_t));
+    rx->timestamp = esp_timer_get_time();
+    rx->event     = ESP_BLE_MESH_SENSOR_CLIENT_GET_STATE_EVT;
+    rx->opcode    = ESP_BLE_MESH_MODEL_OP_SENSOR_GET;
+    rx->recv_op   = ESP_BLE_MESH_MODEL_OP_SENSOR_STATUS;
+    rx->addr      = addr;
+    rx->ttl       = CONFIG_NODE_DEFAULT_TTL;
+    rx->data[0]   = mpid & 0xFF;
+    rx->data[1]   = mpid >> 8;
+    rx->data[2]   = value;
+    rx->len       = 3;
+    rx->orig_len  = 3;
+}
+
+static void task_benchmark(void *params)
+{
+    TickType_t period = pdMS_TO_TICKS(1000 / CONFIG_BENCHMARK_RATE);
+    TickType_t last_wake = xTaskGetTickCount();
+    int64_t last_log = esp_timer_get_time();
+    mesh_rx_t rx;
+
+    for(;;)
+    {
+        vTaskDelayUntil(&last_wake, period > 0 ? period : 1);
+
+        fill_status(&rx, BENCHMARK_FIRST_ADDR + injected % CONFIG_BENCHMARK_NODES, injected & 0xFF);
+        if(!mesh_rx_ring_push(&rx))
+            lost++;
+        injected++;
+
+        if(rx.timestamp - last_log > BENCHMARK_LOG_PERIOD)
+        {
+            last_log = rx.timestamp;
+            ESP_LOGI(TAG, "injected %u, lost %u, published %u, latency ms p50 %u p99 %u, jitter us %u",
+                injected, lost, published, histogram_percentile(&latency, 50),
+                histogram_percentile(&latency, 99), jitter);
+        }
+    }
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Start injecting synthetic readings.
+ */
+void init_benchmark()
+{
+    ESP_LOGW(TAG, "Benchmark mode, %d readings/s from %d synthetic nodes",
+        CONFIG_BENCHMARK_RATE, CONFIG_BENCHMARK_NODES);
+
+    histogram_reset(&latency);
+    started = esp_timer_get_time();
+    create_gateway_task(TASK_BENCHMARK, &task_benchmark, NULL, NULL);
+}
+
+/**
+ * @brief Account a reading that was just published.
+ * @param addr: node addr of the reading, only synthetic ones count
+ * @param timestamp: esp_timer time when the reading was received
+ */
+void benchmark_reading_published(uint16_t addr, int64_t timestamp)
+{
+    if(addr < BENCHMARK_FIRST_ADDR || addr >= BENCHMARK_FIRST_ADDR + CONFIG_BENCHMARK_NODES || timestamp == 0)
+        return;
+
+    int64_t now = esp_timer_get_time();
+    int64_t elapsed = now - timestamp;
+
+    histogram_add(&latency, (uint32_t) (elapsed / 1000));
+
+    if(published > 0)
+    {
+        int64_t d = elapsed - last_latency;
+        if(d < 0)
+            d = -d;
+        jitter += (int32_t) ((d - (int64_t) jitter) / 16);
+    }
+    last_latency = elapsed;
+    published++;
+}
+
+/**
+ * @brief Queue a STATS message with the end to end latency, jitter
+ * and the task placement the results belong to.
+ */
+void queue_benchmark_stats()
+{
+    histogram_t h;
+    memcpy(&h, &latency, sizeof(histogram_t));
+    int64_t elapsed_s = (esp_timer_get_time() - started) / 1000000;
+
+    message_t* message = create_message(STATS);
+    add_message_text_plain(message, false, "Benchmark: rate %d/s, injected %u, lost %u, published %u",
+        CONFIG_BENCHMARK_RATE, injected, lost, published);
+    // sustained rate, below the injected one when the broker does not keep up
+    add_message_text_plain(message, false, "Benchmark: published %u/s over %u s",
+        elapsed_s > 0 ? (uint32_t) (published / elapsed_s) : 0, (uint32_t) elapsed_s);
+    add_message_text_plain(message, false, "E2E ms: mean %u, p50 %u, p95 %u, p99 %u, max %u",
+        histogram_mean(&h), histogram_percentile(&h, 50), histogram_percentile(&h, 95),
+        histogram_percentile(&h, 99), h.max);
+    add_message_text_plain(message, false, "Jitter us: %u", jitter);
+
+    for(int i = 0; i < GATEWAY_TASKS; i++)
+    {
+        const task_placement_t *p = task_placement(i);
+        add_message_text_plain(message, false, "%s: core %d, prio %u, stack %u", p->name,
+            p->core == tskNO_AFFINITY ? -1 : (int) p->core, p->priority, p->stack_size);
+    }
+    send_message_queue(message);
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _BENCHMARK_H_
+#define _BENCHMARK_H_
+
+#include <stdint.h>
+
+/*
+ * CONFIG_GATEWAY_BENCHMARK: synthetic sensor status messages are injected
+ * into the rx ring at CONFIG_BENCHMARK_RATE per second, as if they came from
+ * CONFIG_BENCHMARK_NODES nodes starting at BENCHMARK_FIRST_ADDR, and the time
+ * until they are published is measured. Flash it with different task
+ * placements to compare them.
+ */
+#define BENCHMARK_FIRST_ADDR 0x7F00
+
+/**
+ * @brief Start injecting synthetic readings.
+ */
+void init_benchmark();
+
+/**
+ * @brief Account a reading that was just published.
+ * @param addr: node addr of the reading, only synthetic ones count
+ * @param timestamp: esp_timer time when the reading was received
+ */
+void benchmark_reading_published(uint16_t addr, int64_t timestamp);
+
+/**
+ * @brief Queue a STATS message with the end to end latency, jitter
+ * and the task placement the results belong to.
+ */
+void queue_benchmark_stats();
+
+#endif
@@ -4,6 +4,7 @@
 #include "freertos/queue.h"
 #include "esp_system.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "cJSON.h"
 #include <stdlib.h>
 #include <string.h>
@@ -13,11 +14,34 @@
 #include "source/tasks_manager.h"
 #include "source/messages_parser.h"
 #include "source/data_format.h"
+#include "source/task_placement.h"
+#include "source/commands.h"
+#include "source/metrics.h"
+#include "source/request_ids.h"
+#include "source/action_bin.h"
+#include "source/request_tracker.h"
+#include "source/sensor_model_client.h"
 
 static const char *TAG = "BLE_CMD";
 
+// longest sleep of the scheduler, the tasks are saved meanwhile
+#define SCHEDULER_MAX_SLEEP 1000000
+
+// a due task whose destination has no room in the tracker waits this long
+#define SCHEDULER_RETRY 100000
+
+// most tasks an action with addr or sensor_prop_id lists and ranges expands to
+#define ACTION_MAX_EXPANSION 1024
+
+typedef struct scheduler_pass_t {
+    int64_t now;  // esp_timer time of the pass
+    int64_t next; // closest time a task has to run
+} scheduler_pass_t;
+
+static TaskHandle_t scheduler_handle = NULL;
+
 // function in sensor_model_client.c to send a message of type 'opcode' to a addr
-extern void ble_mesh_send_sensor_message(uint32_t opcode, uint16_t addr, uint16_t sensor_prop_id);
+extern tracker_status_t ble_mesh_send_sensor_message(uint32_t opcode, uint16_t addr, uint16_t sensor_prop_id);
 
 /**
  * @brief Return opcode string-like into uint32_t.
@@ -63,6 +87,196 @@ static bool is_auto_required(uint32_t opcode)
     return opcode == ESP_BLE_MESH_MODEL_OP_SENSOR_GET;
 }
 
+/**
+ * @brief Fill a filter from the selection keys of a json object:
+ * "name", "prefix", "addr" or "addr_min" and "addr_max" (hex strings), "group".
+ * The filter points into json.
+ * @retval false if there is no selection key at all
+ */
+bool parse_task_filter(const cJSON *json, task_filter_t *filter)
+{
+    const cJSON *name     = cJSON_GetObjectItem(json, "name");
+    const cJSON *prefix   = cJSON_GetObjectItem(json, "prefix");
+    const cJSON *addr     = cJSON_GetObjectItem(json, "addr");
+    const cJSON *addr_min = cJSON_GetObjectItem(json, "addr_min");
+    const cJSON *addr_max = cJSON_GetObjectItem(json, "addr_max");
+    const cJSON *group    = cJSON_GetObjectItem(json, "group");
+    bool selected = false;
+
+    task_filter_init(filter);
+    if(cJSON_IsString(name))
+    {
+        filter->name = name->valuestring;
+        selected = true;
+    }
+    if(cJSON_IsString(prefix))
+    {
+        filter->prefix = prefix->valuestring;
+        selected = true;
+    }
+    if(cJSON_IsString(addr))
+    {
+        filter->addr_min = filter->addr_max = string_to_hex_uint16_t(addr->valuestring);
+        selected = true;
+    }
+    if(cJSON_IsString(addr_min))
+    {
+        filter->addr_min = string_to_hex_uint16_t(addr_min->valuestring);
+        selected = true;
+    }
+    if(cJSON_IsString(addr_max))
+    {
+        filter->addr_max = string_to_hex_uint16_t(addr_max->valuestring);
+        selected = true;
+    }
+    if(cJSON_IsNumber(group) && group->valueint > 0)
+    {
+        filter->group = group->valueint;
+        selected = true;
+    }
+    return selected;
+}
+
+/**
+ * @brief Build an action on the tasks already created:
+ * {"op": "update" | "pause" | "resume" | "remove", selection, "set": {...}}
+ * "set" has the new "delay", "addr" or "sensor_prop_id" of an update.
+ * "all": true selects every task.
+ * @retval whether the action is correct
+ */
+static bool build_bulk(action_t *ble_task, const cJSON* action, const char *op, message_t *messages)
+{
+    const cJSON *all = cJSON_GetObjectItem(action, "all");
+
+    if(strcmp(op, "update") == 0)
+        ble_task->opmode = UPDATE;
+    else if(strcmp(op, "pause") == 0)
+        ble_task->opmode = PAUSE;
+    else if(strcmp(op, "resume") == 0)
+        ble_task->opmode = RESUME;
+    else if(strcmp(op, "remove") == 0)
+        ble_task->opmode = REMOVE;
+    else
+    {
+        ESP_LOGE(TAG, "Unknown op %s", op);
+        add_message_text_plain(messages, true, "Unknown op %s", op);
+        return false;
+    }
+
+    // nothing selected is an error, not every task
+    if(!parse_task_filter(action, &ble_task->filter) && !cJSON_IsTrue(all))
+    {
+        ESP_LOGE(TAG, "Op %s without tasks selected", op);
+        add_message_text_plain(messages, true, "Op %s needs name, prefix, addr, addr_min, addr_max, group or all", op);
+        return false;
+    }
+
+    if(ble_task->opmode == UPDATE)
+    {
+        const cJSON *set            = cJSON_GetObjectItem(action, "set");
+        const cJSON *delay          = cJSON_GetObjectItem(set, "delay");
+        const cJSON *addr           = cJSON_GetObjectItem(set, "addr");
+        const cJSON *sensor_prop_id = cJSON_GetObjectItem(set, "sensor_prop_id");
+
+        memset(&ble_task->update, 0, sizeof(task_update_t));
+        if(cJSON_IsNumber(delay) && delay->valueint > TASK_MAX_DELAY)
+        {
+            add_message_text_plain(messages, true, "Delay is at most %d seconds", TASK_MAX_DELAY);
+            return false;
+        }
+        if(cJSON_IsNumber(delay) && delay->valueint > 0)
+            ble_task->update.delay = delay->valueint;
+        if(cJSON_IsString(addr))
+        {
+            ble_task->update.set_addr = true;
+            ble_task->update.addr = string_to_hex_uint16_t(addr->valuestring);
+        }
+        if(cJSON_IsString(sensor_prop_id))
+        {
+            ble_task->update.set_sensor_prop_id = true;
+            ble_task->update.sensor_prop_id = string_to_hex_uint16_t(sensor_prop_id->valuestring);
+        }
+
+        if(ble_task->update.delay == 0 && !ble_task->update.set_addr && !ble_task->update.set_sensor_prop_id)
+        {
+            add_message_text_plain(messages, true, "Op update needs set with delay, addr or sensor_prop_id");
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Read the addr of a task: "0102", a list ["0102", "0104"]
+ * or a range {"from": "0100", "to": "01FF"}
+ * @retval false if it is not valid
+ */
+static bool parse_addr(ble_task_t *ble_task, const cJSON *addr)
+{
+    memset(&ble_task->addr_list, 0, sizeof(value_list_t));
+
+    if(cJSON_IsString(addr))
+    {
+        ble_task->addr = ble_task->addr_last = string_to_hex_uint16_t(addr->valuestring);
+        return true;
+    }
+
+    if(cJSON_IsArray(addr))
+    {
+        const cJSON *item = NULL;
+        cJSON_ArrayForEach(item, addr)
+        {
+            if(!cJSON_IsString(item))
+                return false;
+        }
+        ble_task->addr_list.json = addr;
+        ble_task->addr_list.count = cJSON_GetArraySize(addr);
+        return ble_task->addr_list.count > 0;
+    }
+
+    const cJSON *from = cJSON_GetObjectItem(addr, "from");
+    const cJSON *to   = cJSON_GetObjectItem(addr, "to");
+    if(!cJSON_IsString(from) || !cJSON_IsString(to))
+        return false;
+
+    ble_task->addr      = string_to_hex_uint16_t(from->valuestring);
+    ble_task->addr_last = string_to_hex_uint16_t(to->valuestring);
+    return ble_task->addr <= ble_task->addr_last;
+}
+
+/**
+ * @brief Read the sensor_prop_id of a task: "0056" or a list ["0056", "0057"].
+ * Without it, 0x0000.
+ * @retval false if it is not valid
+ */
+static bool parse_sensor_prop_id(ble_task_t *ble_task, const cJSON *sensor_prop_id)
+{
+    memset(&ble_task->prop_list, 0, sizeof(value_list_t));
+    ble_task->sensor_prop_id = 0x0000;
+
+    if(sensor_prop_id == NULL)
+        return true;
+
+    if(cJSON_IsString(sensor_prop_id))
+    {
+        ble_task->sensor_prop_id = string_to_hex_uint16_t(sensor_prop_id->valuestring);
+        return true;
+    }
+
+    if(!cJSON_IsArray(sensor_prop_id) || cJSON_GetArraySize(sensor_prop_id) == 0)
+        return false;
+
+    const cJSON *item = NULL;
+    cJSON_ArrayForEach(item, sensor_prop_id)
+    {
+        if(!cJSON_IsString(item))
+            return false;
+    }
+    ble_task->prop_list.json = sensor_prop_id;
+    ble_task->prop_list.count = cJSON_GetArraySize(sensor_prop_id);
+    return true;
+}
+
 /**
  * @brief Build a task based on a sigle element from json
  * @param ble_task: pointer to struct where a task will be store in
@@ -80,39 +294,78 @@ static bool build_task(action_t *ble_task, const cJSON* action, message_t *messa
     const cJSON *name           = cJSON_GetObjectItem(action, "name");
     const cJSON *addr           = cJSON_GetObjectItem(action, "addr");
     const cJSON *sensor_prop_id = cJSON_GetObjectItem(action, "sensor_prop_id");
+    const cJSON *max_age        = cJSON_GetObjectItem(action, "max_age");
+    const cJSON *refresh        = cJSON_GetObjectItem(action, "refresh");
+    const cJSON *group          = cJSON_GetObjectItem(action, "group");
+    const cJSON *op             = cJSON_GetObjectItem(action, "op");
 
+    // Action on the tasks already created
+    if(cJSON_IsString(op))
+    {
+        build = build_bulk(ble_task, action, op->valuestring, messages);
+    }
     // Task to delete
-    if(opcode == NULL && delay == NULL
+    else if(opcode == NULL && delay == NULL
         && auto_task == NULL && addr == NULL
         && name != NULL)
     {
+        // a filter without name matches every task, that is only op remove
+        if(!cJSON_IsString(name) || name->valuestring[0] == '\0')
+        {
+            ESP_LOGE(TAG, "Task to remove without a name");
+            add_message_text_plain(messages, true, "Task to remove needs a name, use op remove for many tasks");
+            return false;
+        }
         ble_task->opmode = REMOVE;
-        ble_task->task.name = name->valuestring;
+        task_filter_init(&ble_task->filter);
+        ble_task->filter.name = name->valuestring;
     }
     // Task to create -> one time
     else if(opcode != NULL && addr != NULL)
     {
         ble_task->opmode      = CREATE;
         ble_task->task.opcode = get_opcode(opcode->valuestring);
-        ble_task->task.addr   = string_to_hex_uint16_t(addr->valuestring);
 
-        if(sensor_prop_id != NULL)
+        if(!parse_addr(&ble_task->task, addr) || !parse_sensor_prop_id(&ble_task->task, sensor_prop_id))
         {
-            ble_task->task.sensor_prop_id = string_to_hex_uint16_t(sensor_prop_id->valuestring);
+            ESP_LOGE(TAG, "Wrong addr or sensor_prop_id in a task");
+            add_message_text_plain(messages, true, "Wrong addr or sensor_prop_id in a task");
+            return false;
+        }
+
+        // seconds, without it the request always goes to the mesh
+        if(max_age != NULL && cJSON_IsNumber(max_age) && max_age->valuedouble > 0)
+        {
+            ble_task->task.max_age = (uint32_t) (max_age->valuedouble * 1000);
         }
         else
         {
-            ble_task->task.sensor_prop_id = 0x0000;
+            ble_task->task.max_age = 0;
         }
 
+        // descriptors are cached, refresh asks the node again
+        ble_task->task.refresh = refresh != NULL && cJSON_IsTrue(refresh);
 
         if(auto_task != NULL) // task to create periodically
         {
-            if(cJSON_IsTrue(auto_task) && is_auto_required(ble_task->task.opcode))
+            if(cJSON_IsTrue(auto_task) && is_auto_required(ble_task->task.opcode) && !cJSON_IsString(name))
+            {
+                ESP_LOGE(TAG, "Auto task without name");
+                add_message_text_plain(messages, true, "Auto task without name");
+                build = false;
+            }
+            else if(cJSON_IsTrue(auto_task) && cJSON_IsNumber(delay) && delay->valueint > TASK_MAX_DELAY)
+            {
+                ESP_LOGE(TAG, "Auto task delay %d too long", delay->valueint);
+                add_message_text_plain(messages, true, "Delay is at most %d seconds", TASK_MAX_DELAY);
+                build = false;
+            }
+            else if(cJSON_IsTrue(auto_task) && is_auto_required(ble_task->task.opcode))
             {
                 ble_task->task.auto_task = true;
                 ble_task->task.name   = sanitize_string(name->valuestring);
-                ble_task->task.delay  = delay->valueint;
+                ble_task->task.delay  = cJSON_IsNumber(delay) && delay->valueint > 0 ? delay->valueint : 1;
+                ble_task->task.group  = cJSON_IsNumber(group) && group->valueint > 0 ? group->valueint : 0;
             }
             else
             {
@@ -133,15 +386,14 @@ static bool build_task(action_t *ble_task, const cJSON* action, message_t *messa
  * @brief Parse json and returns task to be launched or removed.
  *
  * @param message_t*: struct to store messages to give feedback
- * @param json: json received through mqtt.
+ * @param root: json received through mqtt, the actions point into it.
  * @retval size: size of action_t array.
  * @retval action_t*: array of tasks.
  */
-static action_t* parse_build_task(message_t* messages, char *json, int* size)
+static action_t* parse_build_task(message_t* messages, const cJSON *root, int* size)
 {
     action_t *acts = NULL;
 
-    cJSON *root = cJSON_Parse(json);
     const cJSON *actions = cJSON_GetObjectItem(root, "actions");
 
     if(actions != NULL)
@@ -176,175 +428,602 @@ static action_t* parse_build_task(message_t* messages, char *json, int* size)
 }
 
 /**
- * @brief delete a running task
- * @param ble_task: ble_task_t* to delete
+ * @brief delete the tasks selected by an action
+ * @param action: action_t* with the selection
  * @param messages: messages_t* struct to store message to send over MQTT
  */
-static void delete_task(ble_task_t *ble_task, message_t *messages)
+static void delete_task(action_t *action, message_t *messages)
 {
-    ESP_LOGI(TAG, "Deleting task %s", ble_task->name);
-
-    task_t found = {
-        .name = ble_task->name,
-    };
-    task_t *task = obtain_task(&found);
+    const char *name = action->filter.name;
+    int removed = tasks_manager_remove(&action->filter);
 
-    if(task != NULL)
+    if(name != NULL && action->filter.prefix == NULL)
     {
-        if(task->task_handler != NULL)
+        if(removed > 0)
         {
-            vTaskDelete(task->task_handler);
-            remove_task(task);
-
-            ESP_LOGI(TAG, "Task %s removed", ble_task->name);
-            add_message_text_plain(messages, false, "Task %s deleted", ble_task->name);
+            ESP_LOGI(TAG, "Task %s removed", name);
+            add_message_text_plain(messages, false, "Task %s deleted", name);
+        }
+        else
+        {
+            ESP_LOGE(TAG, "Task %s doesn't exists. Remove failed", name);
+            add_message_text_plain(messages, true, "Task %s doesn't exists. Remove failed", name);
         }
     }
     else
     {
-        ESP_LOGE(TAG, "Task %s doesn't exists. Remove failed", ble_task->name);
-        add_message_text_plain(messages, true, "Task %s doesn't exists. Remove failed", ble_task->name);
+        ESP_LOGI(TAG, "%d tasks removed", removed);
+        add_message_text_plain(messages, false, "%d tasks deleted", removed);
     }
 }
 
 /**
- * @brief Function to use as a task.
- * Every json received will be converted into ble_task_t
- * and then will be launch a task with this function.
+ * @brief update, pause or resume the tasks selected by an action,
+ * in place: no task is freed or created
+ * @param action: action_t* with the selection
+ * @param messages: messages_t* struct to store message to send over MQTT
  */
-static void task_ble_cmd(void *params)
+static void change_tasks(action_t *action, message_t *messages)
 {
-    ble_task_t ble_task = (*(ble_task_t *) params);
+    int changed = 0;
 
-    if(ble_task.auto_task)
+    if(action->opmode == UPDATE)
     {
-        ESP_LOGI(TAG, "[%s] auto = %d, opcode = 0x%04X, delay = %d, addr = 0x%04X, sensor_prop_id = 0x%04X", ble_task.name, (int)ble_task.auto_task, ble_task.opcode, ble_task.delay, ble_task.addr, ble_task.sensor_prop_id);
-        for(;;)
-        {
-            ble_mesh_send_sensor_message(ble_task.opcode, ble_task.addr, ble_task.sensor_prop_id);
-            vTaskDelay(ble_task.delay * 1000 / portTICK_PERIOD_MS);
-        }
+        changed = tasks_manager_update(&action->filter, &action->update);
+        add_message_text_plain(messages, changed == 0, "%d tasks updated", changed);
     }
     else
     {
-        ESP_LOGI(TAG, "[One-time task] opcode = 0x%04X, addr = 0x%04X, sensor_prop_id = 0x%04X", ble_task.opcode, ble_task.addr, ble_task.sensor_prop_id);
-        ble_mesh_send_sensor_message(ble_task.opcode, ble_task.addr, ble_task.sensor_prop_id);
+        changed = tasks_manager_pause(&action->filter, action->opmode == PAUSE);
+        add_message_text_plain(messages, false, "%d tasks %s", changed, action->opmode == PAUSE ? "paused" : "resumed");
     }
+    ESP_LOGI(TAG, "Op %d changed %d tasks", action->opmode, changed);
 
-    vTaskDelete(NULL);
+    // the next request may be sooner
+    if(changed > 0)
+        xTaskNotifyGive(scheduler_handle);
 }
 
 /**
- * @brief Create a new task
- * @param ble_task: ble_task_t* to create
- * @param messages: messages_t* struct to store message to send over MQTT
+ * @brief Send the request of a task if it is due and keep the
+ * closest time a task has to run.
  */
-static void create_task(ble_task_t *ble_task, message_t *messages)
+static void run_task(task_t *task, void *arg)
 {
+    scheduler_pass_t *pass = (scheduler_pass_t *) arg;
 
-    // If it is auto, it will be register into task_manager
+    if(task->paused)
+        return;
+
+    // the tracker drops what it has no room for, the request waits here instead
+    if(task->next_run <= pass->now && !request_tracker_has_room(task->addr))
+    {
+        if(pass->now + SCHEDULER_RETRY < pass->next)
+            pass->next = pass->now + SCHEDULER_RETRY;
+        return;
+    }
+
+    if(task->next_run <= pass->now)
+    {
+        if(ble_mesh_send_sensor_message(task->opcode, task->addr, task->sensor_prop_id) == DROPPED)
+            task->dropped++;
+        task->last_run = pass->now;
+        task->runs++;
+
+        // keep the period, but do not send a burst to catch up
+        task->next_run += (int64_t) task->delay * 1000000;
+        if(task->next_run <= pass->now)
+            task->next_run = pass->now + (int64_t) task->delay * 1000000;
+    }
+
+    if(task->next_run < pass->next)
+        pass->next = task->next_run;
+}
+
+/**
+ * @brief Task that sends the requests of every auto task.
+ * It sleeps until the next task is due or the list changes.
+ */
+static void task_scheduler(void *params)
+{
+    for(;;)
+    {
+        scheduler_pass_t pass;
+        pass.now  = esp_timer_get_time();
+        pass.next = pass.now + SCHEDULER_MAX_SLEEP;
+
+        tasks_manager_foreach(&run_task, &pass);
+        tasks_manager_save_if_dirty(pass.now);
+
+        int64_t sleep = pass.next - esp_timer_get_time();
+        TickType_t ticks = sleep > 0 ? pdMS_TO_TICKS(sleep / 1000) : 0;
+        ulTaskNotifyTake(pdTRUE, ticks > 0 ? ticks : 1);
+    }
+    vTaskDelete(NULL);
+}
+
+typedef enum {
+    TASK_CREATED,
+    TASK_EXISTS,
+    TASK_LAUNCHED,
+    TASK_FROM_CACHE,
+    TASK_COALESCED,
+    TASK_SUPPRESSED,
+    TASK_DROPPED
+} create_result_t;
+
+/**
+ * @brief Create one task
+ * @param ble_task: ble_task_t* to create, its name is owned by the new task
+ * @param messages: messages_t* struct to store message to send over MQTT, NULL for no message
+ * @param spread: start an auto task at a random time of its period instead of now,
+ * so the tasks of an expanded action do not send their requests at once
+ */
+static create_result_t create_one(ble_task_t *ble_task, message_t *messages, bool spread)
+{
+    // If it is auto, it will be register into task_manager and sent by the scheduler
     if(ble_task->auto_task)
     {
+        task_t *new_task = (task_t *)calloc(1, sizeof(task_t));
+        if(new_task == NULL)
+        {
+            ESP_LOGE(TAG, "No memory for task %s", ble_task->name);
+            if(messages != NULL)
+                add_message_text_plain(messages, true, "No memory for task %s", ble_task->name);
+            free(ble_task->name);
+            return TASK_DROPPED;
+        }
+        new_task->name           = ble_task->name;
+        new_task->opcode         = ble_task->opcode;
+        new_task->addr           = ble_task->addr;
+        new_task->sensor_prop_id = ble_task->sensor_prop_id;
+        new_task->delay          = ble_task->delay;
+        new_task->group          = ble_task->group;
+        new_task->next_run       = esp_timer_get_time();
+        if(spread)
+            new_task->next_run += (int64_t) (esp_random() % ((uint32_t) new_task->delay * 1000 + 1)) * 1000;
 
         // Check if the tasks exists
-        TaskHandle_t TaskHandle = NULL;
-        task_t *new_task = (task_t *)malloc(sizeof(task_t));
-        new_task->name = ble_task->name;
-
         status_t status = add_new_task_if_not_exists(new_task);
         if(status == CREATED)
         {
-            ble_task_t aux;
-            memcpy(&aux, ble_task, sizeof(ble_task_t));
-            xTaskCreate(&task_ble_cmd, aux.name, 2048, (void *) &aux, 5, &TaskHandle);
-            new_task->task_handler = TaskHandle; // save the handler after set it when create the task. IMPORTANT!!
-
-            ESP_LOGI(TAG, "Task %s created", ble_task->name);
-            add_message_text_plain(messages, false, "Task %s created", ble_task->name);
+            ESP_LOGI(TAG, "[%s] opcode = 0x%04X, delay = %d, addr = 0x%04X, sensor_prop_id = 0x%04X", ble_task->name, ble_task->opcode, ble_task->delay, ble_task->addr, ble_task->sensor_prop_id);
+            if(messages != NULL)
+                add_message_text_plain(messages, false, "Task %s created", ble_task->name);
+            return TASK_CREATED;
         }
-        else
-        {
-            free(new_task);
-            ESP_LOGE(TAG, "Task - %s - exists!", ble_task->name);
+
+        ESP_LOGE(TAG, "Task - %s - exists!", ble_task->name);
+        if(messages != NULL)
             add_message_text_plain(messages, true, "Task %s exists", ble_task->name);
-        }
+        free(new_task->name);
+        free(new_task);
+        return TASK_EXISTS;
     }
-    // If it is not auto task, just create it.
-    else
-    {
-        ble_task_t aux;
-        memcpy(&aux, ble_task, sizeof(ble_task_t));
 
-        // Create a name for one time task
-        char buff[80];
-        sprintf(buff, "Task 0x%04x, addr 0x%04x", aux.opcode, aux.addr);
+    // If it is not auto task, send it now. The tracker does not block and
+    // collapses it with an identical request already in flight.
+    ESP_LOGI(TAG, "[One-time task] opcode = 0x%04X, addr = 0x%04X, sensor_prop_id = 0x%04X, max_age = %u",
+        ble_task->opcode, ble_task->addr, ble_task->sensor_prop_id, ble_task->max_age);
 
-        xTaskCreate(&task_ble_cmd, buff, 2048, (void *) &aux, 5, NULL);
-        add_message_text_plain(messages, false, "One-time Task with opcode 0x%04x, addr 0x%04x launched", ble_task->opcode, ble_task->addr);
+    if((ble_task->opcode == ESP_BLE_MESH_MODEL_OP_SENSOR_GET && ble_task->max_age > 0
+        && ble_mesh_get_cached_status(ble_task->addr, ble_task->sensor_prop_id, ble_task->max_age))
+       || (ble_task->opcode == ESP_BLE_MESH_MODEL_OP_SENSOR_DESCRIPTOR_GET && !ble_task->refresh
+        && ble_mesh_get_cached_descriptor(ble_task->addr, ble_task->sensor_prop_id)))
+    {
+        if(messages != NULL)
+            add_message_text_plain(messages, false, "One-time Task with opcode 0x%04x, addr 0x%04x served from cache", ble_task->opcode, ble_task->addr);
+        return TASK_FROM_CACHE;
     }
+
+    // not even queued, the tracker has no room for its destination
+    tracker_status_t status = DROPPED;
+    if(request_tracker_has_room(ble_task->addr))
+    {
+        request_ids_expect(ble_task->addr, ble_task->opcode);
+        status = ble_mesh_send_sensor_message(ble_task->opcode, ble_task->addr, ble_task->sensor_prop_id);
+    }
+    if(status == DROPPED)
+    {
+        ESP_LOGE(TAG, "[One-time task] opcode 0x%04x, addr 0x%04x dropped", ble_task->opcode, ble_task->addr);
+        if(messages != NULL)
+            add_message_text_plain(messages, true, "One-time Task with opcode 0x%04x, addr 0x%04x dropped, too many requests in flight", ble_task->opcode, ble_task->addr);
+        return TASK_DROPPED;
+    }
+    if(status == SUPPRESSED)
+    {
+        ESP_LOGW(TAG, "[One-time task] opcode 0x%04x, addr 0x%04x suppressed", ble_task->opcode, ble_task->addr);
+        if(messages != NULL)
+            add_message_text_plain(messages, true, "One-time Task with opcode 0x%04x, addr 0x%04x suppressed, node unreachable", ble_task->opcode, ble_task->addr);
+        return TASK_SUPPRESSED;
+    }
+    if(status == COALESCED)
+    {
+        // no request of its own, the reply of the identical one answers it
+        if(messages != NULL)
+            add_message_text_plain(messages, false, "One-time Task with opcode 0x%04x, addr 0x%04x merged with an in-flight request", ble_task->opcode, ble_task->addr);
+        return TASK_COALESCED;
+    }
+    if(messages != NULL)
+        add_message_text_plain(messages, false, "One-time Task with opcode 0x%04x, addr 0x%04x launched", ble_task->opcode, ble_task->addr);
+    return TASK_LAUNCHED;
 }
 
 /**
- * @brief task to parse mqtt_json structs to create tasks
- * @param params: pointer to QueueHandle_t queue
+ * @brief Return the values of a list, json or binary, or of a range
+ * @param count: number of values
+ * @retval malloc'd array
  */
-void task_parse_json(void *params)
+static uint16_t* expand_values(const value_list_t *list, uint16_t first, uint16_t last, int *count)
 {
-    QueueHandle_t queue = (*(QueueHandle_t *) params);
-    BaseType_t xStatus;
+    *count = list->count > 0 ? list->count : last - first + 1;
+    if(*count > ACTION_MAX_EXPANSION)
+        return NULL;
 
-    mqtt_json json_received;
-    char* json_string;
+    uint16_t *values = (uint16_t *) malloc(sizeof(uint16_t) * *count);
+    if(values == NULL)
+        return NULL;
 
-    action_t *actions = NULL;
-    int size_actions;
+    if(list->json != NULL)
+    {
+        int i = 0;
+        const cJSON *item = NULL;
+        cJSON_ArrayForEach(item, list->json)
+            values[i++] = string_to_hex_uint16_t(item->valuestring);
+    }
+    else if(list->bin != NULL)
+    {
+        action_bin_values(list->bin, list->count, values);
+    }
+    else
+    {
+        for(int i = 0; i < *count; i++)
+            values[i] = first + i;
+    }
+    return values;
+}
 
-    for(;;)
+/**
+ * @brief Name of a task of an expanded action. {addr} and {prop} in the
+ * template are replaced by their hex value. Without them, they are appended
+ * when there is more than one addr or sensor_prop_id.
+ * @retval malloc'd name, NULL when out of memory
+ */
+static char* expand_name(const char *template, uint16_t addr, uint16_t prop, bool many_addrs, bool many_props)
+{
+    size_t size = strlen(template) + 11; // _XXXX_XXXX\0, a placeholder is longer than its value
+    char *name = (char *) malloc(size);
+    if(name == NULL)
+        return NULL;
+
+    char *out = name;
+    bool has_addr = strstr(template, "{addr}") != NULL;
+    bool has_prop = strstr(template, "{prop}") != NULL;
+
+    for(const char *in = template; *in != '\0';)
     {
-        xStatus = xQueueReceive(queue, &json_received, portMAX_DELAY);
-        if(xStatus == pdTRUE)
+        if(strncmp(in, "{addr}", 6) == 0)
         {
-            message_t* messages = create_message(PLAIN_TEXT);
+            out += sprintf(out, "%04X", addr);
+            in += 6;
+        }
+        else if(strncmp(in, "{prop}", 6) == 0)
+        {
+            out += sprintf(out, "%04X", prop);
+            in += 6;
+        }
+        else
+        {
+            *out++ = *in++;
+        }
+    }
+    if(many_addrs && !has_addr)
+        out += sprintf(out, "_%04X", addr);
+    if(many_props && !has_prop)
+        out += sprintf(out, "_%04X", prop);
+    *out = '\0';
 
-            json_string = (char *) malloc(json_received.size * sizeof(char) + 1);
-            memset(json_string, '\0',  json_received.size * sizeof(char) + 1);
-            strncpy(json_string, json_received.json, json_received.size);
-            ESP_LOGI(TAG, "Json received %s", json_string);
+    return name;
+}
 
-            // Check if json is correct
-            size_actions = 0;
-            actions = parse_build_task(messages, json_string, &size_actions); free(json_string);
-            if(size_actions != 0 && actions != NULL)
+/**
+ * @brief Create a new task, or one per addr and sensor_prop_id of an
+ * action with lists or ranges. They are expanded here, one by one.
+ * @param ble_task: ble_task_t* to create
+ * @param messages: messages_t* struct to store message to send over MQTT
+ */
+static void create_task(ble_task_t *ble_task, message_t *messages)
+{
+    if(ble_task->addr_list.count == 0 && ble_task->prop_list.count == 0 && ble_task->addr == ble_task->addr_last)
+    {
+        if(create_one(ble_task, messages, false) == TASK_CREATED)
+            xTaskNotifyGive(scheduler_handle);
+        return;
+    }
+
+    int num_addrs = 0;
+    int num_props = 0;
+    uint16_t *addrs = expand_values(&ble_task->addr_list, ble_task->addr, ble_task->addr_last, &num_addrs);
+    uint16_t *props = expand_values(&ble_task->prop_list, ble_task->sensor_prop_id, ble_task->sensor_prop_id, &num_props);
+
+    if(addrs == NULL || props == NULL || num_addrs * num_props > ACTION_MAX_EXPANSION)
+    {
+        ESP_LOGE(TAG, "Action expands to more than %d tasks", ACTION_MAX_EXPANSION);
+        add_message_text_plain(messages, true, "Action expands to more than %d tasks", ACTION_MAX_EXPANSION);
+        free(addrs);
+        free(props);
+        free(ble_task->name);
+        return;
+    }
+
+    int results[TASK_DROPPED + 1] = { 0 };
+    char *template = ble_task->name;
+    ble_task_t entry = *ble_task;
+
+    for(int a = 0; a < num_addrs; a++)
+    {
+        for(int p = 0; p < num_props; p++)
+        {
+            entry.addr = addrs[a];
+            entry.sensor_prop_id = props[p];
+            if(entry.auto_task)
             {
-                for(int i = 0; i < size_actions; i++)
+                entry.name = expand_name(template, addrs[a], props[p], num_addrs > 1, num_props > 1);
+                if(entry.name == NULL)
                 {
-                    if(actions[i].opmode == REMOVE) // remove task
-                    {
-                        delete_task(&actions[i].task, messages);
-                    }
-                    else if(actions[i].opmode == CREATE)
-                    {
-                        create_task(&actions[i].task, messages);
-                    }
-                    else
-                    {
-                        ESP_LOGE(TAG, "opmode couldn't be recognize!");
-                    }
+                    ESP_LOGE(TAG, "No memory for the name of a task of %s", template);
+                    results[TASK_DROPPED]++;
+                    continue;
                 }
             }
+            results[create_one(&entry, NULL, true)]++;
+        }
+    }
+    free(addrs);
+    free(props);
+    free(template);
+
+    if(ble_task->auto_task)
+    {
+        add_message_text_plain(messages, results[TASK_DROPPED] > 0, "Action expanded to %d tasks: %d created, %d exist, %d failed",
+            num_addrs * num_props, results[TASK_CREATED], results[TASK_EXISTS], results[TASK_DROPPED]);
+        if(results[TASK_CREATED] > 0)
+            xTaskNotifyGive(scheduler_handle);
+    }
+    else
+    {
+        // two lines, each within the length of a message
+        bool failed = results[TASK_DROPPED] + results[TASK_SUPPRESSED] > 0;
+        add_message_text_plain(messages, failed, "Action expanded to %d requests: %d launched, %d served from cache",
+            num_addrs * num_props, results[TASK_LAUNCHED], results[TASK_FROM_CACHE]);
+        add_message_text_plain(messages, failed, "%d merged with in-flight, %d suppressed (unreachable), %d dropped",
+            results[TASK_COALESCED], results[TASK_SUPPRESSED], results[TASK_DROPPED]);
+    }
+}
+
+/**
+ * @brief Run a list of actions, json or binary
+ * @param actions: action_t array
+ * @param size_actions: actions in the array
+ * @param messages: messages_t* struct to store message to send over MQTT
+ */
+static void run_action_list(action_t *actions, int size_actions, message_t *messages)
+{
+    if(size_actions != 0 && actions != NULL)
+    {
+        for(int i = 0; i < size_actions; i++)
+        {
+            if(actions[i].opmode == REMOVE) // remove task
+            {
+                delete_task(&actions[i], messages);
+            }
+            else if(actions[i].opmode == CREATE)
+            {
+                create_task(&actions[i].task, messages);
+            }
+            else if(actions[i].opmode == UPDATE || actions[i].opmode == PAUSE || actions[i].opmode == RESUME)
+            {
+                change_tasks(&actions[i], messages);
+            }
             else
             {
-                ESP_LOGE(TAG, "Json could be processed or size task equals zero!");
-                add_message_text_plain(messages, false, "Json could be processed or size task equals zero!");
+                ESP_LOGE(TAG, "opmode couldn't be recognize!");
             }
-            send_message_queue(messages);
-            free(actions);
         }
-        else
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Json could be processed or size task equals zero!");
+        add_message_text_plain(messages, false, "Json could be processed or size task equals zero!");
+    }
+}
+
+/**
+ * @brief Run the ble actions of a json
+ * @param json: json ending with \0
+ */
+static void run_actions(char *json)
+{
+    ESP_LOGI(TAG, "Json received %s", json);
+#if CONFIG_GATEWAY_METRICS
+    int64_t start = esp_timer_get_time();
+#endif
+    cJSON *root = cJSON_Parse(json);
+
+    // every answer, also the later replies of the mesh, echoes it
+    const cJSON *request_id = cJSON_GetObjectItem(root, "request_id");
+    request_ids_begin(cJSON_IsString(request_id) ? request_id->valuestring : NULL);
+    message_t* messages = create_message(PLAIN_TEXT);
+
+    // Check if json is correct
+    int size_actions = 0;
+    action_t *actions = parse_build_task(messages, root, &size_actions);
+    METRICS_ADD_SINCE(STAGE_PARSE_JSON, start);
+
+    run_action_list(actions, size_actions, messages);
+    send_message_queue(messages);
+    request_ids_end();
+    free(actions);
+    cJSON_Delete(root);
+}
+
+/**
+ * @brief Run the ble actions of a binary message, see action_bin.h
+ * @param data: message, the actions point into it
+ * @param size: bytes of data
+ */
+static void run_actions_bin(char *data, int size)
+{
+    ESP_LOGI(TAG, "Binary actions received, %d bytes", size);
+#if CONFIG_GATEWAY_METRICS
+    int64_t start = esp_timer_get_time();
+#endif
+    action_bin_t bin;
+    const char *request_id = NULL;
+    bool opened = action_bin_open(&bin, (uint8_t *) data, size, &request_id);
+
+    request_ids_begin(request_id);
+    message_t* messages = create_message(PLAIN_TEXT);
+
+    int size_actions = 0;
+    action_t *actions = NULL;
+    if(opened)
+    {
+        actions = action_bin_actions(&bin, messages, &size_actions);
+        METRICS_ADD_SINCE(STAGE_PARSE_BIN, start);
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Binary actions are not a map");
+        add_message_text_plain(messages, true, "Binary actions are not a map");
+    }
+
+    run_action_list(actions, size_actions, messages);
+    send_message_queue(messages);
+    request_ids_end();
+    free(actions);
+}
+
+/**
+ * @brief Free the actions built by a decoder without running them
+ */
+static void free_actions(action_t *actions, int size_actions)
+{
+    for(int i = 0; i < size_actions; i++)
+    {
+        if(actions[i].opmode == CREATE)
+            free(actions[i].task.name);
+    }
+    free(actions);
+}
+
+/**
+ * @brief Decode the same actions as json and as binary runs times, without
+ * running them, and queue a STATS message with the size and the mean decode
+ * time of each format.
+ * @param json: actions as json, ending with \0
+ * @param bin: the same actions encoded, see action_bin.h
+ * @param bin_size: bytes of bin
+ * @param runs: decodes of each format, at most DECODE_BENCH_MAX_RUNS
+ */
+void queue_decode_benchmark(const char *json, const uint8_t *bin, int bin_size, int runs)
+{
+    message_t *messages = create_message(PLAIN_TEXT); // decoder errors, discarded
+    uint8_t *scratch = (uint8_t *) malloc(bin_size);
+    int64_t json_us = 0;
+    int64_t bin_us = 0;
+    int json_actions = 0;
+    int bin_actions = 0;
+    const char *request_id = NULL;
+    bool valid = runs > 0 && scratch != NULL;
+
+    // the ingress task decodes nothing else meanwhile
+    if(runs > DECODE_BENCH_MAX_RUNS)
+        runs = DECODE_BENCH_MAX_RUNS;
+
+    for(int i = 0; valid && i < runs; i++)
+    {
+        int64_t start = esp_timer_get_time();
+        cJSON *root = cJSON_Parse(json);
+        action_t *actions = parse_build_task(messages, root, &json_actions);
+        json_us += esp_timer_get_time() - start;
+        free_actions(actions, json_actions);
+        cJSON_Delete(root);
+
+        // the binary decoder writes into its buffer, copied out of the time
+        memcpy(scratch, bin, bin_size);
+        start = esp_timer_get_time();
+        action_bin_t reader;
+        actions = NULL;
+        if(action_bin_open(&reader, scratch, bin_size, &request_id))
+            actions = action_bin_actions(&reader, messages, &bin_actions);
+        bin_us += esp_timer_get_time() - start;
+        free_actions(actions, bin_actions);
+    }
+    free(scratch);
+    free_message(messages);
+
+    message_t *message = create_message(STATS);
+    if(!valid)
+    {
+        add_message_text_plain(message, true, "Decode benchmark needs runs > 0 and a binary payload");
+    }
+    else
+    {
+        add_message_text_plain(message, false, "Decode json: %d B, %d actions, %lld us per message over %d runs",
+            (int) strlen(json), json_actions, json_us / runs, runs);
+        add_message_text_plain(message, json_actions != bin_actions, "Decode binary: %d B, %d actions, %lld us per message",
+            bin_size, bin_actions, bin_us / runs);
+    }
+    send_message_queue(message);
+}
+
+/**
+ * @brief task to parse the json of the ingress queue and run
+ * its ble actions or its command
+ * @param params: pointer to QueueHandle_t queue
+ */
+void task_parse_json(void *params)
+{
+    QueueHandle_t queue = (*(QueueHandle_t *) params);
+    mqtt_json json_received;
+
+    for(;;)
+    {
+        if(xQueueReceive(queue, &json_received, portMAX_DELAY) != pdTRUE)
         {
             ESP_LOGE(TAG, "Error in queue -> task_receive_json");
+            continue;
+        }
+        METRICS_ADD_SINCE(STAGE_INGRESS, json_received.received);
+
+        if(json_received.kind == INGRESS_CMD)
+        {
+            command_dispatch(json_received.json);
+            free(json_received.json);
+        }
+        else
+        {
+            if(json_received.kind == INGRESS_BIN)
+                run_actions_bin(json_received.json, json_received.size);
+            else
+                run_actions(json_received.json);
+            // no pause between lists, the request tracker paces the mesh
+            free(json_received.json);
         }
-        vTaskDelay(2000 / portTICK_PERIOD_MS);
     }
     vTaskDelete(NULL);
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Restore the auto tasks saved before the reboot and
+ * start the task that sends their requests.
+ */
+void init_task_scheduler()
+{
+    int64_t start = esp_timer_get_time();
+    int restored = tasks_manager_restore();
+    ESP_LOGI(TAG, "%d tasks restored in %d ms", restored, (int) ((esp_timer_get_time() - start) / 1000));
+
+    create_gateway_task(TASK_SCHEDULER, &task_scheduler, NULL, &scheduler_handle);
+}
@@ -1,33 +1,94 @@
 #ifndef _BLE_CMD_H_
 #define _BLE_CMD_H_
 
+#include "cJSON.h"
+
+#include "source/tasks_manager.h"
+
+// most decodes of each format in a decode benchmark, it blocks the ingress task meanwhile
+#define DECODE_BENCH_MAX_RUNS 1000
+
+typedef enum {
+    INGRESS_BLE, // /sensors/actions/ble
+    INGRESS_CMD, // /sensors/actions/commands
+    INGRESS_BIN  // /sensors/actions/ble/bin, see action_bin.h
+} ingress_kind_t;
+
+/* json received through mqtt, owned by the ingress queue and freed by task_parse_json */
 typedef struct mqtt_json {
-    char* json;
+    ingress_kind_t kind;
+    char* json;       // ends with \0, binary actions too
     int size;
+    int64_t received; // esp_timer time
 } mqtt_json;
 
 typedef enum {
     CREATE,
-    REMOVE
+    REMOVE, // selected tasks
+    UPDATE, // selected tasks, in place
+    PAUSE,
+    RESUME
 } opmode_t;
 
+/* list of addrs or sensor_prop_ids of an action, json or binary */
+typedef struct value_list_t {
+    uint16_t count;      // 0 if there is no list
+    const cJSON *json;   // array of hex strings
+    const uint8_t *bin;  // first item of a binary array, see action_bin.h
+} value_list_t;
+
 typedef struct ble_task_t {
     char *name;      // name of the task.
     bool auto_task;  // whether it is a auto task or just one execution
     int delay;       // seconds
+    uint8_t group;   // group of an auto task, 0 if none
     uint32_t opcode; // BLE opcode message
-    uint16_t addr;   // addr to send the message
+    uint16_t addr;   // addr to send the message, the first one of a range
     uint16_t sensor_prop_id; // sensor_prop_id to request info or change
+    /* expansion: one task per addr and sensor_prop_id, name is then a template */
+    uint16_t addr_last;      // last addr of a range, addr if there is no range
+    value_list_t addr_list;  // addrs, count 0 if none
+    value_list_t prop_list;  // sensor_prop_ids, count 0 if none
+    uint32_t max_age; // ms, one-time GET_STATUS is answered with the last values if they are newer
+    bool refresh;     // one-time GET_DESCRIPTOR goes to the mesh even if it is cached
 } ble_task_t;
 
 typedef struct action_t {
     opmode_t opmode;
-    ble_task_t task; // task to be created
+    ble_task_t task;      // task to be created
+    task_filter_t filter; // tasks to remove, update, pause or resume
+    task_update_t update;
 } action_t;
 
 /**
- * @brief task to parse a json and launchs ble commands
+ * @brief Fill a filter from the selection keys of a json object:
+ * "name", "prefix", "addr" or "addr_min" and "addr_max" (hex strings), "group".
+ * The filter points into json.
+ * @retval false if there is no selection key at all
+ */
+bool parse_task_filter(const cJSON *json, task_filter_t *filter);
+
+/**
+ * @brief Decode the same actions as json and as binary runs times, without
+ * running them, and queue a STATS message with the size and the mean decode
+ * time of each format.
+ * @param json: actions as json, ending with \0
+ * @param bin: the same actions encoded, see action_bin.h
+ * @param bin_size: bytes of bin
+ * @param runs: decodes of each format, at most DECODE_BENCH_MAX_RUNS
+ */
+void queue_decode_benchmark(const char *json, const uint8_t *bin, int bin_size, int runs);
+
+/**
+ * @brief task to parse the json of the ingress queue and run
+ * its ble actions or its command
  */
 void task_parse_json(void *params);
 
+/**
+ * @brief Restore the auto tasks saved before the reboot and
+ * start the task that sends their requests.
+ */
+void init_task_scheduler();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,92 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "source/boot.h"
+#include "source/messages_parser.h"
+
+static const char* TAG = "Boot";
+
+static const char *phase_names[BOOT_PHASES] = {
+    "nvs", "wifi", "mesh", "tasks", "mqtt", "first reading"
+};
+
+static EventGroupHandle_t boot_events = NULL;
+
+// esp_timer time when every phase began and ended the first time, 0 if not yet
+static int64_t began[BOOT_PHASES];
+static int64_t ended[BOOT_PHASES];
+
+/**
+ * @brief Create the boot event group. It has to be called first.
+ */
+void init_boot()
+{
+    memset(began, 0, sizeof(began));
+    memset(ended, 0, sizeof(ended));
+    boot_events = xEventGroupCreate();
+}
+
+/**
+ * @brief Take the time a phase starts. Only the first time counts.
+ */
+void boot_phase_begin(boot_phase_t phase)
+{
+    if(began[phase] == 0)
+        began[phase] = esp_timer_get_time();
+}
+
+/**
+ * @brief Set the bit of a phase. The first time, the phase duration is logged.
+ */
+void boot_phase_end(boot_phase_t phase)
+{
+    if(ended[phase] == 0)
+    {
+        ended[phase] = esp_timer_get_time();
+        ESP_LOGI(TAG, "Phase %s done in %d ms, %d ms since boot", phase_names[phase],
+            (int) ((ended[phase] - began[phase]) / 1000), (int) (ended[phase] / 1000));
+    }
+    xEventGroupSetBits(boot_events, 1 << phase);
+}
+
+/**
+ * @brief Clear the bit of a phase, e.g. when wifi is lost.
+ */
+void boot_phase_reset(boot_phase_t phase)
+{
+    xEventGroupClearBits(boot_events, 1 << phase);
+}
+
+/**
+ * @brief Wait until a phase is done.
+ * @param phase: phase to wait for
+ * @param ticks: maximum time to wait
+ * @retval whether the phase is done
+ */
+bool boot_wait(boot_phase_t phase, TickType_t ticks)
+{
+    EventBits_t bits = xEventGroupWaitBits(boot_events, 1 << phase, pdFALSE, pdTRUE, ticks);
+    return (bits & (1 << phase)) != 0;
+}
+
+/**
+ * @brief Queue a STATS message with the duration of every boot phase.
+ */
+void queue_boot_stats()
+{
+    message_t* message = create_message(STATS);
+
+    for(int i = 0; i < BOOT_PHASES; i++)
+    {
+        if(ended[i] != 0)
+            add_message_text_plain(message, false, "Boot %s: %d ms, done at %d ms",
+                phase_names[i], (int) ((ended[i] - began[i]) / 1000), (int) (ended[i] / 1000));
+        else
+            add_message_text_plain(message, false, "Boot %s: not done", phase_names[i]);
+    }
+    send_message_queue(message);
+}
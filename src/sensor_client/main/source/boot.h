@@ -0,0 +1,57 @@
+#ifndef _BOOT_H_
+#define _BOOT_H_
+
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+
+/*
+ * Boot phases. Wifi association, BLE Mesh init and the restore of the tasks
+ * run at the same time; MQTT starts once there is an IP. Every phase has a
+ * bit in the boot event group that is set while it is done (wifi and MQTT
+ * clear it when they disconnect).
+ */
+typedef enum {
+    BOOT_NVS,
+    BOOT_WIFI,          // until an IP is obtained
+    BOOT_MESH,
+    BOOT_TASKS,         // auto tasks restored
+    BOOT_MQTT,          // until the client is connected to the broker
+    BOOT_FIRST_READING, // first reading published
+    BOOT_PHASES
+} boot_phase_t;
+
+/**
+ * @brief Create the boot event group. It has to be called first.
+ */
+void init_boot();
+
+/**
+ * @brief Take the time a phase starts. Only the first time counts.
+ */
+void boot_phase_begin(boot_phase_t phase);
+
+/**
+ * @brief Set the bit of a phase. The first time, the phase duration is logged.
+ */
+void boot_phase_end(boot_phase_t phase);
+
+/**
+ * @brief Clear the bit of a phase, e.g. when wifi is lost.
+ */
+void boot_phase_reset(boot_phase_t phase);
+
+/**
+ * @brief Wait until a phase is done.
+ * @param phase: phase to wait for
+ * @param ticks: maximum time to wait
+ * @retval whether the phase is done
+ */
+bool boot_wait(boot_phase_t phase, TickType_t ticks);
+
+/**
+ * @brief Queue a STATS message with the duration of every boot phase.
+ */
+void queue_boot_stats();
+
+#endif
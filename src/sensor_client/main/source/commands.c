@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "cJSON.h"
+
+#include "source/commands.h"
+#include "source/messages_parser.h"
+#include "source/data_format.h"
+#include "source/tasks_manager.h"
+#include "source/boot.h"
+#include "source/benchmark.h"
+#include "source/message_queue.h"
+#include "source/mqtt_outbox.h"
+#include "source/store_forward.h"
+#include "source/mqtt.h"
+#include "source/ble_cmd.h"
+#include "source/request_ids.h"
+#include "source/rules.h"
+#include "source/sensor_model_client.h"
+#include "source/request_tracker.h"
+#include "source/node_registry.h"
+#include "source/descriptor_cache.h"
+
+static const char *TAG = "Commands";
+
+typedef struct command_t {
+    const char *name;
+    void (*run)(const cJSON *root);
+} command_t;
+
+// {"cmd": "tasks", "page_size": n, "page": p, filter}, every page without "page".
+// Like every command, it may carry a "request_id" echoed on its answers.
+static void cmd_tasks(const cJSON *root)
+{
+    const cJSON *page_size = cJSON_GetObjectItem(root, "page_size");
+    const cJSON *page      = cJSON_GetObjectItem(root, "page");
+    task_filter_t filter;
+
+    parse_task_filter(root, &filter);
+    queue_list_task(&filter,
+        cJSON_IsNumber(page_size) ? page_size->valueint : CONFIG_TASKS_PAGE_SIZE,
+        cJSON_IsNumber(page) ? page->valueint : -1);
+}
+
+static void cmd_stats(const cJSON *root)
+{
+    queue_boot_stats();
+#if CONFIG_GATEWAY_BENCHMARK
+    queue_benchmark_stats();
+#endif
+    queue_mesh_rx_stats();
+    queue_request_tracker_stats();
+    queue_message_queue_stats();
+    queue_mqtt_outbox_stats();
+    queue_mqtt_ingress_stats();
+    queue_mqtt_egress_stats();
+#if CONFIG_STORE_FORWARD
+    queue_store_forward_stats();
+#endif
+}
+
+static void cmd_nodes(const cJSON *root)
+{
+    queue_node_registry_stats();
+}
+
+static void cmd_flush_descriptors(const cJSON *root)
+{
+    // without addr, every node
+    const cJSON *addr = cJSON_GetObjectItem(root, "addr");
+    descriptor_cache_invalidate(cJSON_IsString(addr) ? string_to_hex_uint16_t(addr->valuestring) : 0x0000);
+}
+
+// {"cmd": "decode_bench", "json": {"actions": [...]}, "bin": "hex", "runs": n}, n up to DECODE_BENCH_MAX_RUNS
+// decodes the same actions in both ingress formats without running them
+static void cmd_decode_bench(const cJSON *root)
+{
+    const cJSON *json = cJSON_GetObjectItem(root, "json");
+    const cJSON *bin  = cJSON_GetObjectItem(root, "bin");
+    const cJSON *runs = cJSON_GetObjectItem(root, "runs");
+
+    if(!cJSON_IsObject(json) || !cJSON_IsString(bin) || strlen(bin->valuestring) % 2 != 0)
+    {
+        message_t *message = create_message(PLAIN_TEXT);
+        add_message_text_plain(message, true, "decode_bench needs a json object and its binary as an even hex string");
+        send_message_queue(message);
+        return;
+    }
+
+    // the json as it comes in /sensors/actions/ble, without spaces
+    char *text = cJSON_PrintUnformatted(json);
+    int size = strlen(bin->valuestring) / 2;
+    uint8_t *data = (uint8_t *) malloc(size + 1);
+    for(int i = 0; data != NULL && i < size; i++)
+    {
+        char byte[3] = { bin->valuestring[2 * i], bin->valuestring[2 * i + 1], '\0' };
+        data[i] = (uint8_t) strtoul(byte, NULL, 16);
+    }
+
+    if(text != NULL && data != NULL)
+        queue_decode_benchmark(text, data, size, cJSON_IsNumber(runs) ? runs->valueint : 100);
+    free(text);
+    free(data);
+}
+
+#if CONFIG_GATEWAY_RULES
+// {"cmd": "rules", "rules": [rule, ...]} replaces the rules, see rules.h.
+// Without "rules" they are listed.
+static void cmd_rules(const cJSON *root)
+{
+    const cJSON *rules = cJSON_GetObjectItem(root, "rules");
+    if(rules != NULL)
+        rules_load(rules);
+    else
+        queue_rules_stats();
+}
+#endif
+
+static const command_t commands[] = {
+    { "tasks",             &cmd_tasks },
+    { "stats",             &cmd_stats },
+    { "nodes",             &cmd_nodes },
+    { "flush_descriptors", &cmd_flush_descriptors },
+    { "decode_bench",      &cmd_decode_bench },
+#if CONFIG_GATEWAY_RULES
+    { "rules",             &cmd_rules },
+#endif
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+/**
+ * @brief Run the command of a json received in the commands topic
+ * @param json: json ending with \0
+ */
+void command_dispatch(const char *json)
+{
+    cJSON *root = cJSON_Parse(json);
+    const cJSON *cmd = cJSON_GetObjectItem(root, "cmd");
+
+    if(!cJSON_IsString(cmd))
+    {
+        ESP_LOGE(TAG, "Command without cmd: %s", json);
+        cJSON_Delete(root);
+        return;
+    }
+
+    const cJSON *request_id = cJSON_GetObjectItem(root, "request_id");
+    request_ids_begin(cJSON_IsString(request_id) ? request_id->valuestring : NULL);
+
+    for(int i = 0; i < NUM_COMMANDS; i++)
+    {
+        if(strcmp(cmd->valuestring, commands[i].name) == 0)
+        {
+            commands[i].run(root);
+            request_ids_end();
+            cJSON_Delete(root);
+            return;
+        }
+    }
+
+    ESP_LOGE(TAG, "Unknown command %s", cmd->valuestring);
+    message_t *message = create_message(PLAIN_TEXT);
+    add_message_text_plain(message, true, "Unknown command %s", cmd->valuestring);
+    send_message_queue(message);
+    request_ids_end();
+    cJSON_Delete(root);
+}
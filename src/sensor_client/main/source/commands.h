@@ -0,0 +1,16 @@
+#ifndef _COMMANDS_H_
+#define _COMMANDS_H_
+
+/*
+ * Commands received in /sensors/actions/commands, {"cmd": "<name>", ...}.
+ * They run in the ingress worker (task_parse_json), never in the MQTT
+ * event task. Every command is an entry of the table in commands.c.
+ */
+
+/**
+ * @brief Run the command of a json received in the commands topic
+ * @param json: json ending with \0
+ */
+void command_dispatch(const char *json);
+
+#endif
@@ -7,6 +7,13 @@
 
 static char hex[] = "0123456789ABCDEF";
 
+/* Properties whose raw value is signed. The rest are unsigned */
+static const uint16_t signed_properties[] = {
+    0x0056, // Present Indoor Ambient Temperature
+    0x005B, // Present Outdoor Ambient Temperature
+    0x0054, // Present Device Operating Temperature
+};
+
 /**
  * @brief return uint8_t representation of a char.
  */
@@ -97,4 +104,27 @@ char* uint16_to_string(uint16_t value)
             buff[i] = '0';
     }
     return buff;
-}
\ No newline at end of file
+}
+/**
+ * @brief Return the value of a sensor raw value. It is little endian and
+ * its length comes from the Marshalled Property ID, up to 4 bytes.
+ */
+int sensor_raw_to_int(uint16_t sensor_prop_id, const uint8_t *raw, uint8_t len)
+{
+    uint32_t value = 0;
+
+    if(len > sizeof(uint32_t))
+        len = sizeof(uint32_t);
+
+    for(int i = len - 1; i >= 0; i--)
+        value = (value << 8) | raw[i];
+
+    for(size_t i = 0; i < sizeof(signed_properties) / sizeof(signed_properties[0]); i++)
+    {
+        // sign extension
+        if(signed_properties[i] == sensor_prop_id && len > 0 && len < sizeof(uint32_t)
+           && (value & (1U << (len * 8 - 1))))
+            return (int) (value | (0xFFFFFFFFU << (len * 8)));
+    }
+    return (int) value;
+}
@@ -16,4 +16,10 @@ uint16_t string_to_hex_uint16_t(const char *string);
 char* uint8_array_to_string(uint8_t *val, uint16_t len);
 
 char* uint16_to_string(uint16_t value);
+
+/**
+ * @brief Return the value of a sensor raw value. It is little endian and
+ * its length comes from the Marshalled Property ID, up to 4 bytes.
+ */
+int sensor_raw_to_int(uint16_t sensor_prop_id, const uint8_t *raw, uint8_t len);
 #endif
\ No newline at end of file
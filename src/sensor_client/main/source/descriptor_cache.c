@@ -0,0 +1,285 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "source/descriptor_cache.h"
+#include "source/node_registry.h"
+#include "source/gateway_storage.h"
+
+static const char* TAG = "DescriptorCache";
+
+/*
+ * The registry keeps the descriptors in RAM. Every node with descriptors
+ * has a blob in NVS_NAMESPACE, keyed by its addr, with the complete flag
+ * followed by the raw descriptors. Descriptors barely change, so the blob
+ * is only written when they do.
+ */
+#define NVS_NAMESPACE "descriptors"
+#define BLOB_SIZE     (1 + NODE_REGISTRY_PROPERTIES * NODE_DESCRIPTOR_LEN)
+
+/**
+ * @brief Sensor property id of a raw descriptor
+ */
+static uint16_t descriptor_prop_id(const uint8_t *descriptor)
+{
+    return descriptor[0] | (descriptor[1] << 8);
+}
+
+static void nvs_key(uint16_t addr, char *key)
+{
+    sprintf(key, "%04x", addr);
+}
+
+/**
+ * @brief Write the descriptors of a node, copied from the registry, to NVS.
+ * A blob without descriptors erases the key.
+ */
+static void save_blob(uint16_t addr, const uint8_t *blob, size_t size)
+{
+    nvs_handle_t handle;
+    char key[8];
+
+    if(gateway_storage_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Cannot open nvs namespace %s", NVS_NAMESPACE);
+        return;
+    }
+
+    nvs_key(addr, key);
+    esp_err_t err = size > 1 ? nvs_set_blob(handle, key, blob, size) : nvs_erase_key(handle, key);
+    if(err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND)
+        err = nvs_commit(handle);
+
+    if(err != ESP_OK)
+        ESP_LOGE(TAG, "Cannot save descriptors of 0x%04x (err %d)", addr, err);
+
+    nvs_close(handle);
+}
+
+/**
+ * @brief Copy the descriptors of a node into a blob. Registry has to be locked.
+ * @retval blob size
+ */
+static size_t node_to_blob(const mesh_node_t *node, uint8_t *blob)
+{
+    blob[0] = node->descriptors_complete;
+    memcpy(blob + 1, node->descriptors, node->num_descriptors * NODE_DESCRIPTOR_LEN);
+    return 1 + node->num_descriptors * NODE_DESCRIPTOR_LEN;
+}
+
+/**
+ * @brief Restore the descriptors saved in NVS into the node registry.
+ * init_node_registry has to be called before.
+ */
+void init_descriptor_cache()
+{
+    int restored = 0;
+    nvs_handle_t handle;
+
+    if(gateway_storage_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+        return; // nothing saved yet
+
+    nvs_iterator_t it = nvs_entry_find(GATEWAY_NVS_PARTITION, NVS_NAMESPACE, NVS_TYPE_BLOB);
+    while(it != NULL)
+    {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+        it = nvs_entry_next(it);
+
+        uint8_t blob[BLOB_SIZE];
+        size_t size = sizeof(blob);
+        uint16_t addr = (uint16_t) strtol(info.key, NULL, 16);
+
+        if(nvs_get_blob(handle, info.key, blob, &size) != ESP_OK
+           || size < 1 || (size - 1) % NODE_DESCRIPTOR_LEN != 0)
+        {
+            ESP_LOGW(TAG, "Ignoring descriptors of %s", info.key);
+            continue;
+        }
+
+        node_registry_lock();
+        mesh_node_t *node = node_registry_get(addr);
+        if(node != NULL)
+        {
+            node->descriptors_complete = blob[0];
+            node->num_descriptors = (size - 1) / NODE_DESCRIPTOR_LEN;
+            memcpy(node->descriptors, blob + 1, size - 1);
+            restored++;
+        }
+        node_registry_unlock();
+    }
+    nvs_release_iterator(it);
+    nvs_close(handle);
+
+    ESP_LOGI(TAG, "Descriptors of %d nodes restored", restored);
+}
+
+/**
+ * @brief Save the descriptors received from a node.
+ * @param addr: node addr
+ * @param data: Sensor Descriptor states, NODE_DESCRIPTOR_LEN bytes each
+ * @param len: data length
+ * @param complete: whether data contains every descriptor of the node. If so,
+ * the descriptors cached before are replaced; otherwise they are merged.
+ */
+void descriptor_cache_store(uint16_t addr, const uint8_t *data, uint16_t len, bool complete)
+{
+    uint8_t blob[BLOB_SIZE];
+    size_t size = 0;
+
+    node_registry_lock();
+    mesh_node_t *node = node_registry_get(addr);
+    if(node != NULL)
+    {
+        uint8_t old[BLOB_SIZE];
+        size_t old_size = node_to_blob(node, old);
+
+        if(complete)
+        {
+            node->num_descriptors = 0;
+            node->descriptors_complete = true;
+        }
+
+        for(int i = 0; i + NODE_DESCRIPTOR_LEN <= len; i += NODE_DESCRIPTOR_LEN)
+        {
+            int j = 0;
+            while(j < node->num_descriptors
+                  && descriptor_prop_id(node->descriptors[j]) != descriptor_prop_id(data + i))
+                j++;
+
+            if(j == NODE_REGISTRY_PROPERTIES)
+            {
+                ESP_LOGW(TAG, "No room for more descriptors of 0x%04x", addr);
+                node->descriptors_complete = false;
+                break;
+            }
+            memcpy(node->descriptors[j], data + i, NODE_DESCRIPTOR_LEN);
+            if(j == node->num_descriptors)
+                node->num_descriptors++;
+        }
+
+        size = node_to_blob(node, blob);
+        if(size == old_size && memcmp(blob, old, size) == 0)
+            size = 0; // nothing changed
+    }
+    node_registry_unlock();
+
+    if(size != 0)
+        save_blob(addr, blob, size);
+}
+
+/**
+ * @brief Copy the cached descriptors of a node.
+ * @param addr: node addr
+ * @param sensor_prop_id: property, 0x0000 for every property of the node
+ * @param data: buffer of NODE_REGISTRY_PROPERTIES * NODE_DESCRIPTOR_LEN bytes
+ * @retval bytes copied, 0 if the descriptors are not cached
+ */
+uint16_t descriptor_cache_get(uint16_t addr, uint16_t sensor_prop_id, uint8_t *data)
+{
+    uint16_t len = 0;
+
+    node_registry_lock();
+    mesh_node_t *node = node_registry_find(addr);
+    if(node != NULL)
+    {
+        if(sensor_prop_id == 0x0000)
+        {
+            if(node->descriptors_complete)
+            {
+                len = node->num_descriptors * NODE_DESCRIPTOR_LEN;
+                memcpy(data, node->descriptors, len);
+            }
+        }
+        else
+        {
+            for(int i = 0; i < node->num_descriptors && len == 0; i++)
+            {
+                if(descriptor_prop_id(node->descriptors[i]) == sensor_prop_id)
+                {
+                    len = NODE_DESCRIPTOR_LEN;
+                    memcpy(data, node->descriptors[i], len);
+                }
+            }
+        }
+    }
+    node_registry_unlock();
+
+    return len;
+}
+
+/**
+ * @brief Forget the descriptor of a property the node does not have anymore.
+ */
+void descriptor_cache_remove(uint16_t addr, uint16_t sensor_prop_id)
+{
+    uint8_t blob[BLOB_SIZE];
+    size_t size = 0;
+
+    node_registry_lock();
+    mesh_node_t *node = node_registry_find(addr);
+    if(node != NULL)
+    {
+        for(int i = 0; i < node->num_descriptors; i++)
+        {
+            if(descriptor_prop_id(node->descriptors[i]) == sensor_prop_id)
+            {
+                ESP_LOGW(TAG, "Property 0x%04x removed from 0x%04x", sensor_prop_id, addr);
+                memmove(node->descriptors[i], node->descriptors[i + 1],
+                    (node->num_descriptors - i - 1) * NODE_DESCRIPTOR_LEN);
+                node->num_descriptors--;
+                // the node has changed, the rest of descriptors are not trusted
+                node->descriptors_complete = false;
+                size = node_to_blob(node, blob);
+                break;
+            }
+        }
+    }
+    node_registry_unlock();
+
+    if(size != 0)
+        save_blob(addr, blob, size);
+}
+
+static void clear_descriptors(mesh_node_t *node, void *arg)
+{
+    node->num_descriptors = 0;
+    node->descriptors_complete = false;
+}
+
+/**
+ * @brief Forget every descriptor of a node, of every node if addr is 0x0000.
+ */
+void descriptor_cache_invalidate(uint16_t addr)
+{
+    ESP_LOGI(TAG, "Invalidating descriptors of 0x%04x", addr);
+
+    if(addr != 0x0000)
+    {
+        node_registry_lock();
+        mesh_node_t *node = node_registry_find(addr);
+        if(node != NULL)
+            clear_descriptors(node, NULL);
+        node_registry_unlock();
+
+        save_blob(addr, NULL, 0);
+    }
+    else
+    {
+        nvs_handle_t handle;
+
+        node_registry_lock();
+        node_registry_foreach(clear_descriptors, NULL);
+        node_registry_unlock();
+
+        if(gateway_storage_open(NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK)
+        {
+            nvs_erase_all(handle);
+            nvs_commit(handle);
+            nvs_close(handle);
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef _DESCRIPTOR_CACHE_H_
+#define _DESCRIPTOR_CACHE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Restore the descriptors saved in NVS into the node registry.
+ * init_node_registry has to be called before.
+ */
+void init_descriptor_cache();
+
+/**
+ * @brief Save the descriptors received from a node.
+ * @param addr: node addr
+ * @param data: Sensor Descriptor states, NODE_DESCRIPTOR_LEN bytes each
+ * @param len: data length
+ * @param complete: whether data contains every descriptor of the node. If so,
+ * the descriptors cached before are replaced; otherwise they are merged.
+ */
+void descriptor_cache_store(uint16_t addr, const uint8_t *data, uint16_t len, bool complete);
+
+/**
+ * @brief Copy the cached descriptors of a node.
+ * @param addr: node addr
+ * @param sensor_prop_id: property, 0x0000 for every property of the node
+ * @param data: buffer of NODE_REGISTRY_PROPERTIES * NODE_DESCRIPTOR_LEN bytes
+ * @retval bytes copied, 0 if the descriptors are not cached
+ */
+uint16_t descriptor_cache_get(uint16_t addr, uint16_t sensor_prop_id, uint8_t *data);
+
+/**
+ * @brief Forget the descriptor of a property the node does not have anymore.
+ */
+void descriptor_cache_remove(uint16_t addr, uint16_t sensor_prop_id);
+
+/**
+ * @brief Forget every descriptor of a node, of every node if addr is 0x0000.
+ */
+void descriptor_cache_invalidate(uint16_t addr);
+
+#endif
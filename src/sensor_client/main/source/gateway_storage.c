@@ -0,0 +1,29 @@
+#include "esp_log.h"
+#include "nvs_flash.h"
+
+#include "source/gateway_storage.h"
+
+static const char* TAG = "GatewayStorage";
+
+/**
+ * @brief Initialize the gateway NVS partition. It is erased if it is full
+ * or was written by another NVS version.
+ */
+esp_err_t init_gateway_storage()
+{
+    esp_err_t err = nvs_flash_init_partition(GATEWAY_NVS_PARTITION);
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_LOGW(TAG, "Erasing partition %s (err %d)", GATEWAY_NVS_PARTITION, err);
+        ESP_ERROR_CHECK(nvs_flash_erase_partition(GATEWAY_NVS_PARTITION));
+        err = nvs_flash_init_partition(GATEWAY_NVS_PARTITION);
+    }
+    return err;
+}
+
+/**
+ * @brief Open a namespace of the gateway NVS partition.
+ */
+esp_err_t gateway_storage_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle)
+{
+    return nvs_open_from_partition(GATEWAY_NVS_PARTITION, name, mode, handle);
+}
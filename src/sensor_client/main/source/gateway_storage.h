@@ -0,0 +1,25 @@
+#ifndef _GATEWAY_STORAGE_H_
+#define _GATEWAY_STORAGE_H_
+
+#include "esp_err.h"
+#include "nvs.h"
+
+/*
+ * NVS partition with the state the gateway keeps across reboots: auto tasks,
+ * provisioning key indexes and sensor descriptors. The default nvs partition
+ * is left for wifi and the BLE Mesh stack.
+ */
+#define GATEWAY_NVS_PARTITION "gateway"
+
+/**
+ * @brief Initialize the gateway NVS partition. It is erased if it is full
+ * or was written by another NVS version.
+ */
+esp_err_t init_gateway_storage();
+
+/**
+ * @brief Open a namespace of the gateway NVS partition.
+ */
+esp_err_t gateway_storage_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle);
+
+#endif
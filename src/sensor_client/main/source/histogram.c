@@ -0,0 +1,78 @@
+#include <string.h>
+
+#include "source/histogram.h"
+
+/**
+ * @brief Return the bucket for a value: floor(log2(value)).
+ */
+static int bucket_index(uint32_t value)
+{
+    int index = 0;
+    if(value > 1)
+        index = 31 - __builtin_clz(value);
+
+    if(index >= HISTOGRAM_BUCKETS)
+        index = HISTOGRAM_BUCKETS - 1;
+
+    return index;
+}
+
+/**
+ * @brief Add a sample to the histogram.
+ * Constant time, no allocations. Safe to call from callbacks.
+ */
+void histogram_add(histogram_t *h, uint32_t value)
+{
+    h->buckets[bucket_index(value)]++;
+    h->count++;
+    h->sum += value;
+    if(value > h->max)
+        h->max = value;
+}
+
+/**
+ * @brief Return an upper bound of the given percentile (0-100).
+ * The bound is the top of the bucket where the percentile falls.
+ */
+uint32_t histogram_percentile(const histogram_t *h, int percentile)
+{
+    if(h->count == 0)
+        return 0;
+
+    // rank of the sample we are looking for, rounded up
+    uint64_t rank = ((uint64_t) h->count * percentile + 99) / 100;
+    if(rank == 0)
+        rank = 1;
+
+    uint64_t accumulated = 0;
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        accumulated += h->buckets[i];
+        if(accumulated >= rank)
+        {
+            // last bucket and buckets above the max are bounded by the max
+            uint32_t upper = (i == HISTOGRAM_BUCKETS - 1) ? h->max : (uint32_t) ((2ULL << i) - 1);
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
+
+/**
+ * @brief Return the mean of the samples or 0 if there are none.
+ */
+uint32_t histogram_mean(const histogram_t *h)
+{
+    if(h->count == 0)
+        return 0;
+
+    return (uint32_t) (h->sum / h->count);
+}
+
+/**
+ * @brief Clear all the samples.
+ */
+void histogram_reset(histogram_t *h)
+{
+    memset(h, 0, sizeof(histogram_t));
+}
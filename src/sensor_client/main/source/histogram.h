@@ -0,0 +1,41 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+
+/*
+ * Bucket i counts the samples in [2^i, 2^(i+1)).
+ * Bucket 0 also counts 0. The last bucket is open-ended.
+ */
+#define HISTOGRAM_BUCKETS 20
+
+typedef struct histogram_t {
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+    uint32_t count;
+    uint32_t max;
+    uint64_t sum;
+} histogram_t;
+
+/**
+ * @brief Add a sample to the histogram.
+ * Constant time, no allocations. Safe to call from callbacks.
+ */
+void histogram_add(histogram_t *h, uint32_t value);
+
+/**
+ * @brief Return an upper bound of the given percentile (0-100).
+ * The bound is the top of the bucket where the percentile falls.
+ */
+uint32_t histogram_percentile(const histogram_t *h, int percentile);
+
+/**
+ * @brief Return the mean of the samples or 0 if there are none.
+ */
+uint32_t histogram_mean(const histogram_t *h);
+
+/**
+ * @brief Clear all the samples.
+ */
+void histogram_reset(histogram_t *h);
+
+#endif
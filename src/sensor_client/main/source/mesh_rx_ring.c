@@ -0,0 +1,133 @@
+#include <string.h>
+
+#include "source/mesh_rx_ring.h"
+
+/*
+ * Single producer / single consumer ring. head and tail are free running
+ * counters; only the producer writes head and only the consumer writes tail,
+ * so no lock is needed, just acquire/release ordering on the counters.
+ */
+static mesh_rx_t ring[MESH_RX_RING_SIZE];
+static uint32_t head; // next slot to write
+static uint32_t tail; // next slot to read
+
+static TaskHandle_t consumer_task;
+static mesh_rx_stats_t stats;
+
+#if CONFIG_GATEWAY_BENCHMARK
+/*
+ * The benchmark injects records from its own task, so producers are
+ * serialized from reserve to commit. Normal builds have no lock.
+ */
+static portMUX_TYPE producer_mux = portMUX_INITIALIZER_UNLOCKED;
+#define PRODUCER_LOCK()   portENTER_CRITICAL(&producer_mux)
+#define PRODUCER_UNLOCK() portEXIT_CRITICAL(&producer_mux)
+#else
+#define PRODUCER_LOCK()
+#define PRODUCER_UNLOCK()
+#endif
+
+/**
+ * @brief Initialize the ring. The consumer task is notified on every commit.
+ * @param consumer: task that reads the ring
+ */
+void mesh_rx_ring_init(TaskHandle_t consumer)
+{
+    head = 0;
+    tail = 0;
+    memset(&stats, 0, sizeof(mesh_rx_stats_t));
+    consumer_task = consumer;
+}
+
+/**
+ * @brief Producer side. Return a free slot or NULL if the ring is full.
+ * Only one producer is allowed (BLE Mesh callbacks run in a single task),
+ * except in CONFIG_GATEWAY_BENCHMARK builds.
+ */
+mesh_rx_t* mesh_rx_ring_reserve()
+{
+    PRODUCER_LOCK();
+
+    uint32_t current_tail = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    uint32_t used = head - current_tail;
+
+    if(used >= MESH_RX_RING_SIZE)
+    {
+        stats.dropped++;
+        PRODUCER_UNLOCK();
+        return NULL;
+    }
+
+    if(used + 1 > stats.high_water_mark)
+        stats.high_water_mark = used + 1;
+
+    return &ring[head % MESH_RX_RING_SIZE];
+}
+
+/**
+ * @brief Producer side. Publish the slot returned by mesh_rx_ring_reserve.
+ */
+void mesh_rx_ring_commit()
+{
+    __atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+    stats.received++;
+
+    PRODUCER_UNLOCK();
+
+    if(consumer_task != NULL)
+        xTaskNotifyGive(consumer_task);
+}
+
+/**
+ * @brief Producer side. Copy a record into the ring.
+ * Only for CONFIG_GATEWAY_BENCHMARK, which adds a second producer.
+ * @retval false if the ring is full
+ */
+bool mesh_rx_ring_push(const mesh_rx_t *rx)
+{
+    mesh_rx_t *slot = mesh_rx_ring_reserve();
+
+    if(slot == NULL)
+        return false;
+
+    memcpy(slot, rx, sizeof(mesh_rx_t));
+    mesh_rx_ring_commit();
+    return true;
+}
+
+/**
+ * @brief Consumer side. Return the oldest record or NULL if empty.
+ */
+mesh_rx_t* mesh_rx_ring_peek()
+{
+    uint32_t current_head = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+
+    if(current_head == tail)
+        return NULL;
+
+    return &ring[tail % MESH_RX_RING_SIZE];
+}
+
+/**
+ * @brief Consumer side. Release the record returned by mesh_rx_ring_peek.
+ */
+void mesh_rx_ring_release()
+{
+    __atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Count a truncated record.
+ */
+void mesh_rx_ring_truncated()
+{
+    stats.truncated++;
+}
+
+/**
+ * @brief Copy the ring counters.
+ */
+void mesh_rx_ring_get_stats(mesh_rx_stats_t *out)
+{
+    memcpy(out, &stats, sizeof(mesh_rx_stats_t));
+}
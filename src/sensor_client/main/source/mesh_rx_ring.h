@@ -0,0 +1,92 @@
+#ifndef _MESH_RX_RING_H_
+#define _MESH_RX_RING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define MESH_RX_RING_SIZE CONFIG_MESH_RX_RING_SIZE
+#define MESH_RX_PDU_SIZE  CONFIG_MESH_RX_PDU_SIZE
+
+#if (MESH_RX_RING_SIZE & (MESH_RX_RING_SIZE - 1)) != 0
+#error "CONFIG_MESH_RX_RING_SIZE has to be a power of two"
+#endif
+
+/*
+ * Raw copy of a sensor client callback. The BLE Mesh callback only
+ * fills one of these and returns; decoding is done later by a worker.
+ */
+typedef struct mesh_rx_t {
+    int64_t timestamp;     // esp_timer_get_time() when the callback was called
+    uint32_t opcode;       // opcode of the request that this message answers
+    uint32_t recv_op;      // opcode of the received message
+    uint16_t addr;         // source (or destination on timeouts)
+    uint16_t property_id;  // property id of cadence, settings, setting, column, series status
+    uint16_t setting_property_id;
+    int16_t error_code;
+    uint8_t event;         // esp_ble_mesh_sensor_client_cb_event_t
+    int8_t rssi;
+    uint8_t ttl;           // received ttl
+    bool op_en;            // setting status carries access and raw value
+    uint8_t setting_access;
+    uint16_t len;          // bytes copied into data
+    uint16_t orig_len;     // bytes received. Greater than len if truncated
+    uint8_t data[MESH_RX_PDU_SIZE];
+} mesh_rx_t;
+
+typedef struct mesh_rx_stats_t {
+    uint32_t received;  // committed records
+    uint32_t dropped;   // records lost because the ring was full
+    uint32_t truncated; // records whose data did not fit into MESH_RX_PDU_SIZE
+    uint32_t high_water_mark;
+} mesh_rx_stats_t;
+
+/**
+ * @brief Initialize the ring. The consumer task is notified on every commit.
+ * @param consumer: task that reads the ring
+ */
+void mesh_rx_ring_init(TaskHandle_t consumer);
+
+/**
+ * @brief Producer side. Return a free slot or NULL if the ring is full.
+ * Only one producer is allowed (BLE Mesh callbacks run in a single task),
+ * except in CONFIG_GATEWAY_BENCHMARK builds.
+ */
+mesh_rx_t* mesh_rx_ring_reserve();
+
+/**
+ * @brief Producer side. Publish the slot returned by mesh_rx_ring_reserve.
+ */
+void mesh_rx_ring_commit();
+
+/**
+ * @brief Producer side. Copy a record into the ring.
+ * Only for CONFIG_GATEWAY_BENCHMARK, which adds a second producer.
+ * @retval false if the ring is full
+ */
+bool mesh_rx_ring_push(const mesh_rx_t *rx);
+
+/**
+ * @brief Consumer side. Return the oldest record or NULL if empty.
+ */
+mesh_rx_t* mesh_rx_ring_peek();
+
+/**
+ * @brief Consumer side. Release the record returned by mesh_rx_ring_peek.
+ */
+void mesh_rx_ring_release();
+
+/**
+ * @brief Count a truncated record.
+ */
+void mesh_rx_ring_truncated();
+
+/**
+ * @brief Copy the ring counters.
+ */
+void mesh_rx_ring_get_stats(mesh_rx_stats_t *stats);
+
+#endif
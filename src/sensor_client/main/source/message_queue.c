@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include "source/message_queue.h"
+
+static const char* TAG = "MessageQueue";
+
+typedef enum {
+    POLICY_BLOCK,
+    POLICY_DROP_OLDEST,
+    POLICY_DROP_NEWEST,
+    POLICY_COALESCE
+} queue_policy_t;
+
+static const char *policy_names[] = {
+    [POLICY_BLOCK]       = "block",
+    [POLICY_DROP_OLDEST] = "drop oldest",
+    [POLICY_DROP_NEWEST] = "drop newest",
+    [POLICY_COALESCE]    = "coalesce",
+};
+
+#if CONFIG_CONTROL_QUEUE_BLOCK
+#define CONTROL_POLICY POLICY_BLOCK
+#elif CONFIG_CONTROL_QUEUE_DROP_OLDEST
+#define CONTROL_POLICY POLICY_DROP_OLDEST
+#elif CONFIG_CONTROL_QUEUE_DROP_NEWEST
+#define CONTROL_POLICY POLICY_DROP_NEWEST
+#else
+#define CONTROL_POLICY POLICY_COALESCE
+#endif
+
+#if CONFIG_TELEMETRY_QUEUE_BLOCK
+#define TELEMETRY_POLICY POLICY_BLOCK
+#elif CONFIG_TELEMETRY_QUEUE_DROP_OLDEST
+#define TELEMETRY_POLICY POLICY_DROP_OLDEST
+#elif CONFIG_TELEMETRY_QUEUE_DROP_NEWEST
+#define TELEMETRY_POLICY POLICY_DROP_NEWEST
+#else
+#define TELEMETRY_POLICY POLICY_COALESCE
+#endif
+
+typedef struct class_queue_t {
+    const char *name;
+    queue_policy_t policy;
+    uint16_t size;
+    uint16_t head;
+    uint16_t count;
+    message_t **slots;
+    SemaphoreHandle_t space; // free slots
+    message_queue_stats_t stats;
+} class_queue_t;
+
+static class_queue_t classes[MESSAGE_CLASSES] = {
+    [MESSAGE_CONTROL] = {
+        .name = "control",
+        .policy = CONTROL_POLICY,
+        .size = CONFIG_CONTROL_QUEUE_SIZE,
+    },
+    [MESSAGE_TELEMETRY] = {
+        .name = "telemetry",
+        .policy = TELEMETRY_POLICY,
+        .size = CONFIG_TELEMETRY_QUEUE_SIZE,
+    },
+};
+
+static SemaphoreHandle_t xSem_queue = NULL;
+static SemaphoreHandle_t items = NULL; // queued messages of every class
+static SemaphoreHandle_t control_items = NULL; // queued control messages, also counted in items
+
+/**
+ * @brief Create the queue
+ */
+void init_message_queue()
+{
+    xSem_queue = xSemaphoreCreateMutex();
+    items = xSemaphoreCreateCounting(CONFIG_CONTROL_QUEUE_SIZE + CONFIG_TELEMETRY_QUEUE_SIZE, 0);
+    control_items = xSemaphoreCreateCounting(CONFIG_CONTROL_QUEUE_SIZE, 0);
+
+    for(int i = 0; i < MESSAGE_CLASSES; i++)
+    {
+        classes[i].slots = calloc(classes[i].size, sizeof(message_t *));
+        classes[i].space = xSemaphoreCreateCounting(classes[i].size, classes[i].size);
+        ESP_LOGI(TAG, "Queue %s: %d slots, %s", classes[i].name, classes[i].size, policy_names[classes[i].policy]);
+    }
+}
+
+static message_class_t class_of(const message_t *message)
+{
+    if(message->type == GET_STATUS || message->type == PROFILE)
+        return MESSAGE_TELEMETRY;
+    return MESSAGE_CONTROL;
+}
+
+/**
+ * @brief Return if two messages carry the same key: the same reading of a node
+ * or the profile of a node. Other messages have no key.
+ */
+static bool same_key(const message_t *a, const message_t *b)
+{
+    if(a->type != b->type)
+        return false;
+
+    if(a->type == GET_STATUS)
+        return a->m_content.measure.addr == b->m_content.measure.addr &&
+               a->m_content.measure.sensor_prop_id == b->m_content.measure.sensor_prop_id;
+
+    if(a->type == PROFILE)
+        return a->m_content.hex_buffer.addr == b->m_content.hex_buffer.addr;
+
+    return false;
+}
+
+// the queue has to be locked
+static void append(class_queue_t *queue, message_t *message)
+{
+    queue->slots[(queue->head + queue->count) % queue->size] = message;
+    queue->count++;
+    queue->stats.queued++;
+    if(queue->count > queue->stats.high_water_mark)
+        queue->stats.high_water_mark = queue->count;
+}
+
+// the queue has to be locked
+static message_t* take_oldest(class_queue_t *queue)
+{
+    message_t *message = queue->slots[queue->head];
+    queue->slots[queue->head] = NULL;
+    queue->head = (queue->head + 1) % queue->size;
+    queue->count--;
+    return message;
+}
+
+/**
+ * @brief Queue a message following the policy of its class
+ * @param message: message to queue, owned by the queue from now on
+ */
+void message_queue_push(message_t *message)
+{
+    class_queue_t *queue = &classes[class_of(message)];
+    message_t *dropped = NULL;
+
+    BaseType_t slot = xSemaphoreTake(queue->space, 0);
+    if(slot != pdTRUE && queue->policy == POLICY_BLOCK)
+    {
+        while(xSemaphoreTake(xSem_queue, (TickType_t) 10) != pdTRUE);
+        queue->stats.blocked++;
+        xSemaphoreGive(xSem_queue);
+
+        slot = xSemaphoreTake(queue->space, pdMS_TO_TICKS(CONFIG_MESSAGE_QUEUE_BLOCK_MS));
+    }
+
+    while(xSemaphoreTake(xSem_queue, (TickType_t) 10) != pdTRUE);
+
+    if(slot == pdTRUE)
+    {
+        append(queue, message);
+        xSemaphoreGive(xSem_queue);
+        if(queue == &classes[MESSAGE_CONTROL])
+            xSemaphoreGive(control_items);
+        xSemaphoreGive(items);
+        return;
+    }
+
+    // the class is full, the number of queued messages does not change
+    if(queue->policy == POLICY_COALESCE)
+    {
+        for(int i = 0; i < queue->count; i++)
+        {
+            int index = (queue->head + i) % queue->size;
+            if(same_key(queue->slots[index], message))
+            {
+                // keep the place of the old one, it has waited longer
+                dropped = queue->slots[index];
+                queue->slots[index] = message;
+                queue->stats.coalesced++;
+                message = NULL;
+                break;
+            }
+        }
+    }
+
+    if(message != NULL)
+    {
+        if((queue->policy == POLICY_COALESCE || queue->policy == POLICY_DROP_OLDEST) && queue->count > 0)
+        {
+            dropped = take_oldest(queue);
+            append(queue, message);
+        }
+        else
+        {
+            // drop newest, block timed out or the last slot is being released
+            dropped = message;
+        }
+        queue->stats.dropped++;
+    }
+
+    xSemaphoreGive(xSem_queue);
+
+    if(dropped != NULL)
+    {
+        ESP_LOGW(TAG, "Queue %s full, message of type %d %s", queue->name, dropped->type,
+            message == NULL ? "coalesced" : "dropped");
+        free_message(dropped);
+    }
+}
+
+/**
+ * @brief Return the next message to publish, control messages first
+ * @param wait: ticks to wait for a message
+ * @param telemetry: false to take only control messages, telemetry ones
+ * stay queued while there is no room to publish them
+ * @retval message or NULL if there is none after wait
+ */
+message_t* message_queue_receive(TickType_t wait, bool telemetry)
+{
+    // there is only one receiver, once a semaphore is taken its message is there
+    if(telemetry)
+    {
+        if(xSemaphoreTake(items, wait) != pdTRUE)
+            return NULL;
+    }
+    else
+    {
+        if(xSemaphoreTake(control_items, wait) != pdTRUE)
+            return NULL;
+        xSemaphoreTake(items, 0);
+    }
+
+    class_queue_t *queue = NULL;
+    message_t *message = NULL;
+
+    while(xSemaphoreTake(xSem_queue, (TickType_t) 10) != pdTRUE);
+    for(int i = 0; i < MESSAGE_CLASSES; i++)
+    {
+        if(classes[i].count > 0)
+        {
+            queue = &classes[i];
+            message = take_oldest(queue);
+            break;
+        }
+    }
+    xSemaphoreGive(xSem_queue);
+
+    if(queue == &classes[MESSAGE_CONTROL] && telemetry)
+        xSemaphoreTake(control_items, 0);
+    if(queue != NULL)
+        xSemaphoreGive(queue->space);
+
+    return message;
+}
+
+/**
+ * @brief Return the number of queued messages of every class
+ */
+uint32_t message_queue_level()
+{
+    return uxSemaphoreGetCount(items);
+}
+
+/**
+ * @brief Copy the counters of a class
+ */
+void message_queue_get_stats(message_class_t message_class, message_queue_stats_t *stats)
+{
+    while(xSemaphoreTake(xSem_queue, (TickType_t) 10) != pdTRUE);
+    memcpy(stats, &classes[message_class].stats, sizeof(message_queue_stats_t));
+    xSemaphoreGive(xSem_queue);
+}
+
+/**
+ * @brief Queue a message with the counters of every class
+ */
+void queue_message_queue_stats()
+{
+    message_queue_stats_t stats;
+    message_t* message = create_message(STATS);
+
+    for(int i = 0; i < MESSAGE_CLASSES; i++)
+    {
+        message_queue_get_stats(i, &stats);
+        add_message_text_plain(message, false, "Queue %s (%s): queued %u, dropped %u, coalesced %u, blocked %u, hwm %u/%d",
+            classes[i].name, policy_names[classes[i].policy], stats.queued, stats.dropped,
+            stats.coalesced, stats.blocked, stats.high_water_mark, classes[i].size);
+    }
+    send_message_queue(message);
+}
@@ -0,0 +1,72 @@
+#ifndef _MESSAGE_QUEUE_H_
+#define _MESSAGE_QUEUE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "source/messages_parser.h"
+
+/*
+ * Bounded queue of the messages to publish, split in two classes:
+ * control (answers to the cli) and telemetry (readings and profiles).
+ * Control messages are always published first. What happens when a class
+ * is full is its policy, taken from Kconfig:
+ *  - block: wait up to MESSAGE_QUEUE_BLOCK_MS for a free slot, then drop the new message
+ *  - drop oldest: the oldest message of the class is dropped
+ *  - drop newest: the new message is dropped
+ *  - coalesce: the new message replaces a queued one with the same key
+ *    (addr and property of a reading, addr of a profile), else the oldest is dropped
+ * The queue owns the messages: dropped and replaced messages are freed.
+ */
+typedef enum {
+    MESSAGE_CONTROL,
+    MESSAGE_TELEMETRY,
+    MESSAGE_CLASSES
+} message_class_t;
+
+typedef struct message_queue_stats_t {
+    uint32_t queued;
+    uint32_t dropped;   // messages lost, new or oldest
+    uint32_t coalesced; // messages replaced by a newer one with the same key
+    uint32_t blocked;   // pushes that had to wait for a free slot
+    uint32_t high_water_mark;
+} message_queue_stats_t;
+
+/**
+ * @brief Create the queue
+ */
+void init_message_queue();
+
+/**
+ * @brief Queue a message following the policy of its class
+ * @param message: message to queue, owned by the queue from now on
+ */
+void message_queue_push(message_t *message);
+
+/**
+ * @brief Return the next message to publish, control messages first
+ * @param wait: ticks to wait for a message
+ * @param telemetry: false to take only control messages, telemetry ones
+ * stay queued while there is no room to publish them
+ * @retval message or NULL if there is none after wait
+ */
+message_t* message_queue_receive(TickType_t wait, bool telemetry);
+
+/**
+ * @brief Return the number of queued messages of every class
+ */
+uint32_t message_queue_level();
+
+/**
+ * @brief Copy the counters of a class
+ */
+void message_queue_get_stats(message_class_t message_class, message_queue_stats_t *stats);
+
+/**
+ * @brief Queue a message with the counters of every class
+ */
+void queue_message_queue_stats();
+
+#endif
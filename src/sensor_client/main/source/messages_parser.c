@@ -2,45 +2,58 @@
 #include "freertos/queue.h"
 #include "cJSON.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include <string.h>
 #include <stdarg.h>
 
 #include "source/messages_parser.h"
 #include "source/data_format.h"
+#include "source/metrics.h"
+#include "source/profiler.h"
+#include "source/message_queue.h"
+#include "source/request_ids.h"
+#include "source/wall_clock.h"
 
 static const char *TAG = "MSG_PARSER";
 
-static QueueHandle_t queue_message;
-
-/**
- * @brief Initialize the queue. This queue is used in mqtt.c.
- * When mqtt.c receive a message_t struct, call message_parser.c
- * to obtain a json.
- * @param queue: queue used to push elements
- */
-void initialize_messages_parser_queue(QueueHandle_t queue)
-{
-    queue_message = queue;
-}
-
 /**
- * @brief queue a message_t*
+ * @brief queue a message_t*. It is freed if the queue drops it.
  * @param m: message_t to queue
  */
 void send_message_queue(message_t *m)
 {
-    xQueueSendToBack(queue_message, (void *) &m, 0);
+    m->enqueued = esp_timer_get_time();
+    METRICS_ADD_SINCE(STAGE_DECODE, m->timestamp);
+
+    message_queue_push(m);
+    METRICS_QUEUE_LEVEL(message_queue_level());
 }
 
 /****** FUNCTIONS TO PARSE message_type_t ******/
 
+// echo the id of the request, only if there is one
+static void add_request_id(cJSON *root, const char *request_id)
+{
+    if(request_id[0] != '\0')
+        cJSON_AddStringToObject(root, "request_id", request_id);
+}
+
+// unix time in ms of the reading, only once the clock is synced
+static void add_reading_time(cJSON *root, const measure_t *m)
+{
+    int64_t unix_ms;
+    if(m->taken != 0 && wall_clock_unix_ms(m->taken, &unix_ms))
+        cJSON_AddNumberToObject(root, "ts", (double) unix_ms);
+}
+
 /**
- * @brief obtain a json from a TEXT_PLAIN or TASKS message type
+ * @brief obtain a json from a TEXT_PLAIN or STATS message type
  * @param t: text_t struct
  * @param key: key to use in json -> {key: text_t as string}
+ * @param request_id: id echoed, empty if none
  * @retval json
  */
-static char* text_plain_to_json(text_t *t, char* key)
+static char* text_plain_to_json(text_t *t, char* key, const char *request_id)
 {
     char* json = NULL;
     cJSON *root = cJSON_CreateObject();
@@ -53,6 +66,7 @@ static char* text_plain_to_json(text_t *t, char* key)
         goto error;
 
     cJSON_AddItemToObject(root, "error_message", error_message);
+    add_request_id(root, request_id);
 
     cJSON *messages = cJSON_CreateArray();
     if (messages == NULL)
@@ -65,7 +79,7 @@ static char* text_plain_to_json(text_t *t, char* key)
     for(int i = 0; i < t->num_messages; i++)
     {
         memset(buff, '\0',  MAX_LENGHT_MESSAGE);
-        strncpy(buff, t->messages[i], strlen(t->messages[i]));
+        strncpy(buff, t->messages[i], MAX_LENGHT_MESSAGE - 1);
 
         message = cJSON_CreateString(buff);
         if(message == NULL)
@@ -74,7 +88,7 @@ static char* text_plain_to_json(text_t *t, char* key)
         cJSON_AddItemToArray(messages, message);
     }
 
-    json = cJSON_Print(root);
+    json = cJSON_PrintUnformatted(root);
 
 error:
     cJSON_Delete(root);
@@ -84,9 +98,10 @@ error:
 /**
  * @brief obtain a json from MEASURE type
  * @param m: measure_t struct
+ * @param request_id: id echoed, empty if none
  * @retval json
  */
-static char* get_status_to_json(measure_t *m)
+static char* get_status_to_json(measure_t *m, const char *request_id)
 {
 
     char* json = NULL;
@@ -113,8 +128,16 @@ static char* get_status_to_json(measure_t *m)
     cJSON_AddItemToObject(root, "sensor_prop_id", sensor_prop_id_json);
     cJSON_AddItemToObject(root, "addr", addr);
     cJSON_AddItemToObject(root, "measure", measure);
+    add_request_id(root, request_id);
+
+    // readings published late by store and forward
+    if(m->age_ms > 0)
+        cJSON_AddNumberToObject(root, "age_ms", m->age_ms);
+    else if(m->age_ms < 0)
+        cJSON_AddNullToObject(root, "age_ms");
+    add_reading_time(root, m);
 
-    json = cJSON_Print(root);
+    json = cJSON_PrintUnformatted(root);
 
 error:
 
@@ -122,13 +145,44 @@ error:
     return json;
 }
 
+/**
+ * @brief Return the compact json of a GET_STATUS message for its node topic,
+ * the addr and sensor_prop_id are only in the topic
+ * @param message: GET_STATUS message
+ * @retval json
+ */
+char* measure_to_node_json(message_t *message)
+{
+    measure_t *m = &message->m_content.measure;
+    char* json = NULL;
+
+    cJSON *root = cJSON_CreateObject();
+    if(root == NULL)
+        goto error;
+
+    cJSON_AddNumberToObject(root, "measure", m->value);
+    if(m->age_ms > 0)
+        cJSON_AddNumberToObject(root, "age_ms", m->age_ms);
+    else if(m->age_ms < 0)
+        cJSON_AddNullToObject(root, "age_ms");
+    add_reading_time(root, m);
+    add_request_id(root, message->request_id);
+
+    json = cJSON_PrintUnformatted(root);
+
+error:
+    cJSON_Delete(root);
+    return json;
+}
+
 /**
  * @brief obtain a json from a HEX_BUFFER type
  * @param hex: hex_buffer_t struct
  * @param key: key in json -> {key: hex_buffer_t as string}
+ * @param request_id: id echoed, empty if none
  * @retval json
  */
-static char* get_hex_buffer_to_json(hex_buffer_t *hex, const char* key)
+static char* get_hex_buffer_to_json(hex_buffer_t *hex, const char* key, const char *request_id)
 {
     char* json = NULL;
     cJSON *root = cJSON_CreateObject();
@@ -142,8 +196,9 @@ static char* get_hex_buffer_to_json(hex_buffer_t *hex, const char* key)
         goto error;
 
     cJSON_AddItemToObject(root, key, data);
+    add_request_id(root, request_id);
 
-    json = cJSON_Print(root);
+    json = cJSON_PrintUnformatted(root);
 
 error:
     cJSON_Delete(root);
@@ -153,9 +208,10 @@ error:
 /**
  * @brief obtain a json from a GET_DESCRIPTOR type
  * @param hex: hex_buffer_t struct
+ * @param request_id: id echoed, empty if none
  * @retval json
  */
-static char* get_descriptor_to_json(hex_buffer_t *hex)
+static char* get_descriptor_to_json(hex_buffer_t *hex, const char *request_id)
 {
     /*
     struct sensor_descriptor {
@@ -178,6 +234,7 @@ static char* get_descriptor_to_json(hex_buffer_t *hex)
         goto error;
 
     cJSON_AddItemToObject(root, "type", type);
+    add_request_id(root, request_id);
 
     cJSON *descriptors = cJSON_AddArrayToObject(root, "descriptors");
     if(descriptors == NULL)
@@ -267,7 +324,183 @@ static char* get_descriptor_to_json(hex_buffer_t *hex)
 
     }
 
-    json = cJSON_Print(root);
+    json = cJSON_PrintUnformatted(root);
+
+error:
+    cJSON_Delete(root);
+    return json;
+}
+
+/**
+ * @brief obtain a json from a TASKS type, compact since a listing has many pages
+ * @param tasks_page: tasks_page_t struct
+ * @param request_id: id echoed, empty if none
+ * @retval json
+ */
+static char* tasks_page_to_json(tasks_page_t *tasks_page, const char *request_id)
+{
+    char* json = NULL;
+    int64_t now = esp_timer_get_time();
+
+    cJSON *root = cJSON_CreateObject();
+    if(root == NULL)
+        goto error;
+
+    cJSON_AddStringToObject(root, "type", "TASKS");
+    cJSON_AddNumberToObject(root, "page", tasks_page->page);
+    cJSON_AddNumberToObject(root, "pages", tasks_page->pages);
+    cJSON_AddNumberToObject(root, "total", tasks_page->total);
+    add_request_id(root, request_id);
+
+    cJSON *tasks = cJSON_AddArrayToObject(root, "tasks");
+    if(tasks == NULL)
+        goto error;
+
+    for(int i = 0; i < tasks_page->count; i++)
+    {
+        task_t *t = &tasks_page->tasks[i];
+
+        cJSON *task = cJSON_CreateObject();
+        if(task == NULL)
+            goto error;
+        cJSON_AddItemToArray(tasks, task);
+
+        char* addr_str = uint16_to_string(t->addr);
+        char* sensor_prop_id_str = uint16_to_string(t->sensor_prop_id);
+        cJSON_AddStringToObject(task, "name", t->name);
+        cJSON_AddStringToObject(task, "addr", addr_str); free(addr_str);
+        cJSON_AddStringToObject(task, "sensor_prop_id", sensor_prop_id_str); free(sensor_prop_id_str);
+        cJSON_AddNumberToObject(task, "delay", t->delay);
+        if(t->group != 0)
+            cJSON_AddNumberToObject(task, "group", t->group);
+        if(t->paused)
+            cJSON_AddTrueToObject(task, "paused");
+
+        // seconds since the last request
+        if(t->last_run != 0)
+            cJSON_AddNumberToObject(task, "last_s", (double) ((now - t->last_run) / 1000000));
+        else
+            cJSON_AddNullToObject(task, "last_s");
+        cJSON_AddNumberToObject(task, "runs", t->runs);
+        cJSON_AddNumberToObject(task, "replies", t->replies);
+        cJSON_AddNumberToObject(task, "timeouts", t->timeouts);
+        cJSON_AddNumberToObject(task, "dropped", t->dropped);
+        if(t->replies > 0)
+            cJSON_AddNumberToObject(task, "rtt_ms", t->rtt_sum / t->replies);
+        else
+            cJSON_AddNullToObject(task, "rtt_ms");
+    }
+
+    json = cJSON_PrintUnformatted(root);
+
+error:
+    cJSON_Delete(root);
+    return json;
+}
+
+/**
+ * @brief obtain a json from an ALERT type
+ * @param alert: alert_t struct
+ * @retval json
+ */
+static char* alert_to_json(alert_t *alert)
+{
+    char* json = NULL;
+    int64_t unix_ms;
+
+    cJSON *root = cJSON_CreateObject();
+    if(root == NULL)
+        goto error;
+
+    char* addr_str = uint16_to_string(alert->addr);
+    char* sensor_prop_id_str = uint16_to_string(alert->sensor_prop_id);
+    cJSON_AddStringToObject(root, "rule", alert->rule);
+    cJSON_AddStringToObject(root, "kind", alert->kind);
+    cJSON_AddStringToObject(root, "state", alert->firing ? "firing" : "resolved");
+    cJSON_AddStringToObject(root, "addr", addr_str); free(addr_str);
+    cJSON_AddStringToObject(root, "sensor_prop_id", sensor_prop_id_str); free(sensor_prop_id_str);
+    cJSON_AddNumberToObject(root, "value", alert->value);
+    if(wall_clock_unix_ms(alert->taken, &unix_ms))
+        cJSON_AddNumberToObject(root, "ts", (double) unix_ms);
+
+    json = cJSON_PrintUnformatted(root);
+
+error:
+    cJSON_Delete(root);
+    return json;
+}
+
+static uint32_t get_u32(const uint8_t *buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24);
+}
+
+/**
+ * @brief obtain a json from a PROFILE type
+ * @param hex: hex_buffer_t struct with a profile record, see profiler.h
+ * @param request_id: id echoed, empty if none
+ * @retval json
+ */
+static char* profile_to_json(hex_buffer_t *hex, const char *request_id)
+{
+    char* json = NULL;
+    cJSON *root = NULL;
+
+    if(hex->len < PROFILE_HEADER_LEN || hex->data[0] != PROFILE_VERSION)
+    {
+        ESP_LOGE(TAG, "Unknown profile record from 0x%04x", hex->addr);
+        goto error;
+    }
+
+    root = cJSON_CreateObject();
+    if(root == NULL)
+        goto error;
+
+    char* addr_str = uint16_to_string(hex->addr);
+    cJSON_AddStringToObject(root, "type", "PROFILE");
+    cJSON_AddStringToObject(root, "addr", addr_str); free(addr_str);
+    add_request_id(root, request_id);
+
+    const uint8_t *data = hex->data;
+    if(data[1] != PROFILE_UNKNOWN_CPU)
+        cJSON_AddNumberToObject(root, "cpu", data[1]);
+
+    uint32_t free_heap = get_u32(data + 3);
+    uint32_t largest = get_u32(data + 11);
+    cJSON *heap = cJSON_AddObjectToObject(root, "heap");
+    if(heap == NULL)
+        goto error;
+    cJSON_AddNumberToObject(heap, "free", free_heap);
+    cJSON_AddNumberToObject(heap, "min_free", get_u32(data + 7));
+    cJSON_AddNumberToObject(heap, "largest", largest);
+    // fragmentation: free memory that is not in the largest block
+    cJSON_AddNumberToObject(heap, "frag", free_heap == 0 ? 0 : 100 - (uint64_t) largest * 100 / free_heap);
+
+    // [name, cpu %, free stack bytes], compact for the slow links
+    cJSON *tasks = cJSON_AddArrayToObject(root, "tasks");
+    if(tasks == NULL)
+        goto error;
+
+    char name[PROFILE_TASK_NAME + 1];
+    for(int i = 0; i < data[2] && PROFILE_HEADER_LEN + (i + 1) * PROFILE_TASK_LEN <= hex->len; i++)
+    {
+        const uint8_t *record = data + PROFILE_HEADER_LEN + i * PROFILE_TASK_LEN;
+        memcpy(name, record, PROFILE_TASK_NAME);
+        name[PROFILE_TASK_NAME] = '\0';
+
+        cJSON *task = cJSON_CreateArray();
+        if(task == NULL)
+            goto error;
+        cJSON_AddItemToArray(tasks, task);
+        cJSON_AddItemToArray(task, cJSON_CreateString(name));
+        if(record[PROFILE_TASK_NAME] != PROFILE_UNKNOWN_CPU)
+            cJSON_AddItemToArray(task, cJSON_CreateNumber(record[PROFILE_TASK_NAME]));
+        else
+            cJSON_AddItemToArray(task, cJSON_CreateNull());
+        cJSON_AddItemToArray(task, cJSON_CreateNumber(record[PROFILE_TASK_NAME + 1] | (record[PROFILE_TASK_NAME + 2] << 8)));
+    }
+
+    json = cJSON_PrintUnformatted(root);
 
 error:
     cJSON_Delete(root);
@@ -298,10 +531,11 @@ void add_message_text_plain(message_t* m, bool error_message, const char* messag
 
         va_list args;
         va_start(args, message);
-        vsprintf(buff, message, args);
+        vsnprintf(buff, MAX_LENGHT_MESSAGE, message, args);
         va_end(args);
 
-        strncpy(text->messages[text->num_messages], buff, MAX_LENGHT_MESSAGE - 1);
+        // a line cut at MAX_LENGHT_MESSAGE - 1 still ends with \0
+        snprintf(text->messages[text->num_messages], MAX_LENGHT_MESSAGE, "%s", buff);
         text->num_messages++;
     }
 }
@@ -348,26 +582,41 @@ message_t* create_message(message_type_t type)
 {
     message_t* message = (message_t *) malloc(sizeof(message_t));
 
-    if(type == PLAIN_TEXT || type == TASKS)
+    if(type == PLAIN_TEXT || type == STATS)
     {
-        ESP_LOGI(TAG, "Creating PLAIN_TEXT, TASKS");
+        ESP_LOGI(TAG, "Creating PLAIN_TEXT, STATS");
         message->m_content.text_plain.num_messages = 0;
         message->m_content.text_plain.error_message = false;
     }
+    else if(type == TASKS)
+    {
+        ESP_LOGI(TAG, "Creating TASKS");
+        memset(&message->m_content.tasks_page, 0, sizeof(tasks_page_t));
+    }
     else if(type == GET_STATUS)
     {
         ESP_LOGI(TAG, "Creating GET_STATUS");
         message->m_content.measure.value = 0;
         message->m_content.measure.addr = 0x0000;
+        message->m_content.measure.age_ms = 0;
+        message->m_content.measure.taken = 0;
     }
-    else if(type == HEX_BUFFER || type == GET_DESCRIPTOR)
+    else if(type == HEX_BUFFER || type == GET_DESCRIPTOR || type == PROFILE)
     {
-        ESP_LOGI(TAG, "Creating HEX_BUFFER, GET_DESCRIPTOR");
+        ESP_LOGI(TAG, "Creating HEX_BUFFER, GET_DESCRIPTOR, PROFILE");
         message->m_content.hex_buffer.data = NULL;
         message->m_content.hex_buffer.len = 0;
+        message->m_content.hex_buffer.addr = 0x0000;
+    }
+    else if(type == ALERT)
+    {
+        memset(&message->m_content.alert, 0, sizeof(alert_t));
     }
 
     message->type = type;
+    message->timestamp = 0;
+    message->enqueued = 0;
+    request_ids_current(message->request_id);
     return message;
 }
 
@@ -378,19 +627,28 @@ message_t* create_message(message_type_t type)
 char* message_to_json(message_t *message)
 {
     if(message->type == PLAIN_TEXT)
-        return text_plain_to_json(&message->m_content.text_plain, "messages");
+        return text_plain_to_json(&message->m_content.text_plain, "messages", message->request_id);
 
     if(message->type == TASKS)
-        return text_plain_to_json(&message->m_content.text_plain, "tasks");
+        return tasks_page_to_json(&message->m_content.tasks_page, message->request_id);
+
+    if(message->type == STATS)
+        return text_plain_to_json(&message->m_content.text_plain, "stats", message->request_id);
 
     if(message->type == GET_STATUS)
-        return get_status_to_json(&message->m_content.measure);
+        return get_status_to_json(&message->m_content.measure, message->request_id);
 
     if(message->type == GET_DESCRIPTOR)
-        return get_descriptor_to_json(&message->m_content.hex_buffer);
+        return get_descriptor_to_json(&message->m_content.hex_buffer, message->request_id);
 
     if(message->type == HEX_BUFFER)
-        return get_hex_buffer_to_json(&message->m_content.hex_buffer, "hex buffer");
+        return get_hex_buffer_to_json(&message->m_content.hex_buffer, "hex buffer", message->request_id);
+
+    if(message->type == PROFILE)
+        return profile_to_json(&message->m_content.hex_buffer, message->request_id);
+
+    if(message->type == ALERT)
+        return alert_to_json(&message->m_content.alert);
 
     return NULL;
 }
@@ -403,10 +661,16 @@ void free_message(message_t *message)
 {
     if(message != NULL)
     {
-        if(message->type == HEX_BUFFER || message->type == GET_DESCRIPTOR)
+        if(message->type == HEX_BUFFER || message->type == GET_DESCRIPTOR || message->type == PROFILE)
         {
             free(message->m_content.hex_buffer.data);
         }
+        else if(message->type == TASKS && message->m_content.tasks_page.tasks != NULL)
+        {
+            for(int i = 0; i < message->m_content.tasks_page.count; i++)
+                free(message->m_content.tasks_page.tasks[i].name);
+            free(message->m_content.tasks_page.tasks);
+        }
         free(message);
     }
 }
\ No newline at end of file
@@ -6,20 +6,27 @@
 
 #include <stdint.h>
 
+#include "source/tasks_manager.h"
+
 #define MAX_NUM_MESSAGES 20
 #define MAX_LENGHT_MESSAGE 81// +1 -> \0
+#define REQUEST_ID_LEN 32 // request_id of an action or command, see request_ids.h
+#define RULE_NAME_LEN 15  // name of a rule, see rules.h
 
 // Type of the messages, this will affect to message's parser
 typedef enum {
     PLAIN_TEXT, // simple message with info, errors
-    TASKS, // tasks list
+    TASKS, // page of the tasks list
     GET_STATUS,
     GET_DESCRIPTOR,
-    HEX_BUFFER
+    HEX_BUFFER,
+    STATS, // counters and histograms
+    PROFILE, // profile record of the gateway or a node
+    ALERT // a rule started or stopped matching
 } message_type_t;
 
 /*********** Types of messages ******************/
-// plain text: errors, info messages, tasks list
+// plain text: errors, info messages, tasks list, stats
 typedef struct text_t {
     bool error_message;
     int num_messages;
@@ -30,38 +37,59 @@ typedef struct measure_t {
     uint16_t sensor_prop_id;
     uint16_t addr;
     int value;
+    int32_t age_ms; // 0 if live, ms since it was taken if published late, -1 if unknown
+    int64_t taken;  // esp_timer time the gateway received it, 0 if unknown
 } measure_t;
 
 typedef struct hex_buffer_t {
     uint8_t* data;
     uint16_t len;
+    uint16_t addr; // node it comes from, only used by PROFILE (0 is the gateway)
 } hex_buffer_t;
 
+// change of state of a rule on a node
+typedef struct alert_t {
+    char rule[RULE_NAME_LEN + 1];
+    const char *kind; // "above", "below", "rate" or "missing"
+    bool firing;      // false when it is resolved
+    uint16_t addr;
+    uint16_t sensor_prop_id; // 0x0000 for a missing rule on any property
+    int value;        // the reading, s without readings for missing
+    int64_t taken;    // esp_timer time of the reading or the check
+} alert_t;
+
+// page of the tasks list, copies of the tasks with their runtime stats
+typedef struct tasks_page_t {
+    uint16_t page;  // from 0
+    uint16_t pages;
+    uint16_t total; // tasks matching the filter
+    uint8_t count;  // tasks in this page
+    task_t *tasks;  // names are owned by the message
+} tasks_page_t;
+
 /************************************************/
 
 /* A message will only have one of the following fields */
 typedef union message_content_t {
     text_t text_plain;
+    tasks_page_t tasks_page;
     measure_t measure;
     hex_buffer_t hex_buffer;
+    alert_t alert;
 } message_content_t;
 
 /* General structure for every message */
 typedef struct message_t {
     message_type_t type;
+    int64_t timestamp; // esp_timer time of the mesh message it comes from, 0 if none
+    int64_t enqueued;  // esp_timer time when it was queued to be published
+    char request_id[REQUEST_ID_LEN + 1]; // id of the request it answers, empty if none
     message_content_t m_content;
 } message_t;
 
 /**
- * @brief Initialize the queue. This queue is used in mqtt.c.
- * When mqtt.c receive a message_t struct, call message_parser.c
- * to obtain a json.
- * @param queue: queue used to push elements
- */
-void initialize_messages_parser_queue(QueueHandle_t queue);
-
-/**
- * @brief queue a message_t*
+ * @brief queue a message_t* to be published by mqtt.c. It is freed if
+ * the queue drops it, see message_queue.h.
  * @param m: message_t to queue
  */
 void send_message_queue(message_t *message);
@@ -104,6 +132,13 @@ message_t* create_message(message_type_t type);
  */
 char* message_to_json(message_t *message);
 
+/**
+ * @brief Return the compact json of a GET_STATUS message for its node topic,
+ * /sensors/results/<addr>/<sensor_prop_id>, without the addr and sensor_prop_id
+ * @param message: GET_STATUS message
+ */
+char* measure_to_node_json(message_t *message);
+
 /**
  * @brief Free message_t struct
  * @param message: message_t *
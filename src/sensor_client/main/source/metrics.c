@@ -0,0 +1,125 @@
+#include "sdkconfig.h"
+
+#if CONFIG_GATEWAY_METRICS
+
+#include <string.h>
+
+#include "cJSON.h"
+#include "esp_timer.h"
+
+#include "source/metrics.h"
+#include "source/histogram.h"
+#include "source/mesh_rx_ring.h"
+
+typedef struct stage_t {
+    const char *name;
+    uint32_t divisor; // from microseconds to the unit of the histogram
+    const char *unit;
+} stage_t;
+
+static const stage_t stages[METRICS_STAGES] = {
+    [STAGE_MESH_RTT]   = { "mesh_rtt",   1000, "ms" },
+    [STAGE_DECODE]     = { "decode",     1,    "us" },
+    [STAGE_QUEUE]      = { "queue",      1000, "ms" },
+    [STAGE_RENDER]     = { "render",     1,    "us" },
+    [STAGE_PUBLISH]    = { "publish",    1,    "us" },
+    [STAGE_TOTAL]      = { "total",      1000, "ms" },
+    [STAGE_HANDLER]    = { "handler",    1,    "us" },
+    [STAGE_INGRESS]    = { "ingress",    1000, "ms" },
+    [STAGE_PARSE_JSON] = { "parse_json", 1,    "us" },
+    [STAGE_PARSE_BIN]  = { "parse_bin",  1,    "us" },
+    [STAGE_RULES]      = { "rules",      1,    "us" },
+    [STAGE_ALERT]      = { "alert",      1000, "ms" },
+};
+
+static histogram_t histograms[METRICS_STAGES];
+static uint32_t queue_high_water_mark;
+static uint32_t outbox_high_water_mark;
+static int64_t window_start;
+
+/**
+ * @brief Add a sample to a stage
+ * @param stage: stage
+ * @param elapsed: microseconds spent in the stage
+ */
+void metrics_add(metrics_stage_t stage, int64_t elapsed)
+{
+    if(elapsed < 0)
+        elapsed = 0;
+    histogram_add(&histograms[stage], (uint32_t) (elapsed / stages[stage].divisor));
+}
+
+/**
+ * @brief Account the number of messages waiting in the publish queue
+ */
+void metrics_queue_level(uint32_t level)
+{
+    if(level > queue_high_water_mark)
+        queue_high_water_mark = level;
+}
+
+/**
+ * @brief Account the number of messages waiting for an ack in the MQTT outbox
+ */
+void metrics_outbox_level(uint32_t level)
+{
+    if(level > outbox_high_water_mark)
+        outbox_high_water_mark = level;
+}
+
+/**
+ * @brief Return a json with the percentiles of every stage and the queue
+ * high water marks since the last call, and start a new window.
+ */
+char* metrics_to_json()
+{
+    char* json = NULL;
+    int64_t now = esp_timer_get_time();
+    mesh_rx_stats_t ring;
+
+    mesh_rx_ring_get_stats(&ring);
+
+    cJSON *root = cJSON_CreateObject();
+    if(root == NULL)
+        return NULL;
+
+    cJSON_AddStringToObject(root, "type", "METRICS");
+    cJSON_AddNumberToObject(root, "window_ms", (double) ((now - window_start) / 1000));
+
+    cJSON *stages_json = cJSON_AddObjectToObject(root, "stages");
+    for(int i = 0; i < METRICS_STAGES && stages_json != NULL; i++)
+    {
+        histogram_t h;
+        memcpy(&h, &histograms[i], sizeof(histogram_t));
+        histogram_reset(&histograms[i]);
+
+        cJSON *stage = cJSON_AddObjectToObject(stages_json, stages[i].name);
+        if(stage == NULL)
+            break;
+
+        cJSON_AddStringToObject(stage, "unit", stages[i].unit);
+        cJSON_AddNumberToObject(stage, "n", h.count);
+        cJSON_AddNumberToObject(stage, "p50", histogram_percentile(&h, 50));
+        cJSON_AddNumberToObject(stage, "p95", histogram_percentile(&h, 95));
+        cJSON_AddNumberToObject(stage, "p99", histogram_percentile(&h, 99));
+        cJSON_AddNumberToObject(stage, "max", h.max);
+    }
+
+    cJSON *queues = cJSON_AddObjectToObject(root, "queues");
+    if(queues != NULL)
+    {
+        cJSON_AddNumberToObject(queues, "messages_hwm", queue_high_water_mark);
+        cJSON_AddNumberToObject(queues, "rx_ring_hwm", ring.high_water_mark);
+        cJSON_AddNumberToObject(queues, "outbox_hwm", outbox_high_water_mark);
+    }
+    queue_high_water_mark = 0;
+    outbox_high_water_mark = 0;
+    window_start = now;
+
+    json = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+
+    return json;
+}
+
+#endif
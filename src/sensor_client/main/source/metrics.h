@@ -0,0 +1,73 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+#include "sdkconfig.h"
+#include "esp_timer.h"
+
+/*
+ * Latency of every stage of the pipeline, from the request to the publish.
+ * Each stage is only written by one task, so there are no locks: a report
+ * taken while a sample is being added can be off by that sample.
+ * Everything is compiled out without CONFIG_GATEWAY_METRICS.
+ */
+typedef enum {
+    STAGE_MESH_RTT, // request sent -> reply callback (ms)
+    STAGE_DECODE,   // reply callback -> message enqueued (us)
+    STAGE_QUEUE,    // enqueued -> dequeued by the MQTT task (ms)
+    STAGE_RENDER,   // dequeued -> json rendered (us)
+    STAGE_PUBLISH,  // esp_mqtt_client_enqueue call (us)
+    STAGE_TOTAL,    // reply callback -> publish returned (ms)
+    STAGE_HANDLER,  // MQTT_EVENT_DATA handled in the MQTT event task (us)
+    STAGE_INGRESS,  // MQTT_EVENT_DATA -> taken by the ingress worker (ms)
+    STAGE_PARSE_JSON, // json actions -> action_t array (us)
+    STAGE_PARSE_BIN,  // binary actions -> action_t array (us)
+    STAGE_RULES,    // rules evaluated against a reading (us)
+    STAGE_ALERT,    // reply callback -> alert published (ms)
+    METRICS_STAGES
+} metrics_stage_t;
+
+#if CONFIG_GATEWAY_METRICS
+
+/**
+ * @brief Add a sample to a stage
+ * @param stage: stage
+ * @param elapsed: microseconds spent in the stage
+ */
+void metrics_add(metrics_stage_t stage, int64_t elapsed);
+
+/**
+ * @brief Account the number of messages waiting in the publish queue
+ */
+void metrics_queue_level(uint32_t level);
+
+/**
+ * @brief Account the number of messages waiting for an ack in the MQTT outbox
+ */
+void metrics_outbox_level(uint32_t level);
+
+/**
+ * @brief Return a json with the percentiles of every stage and the queue
+ * high water marks since the last call, and start a new window.
+ */
+char* metrics_to_json();
+
+#define METRICS_ADD(stage, elapsed) metrics_add((stage), (elapsed))
+
+// time since an esp_timer timestamp, skipped if the timestamp is 0
+#define METRICS_ADD_SINCE(stage, since) \
+    do { if((since) != 0) metrics_add((stage), esp_timer_get_time() - (since)); } while(0)
+#define METRICS_QUEUE_LEVEL(level) metrics_queue_level(level)
+#define METRICS_OUTBOX_LEVEL(level) metrics_outbox_level(level)
+
+#else
+
+#define METRICS_ADD(stage, elapsed)
+#define METRICS_ADD_SINCE(stage, since)
+#define METRICS_QUEUE_LEVEL(level)
+#define METRICS_OUTBOX_LEVEL(level)
+
+#endif
+
+#endif
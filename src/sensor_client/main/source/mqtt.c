@@ -1,29 +1,106 @@
 #include "esp_log.h"
 #include "mqtt_client.h"
+#include "esp_timer.h"
 #include "cJSON.h"
 
 #include "source/mqtt.h"
 #include "source/ble_cmd.h"
 #include "source/messages_parser.h"
-
-extern void init_tasks_manager();
-extern void queue_list_task();
+#include "source/data_format.h"
+#include "source/boot.h"
+#include "source/task_placement.h"
+#include "source/benchmark.h"
+#include "source/metrics.h"
+#include "source/profiler.h"
+#include "source/message_queue.h"
+#include "source/store_forward.h"
+#include "source/mqtt_outbox.h"
+#include "source/request_ids.h"
+#include "source/wall_clock.h"
 
 static const char *TAG = "MQTT";
 
 // Topics to publish
 static const char *PUB_TOPIC_DASH = "/sensors/results/dashboard";
 static const char *PUB_TOPIC_CLI  = "/sensors/results/cli";
+#if CONFIG_GATEWAY_METRICS
+static const char *PUB_TOPIC_METRICS = "/sensors/results/metrics";
+#endif
+static const char *PUB_TOPIC_PROFILE = "/sensors/results/profile"; // gateway and nodes profiles
+#if CONFIG_GATEWAY_RULES
+static const char *PUB_TOPIC_ALERTS = "/sensors/results/alerts"; // rules firing and resolved, see rules.h
+#endif
+#if !CONFIG_READINGS_TOPIC_DASHBOARD
+static const char *PUB_TOPIC_NODES = "/sensors/results"; // readings in /sensors/results/<addr>/<sensor_prop_id>
+#define NODE_TOPIC_LEN 28 // /sensors/results/XXXX/XXXX\0
+#endif
 
 // Topics to listen to
 static const char *SUB_TOPIC_BLE  = "/sensors/actions/ble";      // to execute ble actions
 static const char *SUB_TOPIC_CMD  = "/sensors/actions/commands"; // to execute commands
+#if CONFIG_INGRESS_BINARY
+static const char *SUB_TOPIC_BIN  = "/sensors/actions/ble/bin";  // ble actions in binary, see action_bin.h
+#endif
 
 // mqtt client to send messages to PUB_TOPIC
 static esp_mqtt_client_handle_t client_mqtt;
 
+// bytes published, to compare the formats and the topics on the same workload
+static uint32_t egress_published;
+static uint32_t egress_topic_bytes;
+static uint32_t egress_payload_bytes;
+
 // queue to receive json and porse it
 static QueueHandle_t queue_receive;
+static uint32_t ingress_received;
+static uint32_t ingress_dropped; // the queue was full
+
+static bool is_topic(esp_mqtt_event_handle_t event, const char *topic)
+{
+    return event->topic_len == strlen(topic) && strncmp(event->topic, topic, event->topic_len) == 0;
+}
+
+/**
+ * @brief Copy the json of an action or a command to the ingress queue.
+ * Nothing is parsed here, it runs in the MQTT event task.
+ */
+static void ingress(esp_mqtt_event_handle_t event)
+{
+    mqtt_json json;
+
+    if(is_topic(event, SUB_TOPIC_BLE))
+        json.kind = INGRESS_BLE;
+    else if(is_topic(event, SUB_TOPIC_CMD))
+        json.kind = INGRESS_CMD;
+#if CONFIG_INGRESS_BINARY
+    else if(is_topic(event, SUB_TOPIC_BIN))
+        json.kind = INGRESS_BIN;
+#endif
+    else
+    {
+        ESP_LOGW(TAG, "Data from unknown topic %.*s", event->topic_len, event->topic);
+        return;
+    }
+
+    json.json = malloc(event->data_len + 1);
+    if(json.json == NULL)
+    {
+        ingress_dropped++;
+        return;
+    }
+    memcpy(json.json, event->data, event->data_len);
+    json.json[event->data_len] = '\0';
+    json.size = event->data_len;
+    json.received = esp_timer_get_time();
+
+    ingress_received++;
+    if(xQueueSendToBack(queue_receive, &json, 0) != pdTRUE)
+    {
+        ESP_LOGW(TAG, "Ingress queue full, %.*s dropped", event->topic_len, event->topic);
+        free(json.json);
+        ingress_dropped++;
+    }
+}
 
 static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
 {
@@ -32,16 +109,29 @@ static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
     switch (event->event_id) {
         case MQTT_EVENT_CONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+            boot_phase_end(BOOT_MQTT);
+
+            // a persistent session keeps the subscriptions in the broker
+            if(event->session_present)
+            {
+                ESP_LOGI(TAG, "Session present, subscriptions kept");
+                break;
+            }
 
             ESP_LOGW(TAG, "Suscribing to %s", SUB_TOPIC_BLE);
             esp_mqtt_client_subscribe(client, SUB_TOPIC_BLE, 0);
 
             ESP_LOGW(TAG, "Suscribing to %s", SUB_TOPIC_CMD);
             esp_mqtt_client_subscribe(client, SUB_TOPIC_CMD, 0);
+#if CONFIG_INGRESS_BINARY
+            ESP_LOGW(TAG, "Suscribing to %s", SUB_TOPIC_BIN);
+            esp_mqtt_client_subscribe(client, SUB_TOPIC_BIN, 0);
+#endif
 
             break;
         case MQTT_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+            boot_phase_reset(BOOT_MQTT);
             break;
         case MQTT_EVENT_SUBSCRIBED:
             ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
@@ -51,49 +141,18 @@ static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
             break;
         case MQTT_EVENT_PUBLISHED:
             ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+            mqtt_outbox_acked(event->msg_id);
             break;
         case MQTT_EVENT_DATA:
-            ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-
-            // Get topic
-            char *topic = malloc(event->topic_len * sizeof(char) + 1);
-            memset(topic, '\0', event->topic_len * sizeof(char) + 1);
-            strncpy(topic, event->topic, event->topic_len);
-
-            // Get data
-            char *data = malloc(event->data_len * sizeof(char) + 1);
-            memset(data, '\0', event->data_len * sizeof(char) + 1);
-            strncpy(data, event->data, event->data_len);
-
-            ESP_LOGI(TAG, "Topic: %s, data: %s", topic, data);
-
-            // Receive a request to create a task
-            if(strcmp(topic, SUB_TOPIC_BLE) == 0)
-            {
-                mqtt_json json = {
-                    .json = event->data,
-                    .size = event->data_len,
-                };
-                xQueueSendToBack(queue_receive, &json, 0);
-            }
-            else if(strcmp(topic, SUB_TOPIC_CMD) == 0)
-            {
-                cJSON *root = cJSON_Parse(data);
-                const cJSON *cmd = cJSON_GetObjectItem(root, "cmd");
-
-                if(cmd != NULL)
-                {
-                    if(strcmp(cmd->valuestring, "tasks") == 0)
-                    {
-                        queue_list_task();
-                    }
-                }
-            }
-
-            free(topic);
-            free(data);
-
+        {
+#if CONFIG_GATEWAY_METRICS
+            int64_t start = esp_timer_get_time();
+#endif
+            ESP_LOGI(TAG, "MQTT_EVENT_DATA, topic: %.*s", event->topic_len, event->topic);
+            ingress(event);
+            METRICS_ADD_SINCE(STAGE_HANDLER, start);
             break;
+        }
         case MQTT_EVENT_ERROR:
             ESP_LOGE(TAG, "MQTT_EVENT_ERROR");
             break;
@@ -105,41 +164,319 @@ static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
     return ESP_OK;
 }
 
-static void task_send_response_mqtt(void* params)
+/**
+ * @brief Enqueue a json in the esp-mqtt outbox, the MQTT task sends it.
+ * QoS 1/2 messages are not enqueued if the outbox is full.
+ * @param retain: the broker keeps it as the last message of the topic
+ * @retval msg_id, -1 if it could not be enqueued
+ */
+static int enqueue(const char *topic, const char *json, int qos, bool retain)
+{
+    if(qos > 0 && !mqtt_outbox_has_space())
+        return -1;
+
+    // QoS 0 messages are only enqueued when stored
+    int msg_id = esp_mqtt_client_enqueue(client_mqtt, topic, json, 0, qos, retain, true);
+    if(msg_id >= 0)
+    {
+        egress_published++;
+        egress_topic_bytes += strlen(topic);
+        egress_payload_bytes += strlen(json);
+    }
+    if(msg_id >= 0 && qos > 0)
+        mqtt_outbox_enqueued(msg_id);
+    METRICS_OUTBOX_LEVEL(mqtt_outbox_level());
+
+    return msg_id;
+}
+
+#if CONFIG_GATEWAY_METRICS
+/**
+ * @brief Publish the stage latencies of the last window if it is over
+ * @param last: esp_timer time of the last publication, updated when published
+ */
+static void publish_metrics(int64_t *last)
+{
+    int64_t now = esp_timer_get_time();
+    if(now - *last < (int64_t) CONFIG_METRICS_PERIOD_S * 1000000)
+        return;
+    // keep the window open until it can be enqueued
+    if(CONFIG_MQTT_QOS_METRICS > 0 && !mqtt_outbox_has_space())
+        return;
+    *last = now;
+
+    char *json = metrics_to_json();
+    if(json != NULL)
+    {
+        enqueue(PUB_TOPIC_METRICS, json, CONFIG_MQTT_QOS_METRICS, false);
+        free(json);
+    }
+}
+#endif
+
+#if CONFIG_GATEWAY_PROFILER
+/**
+ * @brief Queue a profile of the gateway if its period is over
+ * @param last: esp_timer time of the last profile, updated when queued
+ */
+static void queue_profile(int64_t *last)
+{
+    int64_t now = esp_timer_get_time();
+    if(now - *last < (int64_t) CONFIG_PROFILER_PERIOD_S * 1000000)
+        return;
+    *last = now;
+
+    queue_gateway_profile();
+}
+#endif
+
+static void reading_published(message_t *message)
+{
+    boot_phase_end(BOOT_FIRST_READING);
+#if CONFIG_GATEWAY_BENCHMARK
+    benchmark_reading_published(message->m_content.measure.addr, message->timestamp);
+#endif
+}
+
+#if !CONFIG_READINGS_TOPIC_DASHBOARD
+/**
+ * @brief Enqueue a reading to /sensors/results/<addr>/<sensor_prop_id>.
+ * Live readings are retained, so a new subscriber gets the last value at
+ * once. Readings forwarded late by store and forward are not, the broker
+ * may already keep a newer one.
+ * @retval msg_id, -1 if it could not be enqueued
+ */
+static int enqueue_node(message_t *message)
+{
+    measure_t *m = &message->m_content.measure;
+    char topic[NODE_TOPIC_LEN];
+#if CONFIG_READINGS_RETAIN
+    bool retain = m->age_ms == 0;
+#else
+    bool retain = false;
+#endif
+
+    char *json = measure_to_node_json(message);
+    if(json == NULL)
+    {
+        ESP_LOGE(TAG, "Json is null!");
+        return 0; // nothing to retry
+    }
+
+    snprintf(topic, sizeof(topic), "%s/%04X/%04X", PUB_TOPIC_NODES, m->addr, m->sensor_prop_id);
+    int msg_id = enqueue(topic, json, CONFIG_MQTT_QOS_DASHBOARD, retain);
+    free(json);
+
+    return msg_id;
+}
+#endif
+
+/**
+ * @brief Return the QoS a control message is published with
+ */
+static int control_qos(const message_t *message)
+{
+#if CONFIG_GATEWAY_RULES
+    if(message->type == ALERT)
+        return CONFIG_MQTT_QOS_ALERTS;
+#endif
+    return CONFIG_MQTT_QOS_CLI;
+}
+
+/**
+ * @brief Render a message and enqueue it to its topic
+ * @retval false if it could not be enqueued
+ */
+static bool publish_message(message_t *message)
 {
-    QueueHandle_t queue = (*(QueueHandle_t *) params);
-    BaseType_t xStatus;
-    message_t *message = NULL; // all data is copied to queue area
     char* json = NULL;
+    int msg_id = -1;
+#if CONFIG_GATEWAY_METRICS
+    int64_t start = esp_timer_get_time();
+#endif
+
+#if CONFIG_READINGS_TOPIC_NODES
+    // readings only go to their node topic
+    if(message->type == GET_STATUS)
+    {
+        msg_id = enqueue_node(message);
+        METRICS_ADD_SINCE(STAGE_PUBLISH, start);
+        METRICS_ADD_SINCE(STAGE_TOTAL, message->timestamp);
+        if(msg_id >= 0)
+            reading_published(message);
+        return msg_id >= 0;
+    }
+#endif
+
+    ESP_LOGI(TAG, "Message to mqtt of type %d", message->type);
+    json = message_to_json(message);
+    METRICS_ADD_SINCE(STAGE_RENDER, start);
+    if(json == NULL)
+    {
+        ESP_LOGE(TAG, "Json is null!");
+        return true; // nothing to retry
+    }
+
+#if CONFIG_GATEWAY_METRICS
+    start = esp_timer_get_time();
+#endif
+    if(message->type == GET_STATUS)
+    {
+        msg_id = enqueue(PUB_TOPIC_DASH, json, CONFIG_MQTT_QOS_DASHBOARD, false); // send to dashboard
+        if(msg_id >= 0)
+        {
+            reading_published(message);
+#if CONFIG_READINGS_TOPIC_BOTH
+            // best effort, retrying it would publish the dashboard reading twice
+            if(enqueue_node(message) < 0)
+                ESP_LOGW(TAG, "Reading of 0x%04x not published to its node topic", message->m_content.measure.addr);
+#endif
+        }
+    }
+    else if(message->type == PROFILE)
+    {
+        msg_id = enqueue(PUB_TOPIC_PROFILE, json, CONFIG_MQTT_QOS_PROFILE, false);
+    }
+#if CONFIG_GATEWAY_RULES
+    else if(message->type == ALERT)
+    {
+        msg_id = enqueue(PUB_TOPIC_ALERTS, json, CONFIG_MQTT_QOS_ALERTS, false);
+        METRICS_ADD_SINCE(STAGE_ALERT, message->timestamp);
+    }
+#endif
+    else{
+        msg_id = enqueue(PUB_TOPIC_CLI, json, CONFIG_MQTT_QOS_CLI, false); // send to cli
+    }
+    METRICS_ADD_SINCE(STAGE_PUBLISH, start);
+    METRICS_ADD_SINCE(STAGE_TOTAL, message->timestamp);
+    free(json);
+
+    return msg_id >= 0;
+}
+
+#if CONFIG_STORE_FORWARD
+/**
+ * @brief Publish a batch of the readings stored while offline, at most
+ * one batch per period so the broker and the live readings are not flooded
+ * @param last: esp_timer time of the last batch, updated when published
+ */
+static void forward_stored(int64_t *last)
+{
+    message_t *messages[CONFIG_SF_DRAIN_BATCH];
+
+    int64_t now = esp_timer_get_time();
+    if(now - *last < (int64_t) CONFIG_SF_DRAIN_PERIOD_MS * 1000 || !store_forward_pending())
+        return;
+    *last = now;
+
+    int n = store_forward_peek(messages, CONFIG_SF_DRAIN_BATCH);
+    int published = 0;
+    for(int i = 0; i < n; i++)
+    {
+        // connection lost again or outbox full, the rest stay stored in order
+        if(published == i && publish_message(messages[i]))
+            published++;
+        free_message(messages[i]);
+    }
+    store_forward_commit(published);
+    ESP_LOGI(TAG, "Forwarded %d of %d stored readings", published, n);
+}
+#endif
+
+static void task_send_response_mqtt(void* params)
+{
+    message_t *message = NULL;
+#if CONFIG_GATEWAY_METRICS
+    int64_t last_metrics = esp_timer_get_time();
+#endif
+#if CONFIG_GATEWAY_PROFILER
+    int64_t last_profile = esp_timer_get_time();
+#endif
+#if CONFIG_STORE_FORWARD
+    int64_t last_forward = 0;
+#endif
+#if CONFIG_GATEWAY_METRICS || CONFIG_GATEWAY_PROFILER || CONFIG_STORE_FORWARD
+    // wake up every second to check the periodic reports and the stored readings
+    TickType_t wait = pdMS_TO_TICKS(1000);
+#else
+    TickType_t wait = portMAX_DELAY;
+#endif
 
     for(;;)
     {
-        xStatus = xQueueReceive(queue, &(message), portMAX_DELAY);
-        if(xStatus == pdTRUE)
+        // while the broker does not keep up, telemetry waits in the queue
+        // and its policies decide which readings are kept. Control messages
+        // go on, they only wait for an ack when they need a place in the outbox
+        bool room = !boot_wait(BOOT_MQTT, 0) || mqtt_outbox_wait(0);
+        message = message_queue_receive(room ? wait : pdMS_TO_TICKS(100), room);
+        if(message != NULL && !room && control_qos(message) > 0)
+            mqtt_outbox_wait(pdMS_TO_TICKS(1000));
+        if(message != NULL)
         {
-            ESP_LOGI(TAG, "Message to mqtt of type %d", message->type);
-            json = message_to_json(message);
-            if(json != NULL)
+            METRICS_ADD_SINCE(STAGE_QUEUE, message->enqueued);
+
+#if CONFIG_STORE_FORWARD
+            // readings are kept while offline, cli answers are useless by then.
+            // Readings also wait for the clock, to be published with their time
+            if(boot_wait(BOOT_MQTT, 0) && (message->type != GET_STATUS || wall_clock_ready())
+                && publish_message(message))
             {
-                if(message->type == GET_STATUS)
-                {
-                    esp_mqtt_client_publish(client_mqtt, PUB_TOPIC_DASH, json, 0, 0, 0); // send to dashboard
-                }
-                else{
-                    esp_mqtt_client_publish(client_mqtt, PUB_TOPIC_CLI, json, 0, 0, 0); // send to cli
-                }
-                free(json);
+                free_message(message);
             }
             else
             {
-                ESP_LOGE(TAG, "Json is null!");
+                if(message->type == GET_STATUS)
+                    store_forward_put(message);
+                else
+                    ESP_LOGW(TAG, "Offline, message of type %d dropped", message->type);
+                free_message(message);
             }
+#else
+            // messages wait in the queue while there is no connection
+            boot_wait(BOOT_MQTT, portMAX_DELAY);
+            if(!publish_message(message))
+                ESP_LOGW(TAG, "Message of type %d could not be enqueued", message->type);
             free_message(message);
+#endif
         }
-        vTaskDelay(2000 / portTICK_PERIOD_MS);
+#if CONFIG_STORE_FORWARD
+        if(boot_wait(BOOT_MQTT, 0) && wall_clock_ready())
+            forward_stored(&last_forward);
+#endif
+#if CONFIG_GATEWAY_METRICS
+        if(boot_wait(BOOT_MQTT, 0))
+            publish_metrics(&last_metrics);
+#endif
+#if CONFIG_GATEWAY_PROFILER
+        queue_profile(&last_profile);
+#endif
     }
 }
 
+/**
+ * @brief Queue a message with the ingress counters
+ */
+void queue_mqtt_ingress_stats()
+{
+    message_t* message = create_message(STATS);
+    add_message_text_plain(message, false, "MQTT ingress: received %u, dropped %u, waiting %u/%d",
+        ingress_received, ingress_dropped, uxQueueMessagesWaiting(queue_receive), CONFIG_INGRESS_QUEUE_SIZE);
+    send_message_queue(message);
+}
+
+/**
+ * @brief Queue a message with the bytes published, to compare the formats
+ * and the topics on the same workload
+ */
+void queue_mqtt_egress_stats()
+{
+    message_t* message = create_message(STATS);
+    add_message_text_plain(message, false, "MQTT egress: published %u, topic %u B, payload %u B, %u B per message",
+        egress_published, egress_topic_bytes, egress_payload_bytes,
+        egress_published > 0 ? (egress_topic_bytes + egress_payload_bytes) / egress_published : 0);
+    send_message_queue(message);
+}
+
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 {
     ESP_LOGD(TAG, "Event dispatched from event loop base=%s, event_id=%d", base, event_id);
@@ -157,26 +494,34 @@ esp_err_t init_mqtt()
 
     esp_mqtt_client_config_t mqtt_cfg = {
         .uri = CONFIG_BROKER_URL,
+#if CONFIG_MQTT_PERSISTENT_SESSION
+        .disable_clean_session = true,
+#endif
     };
 
-    queue_receive  = xQueueCreate(4, sizeof(mqtt_json));
-    QueueHandle_t queue_messages = xQueueCreate(25, sizeof(message_t *));
+    queue_receive  = xQueueCreate(CONFIG_INGRESS_QUEUE_SIZE, sizeof(mqtt_json));
 
-    // Initialize queue message parser
-    initialize_messages_parser_queue(queue_messages);
+    // messages to publish
+    init_message_queue();
+    init_mqtt_outbox();
+#if CONFIG_STORE_FORWARD
+    init_store_forward();
+#endif
 
-    // ble cmd task
-    xTaskCreate(&task_parse_json, "task_parse_json", 4098, (void *) &queue_receive, 4, NULL);
-    //xTaskCreatePinnedToCore(&task_parse_json, "task_parse_json", 4098, (void *) &queue_receive, 4, NULL, 0);
+    // ble actions and commands
+    init_request_ids();
+    create_gateway_task(TASK_PARSE_JSON, &task_parse_json, (void *) &queue_receive, NULL);
 
     // Task to send responses to dashboard or cli
-    xTaskCreate(&task_send_response_mqtt, "task_send_response_mqtt", 4098, (void *) &queue_messages, 4, NULL);
-    //xTaskCreatePinnedToCore(&task_send_response_mqtt, "task_send_response_mqtt", 4098, (void *) &queue_messages, 4, NULL, 0);
-
-    // Initialize task manager
-    init_tasks_manager();
+    create_gateway_task(TASK_SEND_MQTT, &task_send_response_mqtt, NULL, NULL);
 
     client_mqtt = esp_mqtt_client_init(&mqtt_cfg);
+
+    return ESP_OK;
+}
+
+esp_err_t start_mqtt()
+{
     mqtt_app_start(client_mqtt);
 
     return ESP_OK;
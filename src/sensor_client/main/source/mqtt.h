@@ -7,4 +7,19 @@
 
 esp_err_t init_mqtt();
 
+/**
+ * @brief Connect to the broker. It needs an IP.
+*/
+esp_err_t start_mqtt();
+
+/**
+ * @brief Queue a message with the ingress counters
+*/
+void queue_mqtt_ingress_stats();
+
+/**
+ * @brief Queue a message with the bytes published
+*/
+void queue_mqtt_egress_stats();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,174 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "source/mqtt_outbox.h"
+#include "source/messages_parser.h"
+
+static const char* TAG = "MqttOutbox";
+
+#define OUTBOX_LIMIT CONFIG_MQTT_OUTBOX_LIMIT
+#define NO_MSG_ID    -1
+
+typedef struct outbox_entry_t {
+    int msg_id;
+    int64_t enqueued; // esp_timer time
+} outbox_entry_t;
+
+static outbox_entry_t entries[OUTBOX_LIMIT];
+static uint32_t level;
+static mqtt_outbox_stats_t stats;
+
+static SemaphoreHandle_t xSem_outbox = NULL;
+static SemaphoreHandle_t acks = NULL; // given on every ack, wakes up the sender
+
+/**
+ * @brief Create the outbox accounting
+ */
+void init_mqtt_outbox()
+{
+    xSem_outbox = xSemaphoreCreateMutex();
+    acks = xSemaphoreCreateBinary();
+
+    for(int i = 0; i < OUTBOX_LIMIT; i++)
+        entries[i].msg_id = NO_MSG_ID;
+    level = 0;
+    memset(&stats, 0, sizeof(stats));
+}
+
+// the outbox has to be locked
+static void expire()
+{
+    int64_t now = esp_timer_get_time();
+
+    for(int i = 0; i < OUTBOX_LIMIT; i++)
+    {
+        if(entries[i].msg_id != NO_MSG_ID &&
+           now - entries[i].enqueued > (int64_t) CONFIG_MQTT_OUTBOX_EXPIRY_MS * 1000)
+        {
+            ESP_LOGW(TAG, "No ack for msg_id %d, given up", entries[i].msg_id);
+            entries[i].msg_id = NO_MSG_ID;
+            level--;
+            stats.expired++;
+        }
+    }
+}
+
+/**
+ * @brief Return if one more QoS 1/2 message fits in the outbox
+ */
+bool mqtt_outbox_has_space()
+{
+    while(xSemaphoreTake(xSem_outbox, (TickType_t) 10) != pdTRUE);
+    if(level == OUTBOX_LIMIT)
+        expire();
+    bool space = level < OUTBOX_LIMIT;
+    xSemaphoreGive(xSem_outbox);
+
+    return space;
+}
+
+/**
+ * @brief Wait until one more message fits in the outbox
+ * @param wait: ticks to wait for an ack
+ * @retval true if there is space
+ */
+bool mqtt_outbox_wait(TickType_t wait)
+{
+    if(mqtt_outbox_has_space())
+        return true;
+
+    while(xSemaphoreTake(xSem_outbox, (TickType_t) 10) != pdTRUE);
+    stats.full++;
+    xSemaphoreGive(xSem_outbox);
+
+    xSemaphoreTake(acks, wait);
+    return mqtt_outbox_has_space();
+}
+
+/**
+ * @brief Account a QoS 1/2 message just enqueued
+ * @param msg_id: id returned by esp_mqtt_client_enqueue
+ */
+void mqtt_outbox_enqueued(int msg_id)
+{
+    while(xSemaphoreTake(xSem_outbox, (TickType_t) 10) != pdTRUE);
+    for(int i = 0; i < OUTBOX_LIMIT; i++)
+    {
+        if(entries[i].msg_id == NO_MSG_ID)
+        {
+            entries[i].msg_id = msg_id;
+            entries[i].enqueued = esp_timer_get_time();
+            level++;
+            stats.enqueued++;
+            if(level > stats.high_water_mark)
+                stats.high_water_mark = level;
+            break;
+        }
+    }
+    xSemaphoreGive(xSem_outbox);
+}
+
+/**
+ * @brief Account the ack of a message. Called from the MQTT event handler.
+ * @param msg_id: id of the MQTT_EVENT_PUBLISHED event
+ */
+void mqtt_outbox_acked(int msg_id)
+{
+    bool found = false;
+
+    while(xSemaphoreTake(xSem_outbox, (TickType_t) 10) != pdTRUE);
+    for(int i = 0; i < OUTBOX_LIMIT; i++)
+    {
+        if(entries[i].msg_id == msg_id)
+        {
+            entries[i].msg_id = NO_MSG_ID;
+            level--;
+            stats.acked++;
+            found = true;
+            break;
+        }
+    }
+    xSemaphoreGive(xSem_outbox);
+
+    if(found)
+        xSemaphoreGive(acks);
+}
+
+/**
+ * @brief Return the number of messages waiting for an ack
+ */
+uint32_t mqtt_outbox_level()
+{
+    return level;
+}
+
+/**
+ * @brief Copy the counters
+ */
+void mqtt_outbox_get_stats(mqtt_outbox_stats_t *copy)
+{
+    while(xSemaphoreTake(xSem_outbox, (TickType_t) 10) != pdTRUE);
+    memcpy(copy, &stats, sizeof(mqtt_outbox_stats_t));
+    xSemaphoreGive(xSem_outbox);
+}
+
+/**
+ * @brief Queue a message with the counters
+ */
+void queue_mqtt_outbox_stats()
+{
+    mqtt_outbox_stats_t copy;
+    mqtt_outbox_get_stats(&copy);
+    uint32_t current = mqtt_outbox_level();
+
+    message_t* message = create_message(STATS);
+    add_message_text_plain(message, false, "MQTT outbox: %u/%d waiting for ack, hwm %u",
+        current, OUTBOX_LIMIT, copy.high_water_mark);
+    add_message_text_plain(message, false, "MQTT outbox: enqueued %u, acked %u, expired %u, full %u",
+        copy.enqueued, copy.acked, copy.expired, copy.full);
+    send_message_queue(message);
+}
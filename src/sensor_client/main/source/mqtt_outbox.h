@@ -0,0 +1,70 @@
+#ifndef _MQTT_OUTBOX_H_
+#define _MQTT_OUTBOX_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+
+/*
+ * Messages enqueued in the esp-mqtt outbox and not acknowledged by the broker
+ * yet. Publishing only enqueues, the MQTT task writes to the socket, so this
+ * is what tells the sender that the broker is slow: while the outbox is full
+ * no more telemetry is taken from the message queue and its policies apply.
+ * Only QoS 1 and 2 messages are acknowledged, QoS 0 ones are not counted.
+ * esp-mqtt forgets messages after its own expiry without any event, so
+ * entries older than MQTT_OUTBOX_EXPIRY_MS are given up too.
+ */
+typedef struct mqtt_outbox_stats_t {
+    uint32_t enqueued;  // QoS 1/2 messages enqueued
+    uint32_t acked;
+    uint32_t expired;   // given up without an ack
+    uint32_t full;      // times the sender had to wait for space
+    uint32_t high_water_mark;
+} mqtt_outbox_stats_t;
+
+/**
+ * @brief Create the outbox accounting
+ */
+void init_mqtt_outbox();
+
+/**
+ * @brief Return if one more QoS 1/2 message fits in the outbox
+ */
+bool mqtt_outbox_has_space();
+
+/**
+ * @brief Wait until one more message fits in the outbox
+ * @param wait: ticks to wait for an ack
+ * @retval true if there is space
+ */
+bool mqtt_outbox_wait(TickType_t wait);
+
+/**
+ * @brief Account a QoS 1/2 message just enqueued
+ * @param msg_id: id returned by esp_mqtt_client_enqueue
+ */
+void mqtt_outbox_enqueued(int msg_id);
+
+/**
+ * @brief Account the ack of a message. Called from the MQTT event handler.
+ * @param msg_id: id of the MQTT_EVENT_PUBLISHED event
+ */
+void mqtt_outbox_acked(int msg_id);
+
+/**
+ * @brief Return the number of messages waiting for an ack
+ */
+uint32_t mqtt_outbox_level();
+
+/**
+ * @brief Copy the counters
+ */
+void mqtt_outbox_get_stats(mqtt_outbox_stats_t *stats);
+
+/**
+ * @brief Queue a message with the counters
+ */
+void queue_mqtt_outbox_stats();
+
+#endif
@@ -0,0 +1,336 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "source/node_registry.h"
+#include "source/messages_parser.h"
+
+static const char* TAG = "NodeRegistry";
+
+#define RTO_INITIAL  CONFIG_RTO_INITIAL_MS
+#define RTO_MIN      CONFIG_RTO_MIN_MS
+#define RTO_MAX      CONFIG_RTO_MAX_MS
+
+#define TTL_DEFAULT  CONFIG_MSG_SEND_TTL     // ttl while the distance is unknown
+#define TTL_NODES    CONFIG_NODE_DEFAULT_TTL // ttl the nodes send their messages with
+#define TTL_MARGIN   CONFIG_TTL_MARGIN
+#define TTL_MAX      127
+
+typedef struct page_t {
+    mesh_node_t nodes[NODE_REGISTRY_PAGE_SIZE];
+} page_t;
+
+static page_t *pages[NODE_REGISTRY_PAGES];
+static SemaphoreHandle_t xSem_registry = NULL;
+
+/**
+ * @brief Initialize the registry. No page is allocated.
+ */
+void init_node_registry()
+{
+    memset(pages, 0, sizeof(pages));
+    xSem_registry = xSemaphoreCreateMutex();
+}
+
+/**
+ * @brief Lock the registry. Entries can only be used while it is locked.
+ */
+void node_registry_lock()
+{
+    while(xSemaphoreTake(xSem_registry, ( TickType_t ) 10 ) != pdTRUE);
+}
+
+void node_registry_unlock()
+{
+    xSemaphoreGive(xSem_registry);
+}
+
+/**
+ * @brief check if an address is a unicast one
+ */
+static bool is_unicast(uint16_t addr)
+{
+    return addr != 0x0000 && addr < 0x8000;
+}
+
+/**
+ * @brief Return the entry of a unicast address, NULL if there is none.
+ */
+mesh_node_t* node_registry_find(uint16_t addr)
+{
+    if(!is_unicast(addr))
+        return NULL;
+
+    page_t *page = pages[addr >> NODE_REGISTRY_PAGE_BITS];
+    if(page == NULL)
+        return NULL;
+
+    mesh_node_t *node = &page->nodes[addr & (NODE_REGISTRY_PAGE_SIZE - 1)];
+    return node->addr == addr ? node : NULL;
+}
+
+/**
+ * @brief Return the entry of a unicast address and create it if needed.
+ * NULL if addr is not unicast or there is no memory.
+ */
+mesh_node_t* node_registry_get(uint16_t addr)
+{
+    if(!is_unicast(addr))
+        return NULL;
+
+    page_t **page = &pages[addr >> NODE_REGISTRY_PAGE_BITS];
+    if(*page == NULL)
+    {
+        *page = (page_t *) calloc(1, sizeof(page_t));
+        if(*page == NULL)
+        {
+            ESP_LOGE(TAG, "No memory for node 0x%04x", addr);
+            return NULL;
+        }
+    }
+
+    mesh_node_t *node = &(*page)->nodes[addr & (NODE_REGISTRY_PAGE_SIZE - 1)];
+    if(node->addr != addr)
+    {
+        memset(node, 0, sizeof(mesh_node_t));
+        node->addr = addr;
+        node->rto = RTO_INITIAL;
+        node->ttl = TTL_DEFAULT;
+    }
+    return node;
+}
+
+/**
+ * @brief Call fn for every known node in address order.
+ */
+void node_registry_foreach(void (*fn)(mesh_node_t *node, void *arg), void *arg)
+{
+    for(int p = 0; p < NODE_REGISTRY_PAGES; p++)
+    {
+        if(pages[p] == NULL)
+            continue;
+
+        for(int i = 0; i < NODE_REGISTRY_PAGE_SIZE; i++)
+        {
+            if(pages[p]->nodes[i].addr != 0x0000)
+                fn(&pages[p]->nodes[i], arg);
+        }
+    }
+}
+
+/**
+ * @brief Update the status of a node after receiving a message from it.
+ */
+void node_registry_seen(mesh_node_t *node, int64_t timestamp, int8_t rssi)
+{
+    node->last_seen = timestamp;
+    node->rssi = rssi;
+}
+
+/**
+ * @brief Return the last value of a sensor property, NULL if there is none.
+ */
+node_property_t* node_registry_get_value(mesh_node_t *node, uint16_t sensor_prop_id)
+{
+    for(int i = 0; i < NODE_REGISTRY_PROPERTIES; i++)
+    {
+        if(node->properties[i].sensor_prop_id == sensor_prop_id)
+            return &node->properties[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Store the last value of a sensor property. If the node has no
+ * room for a new property, the oldest one is replaced.
+ */
+void node_registry_set_value(mesh_node_t *node, uint16_t sensor_prop_id, int value, int64_t timestamp)
+{
+    node_property_t *property = node_registry_get_value(node, sensor_prop_id);
+
+    if(property == NULL)
+    {
+        property = &node->properties[0];
+        for(int i = 0; i < NODE_REGISTRY_PROPERTIES && property->sensor_prop_id != 0x0000; i++)
+        {
+            if(node->properties[i].sensor_prop_id == 0x0000
+               || node->properties[i].timestamp < property->timestamp)
+                property = &node->properties[i];
+        }
+        property->sensor_prop_id = sensor_prop_id;
+    }
+
+    property->value = value;
+    property->timestamp = timestamp;
+}
+
+/**
+ * @brief clamp the timeout between RTO_MIN and RTO_MAX
+ */
+static uint32_t clamp_rto(int64_t rto)
+{
+    if(rto < RTO_MIN)
+        return RTO_MIN;
+    if(rto > RTO_MAX)
+        return RTO_MAX;
+    return (uint32_t) rto;
+}
+
+/**
+ * @brief Add a round trip time sample and update the timeout.
+ * Same estimator as TCP (RFC 6298) in fixed point:
+ * srtt is stored * 8 and rttvar * 4.
+ */
+void node_link_rtt_sample(mesh_node_t *node, uint32_t rtt)
+{
+    int32_t sample = (int32_t) rtt;
+
+    if(node->srtt == 0)
+    {
+        node->srtt = sample << 3;
+        node->rttvar = sample << 1; // rtt / 2
+    }
+    else
+    {
+        int32_t error = sample - (node->srtt >> 3);
+        node->srtt += error;        // srtt = 7/8 srtt + 1/8 sample
+        if(error < 0)
+            error = -error;
+        node->rttvar += error - (node->rttvar >> 2); // rttvar = 3/4 rttvar + 1/4 |error|
+    }
+
+    node->rto = clamp_rto((node->srtt >> 3) + node->rttvar);
+    histogram_add(&node->rtt, rtt);
+}
+
+/**
+ * @brief Back off the timeout after a request timed out.
+ * The ttl is raised too in case the node moved further away.
+ */
+void node_link_timeout(mesh_node_t *node)
+{
+    node->rto = clamp_rto((int64_t) node->rto * 2);
+
+    uint8_t ttl = node->ttl + 2 > TTL_DEFAULT ? node->ttl + 2 : TTL_DEFAULT;
+    node->ttl = ttl > TTL_MAX ? TTL_MAX : ttl;
+}
+
+/**
+ * @brief Learn the distance of a node from the ttl of a message it sent.
+ * Nodes send with TTL_NODES and every relay decrements it, so the hops
+ * are TTL_NODES - recv_ttl. A message with ttl n can be relayed n - 1
+ * times, so the minimal ttl to reach the node is hops + 1, or 0 (not
+ * relayed at all) for a neighbour.
+ * @param recv_ttl: ttl of the received message
+ */
+void node_link_ttl_sample(mesh_node_t *node, uint8_t recv_ttl)
+{
+    // Replies to requests sent with ttl 0 come with ttl 0: nothing to learn
+    if(recv_ttl == 0 || recv_ttl > TTL_NODES)
+        return;
+
+    node->hops = TTL_NODES - recv_ttl;
+    node->hops_known = true;
+
+    int hops = node->hops + TTL_MARGIN;
+    node->ttl = hops == 0 ? 0 : (hops + 1 > TTL_MAX ? TTL_MAX : hops + 1);
+}
+
+/* A STATS message being filled while the registry is locked */
+typedef struct stats_page_t {
+    message_t *message;
+    uint16_t after; // nodes up to this addr went in the previous pages
+    uint16_t last;  // last node of this page, 0x0000 if none
+} stats_page_t;
+
+#define VALUES_PER_LINE 4 // " XXXX=-2147483648" each, within MAX_LENGHT_MESSAGE
+
+/**
+ * @brief add the lines with the link counters and the values of a node,
+ * if they go in the page
+ */
+static void add_node_stats(mesh_node_t *node, void *arg)
+{
+    stats_page_t *page = (stats_page_t *) arg;
+    message_t *message = page->message;
+    int num_values = 0;
+
+    for(int i = 0; i < NODE_REGISTRY_PROPERTIES; i++)
+    {
+        if(node->properties[i].sensor_prop_id != 0x0000)
+            num_values++;
+    }
+
+    // three lines and the values per node, the next ones go in the next page
+    int lines = 3 + (num_values + VALUES_PER_LINE - 1) / VALUES_PER_LINE;
+    if(node->addr <= page->after || message->m_content.text_plain.num_messages > MAX_NUM_MESSAGES - lines)
+        return;
+    page->last = node->addr;
+
+    int seen = node->last_seen == 0 ? -1 : (int) ((esp_timer_get_time() - node->last_seen) / 1000000);
+    add_message_text_plain(message, false, "%04X seen %ds ago rssi %d err %u",
+        node->addr, seen, node->rssi, node->errors);
+
+    add_message_text_plain(message, false, "%04X hops %d ttl %d rto %u p50 %u p95 %u p99 %u",
+        node->addr, node->hops_known ? node->hops : -1, node->ttl, node->rto,
+        histogram_percentile(&node->rtt, 50), histogram_percentile(&node->rtt, 95), histogram_percentile(&node->rtt, 99));
+
+    add_message_text_plain(message, false, "%04X ok %u to %u re %u gu %u",
+        node->addr, node->replies, node->timeouts, node->retries, node->giveups);
+
+    char values[MAX_LENGHT_MESSAGE];
+    int length = 0;
+    int in_line = 0;
+    for(int i = 0; i < NODE_REGISTRY_PROPERTIES; i++)
+    {
+        if(node->properties[i].sensor_prop_id == 0x0000)
+            continue;
+
+        if(in_line == 0)
+            length = snprintf(values, sizeof(values), "%04X values", node->addr);
+        length += snprintf(values + length, sizeof(values) - length, " %04X=%d",
+            node->properties[i].sensor_prop_id, node->properties[i].value);
+
+        if(++in_line == VALUES_PER_LINE)
+        {
+            add_message_text_plain(message, false, "%s", values);
+            in_line = 0;
+        }
+    }
+    if(in_line > 0)
+        add_message_text_plain(message, false, "%s", values);
+}
+
+/**
+ * @brief Queue STATS messages with the link counters of every node.
+ */
+void queue_node_registry_stats()
+{
+    stats_page_t page = { .after = 0x0000 };
+
+    // the page is filled under the lock and queued without it, queueing may block
+    do
+    {
+        page.message = create_message(STATS);
+        page.last = 0x0000;
+
+        node_registry_lock();
+        node_registry_foreach(add_node_stats, &page);
+        node_registry_unlock();
+
+        if(page.last == 0x0000 && page.after != 0x0000)
+        {
+            free_message(page.message);
+            break;
+        }
+
+        if(page.last == 0x0000)
+            add_message_text_plain(page.message, false, "There are not nodes registered...");
+
+        send_message_queue(page.message);
+        page.after = page.last;
+    } while(page.last != 0x0000);
+}
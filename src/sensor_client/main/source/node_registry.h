@@ -0,0 +1,122 @@
+#ifndef _NODE_REGISTRY_H_
+#define _NODE_REGISTRY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "source/histogram.h"
+
+/*
+ * Unicast addresses go from 0x0001 to 0x7FFF. They are split in pages of
+ * NODE_REGISTRY_PAGE_SIZE entries that are only allocated when a node of
+ * the page is seen, so lookups are O(1) without reserving the whole range.
+ */
+#define NODE_REGISTRY_PAGE_BITS 5
+#define NODE_REGISTRY_PAGE_SIZE (1 << NODE_REGISTRY_PAGE_BITS)
+#define NODE_REGISTRY_PAGES     (0x8000 >> NODE_REGISTRY_PAGE_BITS)
+
+#define NODE_REGISTRY_PROPERTIES CONFIG_NODE_REGISTRY_PROPERTIES
+#define NODE_DESCRIPTOR_LEN      8 // Sensor Descriptor state
+
+/* Last value of a sensor property */
+typedef struct node_property_t {
+    uint16_t sensor_prop_id;       // 0x0000 if not used
+    int value;
+    int64_t timestamp;             // esp_timer time when the value was received
+} node_property_t;
+
+typedef struct mesh_node_t {
+    uint16_t addr;                 // 0x0000 if the entry is not used
+    /* Status */
+    int64_t last_seen;             // esp_timer time of the last message received from the node
+    int8_t rssi;                   // rssi of the last message
+    uint32_t errors;               // error status and failed sends
+    node_property_t properties[NODE_REGISTRY_PROPERTIES];
+    /* Sensor descriptors as received, see descriptor_cache.c */
+    bool descriptors_complete;     // every property of the node is described
+    uint8_t num_descriptors;
+    uint8_t descriptors[NODE_REGISTRY_PROPERTIES][NODE_DESCRIPTOR_LEN];
+    /* Link */
+    int32_t srtt;                  // smoothed round trip time (ms) * 8
+    int32_t rttvar;                // round trip time variation (ms) * 4
+    uint32_t rto;                  // request timeout (ms)
+    uint8_t consecutive_failures;  // requests given up in a row
+    int64_t holdoff_until;         // esp_timer time until requests are not sent
+    uint32_t replies;
+    uint32_t timeouts;
+    uint32_t retries;
+    uint32_t giveups;
+    histogram_t rtt;               // round trip time (ms)
+    uint8_t hops;                  // relays between the node and the gateway
+    bool hops_known;
+    uint8_t ttl;                   // ttl to send requests with
+    /* Rules */
+    uint32_t rules_firing;         // bit per rule of rules.h matching the node
+    uint8_t rules_streak[32];      // per bit, readings in a row that disagree with it
+} mesh_node_t;
+
+/**
+ * @brief Initialize the registry. No page is allocated.
+ */
+void init_node_registry();
+
+/**
+ * @brief Lock the registry. Entries can only be used while it is locked.
+ */
+void node_registry_lock();
+void node_registry_unlock();
+
+/**
+ * @brief Return the entry of a unicast address, NULL if there is none.
+ */
+mesh_node_t* node_registry_find(uint16_t addr);
+
+/**
+ * @brief Return the entry of a unicast address and create it if needed.
+ * NULL if addr is not unicast or there is no memory.
+ */
+mesh_node_t* node_registry_get(uint16_t addr);
+
+/**
+ * @brief Call fn for every known node in address order.
+ */
+void node_registry_foreach(void (*fn)(mesh_node_t *node, void *arg), void *arg);
+
+/**
+ * @brief Update the status of a node after receiving a message from it.
+ */
+void node_registry_seen(mesh_node_t *node, int64_t timestamp, int8_t rssi);
+
+/**
+ * @brief Store the last value of a sensor property. If the node has no
+ * room for a new property, the oldest one is replaced.
+ */
+void node_registry_set_value(mesh_node_t *node, uint16_t sensor_prop_id, int value, int64_t timestamp);
+
+/**
+ * @brief Return the last value of a sensor property, NULL if there is none.
+ */
+node_property_t* node_registry_get_value(mesh_node_t *node, uint16_t sensor_prop_id);
+
+/**
+ * @brief Add a round trip time sample and update the timeout.
+ */
+void node_link_rtt_sample(mesh_node_t *node, uint32_t rtt);
+
+/**
+ * @brief Back off the timeout after a request timed out.
+ */
+void node_link_timeout(mesh_node_t *node);
+
+/**
+ * @brief Learn the distance of a node from the ttl of a message it sent.
+ * @param recv_ttl: ttl of the received message
+ */
+void node_link_ttl_sample(mesh_node_t *node, uint8_t recv_ttl);
+
+/**
+ * @brief Queue STATS messages with the link counters of every node.
+ */
+void queue_node_registry_stats();
+
+#endif
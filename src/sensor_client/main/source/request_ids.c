@@ -0,0 +1,182 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include "source/request_ids.h"
+
+// tasks that run requests: the ingress worker and the mesh decoder.
+// A task holds a slot only while it has an id, see release.
+#define REQUEST_IDS_TASKS 2
+
+static const char *TAG = "REQUEST_IDS";
+
+typedef struct current_id_t {
+    TaskHandle_t task;
+    char id[REQUEST_ID_LEN + 1];
+} current_id_t;
+
+typedef struct pending_id_t {
+    uint16_t addr;
+    uint32_t opcode;
+    int64_t expires; // esp_timer time, 0 if the slot is free
+    char id[REQUEST_ID_LEN + 1];
+} pending_id_t;
+
+static current_id_t current[REQUEST_IDS_TASKS];
+static pending_id_t pending[REQUEST_IDS_PENDING];
+static SemaphoreHandle_t xSem_ids = NULL;
+
+/**
+ * @brief Create the table of ids
+ */
+void init_request_ids()
+{
+    memset(current, 0, sizeof(current));
+    memset(pending, 0, sizeof(pending));
+    xSem_ids = xSemaphoreCreateMutex();
+}
+
+// the table has to be locked
+static current_id_t* current_of(TaskHandle_t task, bool create)
+{
+    current_id_t *free_slot = NULL;
+
+    for(int i = 0; i < REQUEST_IDS_TASKS; i++)
+    {
+        if(current[i].task == task)
+            return &current[i];
+        if(current[i].task == NULL && free_slot == NULL)
+            free_slot = &current[i];
+    }
+
+    if(create && free_slot != NULL)
+    {
+        free_slot->task = task;
+        free_slot->id[0] = '\0';
+        return free_slot;
+    }
+    if(create)
+        ESP_LOGE(TAG, "No slot for task %s, its messages carry no request_id", pcTaskGetName(task));
+    return NULL;
+}
+
+// the table has to be locked
+static void release(current_id_t *slot)
+{
+    slot->task = NULL;
+    slot->id[0] = '\0';
+}
+
+/**
+ * @brief Messages created by the calling task carry request_id until request_ids_end
+ * @param request_id: id, NULL or empty for none. Longer ids are cut.
+ */
+void request_ids_begin(const char *request_id)
+{
+    while(xSemaphoreTake(xSem_ids, (TickType_t) 10) != pdTRUE);
+    bool has_id = request_id != NULL && request_id[0] != '\0';
+    current_id_t *slot = current_of(xTaskGetCurrentTaskHandle(), has_id);
+    if(slot != NULL && !has_id)
+    {
+        release(slot);
+    }
+    else if(slot != NULL)
+    {
+        strncpy(slot->id, request_id, REQUEST_ID_LEN);
+        slot->id[REQUEST_ID_LEN] = '\0';
+    }
+    xSemaphoreGive(xSem_ids);
+}
+
+/**
+ * @brief Messages created by the calling task carry no id from now on
+ */
+void request_ids_end()
+{
+    request_ids_begin(NULL);
+}
+
+/**
+ * @brief The reply of a request sent now to addr carries the current id
+ */
+void request_ids_expect(uint16_t addr, uint32_t opcode)
+{
+    int64_t now = esp_timer_get_time();
+
+    while(xSemaphoreTake(xSem_ids, (TickType_t) 10) != pdTRUE);
+    current_id_t *slot = current_of(xTaskGetCurrentTaskHandle(), false);
+    if(slot != NULL && slot->id[0] != '\0')
+    {
+        // a free or expired slot, else the one that expires first
+        pending_id_t *target = &pending[0];
+        for(int i = 0; i < REQUEST_IDS_PENDING; i++)
+        {
+            if(pending[i].expires < now)
+            {
+                target = &pending[i];
+                break;
+            }
+            if(pending[i].expires < target->expires)
+                target = &pending[i];
+        }
+
+        target->addr = addr;
+        target->opcode = opcode;
+        target->expires = now + REQUEST_IDS_EXPIRY;
+        memcpy(target->id, slot->id, sizeof(target->id));
+    }
+    xSemaphoreGive(xSem_ids);
+}
+
+/**
+ * @brief Begin with the id of the request to addr that just completed, if any
+ * @retval true if there was one
+ */
+bool request_ids_begin_reply(uint16_t addr, uint32_t opcode)
+{
+    int64_t now = esp_timer_get_time();
+    pending_id_t *found = NULL;
+
+    while(xSemaphoreTake(xSem_ids, (TickType_t) 10) != pdTRUE);
+    for(int i = 0; i < REQUEST_IDS_PENDING; i++)
+    {
+        // the oldest one, requests to a destination complete in order
+        if(pending[i].expires >= now && pending[i].addr == addr && pending[i].opcode == opcode
+           && (found == NULL || pending[i].expires < found->expires))
+            found = &pending[i];
+    }
+
+    if(found != NULL)
+    {
+        current_id_t *slot = current_of(xTaskGetCurrentTaskHandle(), true);
+        if(slot != NULL)
+            memcpy(slot->id, found->id, sizeof(slot->id));
+        found->expires = 0;
+    }
+    xSemaphoreGive(xSem_ids);
+
+    return found != NULL;
+}
+
+/**
+ * @brief Copy the id of the calling task, empty if none
+ * @param request_id: REQUEST_ID_LEN + 1 chars
+ */
+void request_ids_current(char *request_id)
+{
+    request_id[0] = '\0';
+
+    // before init_request_ids, nothing has an id
+    if(xSem_ids == NULL)
+        return;
+
+    while(xSemaphoreTake(xSem_ids, (TickType_t) 10) != pdTRUE);
+    current_id_t *slot = current_of(xTaskGetCurrentTaskHandle(), false);
+    if(slot != NULL)
+        memcpy(request_id, slot->id, REQUEST_ID_LEN + 1);
+    xSemaphoreGive(xSem_ids);
+}
@@ -0,0 +1,54 @@
+#ifndef _REQUEST_IDS_H_
+#define _REQUEST_IDS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "source/messages_parser.h"
+
+/*
+ * request_id of the actions and commands, echoed on their answers so a
+ * client can match them with its requests.
+ * While a task runs a request, every message it creates carries its id.
+ * The reply of a one-time mesh request comes later from task_decode_mesh,
+ * so its id is kept until the request to that addr and opcode completes.
+ * Two identical requests in flight are one for the tracker: the reply
+ * carries the id of the first one.
+ */
+#define REQUEST_IDS_PENDING 16
+#define REQUEST_IDS_EXPIRY  60000000 // us, longer than a request and its retries
+
+/**
+ * @brief Create the table of ids
+ */
+void init_request_ids();
+
+/**
+ * @brief Messages created by the calling task carry request_id until request_ids_end
+ * @param request_id: id, NULL or empty for none. Longer ids are cut.
+ */
+void request_ids_begin(const char *request_id);
+
+/**
+ * @brief Messages created by the calling task carry no id from now on
+ */
+void request_ids_end();
+
+/**
+ * @brief The reply of a request sent now to addr carries the current id
+ */
+void request_ids_expect(uint16_t addr, uint32_t opcode);
+
+/**
+ * @brief Begin with the id of the request to addr that just completed, if any
+ * @retval true if there was one
+ */
+bool request_ids_begin_reply(uint16_t addr, uint32_t opcode);
+
+/**
+ * @brief Copy the id of the calling task, empty if none
+ * @param request_id: REQUEST_ID_LEN + 1 chars
+ */
+void request_ids_current(char *request_id);
+
+#endif
@@ -0,0 +1,523 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+#include "source/request_tracker.h"
+#include "source/node_registry.h"
+#include "source/messages_parser.h"
+
+static const char* TAG = "RequestTracker";
+
+#define MAX_RETRIES        CONFIG_MAX_RETRIES
+#define BACKOFF_BASE       CONFIG_RETRY_BACKOFF_MS
+#define BACKOFF_MAX        CONFIG_RETRY_BACKOFF_MAX_MS
+#define DEAD_NODE_FAILURES CONFIG_DEAD_NODE_FAILURES
+#define DEAD_NODE_HOLDOFF  CONFIG_DEAD_NODE_HOLDOFF_MS
+
+typedef enum {
+    IDLE,      // slot free
+    IN_FLIGHT, // waiting for the reply or the timeout
+    BACKOFF    // timed out, waiting to be sent again
+} slot_state_t;
+
+/*
+ * In flight requests, one slot per destination. The client model only
+ * allows one outstanding request per destination, so the rest of the
+ * requests to the same node wait in the slot queue until the reply or
+ * the timeout of the current one arrives.
+ */
+typedef struct dst_slot_t {
+    uint16_t addr;              // 0x0000 when the slot is free
+    slot_state_t state;
+    mesh_request_t current;     // request in flight
+    int64_t sent_at;            // esp_timer time of the request in flight
+    esp_timer_handle_t retry_timer;
+    uint8_t head;
+    uint8_t count;
+    mesh_request_t pending[TRACKER_QUEUE_DEPTH];
+} dst_slot_t;
+
+static dst_slot_t slots[TRACKER_MAX_DESTINATIONS];
+static tracker_stats_t stats;
+static tracker_send_fn send_request;
+static SemaphoreHandle_t xSem_tracker = NULL;
+
+static void lock()
+{
+    while(xSemaphoreTake(xSem_tracker, ( TickType_t ) 10 ) != pdTRUE);
+}
+
+static void unlock()
+{
+    xSemaphoreGive(xSem_tracker);
+}
+
+/**
+ * @brief compare two requests
+ */
+static bool same_request(const mesh_request_t *l, const mesh_request_t *r)
+{
+    return l->opcode == r->opcode && l->addr == r->addr && l->sensor_prop_id == r->sensor_prop_id;
+}
+
+/**
+ * @brief Return the slot of a destination, NULL if there is none
+ */
+static dst_slot_t* find_slot(uint16_t addr)
+{
+    for(int i = 0; i < TRACKER_MAX_DESTINATIONS; i++)
+    {
+        if(slots[i].addr == addr)
+            return &slots[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Return the slot of a destination. Take a free one if
+ * the destination has no slot. NULL if all of them are in use.
+ */
+static dst_slot_t* get_slot(uint16_t addr)
+{
+    dst_slot_t *slot = find_slot(addr);
+    if(slot == NULL)
+    {
+        slot = find_slot(0x0000);
+        if(slot != NULL)
+        {
+            slot->addr = addr;
+            slot->state = IDLE;
+            slot->head = 0;
+            slot->count = 0;
+        }
+    }
+    return slot;
+}
+
+/**
+ * @brief Fill the timeout and the ttl of a request from what
+ * is known of its destination
+ */
+static void set_link_params(mesh_request_t *request)
+{
+    request->timeout = CONFIG_RTO_INITIAL_MS;
+    request->ttl = CONFIG_MSG_SEND_TTL;
+
+    node_registry_lock();
+    mesh_node_t *node = node_registry_get(request->addr);
+    if(node != NULL)
+    {
+        request->timeout = node->rto;
+        request->ttl = node->ttl;
+    }
+    node_registry_unlock();
+
+    if(request->ttl < CONFIG_MSG_SEND_TTL)
+        stats.ttl_saved += CONFIG_MSG_SEND_TTL - request->ttl;
+}
+
+/**
+ * @brief Return whether a destination is being held off after
+ * too many failed requests in a row
+ */
+static bool node_held_off(uint16_t addr)
+{
+    bool held_off = false;
+
+    node_registry_lock();
+    mesh_node_t *node = node_registry_find(addr);
+    if(node != NULL)
+        held_off = esp_timer_get_time() < node->holdoff_until;
+    node_registry_unlock();
+
+    return held_off;
+}
+
+/**
+ * @brief Mark a request in flight in its slot
+ */
+static void set_in_flight(dst_slot_t *slot, const mesh_request_t *request)
+{
+    if(&slot->current != request)
+        memcpy(&slot->current, request, sizeof(mesh_request_t));
+    set_link_params(&slot->current);
+    slot->state = IN_FLIGHT;
+    slot->sent_at = esp_timer_get_time();
+}
+
+/**
+ * @brief Pop the next pending request of a slot and mark it in flight.
+ * Frees the slot if there is nothing else to send.
+ * @retval whether there is a request to send in next
+ */
+static bool take_next(dst_slot_t *slot, mesh_request_t *next)
+{
+    if(slot->count == 0)
+    {
+        slot->state = IDLE;
+        slot->addr = 0x0000;
+        return false;
+    }
+
+    set_in_flight(slot, &slot->pending[slot->head]);
+    slot->head = (slot->head + 1) % TRACKER_QUEUE_DEPTH;
+    slot->count--;
+
+    memcpy(next, &slot->current, sizeof(mesh_request_t));
+    stats.dispatched++;
+    return true;
+}
+
+/**
+ * @brief Send a request that has been marked in flight. The lock
+ * is not held here: the reply is handled in another task and it
+ * will need it. If the client model rejects the request, the next
+ * one of the same destination is tried.
+ */
+static void dispatch(mesh_request_t *request)
+{
+    bool send = true;
+
+    while(send)
+    {
+        if(send_request(request) == ESP_OK)
+            return;
+
+        ESP_LOGE(TAG, "Request 0x%04x to 0x%04x rejected", request->opcode, request->addr);
+
+        lock();
+        stats.send_errors++;
+        dst_slot_t *slot = find_slot(request->addr);
+        send = slot != NULL && take_next(slot, request);
+        unlock();
+    }
+}
+
+/**
+ * @brief Return the time to wait before sending a request again:
+ * exponential on the attempt plus a random jitter of up to a half,
+ * so nodes that timed out together do not retry together.
+ */
+static uint32_t backoff_delay(uint8_t attempt)
+{
+    uint32_t delay = BACKOFF_BASE;
+    for(int i = 1; i < attempt && delay < BACKOFF_MAX; i++)
+        delay *= 2;
+
+    if(delay > BACKOFF_MAX)
+        delay = BACKOFF_MAX;
+
+    return delay + esp_random() % (delay / 2 + 1);
+}
+
+/**
+ * @brief esp_timer callback: send again the request of a slot in BACKOFF
+ */
+static void retry_timer_cb(void *arg)
+{
+    dst_slot_t *slot = (dst_slot_t *) arg;
+    mesh_request_t request;
+    bool send = false;
+
+    lock();
+    if(slot->state == BACKOFF)
+    {
+        set_in_flight(slot, &slot->current);
+        memcpy(&request, &slot->current, sizeof(mesh_request_t));
+        send = true;
+    }
+    unlock();
+
+    if(send)
+    {
+        ESP_LOGI(TAG, "Retry %d of 0x%04x to 0x%04x, timeout %u ms, ttl %d",
+            request.attempt, request.opcode, request.addr, request.timeout, request.ttl);
+        dispatch(&request);
+    }
+}
+
+/**
+ * @brief Initialize the tracker.
+ * @param send: function that sends a request to the mesh
+ */
+void request_tracker_init(tracker_send_fn send)
+{
+    memset(slots, 0, sizeof(slots));
+    memset(&stats, 0, sizeof(tracker_stats_t));
+    send_request = send;
+    xSem_tracker = xSemaphoreCreateMutex();
+
+    for(int i = 0; i < TRACKER_MAX_DESTINATIONS; i++)
+    {
+        esp_timer_create_args_t args = {
+            .callback = retry_timer_cb,
+            .arg = &slots[i],
+            .name = "tracker_retry",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&args, &slots[i].retry_timer));
+    }
+}
+
+/**
+ * @brief Return whether a new request to addr would not be dropped:
+ * its destination has a slot with room in its queue or there is a free slot
+ */
+bool request_tracker_has_room(uint16_t addr)
+{
+    lock();
+    dst_slot_t *slot = find_slot(addr);
+    bool room = slot != NULL ? slot->state == IDLE || slot->count < TRACKER_QUEUE_DEPTH : find_slot(0x0000) != NULL;
+    unlock();
+
+    return room;
+}
+
+/**
+ * @brief Send a request or queue it if there is another one in flight
+ * to the same destination (the client model rejects it otherwise).
+ */
+tracker_status_t request_tracker_submit(uint32_t opcode, uint16_t addr, uint16_t sensor_prop_id)
+{
+    tracker_status_t status = DROPPED;
+    mesh_request_t request = {
+        .opcode = opcode,
+        .addr = addr,
+        .sensor_prop_id = sensor_prop_id,
+        .attempt = 0,
+    };
+
+    lock();
+    stats.submitted++;
+
+    if(node_held_off(addr))
+    {
+        stats.suppressed++;
+        unlock();
+        ESP_LOGW(TAG, "Node 0x%04x is not answering, request 0x%04x suppressed", addr, opcode);
+        return SUPPRESSED;
+    }
+
+    dst_slot_t *slot = get_slot(addr);
+    if(slot == NULL)
+    {
+        stats.dropped++;
+        unlock();
+        ESP_LOGE(TAG, "No slot for 0x%04x, request 0x%04x dropped", addr, opcode);
+        return DROPPED;
+    }
+
+    // The reply or the timeout of the request in flight were lost (rx ring full)
+    if(slot->state == IN_FLIGHT
+       && esp_timer_get_time() - slot->sent_at > ((int64_t) slot->current.timeout + CONFIG_TRACKER_STALE_TIMEOUT_MS) * 1000)
+    {
+        ESP_LOGW(TAG, "Request 0x%04x to 0x%04x is stale", slot->current.opcode, addr);
+        stats.stale++;
+        slot->state = IDLE;
+    }
+
+    if(slot->state == IDLE)
+    {
+        set_in_flight(slot, &request);
+        memcpy(&request, &slot->current, sizeof(mesh_request_t));
+        stats.dispatched++;
+        status = DISPATCHED;
+    }
+    else
+    {
+        // An identical request is going to be answered anyway
+        if(same_request(&slot->current, &request))
+            status = COALESCED;
+
+        for(int i = 0; i < slot->count && status != COALESCED; i++)
+        {
+            if(same_request(&slot->pending[(slot->head + i) % TRACKER_QUEUE_DEPTH], &request))
+                status = COALESCED;
+        }
+
+        if(status == COALESCED)
+        {
+            stats.coalesced++;
+        }
+        else if(slot->count < TRACKER_QUEUE_DEPTH)
+        {
+            memcpy(&slot->pending[(slot->head + slot->count) % TRACKER_QUEUE_DEPTH], &request, sizeof(mesh_request_t));
+            slot->count++;
+            stats.queued++;
+            status = QUEUED;
+        }
+        else
+        {
+            stats.dropped++;
+            ESP_LOGE(TAG, "Queue of 0x%04x full, request 0x%04x dropped", addr, opcode);
+        }
+    }
+    unlock();
+
+    if(status == DISPATCHED)
+        dispatch(&request);
+
+    return status;
+}
+
+/**
+ * @brief Update the destination after a timeout or an error.
+ * @retval whether the request has to be sent again
+ */
+static bool handle_failure(dst_slot_t *slot, mesh_node_t *node, int64_t timestamp, tracker_reply_t reply)
+{
+    if(reply == REPLY_TIMEOUT)
+        stats.timeouts++;
+    else
+        stats.errors++;
+    if(node == NULL)
+        return false;
+
+    // an error says nothing of the round trip time
+    if(reply == REPLY_TIMEOUT)
+    {
+        node->timeouts++;
+        node_link_timeout(node);
+    }
+
+    // Nodes that are not answering do not get retries
+    if(slot->current.attempt < MAX_RETRIES && node->consecutive_failures < DEAD_NODE_FAILURES)
+    {
+        slot->current.attempt++;
+        slot->state = BACKOFF;
+        stats.retries++;
+        node->retries++;
+        esp_timer_start_once(slot->retry_timer, (uint64_t) backoff_delay(slot->current.attempt) * 1000);
+        return true;
+    }
+
+    stats.giveups++;
+    node->giveups++;
+    if(node->consecutive_failures < UINT8_MAX)
+        node->consecutive_failures++;
+
+    if(node->consecutive_failures >= DEAD_NODE_FAILURES)
+    {
+        // Hold off exponentially while the node keeps failing
+        int shift = node->consecutive_failures - DEAD_NODE_FAILURES;
+        int64_t holdoff = (int64_t) DEAD_NODE_HOLDOFF << (shift < 4 ? shift : 4);
+        node->holdoff_until = timestamp + holdoff * 1000;
+
+        ESP_LOGW(TAG, "Node 0x%04x not answering, held off %d ms", node->addr, (int) holdoff);
+
+        // Do not spend airtime on the requests queued for it
+        stats.suppressed += slot->count;
+        slot->count = 0;
+    }
+    return false;
+}
+
+/**
+ * @brief Finish the request in flight to addr and dispatch the next
+ * one queued for the same destination. A request that timed out is
+ * sent again after a backoff until CONFIG_MAX_RETRIES.
+ * @param addr: destination of the request
+ * @param opcode: opcode of the request
+ * @param timestamp: esp_timer time when the reply or the timeout was received
+ * @param reply: how it ended
+ * @param request: if not NULL, the matching request is copied into it
+ * @param gave_up: set if it failed and is not going to be sent again
+ * @retval round trip time in milliseconds, -1 if there was no matching request
+ * or it is going to be retried
+ */
+int32_t request_tracker_complete(uint16_t addr, uint32_t opcode, int64_t timestamp, tracker_reply_t reply,
+                                 mesh_request_t *request, bool *gave_up)
+{
+    int32_t rtt = -1;
+    *gave_up = false;
+    bool send = false;
+    mesh_request_t next;
+
+    lock();
+    dst_slot_t *slot = find_slot(addr);
+    if(slot != NULL && slot->state == IN_FLIGHT && slot->current.opcode == opcode)
+    {
+        if(request != NULL)
+            memcpy(request, &slot->current, sizeof(mesh_request_t));
+
+        rtt = (int32_t) ((timestamp - slot->sent_at) / 1000);
+        if(rtt < 0)
+            rtt = 0;
+
+        node_registry_lock();
+        mesh_node_t *node = node_registry_get(addr);
+        bool retry = false;
+
+        if(reply != REPLY_OK)
+        {
+            retry = handle_failure(slot, node, timestamp, reply);
+            if(retry)
+                rtt = -1;
+            *gave_up = !retry;
+        }
+        else
+        {
+            stats.completed++;
+            if(node != NULL)
+            {
+                node->replies++;
+                node->consecutive_failures = 0;
+                node->holdoff_until = 0;
+
+                // Karn: the reply of a retransmission can't be matched to a transmission
+                if(slot->current.attempt == 0)
+                    node_link_rtt_sample(node, (uint32_t) rtt);
+            }
+            if(slot->current.attempt == 0)
+                histogram_add(&stats.rtt, (uint32_t) rtt);
+        }
+        node_registry_unlock();
+
+        if(!retry)
+            send = take_next(slot, &next);
+    }
+    unlock();
+
+    if(send)
+        dispatch(&next);
+
+    return rtt;
+}
+
+/**
+ * @brief Copy the tracker counters.
+ */
+void request_tracker_get_stats(tracker_stats_t *out)
+{
+    lock();
+    memcpy(out, &stats, sizeof(tracker_stats_t));
+    unlock();
+}
+
+/**
+ * @brief Queue a STATS message with the tracker counters.
+ */
+void queue_request_tracker_stats()
+{
+    tracker_stats_t s;
+    request_tracker_get_stats(&s);
+
+    message_t* message = create_message(STATS);
+    add_message_text_plain(message, false, "Requests: submitted %u, dispatched %u, queued %u, coalesced %u",
+        s.submitted, s.dispatched, s.queued, s.coalesced);
+    add_message_text_plain(message, false, "Requests: suppressed %u, dropped %u, send errors %u, stale %u",
+        s.suppressed, s.dropped, s.send_errors, s.stale);
+    add_message_text_plain(message, false, "Replies: completed %u, timeouts %u, errors %u",
+        s.completed, s.timeouts, s.errors);
+    add_message_text_plain(message, false, "Failures: retries %u, give-ups %u",
+        s.retries, s.giveups);
+    add_message_text_plain(message, false, "TTL: hops saved against fixed ttl %d: %u",
+        CONFIG_MSG_SEND_TTL, s.ttl_saved);
+    add_message_text_plain(message, false, "RTT ms: mean %u, p50 %u, p95 %u, p99 %u, max %u",
+        histogram_mean(&s.rtt), histogram_percentile(&s.rtt, 50),
+        histogram_percentile(&s.rtt, 95), histogram_percentile(&s.rtt, 99), s.rtt.max);
+    send_message_queue(message);
+}
@@ -0,0 +1,105 @@
+#ifndef _REQUEST_TRACKER_H_
+#define _REQUEST_TRACKER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+#include "source/histogram.h"
+
+#define TRACKER_MAX_DESTINATIONS CONFIG_TRACKER_MAX_DESTINATIONS
+#define TRACKER_QUEUE_DEPTH      CONFIG_TRACKER_QUEUE_DEPTH
+
+/* A request to send to a node */
+typedef struct mesh_request_t {
+    uint32_t opcode;
+    uint16_t addr;
+    uint16_t sensor_prop_id;
+    uint32_t timeout;  // ms, taken from the destination round trip time
+    uint8_t ttl;       // taken from the destination distance
+    uint8_t attempt;   // 0 for the first transmission
+} mesh_request_t;
+
+typedef enum {
+    DISPATCHED, // sent to the mesh
+    QUEUED,     // waiting for the request in flight to the same destination
+    COALESCED,  // an identical request is in flight or queued
+    SUPPRESSED, // the destination is not answering, wait before trying again
+    DROPPED     // no room for it
+} tracker_status_t;
+
+/* How a request in flight ended */
+typedef enum {
+    REPLY_OK,      // answered
+    REPLY_TIMEOUT, // no answer in time
+    REPLY_ERROR    // rejected by the client model after it was sent
+} tracker_reply_t;
+
+typedef struct tracker_stats_t {
+    uint32_t submitted;
+    uint32_t dispatched;
+    uint32_t queued;
+    uint32_t coalesced;
+    uint32_t suppressed;
+    uint32_t dropped;
+    uint32_t send_errors;  // rejected by the client model
+    uint32_t completed;    // answered
+    uint32_t timeouts;
+    uint32_t errors;       // error status in the client model callback
+    uint32_t retries;
+    uint32_t giveups;
+    uint32_t stale;        // in flight for too long without reply nor timeout
+    uint32_t ttl_saved;    // sum of CONFIG_MSG_SEND_TTL - ttl of the dispatched requests
+    histogram_t rtt;       // round trip time in milliseconds
+} tracker_stats_t;
+
+/* Function used to send a request to the mesh */
+typedef esp_err_t (*tracker_send_fn)(const mesh_request_t *request);
+
+/**
+ * @brief Initialize the tracker.
+ * @param send: function that sends a request to the mesh
+ */
+void request_tracker_init(tracker_send_fn send);
+
+/**
+ * @brief Send a request or queue it if there is another one in flight
+ * to the same destination (the client model rejects it otherwise).
+ */
+tracker_status_t request_tracker_submit(uint32_t opcode, uint16_t addr, uint16_t sensor_prop_id);
+
+/**
+ * @brief Return whether a new request to addr would not be dropped:
+ * its destination has a slot with room in its queue or there is a free slot
+ */
+bool request_tracker_has_room(uint16_t addr);
+
+/**
+ * @brief Finish the request in flight to addr and dispatch the next
+ * one queued for the same destination. A request that timed out is
+ * sent again after a backoff until CONFIG_MAX_RETRIES.
+ * @param addr: destination of the request
+ * @param opcode: opcode of the request
+ * @param timestamp: esp_timer time when the reply or the timeout was received
+ * @param reply: how it ended
+ * @param request: if not NULL, the matching request is copied into it
+ * @param gave_up: set if it failed and is not going to be sent again
+ * @retval round trip time in milliseconds, -1 if there was no matching request
+ * or it is going to be retried
+ */
+int32_t request_tracker_complete(uint16_t addr, uint32_t opcode, int64_t timestamp, tracker_reply_t reply,
+                                 mesh_request_t *request, bool *gave_up);
+
+/**
+ * @brief Copy the tracker counters.
+ */
+void request_tracker_get_stats(tracker_stats_t *stats);
+
+/**
+ * @brief Queue a STATS message with the tracker counters.
+ */
+void queue_request_tracker_stats();
+
+#endif
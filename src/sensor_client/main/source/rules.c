@@ -0,0 +1,478 @@
+#include "sdkconfig.h"
+
+#if CONFIG_GATEWAY_RULES
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include "source/rules.h"
+#include "source/data_format.h"
+#include "source/gateway_storage.h"
+#include "source/metrics.h"
+
+static const char* TAG = "Rules";
+
+#define NVS_NAMESPACE "rules"
+#define NVS_KEY       "table"
+
+#define ADDR_UNICAST_MIN 0x0001
+#define ADDR_UNICAST_MAX 0x7FFF
+
+static const char *kind_names[] = {
+    [RULE_ABOVE]   = "above",
+    [RULE_BELOW]   = "below",
+    [RULE_RATE]    = "rate",
+    [RULE_MISSING] = "missing",
+};
+
+static rule_t table[RULES_MAX];
+static volatile int num_rules = 0;
+static SemaphoreHandle_t xSem_rules = NULL;
+
+static rule_t compiled[RULES_MAX]; // only used by rules_load
+static int64_t last_check = 0;
+
+// alerts waiting for the registry to be unlocked, under the rules lock
+#define PENDING_ALERTS (2 * RULES_MAX)
+static message_t *pending[PENDING_ALERTS];
+static int num_pending = 0;
+
+/**
+ * @brief Restore the rules saved in NVS
+ */
+void init_rules()
+{
+    nvs_handle_t handle;
+    size_t size = sizeof(table);
+
+    xSem_rules = xSemaphoreCreateMutex();
+
+    if(gateway_storage_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+        return; // nothing saved yet
+
+    esp_err_t err = nvs_get_blob(handle, NVS_KEY, table, &size);
+    if(err == ESP_OK && size % sizeof(rule_t) == 0)
+        num_rules = size / sizeof(rule_t);
+    else if(err != ESP_ERR_NVS_NOT_FOUND)
+        ESP_LOGW(TAG, "Ignoring the saved rules");
+    nvs_close(handle);
+
+    ESP_LOGI(TAG, "%d rules restored", num_rules);
+}
+
+static void save_table(const rule_t *rules, int n)
+{
+    nvs_handle_t handle;
+
+    if(gateway_storage_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Cannot open nvs namespace %s", NVS_NAMESPACE);
+        return;
+    }
+
+    esp_err_t err = n > 0 ? nvs_set_blob(handle, NVS_KEY, rules, n * sizeof(rule_t)) : nvs_erase_key(handle, NVS_KEY);
+    if(err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND)
+        err = nvs_commit(handle);
+
+    if(err != ESP_OK)
+        ESP_LOGE(TAG, "Cannot save the rules (err %d)", err);
+
+    nvs_close(handle);
+}
+
+// "0005" or {"from": "0001", "to": "00FF"}, every node without it
+static bool compile_addr(const cJSON *addr, rule_t *rule)
+{
+    rule->addr_min = ADDR_UNICAST_MIN;
+    rule->addr_max = ADDR_UNICAST_MAX;
+
+    if(addr == NULL)
+        return true;
+
+    if(cJSON_IsString(addr))
+    {
+        rule->addr_min = rule->addr_max = string_to_hex_uint16_t(addr->valuestring);
+    }
+    else if(cJSON_IsObject(addr))
+    {
+        const cJSON *from = cJSON_GetObjectItem(addr, "from");
+        const cJSON *to   = cJSON_GetObjectItem(addr, "to");
+        if(!cJSON_IsString(from) || !cJSON_IsString(to))
+            return false;
+        rule->addr_min = string_to_hex_uint16_t(from->valuestring);
+        rule->addr_max = string_to_hex_uint16_t(to->valuestring);
+    }
+    else
+    {
+        return false;
+    }
+
+    return rule->addr_min >= ADDR_UNICAST_MIN && rule->addr_max <= ADDR_UNICAST_MAX && rule->addr_min <= rule->addr_max;
+}
+
+/**
+ * @brief Compile the json of a rule into an entry of the table
+ * @retval NULL if it is right, else what is wrong
+ */
+static const char* compile_rule(const cJSON *json, rule_t *rule)
+{
+    const cJSON *name           = cJSON_GetObjectItem(json, "name");
+    const cJSON *sensor_prop_id = cJSON_GetObjectItem(json, "sensor_prop_id");
+    const cJSON *period         = cJSON_GetObjectItem(json, "period");
+    const cJSON *hysteresis     = cJSON_GetObjectItem(json, "hysteresis");
+    const cJSON *debounce       = cJSON_GetObjectItem(json, "for");
+    const cJSON *limit          = NULL;
+
+    memset(rule, 0, sizeof(rule_t));
+
+    if(!cJSON_IsString(name) || name->valuestring[0] == '\0' || strlen(name->valuestring) > RULE_NAME_LEN)
+        return "name missing or too long";
+    strcpy(rule->name, name->valuestring);
+
+    // exactly one predicate
+    for(int kind = RULE_ABOVE; kind <= RULE_MISSING; kind++)
+    {
+        const cJSON *item = cJSON_GetObjectItem(json, kind_names[kind]);
+        if(item == NULL)
+            continue;
+        if(limit != NULL)
+            return "more than one of above, below, rate, missing";
+        if(!cJSON_IsNumber(item))
+            return "its limit is not a number";
+        limit = item;
+        rule->kind = kind;
+    }
+    if(limit == NULL)
+        return "no above, below, rate or missing";
+    rule->limit = limit->valueint;
+
+    if(!compile_addr(cJSON_GetObjectItem(json, "addr"), rule))
+        return "wrong addr";
+
+    if(sensor_prop_id != NULL && !cJSON_IsString(sensor_prop_id))
+        return "wrong sensor_prop_id";
+    if(sensor_prop_id != NULL)
+        rule->sensor_prop_id = string_to_hex_uint16_t(sensor_prop_id->valuestring);
+    if(rule->sensor_prop_id == 0x0000 && rule->kind != RULE_MISSING)
+        return "sensor_prop_id missing";
+
+    if(rule->kind == RULE_RATE && rule->limit <= 0)
+        return "rate has to be positive";
+
+    rule->debounce = 1;
+    if((hysteresis != NULL || debounce != NULL) && rule->kind == RULE_MISSING)
+        return "missing takes no hysteresis nor for";
+    if(hysteresis != NULL && (!cJSON_IsNumber(hysteresis) || hysteresis->valueint < 0))
+        return "hysteresis has to be a number >= 0";
+    if(hysteresis != NULL)
+        rule->hysteresis = hysteresis->valueint;
+    if(rule->kind == RULE_RATE && rule->hysteresis >= rule->limit)
+        return "hysteresis has to be smaller than rate";
+    if(debounce != NULL && (!cJSON_IsNumber(debounce) || debounce->valueint < 1 || debounce->valueint > UINT8_MAX))
+        return "for has to be between 1 and 255 readings";
+    if(debounce != NULL)
+        rule->debounce = debounce->valueint;
+
+    if(rule->kind == RULE_MISSING)
+    {
+        if(rule->limit < 1 || !cJSON_IsNumber(period) || period->valueint < 1)
+            return "missing needs periods and a period >= 1 s";
+        if((int64_t) rule->limit * period->valueint > UINT32_MAX / 1000)
+            return "missing for too long";
+        rule->timeout_ms = (uint32_t) rule->limit * period->valueint * 1000;
+    }
+
+    return NULL;
+}
+
+static void clear_firing(mesh_node_t *node, void *arg)
+{
+    node->rules_firing = 0;
+    memset(node->rules_streak, 0, sizeof(node->rules_streak));
+}
+
+/**
+ * @brief Compile and save a new table of rules. If one of them is wrong
+ * an error is answered and the current table is kept.
+ * @param rules: json array of rules, empty to remove them all
+ */
+void rules_load(const cJSON *rules)
+{
+    message_t *message = create_message(PLAIN_TEXT);
+    int n = cJSON_GetArraySize(rules);
+
+    if(!cJSON_IsArray(rules) || n > RULES_MAX)
+    {
+        add_message_text_plain(message, true, "rules has to be an array of up to %d rules", RULES_MAX);
+        send_message_queue(message);
+        return;
+    }
+
+    for(int i = 0; i < n; i++)
+    {
+        const char *error = compile_rule(cJSON_GetArrayItem(rules, i), &compiled[i]);
+        if(error != NULL)
+        {
+            add_message_text_plain(message, true, "Rule %d: %s. Rules not loaded", i, error);
+            send_message_queue(message);
+            return;
+        }
+    }
+
+    // the bits of the nodes belong to the old table, matching rules alert again
+    node_registry_lock();
+    node_registry_foreach(clear_firing, NULL);
+    while(xSemaphoreTake(xSem_rules, (TickType_t) 10) != pdTRUE);
+    memcpy(table, compiled, n * sizeof(rule_t));
+    num_rules = n;
+    xSemaphoreGive(xSem_rules);
+    node_registry_unlock();
+
+    save_table(compiled, n);
+
+    ESP_LOGI(TAG, "%d rules loaded", n);
+    add_message_text_plain(message, false, "%d rules loaded", n);
+    send_message_queue(message);
+}
+
+static void count_firing(mesh_node_t *node, void *arg)
+{
+    uint16_t *firing = (uint16_t *) arg;
+
+    for(int i = 0; i < RULES_MAX; i++)
+    {
+        if(node->rules_firing & (1u << i))
+            firing[i]++;
+    }
+}
+
+/**
+ * @brief Queue STATS messages with the rules and the nodes they match
+ */
+void queue_rules_stats()
+{
+    uint16_t firing[RULES_MAX] = {0};
+    message_t *message = create_message(STATS);
+
+    node_registry_lock();
+    node_registry_foreach(count_firing, firing);
+    node_registry_unlock();
+
+    while(xSemaphoreTake(xSem_rules, (TickType_t) 10) != pdTRUE);
+    for(int i = 0; i < num_rules; i++)
+    {
+        if(message->m_content.text_plain.num_messages == MAX_NUM_MESSAGES)
+        {
+            send_message_queue(message);
+            message = create_message(STATS);
+        }
+
+        const rule_t *rule = &table[i];
+        add_message_text_plain(message, false, "%s %s %d %04X %04X-%04X hyst %d for %d firing on %d",
+            rule->name, kind_names[rule->kind], (int) rule->limit, rule->sensor_prop_id,
+            rule->addr_min, rule->addr_max, (int) rule->hysteresis, rule->debounce, firing[i]);
+    }
+    xSemaphoreGive(xSem_rules);
+
+    if(message->m_content.text_plain.num_messages == 0)
+        add_message_text_plain(message, false, "There are no rules loaded...");
+
+    send_message_queue(message);
+}
+
+/**
+ * @brief Alert if a rule starts or stops matching a node for debounce
+ * evaluations in a row. Both the registry and the table have to be locked,
+ * the alert waits in pending for rules_send_alerts.
+ * @param i: index of the rule
+ * @param value: reading, or s without readings for missing
+ * @param taken: esp_timer time of the reading or the check
+ * @param from_reading: taken is the time of a mesh message
+ */
+static void transition(int i, mesh_node_t *node, uint16_t sensor_prop_id, bool match,
+                       int value, int64_t taken, bool from_reading)
+{
+    const rule_t *rule = &table[i];
+    uint32_t bit = 1u << i;
+
+    if(match == ((node->rules_firing & bit) != 0))
+    {
+        node->rules_streak[i] = 0;
+        return;
+    }
+    // the state does not change until the alert can be queued, next evaluation
+    if(node->rules_streak[i] < UINT8_MAX)
+        node->rules_streak[i]++;
+    if(node->rules_streak[i] < rule->debounce || num_pending == PENDING_ALERTS)
+        return;
+    node->rules_streak[i] = 0;
+    node->rules_firing ^= bit;
+
+    message_t *message = create_message(ALERT);
+    alert_t *alert = &message->m_content.alert;
+    strcpy(alert->rule, rule->name);
+    alert->kind = kind_names[rule->kind];
+    alert->firing = match;
+    alert->addr = node->addr;
+    alert->sensor_prop_id = sensor_prop_id;
+    alert->value = value;
+    alert->taken = taken;
+    // latency of the alert since the mesh message
+    message->timestamp = from_reading ? taken : 0;
+
+    ESP_LOGW(TAG, "Rule %s %s on 0x%04x, value %d", rule->name, match ? "firing" : "resolved", node->addr, value);
+    pending[num_pending++] = message;
+}
+
+static bool applies(const rule_t *rule, uint16_t addr)
+{
+    return addr >= rule->addr_min && addr <= rule->addr_max;
+}
+
+// esp_timer time of the last message a missing rule looks at, 0 if none
+static int64_t last_message(const rule_t *rule, mesh_node_t *node)
+{
+    if(rule->sensor_prop_id == 0x0000)
+        return node->last_seen;
+
+    const node_property_t *property = node_registry_get_value(node, rule->sensor_prop_id);
+    return property != NULL ? property->timestamp : 0;
+}
+
+/**
+ * @brief Check a reading against the rules, alerting the changes. The
+ * registry has to be locked and the value not stored yet.
+ * @param node: node of the reading
+ * @param sensor_prop_id: property
+ * @param value: reading
+ * @param timestamp: esp_timer time it was received
+ */
+void rules_evaluate(mesh_node_t *node, uint16_t sensor_prop_id, int value, int64_t timestamp)
+{
+    if(num_rules == 0)
+        return;
+
+#if CONFIG_GATEWAY_METRICS
+    int64_t start = esp_timer_get_time();
+#endif
+    // the registry still has the previous reading
+    const node_property_t *previous = node_registry_get_value(node, sensor_prop_id);
+
+    while(xSemaphoreTake(xSem_rules, (TickType_t) 10) != pdTRUE);
+    for(int i = 0; i < num_rules; i++)
+    {
+        const rule_t *rule = &table[i];
+        if(!applies(rule, node->addr))
+            continue;
+
+        if(rule->kind == RULE_MISSING)
+        {
+            // any reading of the property ends it
+            if(rule->sensor_prop_id != 0x0000 && rule->sensor_prop_id != sensor_prop_id)
+                continue;
+            int64_t last = last_message(rule, node);
+            transition(i, node, rule->sensor_prop_id, false,
+                last == 0 ? 0 : (int) ((timestamp - last) / 1000000), timestamp, true);
+            continue;
+        }
+
+        if(rule->sensor_prop_id != sensor_prop_id)
+            continue;
+
+        // a firing rule has to go hysteresis back past its limit to resolve
+        bool firing = (node->rules_firing & (1u << i)) != 0;
+        int32_t back = firing ? rule->hysteresis : 0;
+        bool match;
+        if(rule->kind == RULE_ABOVE)
+        {
+            match = value > (int64_t) rule->limit - back;
+        }
+        else if(rule->kind == RULE_BELOW)
+        {
+            match = value < (int64_t) rule->limit + back;
+        }
+        else
+        {
+            // |change| / s > limit, without dividing
+            if(previous == NULL || timestamp <= previous->timestamp)
+                continue;
+            int64_t change = ((int64_t) value - previous->value) * 1000000;
+            match = llabs(change) > (int64_t) (rule->limit - back) * (timestamp - previous->timestamp);
+        }
+        transition(i, node, sensor_prop_id, match, value, timestamp, true);
+    }
+    xSemaphoreGive(xSem_rules);
+
+    METRICS_ADD_SINCE(STAGE_RULES, start);
+}
+
+static void check_node(mesh_node_t *node, void *arg)
+{
+    int64_t now = *(int64_t *) arg;
+
+    while(xSemaphoreTake(xSem_rules, (TickType_t) 10) != pdTRUE);
+    for(int i = 0; i < num_rules; i++)
+    {
+        const rule_t *rule = &table[i];
+        if(rule->kind != RULE_MISSING || !applies(rule, node->addr))
+            continue;
+
+        // a node or property never heard of is not missing
+        int64_t last = last_message(rule, node);
+        if(last == 0)
+            continue;
+
+        transition(i, node, rule->sensor_prop_id, now - last > (int64_t) rule->timeout_ms * 1000,
+            (int) ((now - last) / 1000000), now, false);
+    }
+    xSemaphoreGive(xSem_rules);
+}
+
+/**
+ * @brief Check the missing rules, at most every CONFIG_RULES_CHECK_MS
+ */
+void rules_check_missing()
+{
+    int64_t now = esp_timer_get_time();
+
+    if(num_rules == 0 || now - last_check < (int64_t) CONFIG_RULES_CHECK_MS * 1000)
+        return;
+    last_check = now;
+
+    node_registry_lock();
+    node_registry_foreach(check_node, &now);
+    node_registry_unlock();
+
+    rules_send_alerts();
+}
+
+/**
+ * @brief Queue the alerts of the last evaluations. The registry must not
+ * be locked, queueing may block.
+ */
+void rules_send_alerts()
+{
+    message_t *alerts[PENDING_ALERTS];
+    int n;
+
+    // only the task that evaluates the rules adds alerts
+    if(num_pending == 0)
+        return;
+
+    while(xSemaphoreTake(xSem_rules, (TickType_t) 10) != pdTRUE);
+    n = num_pending;
+    memcpy(alerts, pending, n * sizeof(message_t *));
+    num_pending = 0;
+    xSemaphoreGive(xSem_rules);
+
+    for(int i = 0; i < n; i++)
+        send_message_queue(alerts[i]);
+}
+
+#endif
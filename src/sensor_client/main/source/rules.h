@@ -0,0 +1,97 @@
+#ifndef _RULES_H_
+#define _RULES_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cJSON.h"
+
+#include "source/node_registry.h"
+#include "source/messages_parser.h"
+
+/*
+ * Alert rules evaluated on the gateway, so an alert does not wait for the
+ * readings to go through the broker, Telegraf and InfluxDB.
+ * They are loaded with {"cmd": "rules", "rules": [rule, ...]}:
+ *
+ *   {"name": "hot", "addr": "0005", "sensor_prop_id": "0056", "above": 300}
+ *   {"name": "cold", "addr": {"from": "0001", "to": "00FF"}, "sensor_prop_id": "0056", "below": 50}
+ *   {"name": "jump", "sensor_prop_id": "0056", "rate": 20}       change per second
+ *   {"name": "lost", "addr": "0005", "missing": 3, "period": 60} 3 periods of 60 s
+ *
+ * Without addr a rule applies to every node. A missing rule without
+ * sensor_prop_id looks at any message of the node.
+ * Above, below and rate rules also take:
+ *   "hysteresis": n  a firing rule resolves only n past the limit, back
+ *                    below above - n, above below + n or under rate - n
+ *   "for": n         readings in a row needed to fire or to resolve, 1 by default
+ *
+ *   {"name": "hot", "sensor_prop_id": "0056", "above": 300, "hysteresis": 20, "for": 3}
+ * The json is compiled into a table of rule_t, so a reading is checked with
+ * a loop of integer comparisons against the previous value kept by the
+ * node registry. A rule alerts when it starts matching a node ("firing")
+ * and when it stops ("resolved"), the state is a bit of the node entry.
+ * The alerts are queued by rules_send_alerts, once the registry is unlocked.
+ * The table is saved in NVS and loading a new one replaces it whole.
+ */
+#define RULES_MAX 32 // bits of mesh_node_t.rules_firing
+
+typedef enum {
+    RULE_ABOVE = 1,
+    RULE_BELOW,
+    RULE_RATE,
+    RULE_MISSING
+} rule_kind_t;
+
+/* compiled rule, an entry of the predicate table */
+typedef struct rule_t {
+    uint8_t kind;            // rule_kind_t
+    uint16_t addr_min;       // nodes it applies to
+    uint16_t addr_max;
+    uint16_t sensor_prop_id; // 0x0000 only for missing: any message
+    int32_t limit;           // above/below: value, rate: change per second, missing: periods
+    uint32_t timeout_ms;     // missing: time without readings
+    int32_t hysteresis;      // above/below/rate: distance past the limit to resolve
+    uint8_t debounce;        // above/below/rate: readings in a row to change state
+    char name[RULE_NAME_LEN + 1];
+} rule_t;
+
+/**
+ * @brief Restore the rules saved in NVS
+ */
+void init_rules();
+
+/**
+ * @brief Compile and save a new table of rules. If one of them is wrong
+ * an error is answered and the current table is kept.
+ * @param rules: json array of rules, empty to remove them all
+ */
+void rules_load(const cJSON *rules);
+
+/**
+ * @brief Queue STATS messages with the rules and the nodes they match
+ */
+void queue_rules_stats();
+
+/**
+ * @brief Check a reading against the rules, alerting the changes. The
+ * registry has to be locked and the value not stored yet.
+ * @param node: node of the reading
+ * @param sensor_prop_id: property
+ * @param value: reading
+ * @param timestamp: esp_timer time it was received
+ */
+void rules_evaluate(mesh_node_t *node, uint16_t sensor_prop_id, int value, int64_t timestamp);
+
+/**
+ * @brief Check the missing rules, at most every CONFIG_RULES_CHECK_MS
+ */
+void rules_check_missing();
+
+/**
+ * @brief Queue the alerts of the last evaluations. The registry must not
+ * be locked, queueing may block.
+ */
+void rules_send_alerts();
+
+#endif
@@ -2,6 +2,9 @@
 #include <string.h>
 
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #include "esp_ble_mesh_defs.h"
 #include "esp_ble_mesh_common_api.h"
@@ -12,6 +15,19 @@
 
 #include "ble_mesh_example_init.h"
 #include "source/messages_parser.h"
+#include "source/mesh_rx_ring.h"
+#include "source/histogram.h"
+#include "source/request_tracker.h"
+#include "source/node_registry.h"
+#include "source/descriptor_cache.h"
+#include "source/gateway_storage.h"
+#include "source/task_placement.h"
+#include "source/metrics.h"
+#include "source/request_ids.h"
+#include "source/profiler.h"
+#include "source/data_format.h"
+#include "source/tasks_manager.h"
+#include "source/rules.h"
 
 /*
 FLUJO:
@@ -46,11 +62,18 @@ static const char* TAG = "SensorClient";
 
 #define CID_ESP             0x02E5
 
-#define MSG_SEND_TTL        3
 #define MSG_SEND_REL        false
-#define MSG_TIMEOUT         0
 #define MSG_ROLE            ROLE_NODE
 
+// callback duration in microseconds
+static histogram_t cb_duration;
+
+// one-time GET_STATUS and GET_DESCRIPTOR served from the node registry
+static uint32_t cache_hits;
+static uint32_t cache_misses;
+static uint32_t descriptor_hits;
+static uint32_t descriptor_misses;
+
 static uint8_t dev_uuid[ESP_BLE_MESH_OCTET16_LEN] = { 0x00, 0x11 };
 
 static struct esp_ble_mesh_key {
@@ -59,6 +82,9 @@ static struct esp_ble_mesh_key {
     uint8_t  app_key[ESP_BLE_MESH_OCTET16_LEN];
 } prov_key;
 
+// key indexes are saved here so the gateway keeps polling after a reboot
+#define PROV_KEY_NAMESPACE "mesh"
+
 static esp_ble_mesh_cfg_srv_t config_server = {
     .beacon = ESP_BLE_MESH_BEACON_DISABLED,
 #if defined(CONFIG_BLE_MESH_FRIEND)
@@ -96,24 +122,80 @@ static esp_ble_mesh_prov_t provision = {
 };
 
 static void ble_mesh_set_msg_common(esp_ble_mesh_client_common_param_t *common,
-                                esp_ble_mesh_model_t *model, uint32_t opcode, uint16_t addr)
+                                esp_ble_mesh_model_t *model, uint32_t opcode, uint16_t addr,
+                                int32_t timeout, uint8_t ttl)
 {
     common->opcode = opcode;
     common->model = model;
     common->ctx.net_idx = prov_key.net_idx;
     common->ctx.app_idx = prov_key.app_idx;
     common->ctx.addr = addr;
-    common->ctx.send_ttl = MSG_SEND_TTL;
+    common->ctx.send_ttl = ttl;
     common->ctx.send_rel = MSG_SEND_REL;
-    common->msg_timeout = MSG_TIMEOUT;
+    common->msg_timeout = timeout;
     common->msg_role = MSG_ROLE;
 }
 
+/**
+ * @brief Save the key indexes. The BLE Mesh stack keeps the keys themselves
+ * (CONFIG_BLE_MESH_SETTINGS) but the indexes are only known from the callbacks.
+ */
+static void save_prov_key()
+{
+    nvs_handle_t handle;
+
+    if(gateway_storage_open(PROV_KEY_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Cannot save key indexes");
+        return;
+    }
+
+    nvs_set_u16(handle, "net_idx", prov_key.net_idx);
+    nvs_set_u16(handle, "app_idx", prov_key.app_idx);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+/**
+ * @brief Restore the key indexes saved before the reboot
+ */
+static void restore_prov_key()
+{
+    nvs_handle_t handle;
+
+    if(gateway_storage_open(PROV_KEY_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+        return;
+
+    if(nvs_get_u16(handle, "net_idx", &prov_key.net_idx) == ESP_OK
+       && nvs_get_u16(handle, "app_idx", &prov_key.app_idx) == ESP_OK)
+    {
+        ESP_LOGI(TAG, "Key indexes restored, net_idx 0x%04x, app_idx 0x%04x", prov_key.net_idx, prov_key.app_idx);
+    }
+    nvs_close(handle);
+}
+
+/**
+ * @brief Forget the key indexes when the node is reset
+ */
+static void erase_prov_key()
+{
+    nvs_handle_t handle;
+
+    memset(&prov_key, 0, sizeof(prov_key));
+    if(gateway_storage_open(PROV_KEY_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK)
+    {
+        nvs_erase_all(handle);
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+}
+
 static void prov_complete(uint16_t net_idx, uint16_t addr, uint8_t flags, uint32_t iv_index)
 {
     ESP_LOGI(TAG, "net_idx: 0x%04x, addr: 0x%04x", net_idx, addr);
     ESP_LOGI(TAG, "flags: 0x%02x, iv_index: 0x%08x", flags, iv_index);
     prov_key.net_idx = net_idx;
+    save_prov_key();
 }
 
 static void ble_mesh_provisioning_cb(esp_ble_mesh_prov_cb_event_t event,
@@ -140,6 +222,10 @@ static void ble_mesh_provisioning_cb(esp_ble_mesh_prov_cb_event_t event,
                 param->node_prov_complete.flags, param->node_prov_complete.iv_index);
             break;
         case ESP_BLE_MESH_NODE_PROV_RESET_EVT:
+            ESP_LOGI(TAG, "ESP_BLE_MESH_NODE_PROV_RESET_EVT");
+            // addresses will be assigned again
+            descriptor_cache_invalidate(0x0000);
+            erase_prov_key();
             break;
         case ESP_BLE_MESH_NODE_SET_UNPROV_DEV_NAME_COMP_EVT:
             ESP_LOGI(TAG, "ESP_BLE_MESH_NODE_SET_UNPROV_DEV_NAME_COMP_EVT, err_code %d", param->node_set_unprov_dev_name_comp.err_code);
@@ -149,16 +235,24 @@ static void ble_mesh_provisioning_cb(esp_ble_mesh_prov_cb_event_t event,
     }
 }
 
-void ble_mesh_send_sensor_message(uint32_t opcode, uint16_t addr, uint16_t sensor_prop_id)
+/**
+ * @brief Send a get state message. Called by the request tracker once
+ * there is nothing else in flight to the destination.
+ */
+static esp_err_t ble_mesh_send_get_state(const mesh_request_t *request)
 {
+    uint32_t opcode = request->opcode;
+    uint16_t addr = request->addr;
+    uint16_t sensor_prop_id = request->sensor_prop_id;
 
-    ESP_LOGI(TAG, "ble_mesh_send_sensor_message: 0x%04x. Addr = 0x%04x", opcode, addr);
+    ESP_LOGI(TAG, "ble_mesh_send_get_state: 0x%04x. Addr = 0x%04x, timeout %u ms, ttl %d, attempt %d",
+        opcode, addr, request->timeout, request->ttl, request->attempt);
 
     esp_ble_mesh_sensor_client_get_state_t get = {0};
     esp_ble_mesh_client_common_param_t common = {0};
     esp_err_t err = ESP_OK;
 
-    ble_mesh_set_msg_common(&common, sensor_client.model, opcode, addr);
+    ble_mesh_set_msg_common(&common, sensor_client.model, opcode, addr, request->timeout, request->ttl);
     switch (opcode) {
     case ESP_BLE_MESH_MODEL_OP_SENSOR_GET:
         if(sensor_prop_id != 0x0000)
@@ -191,17 +285,97 @@ void ble_mesh_send_sensor_message(uint32_t opcode, uint16_t addr, uint16_t senso
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to send sensor message 0x%04x", opcode);
     }
+    return err;
 }
 
-static void publish_measure(esp_ble_mesh_sensor_client_cb_param_t *param)
+tracker_status_t ble_mesh_send_sensor_message(uint32_t opcode, uint16_t addr, uint16_t sensor_prop_id)
 {
-    ESP_LOGI(TAG, "Sensor Status, opcode 0x%04x", param->params->ctx.recv_op);
+    tracker_status_t status = request_tracker_submit(opcode, addr, sensor_prop_id);
+    ESP_LOGI(TAG, "ble_mesh_send_sensor_message: 0x%04x. Addr = 0x%04x, status %d", opcode, addr, status);
+    return status;
+}
 
-    if (param->status_cb.sensor_status.marshalled_sensor_data->len)
+bool ble_mesh_get_cached_status(uint16_t addr, uint16_t sensor_prop_id, uint32_t max_age)
+{
+    node_property_t values[NODE_REGISTRY_PROPERTIES];
+    int num_values = 0;
+    bool fresh = true;
+    int64_t oldest = esp_timer_get_time() - (int64_t) max_age * 1000;
+
+    node_registry_lock();
+    mesh_node_t *node = node_registry_find(addr);
+    if(node != NULL)
     {
-        ESP_LOG_BUFFER_HEX("Sensor Data", param->status_cb.sensor_status.marshalled_sensor_data->data,
-            param->status_cb.sensor_status.marshalled_sensor_data->len);
-        uint8_t *data = param->status_cb.sensor_status.marshalled_sensor_data->data;
+        for(int i = 0; i < NODE_REGISTRY_PROPERTIES; i++)
+        {
+            const node_property_t *property = &node->properties[i];
+            if(property->sensor_prop_id == 0x0000)
+                continue;
+            // 0x0000 asks for every property, all of them have to be fresh
+            if(sensor_prop_id != 0x0000 && property->sensor_prop_id != sensor_prop_id)
+                continue;
+
+            if(property->timestamp < oldest)
+                fresh = false;
+            values[num_values++] = *property;
+        }
+
+        // the descriptors tell which properties the node has, without all
+        // of them the cached ones may be only a part of the status
+        if(sensor_prop_id == 0x0000 && !node->descriptors_complete)
+            fresh = false;
+        for(int i = 0; sensor_prop_id == 0x0000 && node->descriptors_complete && i < node->num_descriptors; i++)
+        {
+            uint16_t prop_id = node->descriptors[i][0] | (node->descriptors[i][1] << 8);
+            if(node_registry_get_value(node, prop_id) == NULL)
+                fresh = false;
+        }
+    }
+    node_registry_unlock();
+
+    if(num_values == 0 || !fresh)
+    {
+        cache_misses++;
+        return false;
+    }
+
+    cache_hits++;
+    for(int i = 0; i < num_values; i++)
+    {
+        message_t* message = create_message(GET_STATUS);
+        add_measure_to_message(message, addr, values[i].sensor_prop_id, values[i].value);
+        message->m_content.measure.taken = values[i].timestamp;
+        send_message_queue(message);
+    }
+    return true;
+}
+
+bool ble_mesh_get_cached_descriptor(uint16_t addr, uint16_t sensor_prop_id)
+{
+    uint8_t data[NODE_REGISTRY_PROPERTIES * NODE_DESCRIPTOR_LEN];
+    uint16_t len = descriptor_cache_get(addr, sensor_prop_id, data);
+
+    if(len == 0)
+    {
+        descriptor_misses++;
+        return false;
+    }
+
+    descriptor_hits++;
+    message_t* message = create_message(GET_DESCRIPTOR);
+    add_hex_buffer(message, data, len);
+    send_message_queue(message);
+    return true;
+}
+
+static void publish_measure(const mesh_rx_t *rx)
+{
+    ESP_LOGI(TAG, "Sensor Status, opcode 0x%04x", rx->recv_op);
+
+    if (rx->len)
+    {
+        ESP_LOG_BUFFER_HEX("Sensor Data", rx->data, rx->len);
+        const uint8_t *data = rx->data;
         uint16_t length = 0;
 
         if(data[0] == 0xFF) // prop id doesnt exists. Error.
@@ -209,14 +383,22 @@ static void publish_measure(esp_ble_mesh_sensor_client_cb_param_t *param)
             uint8_t fmt      = ESP_BLE_MESH_GET_SENSOR_DATA_FORMAT(data);
             uint16_t prop_id = ESP_BLE_MESH_GET_SENSOR_DATA_PROPERTY_ID(data, fmt);
 
+            node_registry_lock();
+            mesh_node_t *node = node_registry_find(rx->addr);
+            if(node != NULL)
+                node->errors++;
+            node_registry_unlock();
+
+            descriptor_cache_remove(rx->addr, prop_id);
+
             message_t* message = create_message(PLAIN_TEXT);
-            add_message_text_plain(message, true, "Sensor prop id 0x%04x doesnt exists in sensor addr 0x%04x", prop_id, param->params->ctx.addr);
+            add_message_text_plain(message, true, "Sensor prop id 0x%04x doesnt exists in sensor addr 0x%04x", prop_id, rx->addr);
             send_message_queue(message);
 
         }
         else
         {
-            for (; length < param->status_cb.sensor_status.marshalled_sensor_data->len; )
+            for (; length < rx->len; )
             {
                 uint8_t fmt      = ESP_BLE_MESH_GET_SENSOR_DATA_FORMAT(data);
                 uint8_t data_len = ESP_BLE_MESH_GET_SENSOR_DATA_LENGTH(data, fmt);
@@ -229,13 +411,49 @@ static void publish_measure(esp_ble_mesh_sensor_client_cb_param_t *param)
 
                 if (data_len != ESP_BLE_MESH_SENSOR_DATA_ZERO_LEN)
                 {
+                    // the record could have been truncated
+                    if(length + mpid_len + data_len + 1 > rx->len)
+                    {
+                        ESP_LOGE(TAG, "Sensor data truncated, addr 0x%04x", rx->addr);
+                        break;
+                    }
+
                     ESP_LOG_BUFFER_HEX("Sensor Data", data + mpid_len, data_len + 1);
 
-                    int measure = *(data + mpid_len);
+                    if(prop_id == SENSOR_PROPERTY_PROFILE)
+                    {
+                        // profile of the node, not a measure
+                        message_t* message = create_message(PROFILE);
+                        add_hex_buffer(message, (uint8_t *) data + mpid_len, data_len + 1);
+                        message->m_content.hex_buffer.addr = rx->addr;
+                        send_message_queue(message);
+
+                        length += mpid_len + data_len + 1;
+                        data += mpid_len + data_len + 1;
+                        continue;
+                    }
+
+                    int measure = sensor_raw_to_int(prop_id, data + mpid_len, data_len + 1);
                     ESP_LOGW(TAG, "Measure %d", measure);
 
+                    node_registry_lock();
+                    mesh_node_t *node = node_registry_get(rx->addr);
+                    if(node != NULL)
+                    {
+#if CONFIG_GATEWAY_RULES
+                        rules_evaluate(node, prop_id, measure, rx->timestamp);
+#endif
+                        node_registry_set_value(node, prop_id, measure, rx->timestamp);
+                    }
+                    node_registry_unlock();
+#if CONFIG_GATEWAY_RULES
+                    rules_send_alerts();
+#endif
+
                     message_t* message = create_message(GET_STATUS);
-                    add_measure_to_message(message, param->params->ctx.addr, prop_id, measure);
+                    message->timestamp = rx->timestamp;
+                    add_measure_to_message(message, rx->addr, prop_id, measure);
+                    message->m_content.measure.taken = rx->timestamp;
                     send_message_queue(message);
 
                     length += mpid_len + data_len + 1;
@@ -251,137 +469,199 @@ static void publish_measure(esp_ble_mesh_sensor_client_cb_param_t *param)
     }
 }
 
-static void ble_mesh_sensor_client_cb(esp_ble_mesh_sensor_client_cb_event_t event,
-                                              esp_ble_mesh_sensor_client_cb_param_t *param)
+/**
+ * @brief Queue a message with the raw content of a status message
+ */
+static void publish_hex_buffer(const mesh_rx_t *rx)
 {
+    message_t* messages = create_message(HEX_BUFFER);
+    add_hex_buffer(messages, (uint8_t *) rx->data, rx->len);
+    send_message_queue(messages);
+}
 
-    ESP_LOGI(TAG, "ble_mesh_sensor_client_cb");
-    ESP_LOGI(TAG, "Sensor client, event %u, addr 0x%04x", event, param->params->ctx.addr);
+/**
+ * @brief Keep the descriptors in the cache. The reply to a request for every
+ * property replaces the descriptors known of the node.
+ */
+static void cache_descriptor(const mesh_rx_t *rx, const mesh_request_t *request)
+{
+    if(rx->len % ESP_BLE_MESH_SENSOR_DESCRIPTOR_LEN == 0)
+    {
+        bool complete = request->opcode == ESP_BLE_MESH_MODEL_OP_SENSOR_DESCRIPTOR_GET
+                        && request->sensor_prop_id == 0x0000 && rx->len == rx->orig_len;
+        descriptor_cache_store(rx->addr, rx->data, rx->len, complete);
+    }
+    else if(rx->len == ESP_BLE_MESH_SENSOR_PROPERTY_ID_LEN)
+    {
+        // only the property id is returned when the node does not have it
+        descriptor_cache_remove(rx->addr, rx->data[0] | (rx->data[1] << 8));
+    }
+}
 
-    if (param->error_code) {
-        ESP_LOGE(TAG, "Send sensor client message failed (err %d)", param->error_code);
+/**
+ * @brief Queue a GET_DESCRIPTOR message if the descriptors are well formed
+ */
+static void publish_descriptor(const mesh_rx_t *rx, bool valid)
+{
+    message_t* messages = NULL;
+
+    if(valid)
+    {
+        ESP_LOG_BUFFER_HEX("Sensor Descriptor", rx->data, rx->len);
+
+        messages = create_message(GET_DESCRIPTOR);
+        add_hex_buffer(messages, (uint8_t *) rx->data, rx->len);
+        send_message_queue(messages);
+    }
+    else
+    {
+        messages = create_message(PLAIN_TEXT);
+        add_message_text_plain(messages, true, "Incorrect sensor prop id for device 0x%04x", rx->addr);
+        send_message_queue(messages);
+    }
+}
+
+/**
+ * @brief Decode a message copied by ble_mesh_sensor_client_cb.
+ * It runs in task_decode_mesh so it can take its time.
+ */
+static void decode_mesh_rx(const mesh_rx_t *rx)
+{
+    ESP_LOGI(TAG, "Sensor client, event %u, addr 0x%04x, rssi %d, ttl %d",
+        rx->event, rx->addr, rx->rssi, rx->ttl);
+
+    mesh_request_t request;
+    memset(&request, 0, sizeof(mesh_request_t));
+
+    // Let the next request to this node go before decoding
+    if (rx->event == ESP_BLE_MESH_SENSOR_CLIENT_GET_STATE_EVT || rx->event == ESP_BLE_MESH_SENSOR_CLIENT_TIMEOUT_EVT) {
+        tracker_reply_t reply = REPLY_OK;
+        if (rx->event == ESP_BLE_MESH_SENSOR_CLIENT_TIMEOUT_EVT)
+            reply = REPLY_TIMEOUT;
+        else if (rx->error_code)
+            reply = REPLY_ERROR;
+        bool failed = reply != REPLY_OK;
+        bool gave_up = false;
+
+        int32_t rtt = request_tracker_complete(rx->addr, rx->opcode, rx->timestamp, reply, &request, &gave_up);
+        ESP_LOGI(TAG, "Request 0x%04x to 0x%04x done, rtt %d ms", rx->opcode, rx->addr, rtt);
+        if (rtt >= 0) {
+            METRICS_ADD(STAGE_MESH_RTT, (int64_t) rtt * 1000);
+            tasks_manager_account(rx->addr, request.opcode, request.sensor_prop_id, !failed, (uint32_t) rtt);
+            // answers to a one-time request echo its request_id, see request_ids.h
+            request_ids_begin_reply(rx->addr, request.opcode);
+        }
+
+        // the cli only hears of a request once it is not retried any more
+        if (gave_up) {
+            message_t* messages = create_message(PLAIN_TEXT);
+            add_message_text_plain(messages, true, "%s: opcode 0x%04x, destination 0x%04x, %d attempts",
+                reply == REPLY_TIMEOUT ? "Timeout" : "Error", rx->opcode, rx->addr, request.attempt + 1);
+            send_message_queue(messages);
+        }
+    }
+
+    if (rx->error_code) {
+        ESP_LOGE(TAG, "Send sensor client message failed (err %d)", rx->error_code);
+        node_registry_lock();
+        mesh_node_t *node = node_registry_find(rx->addr);
+        if (node != NULL)
+            node->errors++;
+        node_registry_unlock();
         return;
     }
 
-    message_t* messages = NULL; // Variable to store received info
+    // Node status and how far it is from the ttl of its message
+    if (rx->event != ESP_BLE_MESH_SENSOR_CLIENT_TIMEOUT_EVT) {
+        node_registry_lock();
+        mesh_node_t *node = node_registry_get(rx->addr);
+        if (node != NULL) {
+            node_registry_seen(node, rx->timestamp, rx->rssi);
+            node_link_ttl_sample(node, rx->ttl);
+        }
+        node_registry_unlock();
+    }
 
-    switch (event) {
+    if (rx->orig_len != rx->len) {
+        ESP_LOGW(TAG, "Status from 0x%04x truncated %d -> %d bytes", rx->addr, rx->orig_len, rx->len);
+    }
+
+    switch (rx->event) {
     case ESP_BLE_MESH_SENSOR_CLIENT_GET_STATE_EVT:
-        switch (param->params->opcode) {
+        switch (rx->opcode) {
         case ESP_BLE_MESH_MODEL_OP_SENSOR_DESCRIPTOR_GET:
-            ESP_LOGI(TAG, "Sensor Descriptor Status, opcode 0x%04x", param->params->ctx.recv_op);
-            if (param->status_cb.descriptor_status.descriptor->len != ESP_BLE_MESH_SENSOR_SETTING_PROPERTY_ID_LEN &&
-                param->status_cb.descriptor_status.descriptor->len % ESP_BLE_MESH_SENSOR_DESCRIPTOR_LEN) {
-                ESP_LOGE(TAG, "Invalid Sensor Descriptor Status length %d", param->status_cb.descriptor_status.descriptor->len);
+            ESP_LOGI(TAG, "Sensor Descriptor Status, opcode 0x%04x", rx->recv_op);
+            if (rx->orig_len != ESP_BLE_MESH_SENSOR_SETTING_PROPERTY_ID_LEN &&
+                rx->orig_len % ESP_BLE_MESH_SENSOR_DESCRIPTOR_LEN) {
+                ESP_LOGE(TAG, "Invalid Sensor Descriptor Status length %d", rx->orig_len);
                 return;
             }
 
-            if (param->status_cb.descriptor_status.descriptor->len)
+            if (rx->len)
             {
-                if(param->status_cb.descriptor_status.descriptor->len % 8 == 0)
-                {
-                    ESP_LOG_BUFFER_HEX("Sensor Descriptor", param->status_cb.descriptor_status.descriptor->data,
-                    param->status_cb.descriptor_status.descriptor->len);
-
-                    messages = create_message(GET_DESCRIPTOR);
-                    add_hex_buffer(messages,
-                            param->status_cb.descriptor_status.descriptor->data,
-                            param->status_cb.descriptor_status.descriptor->len
-                    );
-                    send_message_queue(messages);
-                }
-                else
-                {
-                    messages = create_message(PLAIN_TEXT);
-                    add_message_text_plain(messages, true, "Incorrect sensor prop id for device 0x%04x", param->params->ctx.addr);
-                    send_message_queue(messages);
-                }
-
+                cache_descriptor(rx, &request);
+                publish_descriptor(rx, rx->len % 8 == 0);
             }
             break;
         case ESP_BLE_MESH_MODEL_OP_SENSOR_CADENCE_GET:
             ESP_LOGI(TAG, "Sensor Cadence Status, opcode 0x%04x, Sensor Property ID 0x%04x",
-                param->params->ctx.recv_op, param->status_cb.cadence_status.property_id);
-            ESP_LOG_BUFFER_HEX("Sensor Cadence", param->status_cb.cadence_status.sensor_cadence_value->data,
-                param->status_cb.cadence_status.sensor_cadence_value->len);
-
-                messages = create_message(HEX_BUFFER);
-                add_hex_buffer(messages,
-                        param->status_cb.cadence_status.sensor_cadence_value->data,
-                        param->status_cb.cadence_status.sensor_cadence_value->len
-                );
-                send_message_queue(messages);
+                rx->recv_op, rx->property_id);
+            ESP_LOG_BUFFER_HEX("Sensor Cadence", rx->data, rx->len);
+
+            publish_hex_buffer(rx);
             break;
         case ESP_BLE_MESH_MODEL_OP_SENSOR_SETTINGS_GET:
             ESP_LOGI(TAG, "Sensor Settings Status, opcode 0x%04x, Sensor Property ID 0x%04x",
-                param->params->ctx.recv_op, param->status_cb.settings_status.sensor_property_id);
-            ESP_LOG_BUFFER_HEX("Sensor Settings", param->status_cb.settings_status.sensor_setting_property_ids->data,
-                param->status_cb.settings_status.sensor_setting_property_ids->len);
-
-                messages = create_message(HEX_BUFFER);
-                add_hex_buffer(messages,
-                        param->status_cb.settings_status.sensor_setting_property_ids->data,
-                        param->status_cb.settings_status.sensor_setting_property_ids->len
-                );
-                send_message_queue(messages);
+                rx->recv_op, rx->property_id);
+            ESP_LOG_BUFFER_HEX("Sensor Settings", rx->data, rx->len);
+
+            publish_hex_buffer(rx);
             break;
         case ESP_BLE_MESH_MODEL_OP_SENSOR_SETTING_GET:
             ESP_LOGI(TAG, "Sensor Setting Status, opcode 0x%04x, Sensor Property ID 0x%04x, Sensor Setting Property ID 0x%04x",
-                param->params->ctx.recv_op, param->status_cb.setting_status.sensor_property_id,
-                param->status_cb.setting_status.sensor_setting_property_id);
-            if (param->status_cb.setting_status.op_en) {
-                ESP_LOGI(TAG, "Sensor Setting Access 0x%02x", param->status_cb.setting_status.sensor_setting_access);
-                ESP_LOG_BUFFER_HEX("Sensor Setting Raw", param->status_cb.setting_status.sensor_setting_raw->data,
-                    param->status_cb.setting_status.sensor_setting_raw->len);
-
-                messages = create_message(HEX_BUFFER);
-                add_hex_buffer(messages,
-                        param->status_cb.setting_status.sensor_setting_raw->data,
-                        param->status_cb.setting_status.sensor_setting_raw->len
-                );
-                send_message_queue(messages);
+                rx->recv_op, rx->property_id, rx->setting_property_id);
+            if (rx->op_en) {
+                ESP_LOGI(TAG, "Sensor Setting Access 0x%02x", rx->setting_access);
+                ESP_LOG_BUFFER_HEX("Sensor Setting Raw", rx->data, rx->len);
+
+                publish_hex_buffer(rx);
             }
             break;
         case ESP_BLE_MESH_MODEL_OP_SENSOR_GET: /* Read temperature */
-                publish_measure(param);
+                publish_measure(rx);
             break;
         case ESP_BLE_MESH_MODEL_OP_SENSOR_COLUMN_GET:
             ESP_LOGI(TAG, "Sensor Column Status, opcode 0x%04x, Sensor Property ID 0x%04x",
-                param->params->ctx.recv_op, param->status_cb.column_status.property_id);
-            ESP_LOG_BUFFER_HEX("Sensor Column", param->status_cb.column_status.sensor_column_value->data,
-                param->status_cb.column_status.sensor_column_value->len);
+                rx->recv_op, rx->property_id);
+            ESP_LOG_BUFFER_HEX("Sensor Column", rx->data, rx->len);
             break;
         case ESP_BLE_MESH_MODEL_OP_SENSOR_SERIES_GET:
             ESP_LOGI(TAG, "Sensor Series Status, opcode 0x%04x, Sensor Property ID 0x%04x",
-                param->params->ctx.recv_op, param->status_cb.series_status.property_id);
-            ESP_LOG_BUFFER_HEX("Sensor Series", param->status_cb.series_status.sensor_series_value->data,
-                param->status_cb.series_status.sensor_series_value->len);
+                rx->recv_op, rx->property_id);
+            ESP_LOG_BUFFER_HEX("Sensor Series", rx->data, rx->len);
             break;
         default:
-            ESP_LOGE(TAG, "Unknown Sensor Get opcode 0x%04x", param->params->ctx.recv_op);
+            ESP_LOGE(TAG, "Unknown Sensor Get opcode 0x%04x", rx->recv_op);
             break;
         }
         break;
     case ESP_BLE_MESH_SENSOR_CLIENT_SET_STATE_EVT:
-        switch (param->params->opcode) {
+        switch (rx->opcode) {
         case ESP_BLE_MESH_MODEL_OP_SENSOR_CADENCE_SET:
             ESP_LOGI(TAG, "Sensor Cadence Status, opcode 0x%04x, Sensor Property ID 0x%04x",
-                param->params->ctx.recv_op, param->status_cb.cadence_status.property_id);
-            ESP_LOG_BUFFER_HEX("Sensor Cadence", param->status_cb.cadence_status.sensor_cadence_value->data,
-                param->status_cb.cadence_status.sensor_cadence_value->len);
+                rx->recv_op, rx->property_id);
+            ESP_LOG_BUFFER_HEX("Sensor Cadence", rx->data, rx->len);
             break;
         case ESP_BLE_MESH_MODEL_OP_SENSOR_SETTING_SET:
             ESP_LOGI(TAG, "Sensor Setting Status, opcode 0x%04x, Sensor Property ID 0x%04x, Sensor Setting Property ID 0x%04x",
-                param->params->ctx.recv_op, param->status_cb.setting_status.sensor_property_id,
-                param->status_cb.setting_status.sensor_setting_property_id);
-            if (param->status_cb.setting_status.op_en) {
-                ESP_LOGI(TAG, "Sensor Setting Access 0x%02x", param->status_cb.setting_status.sensor_setting_access);
-                ESP_LOG_BUFFER_HEX("Sensor Setting Raw", param->status_cb.setting_status.sensor_setting_raw->data,
-                    param->status_cb.setting_status.sensor_setting_raw->len);
+                rx->recv_op, rx->property_id, rx->setting_property_id);
+            if (rx->op_en) {
+                ESP_LOGI(TAG, "Sensor Setting Access 0x%02x", rx->setting_access);
+                ESP_LOG_BUFFER_HEX("Sensor Setting Raw", rx->data, rx->len);
             }
             break;
         default:
-            ESP_LOGE(TAG, "Unknown Sensor Set opcode 0x%04x", param->params->ctx.recv_op);
+            ESP_LOGE(TAG, "Unknown Sensor Set opcode 0x%04x", rx->recv_op);
             break;
         }
         break;
@@ -391,48 +671,175 @@ static void ble_mesh_sensor_client_cb(esp_ble_mesh_sensor_client_cb_event_t even
         este evento.
     */
     case ESP_BLE_MESH_SENSOR_CLIENT_PUBLISH_EVT:
-        ESP_LOGI(TAG, "Receive message from group. opcode 0x%04x", param->params->opcode);
-        switch(param->params->opcode)
+        ESP_LOGI(TAG, "Receive message from group. opcode 0x%04x", rx->opcode);
+        switch(rx->opcode)
         {
             case ESP_BLE_MESH_MODEL_OP_SENSOR_STATUS:
-                publish_measure(param);
+                publish_measure(rx);
                 break;
             case ESP_BLE_MESH_MODEL_OP_SENSOR_DESCRIPTOR_GET:
-                if(param->status_cb.descriptor_status.descriptor->len == 8)
-                {
-                    ESP_LOG_BUFFER_HEX("Sensor Descriptor", param->status_cb.descriptor_status.descriptor->data,
-                    param->status_cb.descriptor_status.descriptor->len);
-
-                    messages = create_message(GET_DESCRIPTOR);
-                    add_hex_buffer(messages,
-                            param->status_cb.descriptor_status.descriptor->data,
-                            param->status_cb.descriptor_status.descriptor->len
-                    );
-                    send_message_queue(messages);
-                }
-                else
-                {
-                    messages = create_message(PLAIN_TEXT);
-                    add_message_text_plain(messages, true, "Incorrect sensor prop id for device 0x%04x", param->params->ctx.addr);
-                    send_message_queue(messages);
-                }
+                publish_descriptor(rx, rx->len == 8);
                 break;
         }
         break;
     case ESP_BLE_MESH_SENSOR_CLIENT_TIMEOUT_EVT:
-        ESP_LOGI(TAG, "Timeout: opcode 0x%04x, destination 0x%04x", param->params->opcode, param->params->ctx.addr);
-
-        messages = create_message(PLAIN_TEXT);
-        add_message_text_plain(messages, true,
-            "Timeout: opcode 0x%04x, destination 0x%04x",
-            param->params->opcode, param->params->ctx.addr
-        );
-        send_message_queue(messages);
+        // answered to the cli above if it is not retried
+        ESP_LOGI(TAG, "Timeout: opcode 0x%04x, destination 0x%04x", rx->opcode, rx->addr);
+        break;
     default:
         break;
     }
 }
 
+/**
+ * @brief Task: decode the messages stored by ble_mesh_sensor_client_cb
+ */
+static void task_decode_mesh(void *params)
+{
+    mesh_rx_t *rx = NULL;
+
+    for(;;)
+    {
+#if CONFIG_GATEWAY_RULES
+        // wake up to check the missing rules even if nothing arrives
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_RULES_CHECK_MS));
+#else
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#endif
+        while((rx = mesh_rx_ring_peek()) != NULL)
+        {
+            decode_mesh_rx(rx);
+            request_ids_end();
+            mesh_rx_ring_release();
+        }
+#if CONFIG_GATEWAY_RULES
+        rules_check_missing();
+#endif
+    }
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Return the buffer that carries the status payload and fill
+ * the status specific fields of rx.
+ */
+static struct net_buf_simple* status_buffer(esp_ble_mesh_sensor_client_cb_event_t event,
+                                            esp_ble_mesh_sensor_client_cb_param_t *param, mesh_rx_t *rx)
+{
+    esp_ble_mesh_sensor_client_status_cb_t *status = &param->status_cb;
+
+    if (event == ESP_BLE_MESH_SENSOR_CLIENT_TIMEOUT_EVT || param->error_code)
+        return NULL;
+
+    if (event == ESP_BLE_MESH_SENSOR_CLIENT_PUBLISH_EVT) {
+        if (param->params->opcode == ESP_BLE_MESH_MODEL_OP_SENSOR_STATUS)
+            return status->sensor_status.marshalled_sensor_data;
+        if (param->params->opcode == ESP_BLE_MESH_MODEL_OP_SENSOR_DESCRIPTOR_GET)
+            return status->descriptor_status.descriptor;
+        return NULL;
+    }
+
+    switch (param->params->opcode) {
+    case ESP_BLE_MESH_MODEL_OP_SENSOR_DESCRIPTOR_GET:
+        return status->descriptor_status.descriptor;
+    case ESP_BLE_MESH_MODEL_OP_SENSOR_GET:
+        return status->sensor_status.marshalled_sensor_data;
+    case ESP_BLE_MESH_MODEL_OP_SENSOR_CADENCE_GET:
+    case ESP_BLE_MESH_MODEL_OP_SENSOR_CADENCE_SET:
+        rx->property_id = status->cadence_status.property_id;
+        return status->cadence_status.sensor_cadence_value;
+    case ESP_BLE_MESH_MODEL_OP_SENSOR_SETTINGS_GET:
+        rx->property_id = status->settings_status.sensor_property_id;
+        return status->settings_status.sensor_setting_property_ids;
+    case ESP_BLE_MESH_MODEL_OP_SENSOR_SETTING_GET:
+    case ESP_BLE_MESH_MODEL_OP_SENSOR_SETTING_SET:
+        rx->property_id = status->setting_status.sensor_property_id;
+        rx->setting_property_id = status->setting_status.sensor_setting_property_id;
+        rx->op_en = status->setting_status.op_en;
+        rx->setting_access = status->setting_status.sensor_setting_access;
+        return rx->op_en ? status->setting_status.sensor_setting_raw : NULL;
+    case ESP_BLE_MESH_MODEL_OP_SENSOR_COLUMN_GET:
+        rx->property_id = status->column_status.property_id;
+        return status->column_status.sensor_column_value;
+    case ESP_BLE_MESH_MODEL_OP_SENSOR_SERIES_GET:
+        rx->property_id = status->series_status.property_id;
+        return status->series_status.sensor_series_value;
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * This callback runs in the BLE Mesh stack task. A slow callback delays the
+ * stack, so it only copies the message into the rx ring. Decoding, json and
+ * logging are done in task_decode_mesh.
+ */
+static void ble_mesh_sensor_client_cb(esp_ble_mesh_sensor_client_cb_event_t event,
+                                              esp_ble_mesh_sensor_client_cb_param_t *param)
+{
+    int64_t start = esp_timer_get_time();
+
+    mesh_rx_t *rx = mesh_rx_ring_reserve();
+    if (rx != NULL) {
+        rx->timestamp   = start;
+        rx->event       = event;
+        rx->opcode      = param->params->opcode;
+        rx->recv_op     = param->params->ctx.recv_op;
+        rx->addr        = param->params->ctx.addr;
+        rx->rssi        = param->params->ctx.recv_rssi;
+        rx->ttl         = param->params->ctx.recv_ttl;
+        rx->error_code  = param->error_code;
+        rx->property_id = 0x0000;
+        rx->setting_property_id = 0x0000;
+        rx->op_en       = false;
+        rx->setting_access = 0;
+        rx->len         = 0;
+        rx->orig_len    = 0;
+
+        struct net_buf_simple *buf = status_buffer(event, param, rx);
+        if (buf != NULL) {
+            rx->orig_len = buf->len;
+            rx->len = buf->len > MESH_RX_PDU_SIZE ? MESH_RX_PDU_SIZE : buf->len;
+            memcpy(rx->data, buf->data, rx->len);
+            if (rx->len != rx->orig_len)
+                mesh_rx_ring_truncated();
+        }
+        mesh_rx_ring_commit();
+    }
+
+    histogram_add(&cb_duration, (uint32_t) (esp_timer_get_time() - start));
+}
+
+/**
+ * @brief Queue a STATS message with the callback duration histogram
+ * and the rx ring counters.
+ */
+void queue_mesh_rx_stats()
+{
+    histogram_t h;
+    mesh_rx_stats_t stats;
+
+    memcpy(&h, &cb_duration, sizeof(histogram_t));
+    mesh_rx_ring_get_stats(&stats);
+
+    message_t* message = create_message(STATS);
+    add_message_text_plain(message, false, "Callback us: n %u, mean %u, p50 %u, p95 %u, p99 %u, max %u",
+        h.count, histogram_mean(&h), histogram_percentile(&h, 50),
+        histogram_percentile(&h, 95), histogram_percentile(&h, 99), h.max);
+
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        if(h.buckets[i] != 0)
+            add_message_text_plain(message, false, "Callback us < %u: %u", 2U << i, h.buckets[i]);
+    }
+
+    add_message_text_plain(message, false, "Rx ring: received %u, dropped %u, truncated %u, hwm %u/%d",
+        stats.received, stats.dropped, stats.truncated, stats.high_water_mark, MESH_RX_RING_SIZE);
+    add_message_text_plain(message, false, "Status cache: hits %u, misses %u", cache_hits, cache_misses);
+    add_message_text_plain(message, false, "Descriptor cache: hits %u, misses %u", descriptor_hits, descriptor_misses);
+    send_message_queue(message);
+}
+
 static void ble_mesh_config_server_cb(esp_ble_mesh_cfg_server_cb_event_t event,
                                       esp_ble_mesh_cfg_server_cb_param_t *param)
 {
@@ -462,6 +869,7 @@ static void ble_mesh_config_server_cb(esp_ble_mesh_cfg_server_cb_event_t event,
                param->value.state_change.mod_app_bind.model_id == ESP_BLE_MESH_MODEL_ID_SENSOR_CLI){
                 // Guardo app key
                 prov_key.app_idx = param->value.state_change.mod_app_bind.app_idx;
+                save_prov_key();
                }
             break;
         }
@@ -474,6 +882,22 @@ esp_err_t ble_mesh_init(void)
 
     esp_err_t err = ESP_OK;
 
+    // worker that decodes what the sensor client callback stores in the rx ring
+    TaskHandle_t decode_task = NULL;
+    create_gateway_task(TASK_DECODE_MESH, &task_decode_mesh, NULL, &decode_task);
+    mesh_rx_ring_init(decode_task);
+
+    // per node link state and only one request in flight per destination
+    init_node_registry();
+    init_descriptor_cache();
+#if CONFIG_GATEWAY_RULES
+    init_rules();
+#endif
+    request_tracker_init(ble_mesh_send_get_state);
+
+    // a provisioned node is restored by the stack without calling the provisioning callbacks
+    restore_prov_key();
+
     err = bluetooth_init();
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "esp32_bluetooth_init failed (err %d)", err);
@@ -1,6 +1,9 @@
 #ifndef _SENSOR_MODEL_CLIENT_H_
 #define _SENSOR_MODEL_CLIENT_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "esp_log.h"
 
 /**
@@ -9,4 +12,28 @@
 
 esp_err_t ble_mesh_init(void);
 
+/**
+ * @brief Publish the last values of a node if they were received within max_age.
+ * Only a miss has to be requested to the mesh.
+ * @param addr: node addr
+ * @param sensor_prop_id: property, 0x0000 for every property known of the node
+ * @param max_age: milliseconds
+ * @retval true if the values were published from the cache
+ */
+bool ble_mesh_get_cached_status(uint16_t addr, uint16_t sensor_prop_id, uint32_t max_age);
+
+/**
+ * @brief Publish the descriptors of a node if they are cached.
+ * @param addr: node addr
+ * @param sensor_prop_id: property, 0x0000 for every property of the node
+ * @retval true if the descriptors were published from the cache
+ */
+bool ble_mesh_get_cached_descriptor(uint16_t addr, uint16_t sensor_prop_id);
+
+/**
+ * @brief Queue a message with the sensor client callback
+ * duration histogram and the rx ring counters
+ */
+void queue_mesh_rx_stats();
+
 #endif
\ No newline at end of file
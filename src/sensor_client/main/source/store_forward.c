@@ -0,0 +1,356 @@
+#include "sdkconfig.h"
+
+#if CONFIG_STORE_FORWARD
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+
+#include "source/store_forward.h"
+#include "source/gateway_storage.h"
+
+static const char* TAG = "StoreForward";
+
+#define SF_RECORD_LEN      sizeof(sf_record_t)
+#define SF_SECTOR_RECORDS  (SPI_FLASH_SEC_SIZE / SF_RECORD_LEN)
+#define SF_ERASED          0xFFFFFFFF
+#define SF_RAM_RECORDS     CONFIG_SF_RAM_RECORDS
+
+static const esp_partition_t *partition = NULL;
+static uint32_t sectors;
+static uint32_t capacity;  // records in flash
+static uint32_t write_seq; // seq of the next record written to flash
+static uint32_t read_seq;  // seq of the oldest record not forwarded yet
+static uint32_t boot_seq;  // first seq written in this boot
+
+static sf_record_t ram[SF_RAM_RECORDS];
+static int ram_head;
+static int ram_count;
+
+static sf_stats_t stats;
+
+static uint32_t offset_of(uint32_t seq)
+{
+    return (seq % capacity) * SF_RECORD_LEN;
+}
+
+static bool read_record(uint32_t seq, sf_record_t *record)
+{
+    return esp_partition_read(partition, offset_of(seq), record, SF_RECORD_LEN) == ESP_OK;
+}
+
+/**
+ * @brief Oldest seq that can still be in flash when the next record is write_seq.
+ * The sector being written and the ones after it have been erased or are
+ * going to be.
+ */
+static uint32_t oldest_seq()
+{
+    uint32_t sector_start = write_seq - (write_seq % SF_SECTOR_RECORDS);
+    uint32_t kept = (sectors - 1) * SF_SECTOR_RECORDS;
+    return sector_start > kept ? sector_start - kept : 0;
+}
+
+/**
+ * @brief Return whether nothing has been written in the slot of seq since its sector was erased
+ */
+static bool slot_erased(uint32_t seq)
+{
+    uint8_t bytes[SF_RECORD_LEN];
+    if(esp_partition_read(partition, offset_of(seq), bytes, SF_RECORD_LEN) != ESP_OK)
+        return false;
+
+    for(int i = 0; i < SF_RECORD_LEN; i++)
+    {
+        if(bytes[i] != 0xFF)
+            return false;
+    }
+    return true;
+}
+
+static void save_read_seq()
+{
+    nvs_handle_t handle;
+    if(gateway_storage_open("sf", NVS_READWRITE, &handle) != ESP_OK)
+        return;
+
+    nvs_set_u32(handle, "read", read_seq);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+/**
+ * @brief Find the last record written. Sectors are written in order, so
+ * it is in the sector whose first record has the greatest seq.
+ */
+static void find_write_seq()
+{
+    sf_record_t record;
+    bool found = false;
+    uint32_t last = 0;
+    uint32_t last_sector = 0;
+
+    for(uint32_t s = 0; s < sectors; s++)
+    {
+        if(!read_record(s * SF_SECTOR_RECORDS, &record) || record.seq == SF_ERASED)
+            continue;
+        if(!found || record.seq > last)
+        {
+            found = true;
+            last = record.seq;
+            last_sector = s;
+        }
+    }
+
+    if(!found)
+    {
+        write_seq = 0;
+        return;
+    }
+
+    for(uint32_t i = 1; i < SF_SECTOR_RECORDS; i++)
+    {
+        if(!read_record(last_sector * SF_SECTOR_RECORDS + i, &record) || record.seq != last + 1)
+            break;
+        last = record.seq;
+    }
+    write_seq = last + 1;
+}
+
+/**
+ * @brief Find the log in the partition and the readings pending from the last boot
+ */
+void init_store_forward()
+{
+    memset(&stats, 0, sizeof(stats));
+    ram_head = 0;
+    ram_count = 0;
+
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, SF_PARTITION);
+    if(partition == NULL || partition->size < 2 * SPI_FLASH_SEC_SIZE)
+    {
+        ESP_LOGW(TAG, "No %s partition, readings are only kept in RAM", SF_PARTITION);
+        partition = NULL;
+        return;
+    }
+
+    sectors = partition->size / SPI_FLASH_SEC_SIZE;
+    capacity = sectors * SF_SECTOR_RECORDS;
+    find_write_seq();
+
+    // a record torn by a reboot left bits set after the last one, nothing can
+    // be written over it before its sector is erased: go on in the next sector
+    if(write_seq % SF_SECTOR_RECORDS != 0 && !slot_erased(write_seq))
+    {
+        ESP_LOGW(TAG, "Record %u torn, going on in the next sector", write_seq);
+        write_seq += SF_SECTOR_RECORDS - write_seq % SF_SECTOR_RECORDS;
+    }
+    boot_seq = write_seq;
+
+    read_seq = write_seq;
+    nvs_handle_t handle;
+    if(gateway_storage_open("sf", NVS_READONLY, &handle) == ESP_OK)
+    {
+        nvs_get_u32(handle, "read", &read_seq);
+        nvs_close(handle);
+    }
+    if(read_seq > write_seq)
+        read_seq = write_seq;
+    if(read_seq < oldest_seq())
+        read_seq = oldest_seq();
+
+    ESP_LOGI(TAG, "%u records in flash, %u readings to forward", capacity, write_seq - read_seq);
+}
+
+static bool write_record(sf_record_t *record)
+{
+    uint32_t offset = offset_of(write_seq);
+
+    if(offset % SPI_FLASH_SEC_SIZE == 0)
+    {
+        if(esp_partition_erase_range(partition, offset, SPI_FLASH_SEC_SIZE) != ESP_OK)
+            return false;
+    }
+
+    record->seq = write_seq;
+    // seq last: a record is valid only if it was written completely
+    if(esp_partition_write(partition, offset + sizeof(uint32_t),
+        (uint8_t *) record + sizeof(uint32_t), SF_RECORD_LEN - sizeof(uint32_t)) != ESP_OK)
+        return false;
+    if(esp_partition_write(partition, offset, &record->seq, sizeof(uint32_t)) != ESP_OK)
+        return false;
+
+    write_seq++;
+
+    // the oldest sector was erased to make room
+    if(read_seq < oldest_seq())
+    {
+        stats.dropped += oldest_seq() - read_seq;
+        read_seq = oldest_seq();
+    }
+    return true;
+}
+
+/**
+ * @brief Move the RAM ring to flash
+ */
+static void spill()
+{
+    if(partition == NULL)
+        return;
+
+    while(ram_count > 0)
+    {
+        if(!write_record(&ram[ram_head]))
+        {
+            ESP_LOGE(TAG, "Failed to write seq %u", write_seq);
+            return;
+        }
+        ram_head = (ram_head + 1) % SF_RAM_RECORDS;
+        ram_count--;
+        stats.spilled++;
+    }
+    ESP_LOGI(TAG, "Spilled to flash, %u readings to forward", write_seq - read_seq);
+}
+
+/**
+ * @brief Keep a reading to publish it later
+ * @param message: GET_STATUS message, still owned by the caller
+ */
+void store_forward_put(const message_t *message)
+{
+    if(ram_count == SF_RAM_RECORDS)
+        spill();
+
+    if(ram_count == SF_RAM_RECORDS)
+    {
+        // no flash, lose the oldest
+        ram_head = (ram_head + 1) % SF_RAM_RECORDS;
+        ram_count--;
+        stats.dropped++;
+    }
+
+    sf_record_t *record = &ram[(ram_head + ram_count) % SF_RAM_RECORDS];
+    int64_t timestamp = message->m_content.measure.taken;
+    if(timestamp == 0)
+        timestamp = message->enqueued;
+    record->seq = SF_ERASED;
+    record->time = (uint32_t) (timestamp / 1000);
+    record->value = message->m_content.measure.value;
+    record->addr = message->m_content.measure.addr;
+    record->sensor_prop_id = message->m_content.measure.sensor_prop_id;
+    ram_count++;
+    stats.stored++;
+}
+
+/**
+ * @brief Return if there are readings to forward
+ */
+bool store_forward_pending()
+{
+    return ram_count > 0 || (partition != NULL && read_seq < write_seq);
+}
+
+static message_t* record_to_message(const sf_record_t *record, bool known_age)
+{
+    message_t *message = create_message(GET_STATUS);
+    add_measure_to_message(message, record->addr, record->sensor_prop_id, record->value);
+    message->m_content.measure.age_ms = -1;
+    if(known_age)
+    {
+        int64_t now = esp_timer_get_time();
+        message->m_content.measure.age_ms = (int32_t) ((uint32_t) (now / 1000) - record->time);
+        message->m_content.measure.taken = now - (int64_t) message->m_content.measure.age_ms * 1000;
+    }
+    return message;
+}
+
+/**
+ * @brief Return the oldest stored readings as GET_STATUS messages with
+ * their original timestamp, up to max. They are kept until committed.
+ * @param messages: where the messages are written
+ * @param max: size of messages
+ * @retval number of messages
+ */
+int store_forward_peek(message_t **messages, int max)
+{
+    int n = 0;
+    bool skipped = false;
+    bool unreadable = false;
+    sf_record_t record;
+
+    // flash first, it has the oldest readings. The ones returned are the
+    // records from read_seq on, so a record that can not be read is
+    // skipped only when it is the oldest one
+    while(partition != NULL && !unreadable && n < max && read_seq + n < write_seq)
+    {
+        uint32_t seq = read_seq + n;
+        bool read = read_record(seq, &record);
+        if(read && record.seq == seq)
+        {
+            messages[n++] = record_to_message(&record, seq >= boot_seq);
+        }
+        else if(n == 0)
+        {
+            // an erased slot never had a reading, see the torn records in init
+            if(!read || record.seq != SF_ERASED)
+                stats.dropped++;
+            read_seq++;
+            skipped = true;
+        }
+        else
+        {
+            unreadable = true;
+        }
+    }
+    if(skipped)
+        save_read_seq();
+    if(unreadable)
+        return n;
+
+    for(int i = 0; n < max && i < ram_count; i++)
+        messages[n++] = record_to_message(&ram[(ram_head + i) % SF_RAM_RECORDS], true);
+
+    return n;
+}
+
+/**
+ * @brief Forget the oldest readings, once they have been published
+ * @param count: readings published, at most the ones of the last peek
+ */
+void store_forward_commit(int count)
+{
+    stats.forwarded += count;
+
+    if(partition != NULL && count > 0 && read_seq < write_seq)
+    {
+        uint32_t flash = write_seq - read_seq < (uint32_t) count ? write_seq - read_seq : (uint32_t) count;
+        read_seq += flash;
+        count -= flash;
+        // only now, a reboot before publishing them forwards them again
+        save_read_seq();
+    }
+
+    if(count > ram_count)
+        count = ram_count;
+    ram_head = (ram_head + count) % SF_RAM_RECORDS;
+    ram_count -= count;
+}
+
+/**
+ * @brief Queue a message with the counters
+ */
+void queue_store_forward_stats()
+{
+    message_t* message = create_message(STATS);
+    add_message_text_plain(message, false, "Store and forward: stored %u, spilled %u, forwarded %u, dropped %u",
+        stats.stored, stats.spilled, stats.forwarded, stats.dropped);
+    add_message_text_plain(message, false, "Store and forward: %d in RAM, %u in flash (%u records)",
+        ram_count, partition != NULL ? write_seq - read_seq : 0, capacity);
+    send_message_queue(message);
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef _STORE_FORWARD_H_
+#define _STORE_FORWARD_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdkconfig.h"
+
+#include "source/messages_parser.h"
+
+/*
+ * Readings taken while there is no MQTT connection. They are kept in a RAM
+ * ring that is spilled to the "telemetry" partition when it is full, and are
+ * published again, oldest first, once the connection is back.
+ * Only used by the MQTT task, so there are no locks.
+ *
+ * Flash record, 16 bytes little endian:
+ *   seq (4): position in the log, 0xFFFFFFFF if the slot is erased
+ *   time (4): esp_timer time of the reading in ms
+ *   value (4), addr (2), sensor_prop_id (2)
+ * seq is written after the rest of the record, so a torn write is never valid.
+ * Records older than the first seq of this boot have no known age.
+ */
+#define SF_PARTITION "telemetry"
+
+typedef struct __attribute__((packed)) sf_record_t {
+    uint32_t seq;
+    uint32_t time;
+    int32_t value;
+    uint16_t addr;
+    uint16_t sensor_prop_id;
+} sf_record_t;
+
+typedef struct sf_stats_t {
+    uint32_t stored;    // readings taken while offline
+    uint32_t spilled;   // readings written to flash
+    uint32_t forwarded; // readings published after the outage
+    uint32_t dropped;   // readings lost because flash was full or unreadable
+} sf_stats_t;
+
+#if CONFIG_STORE_FORWARD
+
+/**
+ * @brief Find the log in the partition and the readings pending from the last boot
+ */
+void init_store_forward();
+
+/**
+ * @brief Keep a reading to publish it later
+ * @param message: GET_STATUS message, still owned by the caller
+ */
+void store_forward_put(const message_t *message);
+
+/**
+ * @brief Return if there are readings to forward
+ */
+bool store_forward_pending();
+
+/**
+ * @brief Return the oldest stored readings as GET_STATUS messages with
+ * their original timestamp, up to max. They are kept until committed.
+ * @param messages: where the messages are written
+ * @param max: size of messages
+ * @retval number of messages
+ */
+int store_forward_peek(message_t **messages, int max);
+
+/**
+ * @brief Forget the oldest readings, once they have been published
+ * @param count: readings published, at most the ones of the last peek
+ */
+void store_forward_commit(int count);
+
+/**
+ * @brief Queue a message with the counters
+ */
+void queue_store_forward_stats();
+
+#endif
+
+#endif
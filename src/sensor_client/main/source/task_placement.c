@@ -0,0 +1,72 @@
+#include "sdkconfig.h"
+#include "esp_log.h"
+
+#include "source/task_placement.h"
+
+static const char* TAG = "TaskPlacement";
+
+// a negative core in Kconfig means any core
+#define CORE(core) ((core) < 0 ? tskNO_AFFINITY : (core))
+
+static const task_placement_t placement[GATEWAY_TASKS] = {
+    [TASK_DECODE_MESH] = {
+        "task_decode_mesh",
+        CORE(CONFIG_DECODE_MESH_TASK_CORE),
+        CONFIG_DECODE_MESH_TASK_PRIORITY,
+        CONFIG_DECODE_MESH_TASK_STACK_SIZE,
+    },
+    [TASK_SCHEDULER] = {
+        "task_scheduler",
+        CORE(CONFIG_SCHEDULER_TASK_CORE),
+        CONFIG_SCHEDULER_TASK_PRIORITY,
+        CONFIG_SCHEDULER_TASK_STACK_SIZE,
+    },
+    [TASK_PARSE_JSON] = {
+        "task_parse_json",
+        CORE(CONFIG_PARSE_JSON_TASK_CORE),
+        CONFIG_PARSE_JSON_TASK_PRIORITY,
+        CONFIG_PARSE_JSON_TASK_STACK_SIZE,
+    },
+    [TASK_SEND_MQTT] = {
+        "task_send_response_mqtt",
+        CORE(CONFIG_SEND_MQTT_TASK_CORE),
+        CONFIG_SEND_MQTT_TASK_PRIORITY,
+        CONFIG_SEND_MQTT_TASK_STACK_SIZE,
+    },
+    [TASK_BENCHMARK] = {
+        "task_benchmark",
+        CORE(CONFIG_BENCHMARK_TASK_CORE),
+        CONFIG_BENCHMARK_TASK_PRIORITY,
+        CONFIG_BENCHMARK_TASK_STACK_SIZE,
+    },
+};
+
+/**
+ * @brief Return the placement of a task
+ */
+const task_placement_t* task_placement(gateway_task_t task)
+{
+    return &placement[task];
+}
+
+/**
+ * @brief Create a task with its placement
+ * @param task: which task
+ * @param function: task function
+ * @param params: task parameters
+ * @param handle: where the handle is stored, can be NULL
+ * @retval pdPASS if the task was created
+ */
+BaseType_t create_gateway_task(gateway_task_t task, TaskFunction_t function, void *params, TaskHandle_t *handle)
+{
+    const task_placement_t *p = &placement[task];
+
+    BaseType_t ret = xTaskCreatePinnedToCore(function, p->name, p->stack_size, params, p->priority, handle, p->core);
+    if(ret != pdPASS)
+        ESP_LOGE(TAG, "Task %s could not be created", p->name);
+    else
+        ESP_LOGI(TAG, "Task %s, core %d, priority %u, stack %u", p->name,
+            p->core == tskNO_AFFINITY ? -1 : (int) p->core, p->priority, p->stack_size);
+
+    return ret;
+}
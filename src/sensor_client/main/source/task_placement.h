@@ -0,0 +1,40 @@
+#ifndef _TASK_PLACEMENT_H_
+#define _TASK_PLACEMENT_H_
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/* Every task created by the gateway */
+typedef enum {
+    TASK_DECODE_MESH,
+    TASK_SCHEDULER,
+    TASK_PARSE_JSON,
+    TASK_SEND_MQTT,
+    TASK_BENCHMARK,
+    GATEWAY_TASKS
+} gateway_task_t;
+
+/* Where and how a task runs, taken from Kconfig */
+typedef struct task_placement_t {
+    const char *name;
+    BaseType_t core;      // tskNO_AFFINITY to run on any core
+    UBaseType_t priority;
+    uint32_t stack_size;
+} task_placement_t;
+
+/**
+ * @brief Return the placement of a task
+ */
+const task_placement_t* task_placement(gateway_task_t task);
+
+/**
+ * @brief Create a task with its placement
+ * @param task: which task
+ * @param function: task function
+ * @param params: task parameters
+ * @param handle: where the handle is stored, can be NULL
+ * @retval pdPASS if the task was created
+ */
+BaseType_t create_gateway_task(gateway_task_t task, TaskFunction_t function, void *params, TaskHandle_t *handle);
+
+#endif
@@ -1,13 +1,65 @@
 #include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 
 #include "source/tasks_manager.h"
 #include "source/messages_parser.h"
+#include "source/gateway_storage.h"
 
 static const char* TAG = "TaskManager";
 
+/*
+ * The tasks are saved in one blob of the gateway NVS partition. Changes are
+ * batched: the blob is written TASKS_SAVE_DELAY after the first change not
+ * saved, so a burst of actions from the CLI is only one write.
+ */
+#define TASKS_NAMESPACE  "tasks"
+#define TASKS_KEY        "table"
+#define TASKS_VERSION    2
+#define TASKS_SAVE_DELAY ((int64_t) CONFIG_TASKS_SAVE_DELAY_MS * 1000)
+
+#define TASK_FLAG_PAUSED 0x01
+
+/* Task as saved in flash, followed by name_len chars of its name */
+typedef struct __attribute__((packed)) task_record_t {
+    uint32_t opcode;
+    uint16_t addr;
+    uint16_t sensor_prop_id;
+    uint16_t delay;
+    uint8_t group;
+    uint8_t flags;
+    uint8_t name_len;
+} task_record_t;
+
 // pointer to tasks_t struct to manage tasks
 static tasks_t *task_manager;
+static SemaphoreHandle_t xSem_tasks = NULL;
+
+// whether there are changes not saved and the esp_timer time of the first one
+static bool dirty = false;
+static int64_t dirty_since = 0;
+
+static void lock()
+{
+    while(xSemaphoreTake(xSem_tasks, ( TickType_t ) 10 ) != pdTRUE);
+}
+
+static void unlock()
+{
+    xSemaphoreGive(xSem_tasks);
+}
+
+static void mark_dirty()
+{
+    if(!dirty)
+    {
+        dirty = true;
+        dirty_since = esp_timer_get_time();
+    }
+}
 
 /**
  * @brief initialize task_manager
@@ -18,13 +70,15 @@ void init_tasks_manager()
     task_manager->first = NULL;
     task_manager->last = NULL;
     task_manager->num_tasks = 0;
+    xSem_tasks = xSemaphoreCreateMutex();
 }
 
 /**
- * @brief free task struct only
+ * @brief free task struct
  */
 static void free_task(task_t *task){
     free(task->name);
+    free(task);
 }
 
 /**
@@ -44,16 +98,22 @@ static void free_node(node_t *node)
  */
 void free_tasks_manager()
 {
-    for(node_t* temp = task_manager->first->next; temp != NULL; temp = temp->next)
+    lock();
+    if(task_manager->first != NULL)
     {
-        free_node(temp->prev);
-    }
+        for(node_t* temp = task_manager->first->next; temp != NULL; temp = temp->next)
+        {
+            free_node(temp->prev);
+        }
 
-    free_node(task_manager->last);
+        free_node(task_manager->last);
+    }
 
     task_manager->first = NULL;
     task_manager->last = NULL;
     task_manager->num_tasks = 0;
+    mark_dirty();
+    unlock();
 }
 
 /**
@@ -71,36 +131,26 @@ static bool equals(task_t *task_l, task_t *task_r)
 }
 
 /**
- * @brief check if a task exists within tasks_manager
+ * @brief find the node of a task. tasks_manager has to be locked
  */
-status_t task_exists(task_t *new_task)
+static node_t* find_node(task_t *task)
 {
-    status_t status = NOT_EXISTS;
-
-    if(task_manager->first != NULL && task_manager->last != NULL)
+    for(node_t *temp = task_manager->first; temp != NULL; temp = temp->next)
     {
-
-        if(equals(task_manager->first->task, new_task))
-        {
-            status = EXISTS;
-        }
-        else if(equals(task_manager->last->task, new_task))
-        {
-            status = EXISTS;
-        }
-        else if(task_manager->first != task_manager->last)
-        {
-            for(node_t *temp = task_manager->first->next;
-                temp != task_manager->last && status == NOT_EXISTS;
-                temp = temp->next)
-            {
-                if(equals(temp->task, new_task))
-                {
-                    status = EXISTS;
-                }
-            }
-        }
+        if(equals(temp->task, task))
+            return temp;
     }
+    return NULL;
+}
+
+/**
+ * @brief check if a task exists within tasks_manager
+ */
+status_t task_exists(task_t *new_task)
+{
+    lock();
+    status_t status = find_node(new_task) != NULL ? EXISTS : NOT_EXISTS;
+    unlock();
     return status;
 }
 
@@ -137,123 +187,456 @@ static void add_task(task_t *new_task)
 status_t add_new_task_if_not_exists(task_t *new_task)
 {
     status_t status = EXISTS;
-    if(task_exists(new_task) != EXISTS){
+
+    lock();
+    if(find_node(new_task) == NULL){
         add_task(new_task);
+        mark_dirty();
         status = CREATED;
     }
+    unlock();
+
     return status;
 }
 
 /**
- * @brief obtain the task's data based on a given name
+ * @brief obtain the task's data based on a given name.
+ * It is valid until the task is removed.
  */
 task_t* obtain_task(task_t* task)
 {
+    lock();
+    node_t *node = find_node(task);
+    unlock();
+
+    return node != NULL ? node->task : NULL;
+}
+
+/**
+ * @brief take a node out of the list and free it. tasks_manager has to be locked
+ */
+static void unlink_node(node_t *node)
+{
+    if(node->prev != NULL)
+        node->prev->next = node->next;
+    else
+        task_manager->first = node->next;
+
+    if(node->next != NULL)
+        node->next->prev = node->prev;
+    else
+        task_manager->last = node->prev;
+
+    free_node(node);
+    task_manager->num_tasks--;
+}
 
-    if(task_manager->num_tasks == 0)
-        return NULL;
+/**
+ * @brief remove a task from list based on a given name
+ */
+status_t remove_task(task_t* remove_task)
+{
+    status_t status = NOT_EXISTS;
 
-    if(task_manager->first != NULL && task_manager->last != NULL)
+    lock();
+    node_t *node = find_node(remove_task);
+    if(node != NULL)
     {
-        if(equals(task_manager->first->task, task))
-            return task_manager->first->task;
+        unlink_node(node);
+        mark_dirty();
+        status = EXISTS;
+    }
+    unlock();
 
-        if(equals(task_manager->last->task, task))
-            return task_manager->last->task;
+    return status;
+}
 
-        task_t *found_task = NULL;
-        status_t status = NOT_EXISTS;
+/**
+ * @brief Change the selected tasks in place. A new delay keeps the time of
+ * the last request, so the next one is sent delay seconds after it.
+ * @retval number of tasks updated
+ */
+int tasks_manager_update(const task_filter_t *filter, const task_update_t *update)
+{
+    int updated = 0;
+    int64_t now = esp_timer_get_time();
 
-        for(node_t *temp = task_manager->first->next;
-            temp != task_manager->last->prev && status == NOT_EXISTS;
-            temp = temp->next)
+    lock();
+    for(node_t *temp = task_manager->first; temp != NULL; temp = temp->next)
+    {
+        task_t *task = temp->task;
+        if(!task_matches(task, filter))
+            continue;
+
+        if(update->delay > 0 && update->delay != task->delay)
         {
-            if(equals(temp->task, task))
-            {
-                status = EXISTS;
-                found_task = temp->task;
-            }
+            task->delay = update->delay;
+            task->next_run = task->last_run != 0 ? task->last_run + (int64_t) task->delay * 1000000 : now;
         }
-        return found_task;
+        if(update->set_addr)
+            task->addr = update->addr;
+        if(update->set_sensor_prop_id)
+            task->sensor_prop_id = update->sensor_prop_id;
+        updated++;
     }
-    return NULL;
+    if(updated > 0)
+        mark_dirty();
+    unlock();
+
+    return updated;
 }
 
 /**
- * @brief remove a task from list based on a given name
+ * @brief Pause or resume the selected tasks. A resumed task keeps its
+ * phase: the next request is at the next multiple of its delay since the
+ * last planned one, so resuming many tasks does not send them all at once.
+ * @retval number of tasks that changed
  */
-status_t remove_task(task_t* remove_task)
+int tasks_manager_pause(const task_filter_t *filter, bool paused)
 {
-    status_t status = NOT_EXISTS;
+    int changed = 0;
+    int64_t now = esp_timer_get_time();
 
-    if(task_manager->first != NULL && task_manager->last != NULL)
+    lock();
+    for(node_t *temp = task_manager->first; temp != NULL; temp = temp->next)
     {
-        // if it is the first element, remove and point to the next element
-        if(equals(task_manager->first->task, remove_task))
+        task_t *task = temp->task;
+        if(!task_matches(task, filter) || task->paused == paused)
+            continue;
+
+        task->paused = paused;
+        if(!paused && task->delay > 0 && task->next_run <= now)
         {
-            if(task_manager->first == task_manager->last)// if we have one element
-            {
-                free_node(task_manager->first);
-            }
-            else
-            {
-                task_manager->first = task_manager->first->next;
-                free_node(task_manager->first->prev);
-            }
-            status = EXISTS;
-            task_manager->num_tasks--;
+            int64_t period = (int64_t) task->delay * 1000000;
+            task->next_run += ((now - task->next_run) / period + 1) * period;
         }
-        // if it is the last element, remove and point to the previous element
-        else if(equals(task_manager->last->task, remove_task))
+        changed++;
+    }
+    if(changed > 0)
+        mark_dirty();
+    unlock();
+
+    return changed;
+}
+
+/**
+ * @brief Remove the selected tasks
+ * @retval number of tasks removed
+ */
+int tasks_manager_remove(const task_filter_t *filter)
+{
+    int removed = 0;
+
+    lock();
+    node_t *temp = task_manager->first;
+    while(temp != NULL)
+    {
+        node_t *next = temp->next;
+        if(task_matches(temp->task, filter))
         {
-            if(task_manager->first == task_manager->last)
-            {
-                free_node(task_manager->first);
-            }
-            else
-            {
-                task_manager->last = task_manager->last->prev;
-                free_node(task_manager->last->next);
-            }
-            status = EXISTS;
-            task_manager->num_tasks--;
+            unlink_node(temp);
+            removed++;
+        }
+        temp = next;
+    }
+    if(removed > 0)
+        mark_dirty();
+    unlock();
+
+    return removed;
+}
+
+/**
+ * @brief Call fn for every task with tasks_manager locked.
+ * fn cannot call tasks_manager functions
+ */
+void tasks_manager_foreach(void (*fn)(task_t *task, void *arg), void *arg)
+{
+    lock();
+    for(node_t *temp = task_manager->first; temp != NULL; temp = temp->next)
+    {
+        fn(temp->task, arg);
+    }
+    unlock();
+}
+
+/**
+ * @brief Runtime stats: account the end of a request sent by the tasks to addr
+ * @param replied: false if the request was given up
+ * @param rtt: ms, only used if replied
+ */
+void tasks_manager_account(uint16_t addr, uint32_t opcode, uint16_t sensor_prop_id, bool replied, uint32_t rtt)
+{
+    lock();
+    for(node_t *temp = task_manager->first; temp != NULL; temp = temp->next)
+    {
+        task_t *task = temp->task;
+        if(task->addr != addr || task->opcode != opcode || task->sensor_prop_id != sensor_prop_id || task->runs == 0)
+            continue;
+
+        if(replied)
+        {
+            task->replies++;
+            task->rtt_sum += rtt;
         }
         else
         {
-            for(node_t* temp = task_manager->first->next; temp != task_manager->last->prev && status == NOT_EXISTS; temp = temp->next)
-            {
-                if(equals(temp->task, remove_task))
-                {
-                    status = EXISTS;
-                    temp->prev->next = temp->next;
-                    temp->next->prev = temp->prev;
-                    free_node(temp);
-                    task_manager->num_tasks--;
-                }
-            }
+            task->timeouts++;
         }
     }
-    return status;
+    unlock();
+}
+
+/**
+ * @brief Filter that selects every task
+ */
+void task_filter_init(task_filter_t *filter)
+{
+    filter->name     = NULL;
+    filter->prefix   = NULL;
+    filter->addr_min = 0x0000;
+    filter->addr_max = 0xFFFF;
+    filter->group    = 0;
+}
+
+/**
+ * @brief Return if a task is selected by a filter
+ */
+bool task_matches(const task_t *task, const task_filter_t *filter)
+{
+    if(task->addr < filter->addr_min || task->addr > filter->addr_max)
+        return false;
+
+    if(filter->group != 0 && task->group != filter->group)
+        return false;
+
+    if(filter->name != NULL && strcmp(task->name, filter->name) != 0)
+        return false;
+
+    return filter->prefix == NULL || strncmp(task->name, filter->prefix, strlen(filter->prefix)) == 0;
+}
+
+/**
+ * @brief Copy up to max tasks matching filter, after skipping the first skip ones.
+ * tasks_manager has to be locked.
+ * @retval number of tasks copied
+ */
+static int copy_tasks(const task_filter_t *filter, int skip, task_t *tasks, int max)
+{
+    int n = 0;
+
+    for(node_t *temp = task_manager->first; temp != NULL && n < max; temp = temp->next)
+    {
+        if(!task_matches(temp->task, filter))
+            continue;
+        if(skip > 0)
+        {
+            skip--;
+            continue;
+        }
+
+        memcpy(&tasks[n], temp->task, sizeof(task_t));
+        tasks[n].name = strdup(temp->task->name);
+        n++;
+    }
+    return n;
 }
 
 /**
- * @brief Queue a message_t with task info
+ * @brief Queue TASKS messages with the tasks matching filter, page_size tasks each.
+ * The list is only locked while a page is copied, so a long listing does not
+ * stop the scheduler, and it can change between two pages.
+ * @param page: page to queue, every page if it is negative
  */
-void queue_list_task()
+void queue_list_task(const task_filter_t *filter, int page_size, int page)
 {
-    message_t* tasks_info = create_message(TASKS);
+    int total = 0;
 
-    if(task_manager->num_tasks > 0)
+    if(page_size < 1 || page_size > TASKS_PAGE_MAX)
+        page_size = TASKS_PAGE_MAX;
+
+    lock();
+    for(node_t *temp = task_manager->first; temp != NULL; temp = temp->next)
     {
+        if(task_matches(temp->task, filter))
+            total++;
+    }
+    unlock();
+
+    int pages = total == 0 ? 1 : (total + page_size - 1) / page_size;
+    int first = page < 0 ? 0 : page;
+    int last  = page < 0 ? pages - 1 : page;
+
+    if(first >= pages)
+    {
+        message_t* error = create_message(PLAIN_TEXT);
+        add_message_text_plain(error, true, "Page %d out of %d pages", page, pages);
+        send_message_queue(error);
+        return;
+    }
+
+    for(int p = first; p <= last; p++)
+    {
+        message_t* tasks_info = create_message(TASKS);
+        tasks_page_t *tasks_page = &tasks_info->m_content.tasks_page;
+
+        tasks_page->tasks = (task_t *) malloc(sizeof(task_t) * page_size);
+        if(tasks_page->tasks == NULL)
+        {
+            free_message(tasks_info);
+            return;
+        }
+
+        lock();
+        tasks_page->count = copy_tasks(filter, p * page_size, tasks_page->tasks, page_size);
+        unlock();
+
+        tasks_page->page  = p;
+        tasks_page->pages = pages;
+        tasks_page->total = total;
+        send_message_queue(tasks_info);
+    }
+}
+
+/**
+ * @brief Load the tasks saved before the reboot. The first request of
+ * every task is spread along its delay so they do not go all at once.
+ * @retval number of tasks restored
+ */
+int tasks_manager_restore()
+{
+    nvs_handle_t handle;
+    size_t size = 0;
+    int restored = 0;
+
+    if(gateway_storage_open(TASKS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+        return 0; // nothing saved yet
+
+    if(nvs_get_blob(handle, TASKS_KEY, NULL, &size) != ESP_OK || size == 0)
+    {
+        nvs_close(handle);
+        return 0;
+    }
+
+    uint8_t *blob = (uint8_t *) malloc(size);
+    if(blob == NULL || nvs_get_blob(handle, TASKS_KEY, blob, &size) != ESP_OK || blob[0] != TASKS_VERSION)
+    {
+        ESP_LOGE(TAG, "Saved tasks could not be read");
+        free(blob);
+        nvs_close(handle);
+        return 0;
+    }
+    nvs_close(handle);
+
+    int64_t now = esp_timer_get_time();
+    size_t offset = 1;
+    while(offset + sizeof(task_record_t) <= size)
+    {
+        task_record_t record;
+        memcpy(&record, blob + offset, sizeof(task_record_t));
+        offset += sizeof(task_record_t);
+
+        if(offset + record.name_len > size)
+            break;
+
+        task_t *task = (task_t *) calloc(1, sizeof(task_t));
+        task->name = (char *) malloc(record.name_len + 1);
+        memcpy(task->name, blob + offset, record.name_len);
+        task->name[record.name_len] = '\0';
+        offset += record.name_len;
+
+        task->opcode         = record.opcode;
+        task->addr           = record.addr;
+        task->sensor_prop_id = record.sensor_prop_id;
+        task->delay          = record.delay;
+        task->group          = record.group;
+        task->paused         = (record.flags & TASK_FLAG_PAUSED) != 0;
+        task->next_run       = now + (int64_t) (esp_random() % ((uint32_t) task->delay * 1000 + 1)) * 1000;
+
+        lock();
+        if(find_node(task) == NULL)
+        {
+            add_task(task);
+            restored++;
+        }
+        else
+        {
+            free_task(task);
+        }
+        unlock();
+    }
+    free(blob);
+
+    return restored;
+}
+
+/**
+ * @brief Save the tasks if they changed more than TASKS_SAVE_DELAY ago.
+ * @param now: esp_timer time
+ */
+void tasks_manager_save_if_dirty(int64_t now)
+{
+    uint8_t *blob = NULL;
+    size_t size = 1;
+
+    lock();
+    if(!dirty || now - dirty_since < TASKS_SAVE_DELAY)
+    {
+        unlock();
+        return;
+    }
+
+    for(node_t *temp = task_manager->first; temp != NULL; temp = temp->next)
+        size += sizeof(task_record_t) + strnlen(temp->task->name, UINT8_MAX);
+
+    blob = (uint8_t *) malloc(size);
+    if(blob != NULL)
+    {
+        size_t offset = 1;
+        blob[0] = TASKS_VERSION;
         for(node_t *temp = task_manager->first; temp != NULL; temp = temp->next)
         {
-            add_message_text_plain(tasks_info, false, "Task: Name -> %s", temp->task->name);
+            task_record_t record = {
+                .opcode         = temp->task->opcode,
+                .addr           = temp->task->addr,
+                .sensor_prop_id = temp->task->sensor_prop_id,
+                .delay          = temp->task->delay,
+                .group          = temp->task->group,
+                .flags          = temp->task->paused ? TASK_FLAG_PAUSED : 0,
+                .name_len       = strnlen(temp->task->name, UINT8_MAX),
+            };
+            memcpy(blob + offset, &record, sizeof(task_record_t));
+            offset += sizeof(task_record_t);
+            memcpy(blob + offset, temp->task->name, record.name_len);
+            offset += record.name_len;
         }
+        dirty = false;
     }
-    else
+    unlock();
+
+    if(blob == NULL)
+        return;
+
+    nvs_handle_t handle;
+    esp_err_t err = gateway_storage_open(TASKS_NAMESPACE, NVS_READWRITE, &handle);
+    if(err == ESP_OK)
     {
-        add_message_text_plain(tasks_info, false, "There are not tasks running...");
+        err = nvs_set_blob(handle, TASKS_KEY, blob, size);
+        if(err == ESP_OK)
+            err = nvs_commit(handle);
+        nvs_close(handle);
     }
+    free(blob);
 
-    send_message_queue(tasks_info);
-}
\ No newline at end of file
+    if(err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Tasks could not be saved (err %d)", err);
+        lock();
+        mark_dirty();
+        unlock();
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Tasks saved, %u bytes", (unsigned) size);
+    }
+}
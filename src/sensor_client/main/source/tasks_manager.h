@@ -1,12 +1,34 @@
 #ifndef _TASK_MANAGER_
 #define _TASK_MANAGER_
 
+#include <stdint.h>
+#include <stdbool.h>
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
+// most tasks in one TASKS message
+#define TASKS_PAGE_MAX 32
+// longest delay of a task in seconds, it is saved in 16 bits
+#define TASK_MAX_DELAY UINT16_MAX
+
+/* Auto task: a request sent periodically by the scheduler in ble_cmd.c */
 typedef struct task_t {
     char *name;
-    TaskHandle_t task_handler;
+    uint32_t opcode;         // BLE opcode message
+    uint16_t addr;           // addr to send the message
+    uint16_t sensor_prop_id; // sensor_prop_id to request
+    int delay;               // seconds
+    uint8_t group;           // chosen by the user to select tasks in bulk, 0 if none
+    bool paused;             // kept, but no requests are sent
+    int64_t next_run;        // esp_timer time of the next request
+    /* runtime stats, not saved */
+    int64_t last_run;        // esp_timer time of the last request, 0 if none
+    uint32_t runs;           // requests sent
+    uint32_t replies;
+    uint32_t timeouts;       // requests given up
+    uint32_t dropped;        // requests the tracker had no room for
+    uint32_t rtt_sum;        // ms, of the replies
 } task_t;
 
 typedef struct node_t {
@@ -21,6 +43,25 @@ typedef struct tasks_t {
     unsigned int num_tasks;
 } tasks_t;
 
+/* Tasks selected by a listing or a bulk action.
+ * Every field is optional: NULL name and prefix, 0x0000-0xFFFF range, group 0 */
+typedef struct task_filter_t {
+    const char *name;   // exact name
+    const char *prefix; // name prefix
+    uint16_t addr_min;
+    uint16_t addr_max;
+    uint8_t group;
+} task_filter_t;
+
+/* Changes of an update, applied to every selected task */
+typedef struct task_update_t {
+    int delay;           // seconds, 0 keeps it
+    bool set_addr;
+    uint16_t addr;
+    bool set_sensor_prop_id;
+    uint16_t sensor_prop_id;
+} task_update_t;
+
 typedef enum {
     EXISTS,
     NOT_EXISTS,
@@ -32,6 +73,9 @@ typedef enum {
 void init_tasks_manager();
 void free_tasks_manager();
 
+/* Call fn for every task with tasks_manager locked. fn cannot call tasks_manager functions */
+void tasks_manager_foreach(void (*fn)(task_t *task, void *arg), void *arg);
+
 /* Compare */
 status_t task_exists(task_t *new_task);
 
@@ -44,7 +88,23 @@ task_t* obtain_task(task_t* task);
 /* Remove */
 status_t remove_task(task_t* remove_task);
 
-/* Queue a message_t with task info */
-void queue_list_task();
+/* Bulk operations in place, they return the number of tasks changed */
+int tasks_manager_update(const task_filter_t *filter, const task_update_t *update);
+int tasks_manager_pause(const task_filter_t *filter, bool paused);
+int tasks_manager_remove(const task_filter_t *filter);
+
+/* Runtime stats: account the end of a request sent by the tasks to addr */
+void tasks_manager_account(uint16_t addr, uint32_t opcode, uint16_t sensor_prop_id, bool replied, uint32_t rtt);
+
+/* Filters */
+void task_filter_init(task_filter_t *filter);
+bool task_matches(const task_t *task, const task_filter_t *filter);
+
+/* Queue TASKS messages with the tasks matching filter, page_size tasks each. page < 0 queues every page */
+void queue_list_task(const task_filter_t *filter, int page_size, int page);
+
+/* Persistence */
+int tasks_manager_restore();
+void tasks_manager_save_if_dirty(int64_t now);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,70 @@
+#include <sys/time.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#if CONFIG_SNTP_TIMESTAMPS
+#include "esp_sntp.h"
+#endif
+
+#include "source/wall_clock.h"
+
+static const char* TAG = "WALL_CLOCK";
+
+static volatile bool synced = false;
+
+#if CONFIG_SNTP_TIMESTAMPS
+// runs in the lwip task on every sync
+static void time_sync_cb(struct timeval *tv)
+{
+    if(!synced)
+        ESP_LOGI(TAG, "Clock synced, %lld s after the boot", esp_timer_get_time() / 1000000);
+    synced = true;
+}
+#endif
+
+/**
+ * @brief Start SNTP, the network has to be initialised
+ */
+void init_wall_clock()
+{
+#if CONFIG_SNTP_TIMESTAMPS
+    ESP_LOGI(TAG, "Syncing with %s", CONFIG_SNTP_SERVER);
+    sntp_setoperatingmode(SNTP_OPMODE_POLL);
+    sntp_setservername(0, CONFIG_SNTP_SERVER);
+    sntp_set_time_sync_notification_cb(time_sync_cb);
+    sntp_init();
+#endif
+}
+
+/**
+ * @brief Unix time of an esp_timer time
+ * @param timer_us: esp_timer time
+ * @param unix_ms: its unix time in ms
+ * @retval false if the clock has never been synced
+ */
+bool wall_clock_unix_ms(int64_t timer_us, int64_t *unix_ms)
+{
+    if(!synced)
+        return false;
+
+    // the offset is taken now, SNTP may have moved the system time since timer_us
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    int64_t offset = (int64_t) now.tv_sec * 1000000 + now.tv_usec - esp_timer_get_time();
+
+    *unix_ms = (timer_us + offset) / 1000;
+    return true;
+}
+
+/**
+ * @brief Whether the readings can be published: the clock is synced or
+ * CONFIG_SNTP_WAIT_S have passed since the boot
+ */
+bool wall_clock_ready()
+{
+#if CONFIG_SNTP_TIMESTAMPS
+    return synced || esp_timer_get_time() >= (int64_t) CONFIG_SNTP_WAIT_S * 1000000;
+#else
+    return true;
+#endif
+}
@@ -0,0 +1,34 @@
+#ifndef _WALL_CLOCK_H_
+#define _WALL_CLOCK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Wall clock of the readings. They are timestamped with esp_timer when the
+ * mesh message arrives, which is monotonic but counts from the boot. SNTP
+ * disciplines the system time, and the offset between both clocks is
+ * applied when a reading is serialised, so a reading taken before a sync
+ * or a step of the clock still gets its right time.
+ */
+
+/**
+ * @brief Start SNTP, the network has to be initialised
+ */
+void init_wall_clock();
+
+/**
+ * @brief Unix time of an esp_timer time
+ * @param timer_us: esp_timer time
+ * @param unix_ms: its unix time in ms
+ * @retval false if the clock has never been synced
+ */
+bool wall_clock_unix_ms(int64_t timer_us, int64_t *unix_ms);
+
+/**
+ * @brief Whether the readings can be published: the clock is synced or
+ * CONFIG_SNTP_WAIT_S have passed since the boot
+ */
+bool wall_clock_ready();
+
+#endif
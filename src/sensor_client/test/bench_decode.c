@@ -0,0 +1,334 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_ble_mesh_sensor_model_api.h"
+
+#include "source/action_bin.h"
+#include "host.h"
+
+#ifdef HOST_CJSON
+#include "cJSON.h"
+#endif
+
+/*
+ * Size and decode cost of the same actions in the two ingress formats,
+ * the host side of the decode_bench command. Every message is written as
+ * json and as binary (action_bin.h); the binary one is decoded into actions
+ * and checked, then both are decoded RUNS times.
+ *
+ * The json cost is cJSON_Parse and cJSON_Delete only: parse_build_task needs
+ * the whole ble_cmd.c, so walking the tree into actions comes on top. It is
+ * measured only when built with the cJSON of ESP-IDF:
+ *   make bench CJSON_DIR=$IDF_PATH/components/json/cJSON
+ */
+#define RUNS     100000
+#define MSG_MAX  1024
+
+typedef struct payload_t {
+    char json[MSG_MAX];
+    int json_len;
+    uint8_t bin[MSG_MAX];
+    int bin_len;
+} payload_t;
+
+/******************** writers ********************/
+
+static void json(payload_t *p, const char *text)
+{
+    p->json_len += snprintf(p->json + p->json_len, MSG_MAX - p->json_len, "%s", text);
+}
+
+static void cbor_head(payload_t *p, uint8_t major, uint32_t value)
+{
+    uint8_t *out = p->bin + p->bin_len;
+
+    if(value < 24)
+    {
+        out[0] = (major << 5) | value;
+        p->bin_len += 1;
+    }
+    else if(value <= UINT8_MAX)
+    {
+        out[0] = (major << 5) | 24;
+        out[1] = value;
+        p->bin_len += 2;
+    }
+    else if(value <= UINT16_MAX)
+    {
+        out[0] = (major << 5) | 25;
+        out[1] = value >> 8;
+        out[2] = value;
+        p->bin_len += 3;
+    }
+    else
+    {
+        out[0] = (major << 5) | 26;
+        out[1] = value >> 24;
+        out[2] = value >> 16;
+        out[3] = value >> 8;
+        out[4] = value;
+        p->bin_len += 5;
+    }
+}
+
+static void cbor_uint(payload_t *p, uint32_t value) { cbor_head(p, 0, value); }
+static void cbor_array(payload_t *p, uint32_t count) { cbor_head(p, 4, count); }
+static void cbor_map(payload_t *p, uint32_t count) { cbor_head(p, 5, count); }
+static void cbor_true(payload_t *p) { p->bin[p->bin_len++] = 0xF5; }
+
+static void cbor_text(payload_t *p, const char *text)
+{
+    cbor_head(p, 3, strlen(text));
+    memcpy(p->bin + p->bin_len, text, strlen(text));
+    p->bin_len += strlen(text);
+}
+
+/******************** messages ********************/
+
+/* One GET_STATUS to a node */
+static void poll(payload_t *p)
+{
+    json(p, "{\"actions\":[{\"opcode\":\"GET_STATUS\",\"addr\":\"0005\",\"sensor_prop_id\":\"0056\"}]}");
+
+    cbor_map(p, 1);
+    cbor_uint(p, 1); cbor_array(p, 1);
+    cbor_map(p, 3);
+    cbor_uint(p, 1); cbor_uint(p, ESP_BLE_MESH_MODEL_OP_SENSOR_GET);
+    cbor_uint(p, 2); cbor_uint(p, 0x0005);
+    cbor_uint(p, 3); cbor_uint(p, 0x0056);
+}
+
+static void check_poll(const action_t *actions, int size)
+{
+    CHECK_EQ(size, 1);
+    CHECK_EQ(actions[0].opmode, CREATE);
+    CHECK_EQ(actions[0].task.opcode, ESP_BLE_MESH_MODEL_OP_SENSOR_GET);
+    CHECK_EQ(actions[0].task.addr, 0x0005);
+    CHECK_EQ(actions[0].task.addr_last, 0x0005);
+    CHECK_EQ(actions[0].task.sensor_prop_id, 0x0056);
+    CHECK(!actions[0].task.auto_task);
+}
+
+/* An auto task for a range of nodes and two properties, with a request_id */
+static void auto_range(payload_t *p)
+{
+    json(p, "{\"request_id\":\"r-42\",\"actions\":[{\"opcode\":\"GET_STATUS\",\"addr\":{\"from\":\"0010\",\"to\":\"001F\"},"
+            "\"sensor_prop_id\":[\"0056\",\"0057\"],\"auto\":true,\"delay\":30,\"name\":\"temp\",\"group\":3}]}");
+
+    cbor_map(p, 2);
+    cbor_uint(p, 0); cbor_text(p, "r-42");
+    cbor_uint(p, 1); cbor_array(p, 1);
+    cbor_map(p, 7);
+    cbor_uint(p, 1); cbor_uint(p, ESP_BLE_MESH_MODEL_OP_SENSOR_GET);
+    cbor_uint(p, 2); cbor_map(p, 2); cbor_uint(p, 0); cbor_uint(p, 0x0010); cbor_uint(p, 1); cbor_uint(p, 0x001F);
+    cbor_uint(p, 3); cbor_array(p, 2); cbor_uint(p, 0x0056); cbor_uint(p, 0x0057);
+    cbor_uint(p, 4); cbor_true(p);
+    cbor_uint(p, 5); cbor_uint(p, 30);
+    cbor_uint(p, 6); cbor_text(p, "temp");
+    cbor_uint(p, 7); cbor_uint(p, 3);
+}
+
+static void check_auto_range(const action_t *actions, int size)
+{
+    uint16_t props[2];
+
+    CHECK_EQ(size, 1);
+    CHECK_EQ(actions[0].opmode, CREATE);
+    CHECK(actions[0].task.auto_task);
+    CHECK(actions[0].task.name != NULL && strcmp(actions[0].task.name, "temp") == 0);
+    CHECK_EQ(actions[0].task.delay, 30);
+    CHECK_EQ(actions[0].task.group, 3);
+    CHECK_EQ(actions[0].task.addr, 0x0010);
+    CHECK_EQ(actions[0].task.addr_last, 0x001F);
+    CHECK_EQ(actions[0].task.prop_list.count, 2);
+    action_bin_values(actions[0].task.prop_list.bin, 2, props);
+    CHECK_EQ(props[0], 0x0056);
+    CHECK_EQ(props[1], 0x0057);
+}
+
+/* One GET_STATUS to a list of 16 nodes, answered from the cache if recent */
+static void list(payload_t *p)
+{
+    json(p, "{\"actions\":[{\"opcode\":\"GET_STATUS\",\"addr\":[");
+    for(int i = 0; i < 16; i++)
+    {
+        char addr[8];
+        snprintf(addr, sizeof(addr), "%s\"%04X\"", i > 0 ? "," : "", 0x0020 + i);
+        json(p, addr);
+    }
+    json(p, "],\"sensor_prop_id\":\"0056\",\"max_age\":5000}]}");
+
+    cbor_map(p, 1);
+    cbor_uint(p, 1); cbor_array(p, 1);
+    cbor_map(p, 4);
+    cbor_uint(p, 1); cbor_uint(p, ESP_BLE_MESH_MODEL_OP_SENSOR_GET);
+    cbor_uint(p, 2); cbor_array(p, 16);
+    for(int i = 0; i < 16; i++)
+        cbor_uint(p, 0x0020 + i);
+    cbor_uint(p, 3); cbor_uint(p, 0x0056);
+    cbor_uint(p, 8); cbor_uint(p, 5000);
+}
+
+static void check_list(const action_t *actions, int size)
+{
+    uint16_t addrs[16];
+
+    CHECK_EQ(size, 1);
+    CHECK_EQ(actions[0].opmode, CREATE);
+    CHECK_EQ(actions[0].task.max_age, 5000);
+    CHECK_EQ(actions[0].task.addr_list.count, 16);
+    action_bin_values(actions[0].task.addr_list.bin, 16, addrs);
+    for(int i = 0; i < 16; i++)
+        CHECK_EQ(addrs[i], 0x0020 + i);
+}
+
+/* A new delay for the tasks of a group whose name starts with a prefix */
+static void update(payload_t *p)
+{
+    json(p, "{\"actions\":[{\"op\":\"update\",\"prefix\":\"temp\",\"group\":3,\"set\":{\"delay\":60}}]}");
+
+    cbor_map(p, 1);
+    cbor_uint(p, 1); cbor_array(p, 1);
+    cbor_map(p, 4);
+    cbor_uint(p, 10); cbor_uint(p, ACTION_BIN_OP_UPDATE);
+    cbor_uint(p, 11); cbor_text(p, "temp");
+    cbor_uint(p, 7); cbor_uint(p, 3);
+    cbor_uint(p, 15); cbor_map(p, 1); cbor_uint(p, 5); cbor_uint(p, 60);
+}
+
+static void check_update(const action_t *actions, int size)
+{
+    CHECK_EQ(size, 1);
+    CHECK_EQ(actions[0].opmode, UPDATE);
+    CHECK(actions[0].filter.prefix != NULL && strcmp(actions[0].filter.prefix, "temp") == 0);
+    CHECK_EQ(actions[0].filter.group, 3);
+    CHECK_EQ(actions[0].update.delay, 60);
+}
+
+/* Eight polls in one message, as a dashboard refresh sends them */
+static void batch(payload_t *p)
+{
+    json(p, "{\"actions\":[");
+    for(int i = 0; i < 8; i++)
+    {
+        char action[96];
+        snprintf(action, sizeof(action), "%s{\"opcode\":\"GET_STATUS\",\"addr\":\"%04X\",\"sensor_prop_id\":\"0056\"}",
+            i > 0 ? "," : "", 0x0020 + i);
+        json(p, action);
+    }
+    json(p, "]}");
+
+    cbor_map(p, 1);
+    cbor_uint(p, 1); cbor_array(p, 8);
+    for(int i = 0; i < 8; i++)
+    {
+        cbor_map(p, 3);
+        cbor_uint(p, 1); cbor_uint(p, ESP_BLE_MESH_MODEL_OP_SENSOR_GET);
+        cbor_uint(p, 2); cbor_uint(p, 0x0020 + i);
+        cbor_uint(p, 3); cbor_uint(p, 0x0056);
+    }
+}
+
+static void check_batch(const action_t *actions, int size)
+{
+    CHECK_EQ(size, 8);
+    for(int i = 0; i < size; i++)
+    {
+        CHECK_EQ(actions[i].opmode, CREATE);
+        CHECK_EQ(actions[i].task.addr, 0x0020 + i);
+    }
+}
+
+typedef struct bench_t {
+    const char *name;
+    void (*write)(payload_t *p);
+    void (*check)(const action_t *actions, int size);
+} bench_t;
+
+static const bench_t benches[] = {
+    { "poll",   &poll,       &check_poll },
+    { "auto",   &auto_range, &check_auto_range },
+    { "list",   &list,       &check_list },
+    { "update", &update,     &check_update },
+    { "batch",  &batch,      &check_batch },
+};
+
+/******************** decoding ********************/
+
+static void free_actions(action_t *actions, int size)
+{
+    for(int i = 0; i < size; i++)
+    {
+        if(actions[i].opmode == CREATE)
+            free(actions[i].task.name);
+    }
+    free(actions);
+}
+
+/**
+ * @brief Decode a binary message as the ingress task does, into scratch
+ */
+static action_t* decode_bin(const payload_t *p, uint8_t *scratch, message_t *messages, int *size)
+{
+    action_bin_t reader;
+    const char *request_id;
+
+    *size = 0;
+    memcpy(scratch, p->bin, p->bin_len);
+    if(!action_bin_open(&reader, scratch, p->bin_len, &request_id))
+        return NULL;
+    return action_bin_actions(&reader, messages, size);
+}
+
+static int64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int main()
+{
+    message_t *messages = create_message(PLAIN_TEXT);
+    uint8_t scratch[MSG_MAX];
+
+    printf("  %-8s %6s %6s %6s %12s %12s\n", "message", "json B", "bin B", "ratio", "bin ns", "json ns");
+    for(size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++)
+    {
+        payload_t payload = { .json_len = 0, .bin_len = 0 };
+        benches[b].write(&payload);
+
+        int size;
+        action_t *actions = decode_bin(&payload, scratch, messages, &size);
+        benches[b].check(actions, size);
+        free_actions(actions, size);
+        CHECK_EQ(messages->m_content.text_plain.num_messages, 0);
+
+        int64_t start = now_ns();
+        for(int i = 0; i < RUNS; i++)
+        {
+            actions = decode_bin(&payload, scratch, messages, &size);
+            free_actions(actions, size);
+        }
+        int64_t bin_ns = (now_ns() - start) / RUNS;
+
+        char json_ns[16] = "-";
+#ifdef HOST_CJSON
+        start = now_ns();
+        for(int i = 0; i < RUNS; i++)
+        {
+            cJSON *root = cJSON_Parse(payload.json);
+            CHECK(root != NULL);
+            cJSON_Delete(root);
+        }
+        snprintf(json_ns, sizeof(json_ns), "%lld", (long long) ((now_ns() - start) / RUNS));
+#endif
+
+        printf("  %-8s %6d %6d %6.2f %12lld %12s\n", benches[b].name, payload.json_len, payload.bin_len,
+            (double) payload.bin_len / payload.json_len, (long long) bin_ns, json_ns);
+    }
+
+    free_message(messages);
+    return host_report("bench_decode");
+}
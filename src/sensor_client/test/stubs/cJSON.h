@@ -0,0 +1,49 @@
+#ifndef _HOST_CJSON_H_
+#define _HOST_CJSON_H_
+
+/*
+ * The part of cJSON the modules under test use, with the same types, see
+ * host_cjson.c. bench_decode times the cJSON of ESP-IDF instead, see
+ * CJSON_DIR in the Makefile.
+ */
+#define cJSON_Invalid (0)
+#define cJSON_False   (1 << 0)
+#define cJSON_True    (1 << 1)
+#define cJSON_NULL    (1 << 2)
+#define cJSON_Number  (1 << 3)
+#define cJSON_String  (1 << 4)
+#define cJSON_Array   (1 << 5)
+#define cJSON_Object  (1 << 6)
+
+typedef int cJSON_bool;
+
+typedef struct cJSON {
+    struct cJSON *next;
+    struct cJSON *prev;
+    struct cJSON *child;
+    int type;
+    char *valuestring;
+    int valueint;
+    double valuedouble;
+    char *string;
+} cJSON;
+
+/* Objects, arrays, strings without escapes, numbers, true, false and null */
+cJSON* cJSON_Parse(const char *value);
+void cJSON_Delete(cJSON *item);
+
+int cJSON_GetArraySize(const cJSON *array);
+cJSON* cJSON_GetArrayItem(const cJSON *array, int index);
+cJSON* cJSON_GetObjectItem(const cJSON *object, const char *string);
+
+cJSON_bool cJSON_IsBool(const cJSON *item);
+cJSON_bool cJSON_IsTrue(const cJSON *item);
+cJSON_bool cJSON_IsNumber(const cJSON *item);
+cJSON_bool cJSON_IsString(const cJSON *item);
+cJSON_bool cJSON_IsArray(const cJSON *item);
+cJSON_bool cJSON_IsObject(const cJSON *item);
+
+#define cJSON_ArrayForEach(element, array) \
+    for(element = (array != NULL) ? (array)->child : NULL; element != NULL; element = element->next)
+
+#endif
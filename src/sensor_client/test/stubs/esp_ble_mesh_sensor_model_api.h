@@ -0,0 +1,8 @@
+#ifndef _HOST_ESP_BLE_MESH_SENSOR_MODEL_API_H_
+#define _HOST_ESP_BLE_MESH_SENSOR_MODEL_API_H_
+
+/* The opcodes of the sensor client model the gateway sends */
+#define ESP_BLE_MESH_MODEL_OP_SENSOR_DESCRIPTOR_GET 0x8230
+#define ESP_BLE_MESH_MODEL_OP_SENSOR_GET            0x8231
+
+#endif
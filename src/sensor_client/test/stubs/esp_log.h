@@ -0,0 +1,23 @@
+#ifndef _HOST_ESP_LOG_H_
+#define _HOST_ESP_LOG_H_
+
+#include <stdio.h>
+
+#include "esp_err.h"
+
+/* Logs go to stderr with make V=1, the format is checked either way */
+#ifdef HOST_LOG
+#define HOST_LOG_ENABLED 1
+#else
+#define HOST_LOG_ENABLED 0
+#endif
+
+#define HOST_LOGX(level, tag, fmt, ...) \
+    do { if(HOST_LOG_ENABLED) fprintf(stderr, level " (%s) " fmt "\n", tag, ##__VA_ARGS__); } while(0)
+
+#define ESP_LOGE(tag, fmt, ...) HOST_LOGX("E", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) HOST_LOGX("W", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) HOST_LOGX("I", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) HOST_LOGX("D", tag, fmt, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef _HOST_ESP_SPI_FLASH_H_
+#define _HOST_ESP_SPI_FLASH_H_
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef _HOST_ESP_SYSTEM_H_
+#define _HOST_ESP_SYSTEM_H_
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/* Deterministic, seeded with host_seed */
+uint32_t esp_random(void);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef _HOST_QUEUE_H_
+#define _HOST_QUEUE_H_
+
+#include "freertos/FreeRTOS.h"
+
+#endif
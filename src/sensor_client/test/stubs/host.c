@@ -0,0 +1,310 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+#include "host.h"
+
+int host_failures = 0;
+
+/******************** semaphores ********************/
+
+/* Mutexes, binary and counting semaphores are all counting semaphores here */
+typedef struct host_sem_t {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    UBaseType_t count;
+    UBaseType_t max;
+} host_sem_t;
+
+static SemaphoreHandle_t sem_create(UBaseType_t max, UBaseType_t initial)
+{
+    host_sem_t *sem = (host_sem_t *) calloc(1, sizeof(host_sem_t));
+    pthread_mutex_init(&sem->mutex, NULL);
+    pthread_cond_init(&sem->cond, NULL);
+    sem->count = initial;
+    sem->max = max;
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return sem_create(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return sem_create(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial)
+{
+    return sem_create(max, initial);
+}
+
+/* The wait is in real time: a tick is a millisecond */
+BaseType_t xSemaphoreTake(SemaphoreHandle_t handle, TickType_t wait)
+{
+    host_sem_t *sem = (host_sem_t *) handle;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wait / 1000;
+    deadline.tv_nsec += (long) (wait % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&sem->mutex);
+    while(sem->count == 0 && wait > 0)
+    {
+        if(wait == portMAX_DELAY)
+            pthread_cond_wait(&sem->cond, &sem->mutex);
+        else if(pthread_cond_timedwait(&sem->cond, &sem->mutex, &deadline) != 0)
+            break;
+    }
+    BaseType_t taken = sem->count > 0;
+    if(taken)
+        sem->count--;
+    pthread_mutex_unlock(&sem->mutex);
+
+    return taken ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t handle)
+{
+    host_sem_t *sem = (host_sem_t *) handle;
+    BaseType_t given = pdFALSE;
+
+    pthread_mutex_lock(&sem->mutex);
+    if(sem->count < sem->max)
+    {
+        sem->count++;
+        given = pdTRUE;
+        pthread_cond_signal(&sem->cond);
+    }
+    pthread_mutex_unlock(&sem->mutex);
+
+    return given;
+}
+
+UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t handle)
+{
+    host_sem_t *sem = (host_sem_t *) handle;
+
+    pthread_mutex_lock(&sem->mutex);
+    UBaseType_t count = sem->count;
+    pthread_mutex_unlock(&sem->mutex);
+
+    return count;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t handle)
+{
+    host_sem_t *sem = (host_sem_t *) handle;
+    pthread_mutex_destroy(&sem->mutex);
+    pthread_cond_destroy(&sem->cond);
+    free(sem);
+}
+
+/******************** tasks ********************/
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return (TaskHandle_t) pthread_self();
+}
+
+char *pcTaskGetName(TaskHandle_t task)
+{
+    return "host";
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait)
+{
+    return 0;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    host_advance((int64_t) ticks * 1000);
+}
+
+/******************** esp_timer and the clock ********************/
+
+#define HOST_TIMERS 64
+
+struct host_timer_t {
+    esp_timer_cb_t callback;
+    void *arg;
+    bool armed;
+    int64_t deadline;
+    uint64_t period; // us, 0 for a one shot timer
+};
+
+static struct host_timer_t timers[HOST_TIMERS];
+static int num_timers = 0;
+static int64_t now_us = 0;
+static pthread_mutex_t clock_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int64_t esp_timer_get_time(void)
+{
+    pthread_mutex_lock(&clock_mutex);
+    int64_t now = now_us;
+    pthread_mutex_unlock(&clock_mutex);
+    return now;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle)
+{
+    pthread_mutex_lock(&clock_mutex);
+    if(num_timers == HOST_TIMERS)
+    {
+        pthread_mutex_unlock(&clock_mutex);
+        return ESP_ERR_NO_MEM;
+    }
+    struct host_timer_t *timer = &timers[num_timers++];
+    memset(timer, 0, sizeof(struct host_timer_t));
+    timer->callback = args->callback;
+    timer->arg = args->arg;
+    *handle = timer;
+    pthread_mutex_unlock(&clock_mutex);
+
+    return ESP_OK;
+}
+
+static esp_err_t timer_start(esp_timer_handle_t timer, uint64_t timeout_us, uint64_t period_us)
+{
+    pthread_mutex_lock(&clock_mutex);
+    timer->armed = true;
+    timer->deadline = now_us + (int64_t) timeout_us;
+    timer->period = period_us;
+    pthread_mutex_unlock(&clock_mutex);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    return timer_start(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+    return timer_start(timer, period_us, period_us);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    pthread_mutex_lock(&clock_mutex);
+    esp_err_t err = timer->armed ? ESP_OK : ESP_ERR_INVALID_STATE;
+    timer->armed = false;
+    pthread_mutex_unlock(&clock_mutex);
+
+    return err;
+}
+
+/**
+ * @brief Move the clock forward, firing the esp_timers that expire on the way
+ * @param us: microseconds
+ */
+void host_advance(int64_t us)
+{
+    pthread_mutex_lock(&clock_mutex);
+    int64_t target = now_us + us;
+
+    for(;;)
+    {
+        // the timer that expires first, callbacks run in order of expiry
+        struct host_timer_t *next = NULL;
+        for(int i = 0; i < num_timers; i++)
+        {
+            if(timers[i].armed && timers[i].deadline <= target
+               && (next == NULL || timers[i].deadline < next->deadline))
+                next = &timers[i];
+        }
+        if(next == NULL)
+            break;
+
+        if(next->deadline > now_us)
+            now_us = next->deadline;
+        if(next->period > 0)
+            next->deadline += (int64_t) next->period;
+        else
+            next->armed = false;
+
+        // the callback may start or stop timers
+        pthread_mutex_unlock(&clock_mutex);
+        next->callback(next->arg);
+        pthread_mutex_lock(&clock_mutex);
+    }
+    now_us = target;
+    pthread_mutex_unlock(&clock_mutex);
+}
+
+/**
+ * @brief Restart the clock from 0 and delete every esp_timer, as a reboot
+ * does, before the modules are initialized again
+ */
+void host_reboot()
+{
+    pthread_mutex_lock(&clock_mutex);
+    now_us = 0;
+    num_timers = 0;
+    pthread_mutex_unlock(&clock_mutex);
+}
+
+/******************** esp_random ********************/
+
+static uint32_t random_state = 1;
+static pthread_mutex_t random_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void host_seed(uint32_t seed)
+{
+    pthread_mutex_lock(&random_mutex);
+    random_state = seed != 0 ? seed : 1;
+    pthread_mutex_unlock(&random_mutex);
+}
+
+/* xorshift32 */
+uint32_t esp_random(void)
+{
+    pthread_mutex_lock(&random_mutex);
+    uint32_t x = random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    random_state = x;
+    pthread_mutex_unlock(&random_mutex);
+
+    return x;
+}
+
+/******************** report ********************/
+
+/**
+ * @brief Print the result of a test program
+ * @retval exit code
+ */
+int host_report(const char *name)
+{
+    if(host_failures > 0)
+    {
+        printf("%s: FAIL, %d checks failed\n", name, host_failures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
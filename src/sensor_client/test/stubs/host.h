@@ -0,0 +1,86 @@
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "source/messages_parser.h"
+
+/*
+ * Helpers of the host tests: the clock, the random numbers, the messages
+ * the code under test sends and the checks.
+ */
+
+/**
+ * @brief Move the clock forward, firing the esp_timers that expire on the way
+ * @param us: microseconds
+ */
+void host_advance(int64_t us);
+
+/**
+ * @brief Restart the clock from 0 and delete every esp_timer, as a reboot
+ * does, before the modules are initialized again
+ */
+void host_reboot();
+
+/**
+ * @brief Restart esp_random from a seed, so a run can be repeated
+ */
+void host_seed(uint32_t seed);
+
+/**
+ * @brief Messages passed to send_message_queue since the last host_sent_clear
+ * @param count: number of messages
+ * @retval array of messages, owned by the host
+ */
+message_t** host_sent(int *count);
+
+/**
+ * @brief Free the messages sent
+ */
+void host_sent_clear();
+
+/**
+ * @brief Return whether a message sent has a text line containing text
+ */
+bool host_sent_text(const char *text);
+
+/**
+ * @brief Add an erased data partition
+ * @param label: label of the partition
+ * @param size: bytes, a multiple of SPI_FLASH_SEC_SIZE
+ * @retval its bytes, to look at them or corrupt them
+ */
+uint8_t* host_partition_add(const char *label, uint32_t size);
+
+/**
+ * @brief Erase every NVS key, as a new gateway
+ */
+void host_nvs_erase();
+
+extern int host_failures;
+
+/* Check a condition, report it and go on so one run shows every failure */
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            host_failures++; \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while(0)
+
+#define CHECK_EQ(actual, expected) do { \
+        long long a_ = (long long) (actual), e_ = (long long) (expected); \
+        if(a_ != e_) { \
+            host_failures++; \
+            fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, a_, e_); \
+        } \
+    } while(0)
+
+/**
+ * @brief Print the result of a test program
+ * @retval exit code
+ */
+int host_report(const char *name);
+
+#endif
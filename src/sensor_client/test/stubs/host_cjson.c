@@ -0,0 +1,198 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cJSON.h"
+
+/*
+ * cJSON for the tests that load json, enough to read what they write:
+ * there are no escapes in strings nor printing.
+ */
+static cJSON* parse_value(const char **p);
+
+static void skip_spaces(const char **p)
+{
+    while(isspace((unsigned char) **p))
+        (*p)++;
+}
+
+// *p on the opening quote, NULL if the string does not end
+static char* parse_string(const char **p)
+{
+    const char *start = ++(*p);
+    const char *end = strchr(start, '"');
+    if(end == NULL)
+        return NULL;
+
+    *p = end + 1;
+    return strndup(start, end - start);
+}
+
+// *p on the opening bracket or brace
+static cJSON* parse_children(const char **p, cJSON *item, char close)
+{
+    cJSON **tail = &item->child;
+    cJSON *prev = NULL;
+
+    (*p)++;
+    skip_spaces(p);
+    while(**p != close)
+    {
+        char *key = NULL;
+        if(item->type == cJSON_Object)
+        {
+            if(**p != '"' || (key = parse_string(p)) == NULL)
+                return NULL;
+            skip_spaces(p);
+            if(**p != ':')
+            {
+                free(key);
+                return NULL;
+            }
+            (*p)++;
+        }
+
+        cJSON *child = parse_value(p);
+        if(child == NULL)
+        {
+            free(key);
+            return NULL;
+        }
+        child->string = key;
+        child->prev = prev;
+        *tail = child;
+        tail = &child->next;
+        prev = child;
+
+        skip_spaces(p);
+        if(**p == ',')
+            (*p)++;
+        else if(**p != close)
+            return NULL;
+        skip_spaces(p);
+    }
+    (*p)++;
+    return item;
+}
+
+static cJSON* parse_value(const char **p)
+{
+    cJSON *item = (cJSON *) calloc(1, sizeof(cJSON));
+    bool ok = true;
+
+    skip_spaces(p);
+    if(**p == '{' || **p == '[')
+    {
+        item->type = **p == '{' ? cJSON_Object : cJSON_Array;
+        ok = parse_children(p, item, **p == '{' ? '}' : ']') != NULL;
+    }
+    else if(**p == '"')
+    {
+        item->type = cJSON_String;
+        ok = (item->valuestring = parse_string(p)) != NULL;
+    }
+    else if(strncmp(*p, "true", 4) == 0 || strncmp(*p, "false", 5) == 0 || strncmp(*p, "null", 4) == 0)
+    {
+        item->type = **p == 't' ? cJSON_True : **p == 'f' ? cJSON_False : cJSON_NULL;
+        *p += **p == 'f' ? 5 : 4;
+    }
+    else
+    {
+        char *end;
+        item->type = cJSON_Number;
+        item->valuedouble = strtod(*p, &end);
+        item->valueint = (int) item->valuedouble;
+        ok = end != *p;
+        *p = end;
+    }
+
+    if(!ok)
+    {
+        cJSON_Delete(item);
+        return NULL;
+    }
+    return item;
+}
+
+cJSON* cJSON_Parse(const char *value)
+{
+    cJSON *item = parse_value(&value);
+    skip_spaces(&value);
+    if(item != NULL && *value != '\0')
+    {
+        cJSON_Delete(item);
+        return NULL;
+    }
+    return item;
+}
+
+void cJSON_Delete(cJSON *item)
+{
+    while(item != NULL)
+    {
+        cJSON *next = item->next;
+        cJSON_Delete(item->child);
+        free(item->valuestring);
+        free(item->string);
+        free(item);
+        item = next;
+    }
+}
+
+int cJSON_GetArraySize(const cJSON *array)
+{
+    int size = 0;
+    for(const cJSON *child = array != NULL ? array->child : NULL; child != NULL; child = child->next)
+        size++;
+    return size;
+}
+
+cJSON* cJSON_GetArrayItem(const cJSON *array, int index)
+{
+    cJSON *child = array != NULL ? array->child : NULL;
+    while(child != NULL && index-- > 0)
+        child = child->next;
+    return child;
+}
+
+cJSON* cJSON_GetObjectItem(const cJSON *object, const char *string)
+{
+    if(!cJSON_IsObject(object))
+        return NULL;
+
+    cJSON *child = object->child;
+    while(child != NULL && strcmp(child->string, string) != 0)
+        child = child->next;
+    return child;
+}
+
+cJSON_bool cJSON_IsBool(const cJSON *item)
+{
+    return item != NULL && (item->type & (cJSON_True | cJSON_False)) != 0;
+}
+
+cJSON_bool cJSON_IsTrue(const cJSON *item)
+{
+    return item != NULL && item->type == cJSON_True;
+}
+
+cJSON_bool cJSON_IsNumber(const cJSON *item)
+{
+    return item != NULL && item->type == cJSON_Number;
+}
+
+cJSON_bool cJSON_IsString(const cJSON *item)
+{
+    return item != NULL && item->type == cJSON_String;
+}
+
+cJSON_bool cJSON_IsArray(const cJSON *item)
+{
+    return item != NULL && item->type == cJSON_Array;
+}
+
+cJSON_bool cJSON_IsObject(const cJSON *item)
+{
+    return item != NULL && item->type == cJSON_Object;
+}
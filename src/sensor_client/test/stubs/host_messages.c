@@ -0,0 +1,110 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_timer.h"
+
+#include "host.h"
+
+/*
+ * messages_parser.c for the tests that do not link it: messages are
+ * kept instead of being queued, see host_sent.
+ */
+#define HOST_SENT_MAX 4096
+
+static message_t *sent[HOST_SENT_MAX];
+static int num_sent = 0;
+static pthread_mutex_t sent_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+message_t* create_message(message_type_t type)
+{
+    message_t *message = (message_t *) calloc(1, sizeof(message_t));
+    message->type = type;
+    return message;
+}
+
+void add_message_text_plain(message_t* m, bool error_message, const char* message, ...)
+{
+    text_t *text = &m->m_content.text_plain;
+    if(text->num_messages >= MAX_NUM_MESSAGES)
+        return;
+
+    va_list args;
+    va_start(args, message);
+    vsnprintf(text->messages[text->num_messages++], MAX_LENGHT_MESSAGE, message, args);
+    va_end(args);
+    text->error_message |= error_message;
+}
+
+void add_measure_to_message(message_t* m, uint16_t addr, uint16_t sensor_prop_id, int measure)
+{
+    m->m_content.measure.addr = addr;
+    m->m_content.measure.sensor_prop_id = sensor_prop_id;
+    m->m_content.measure.value = measure;
+}
+
+void free_message(message_t *message)
+{
+    if(message != NULL && (message->type == HEX_BUFFER || message->type == GET_DESCRIPTOR || message->type == PROFILE))
+        free(message->m_content.hex_buffer.data);
+    free(message);
+}
+
+void send_message_queue(message_t *message)
+{
+    pthread_mutex_lock(&sent_mutex);
+    if(num_sent < HOST_SENT_MAX)
+    {
+        message->enqueued = esp_timer_get_time();
+        sent[num_sent++] = message;
+        message = NULL;
+    }
+    pthread_mutex_unlock(&sent_mutex);
+
+    free_message(message);
+}
+
+/**
+ * @brief Messages passed to send_message_queue since the last host_sent_clear
+ * @param count: number of messages
+ * @retval array of messages, owned by the host
+ */
+message_t** host_sent(int *count)
+{
+    *count = num_sent;
+    return sent;
+}
+
+/**
+ * @brief Free the messages sent
+ */
+void host_sent_clear()
+{
+    pthread_mutex_lock(&sent_mutex);
+    for(int i = 0; i < num_sent; i++)
+        free_message(sent[i]);
+    num_sent = 0;
+    pthread_mutex_unlock(&sent_mutex);
+}
+
+/**
+ * @brief Return whether a message sent has a text line containing text
+ */
+bool host_sent_text(const char *text)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&sent_mutex);
+    for(int i = 0; i < num_sent && !found; i++)
+    {
+        if(sent[i]->type != PLAIN_TEXT && sent[i]->type != STATS)
+            continue;
+        for(int j = 0; j < sent[i]->m_content.text_plain.num_messages && !found; j++)
+            found = strstr(sent[i]->m_content.text_plain.messages[j], text) != NULL;
+    }
+    pthread_mutex_unlock(&sent_mutex);
+
+    return found;
+}
@@ -0,0 +1,9 @@
+#include "source/metrics.h"
+
+/*
+ * metrics.c for the tests that do not link it: the latencies of the
+ * stages are not kept.
+ */
+void metrics_add(metrics_stage_t stage, int64_t elapsed)
+{
+}
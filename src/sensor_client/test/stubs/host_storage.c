@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+#include "nvs_flash.h"
+
+#include "host.h"
+
+/******************** partitions ********************/
+
+#define HOST_PARTITIONS 4
+
+typedef struct host_partition_t {
+    esp_partition_t partition;
+    uint8_t *data;
+} host_partition_t;
+
+static host_partition_t partitions[HOST_PARTITIONS];
+static int num_partitions = 0;
+
+/**
+ * @brief Add an erased data partition
+ * @param label: label of the partition
+ * @param size: bytes, a multiple of SPI_FLASH_SEC_SIZE
+ * @retval its bytes, to look at them or corrupt them
+ */
+uint8_t* host_partition_add(const char *label, uint32_t size)
+{
+    host_partition_t *p = &partitions[num_partitions++];
+    p->partition.type = ESP_PARTITION_TYPE_DATA;
+    p->partition.subtype = ESP_PARTITION_SUBTYPE_ANY;
+    p->partition.size = size;
+    strncpy(p->partition.label, label, sizeof(p->partition.label) - 1);
+    p->data = (uint8_t *) malloc(size);
+    memset(p->data, 0xFF, size);
+    return p->data;
+}
+
+static host_partition_t* partition_of(const esp_partition_t *partition)
+{
+    return (host_partition_t *) partition;
+}
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    for(int i = 0; i < num_partitions; i++)
+    {
+        if(partitions[i].partition.type == type && (label == NULL || strcmp(partitions[i].partition.label, label) == 0))
+            return &partitions[i].partition;
+    }
+    return NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    if(src_offset + size > partition->size)
+        return ESP_ERR_INVALID_SIZE;
+    memcpy(dst, partition_of(partition)->data + src_offset, size);
+    return ESP_OK;
+}
+
+/* Writing only clears bits, as in NOR flash */
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    if(dst_offset + size > partition->size)
+        return ESP_ERR_INVALID_SIZE;
+    uint8_t *data = partition_of(partition)->data + dst_offset;
+    for(size_t i = 0; i < size; i++)
+        data[i] &= ((const uint8_t *) src)[i];
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    if(offset % SPI_FLASH_SEC_SIZE != 0 || size % SPI_FLASH_SEC_SIZE != 0 || offset + size > partition->size)
+        return ESP_ERR_INVALID_ARG;
+    memset(partition_of(partition)->data + offset, 0xFF, size);
+    return ESP_OK;
+}
+
+/******************** nvs ********************/
+
+#define HOST_NVS_ENTRIES   64
+#define HOST_NVS_HANDLES   8
+#define HOST_NVS_NAME_LEN  16
+
+typedef struct nvs_entry_t {
+    bool used;
+    char name_space[HOST_NVS_NAME_LEN];
+    char key[HOST_NVS_NAME_LEN];
+    void *value;
+    size_t length;
+} nvs_entry_t;
+
+typedef struct nvs_open_t {
+    bool used;
+    char name_space[HOST_NVS_NAME_LEN];
+    nvs_open_mode_t mode;
+} nvs_open_t;
+
+static nvs_entry_t entries[HOST_NVS_ENTRIES];
+static nvs_open_t handles[HOST_NVS_HANDLES];
+
+/**
+ * @brief Erase every NVS key, as a new gateway
+ */
+void host_nvs_erase()
+{
+    for(int i = 0; i < HOST_NVS_ENTRIES; i++)
+    {
+        free(entries[i].value);
+        memset(&entries[i], 0, sizeof(nvs_entry_t));
+    }
+}
+
+esp_err_t nvs_flash_init_partition(const char *part_name)
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase_partition(const char *part_name)
+{
+    host_nvs_erase();
+    return ESP_OK;
+}
+
+/* Handles are their index + 1, there is only the gateway partition */
+esp_err_t nvs_open_from_partition(const char *part_name, const char *name, nvs_open_mode_t mode, nvs_handle_t *handle)
+{
+    for(int i = 0; i < HOST_NVS_HANDLES; i++)
+    {
+        if(!handles[i].used)
+        {
+            handles[i].used = true;
+            handles[i].mode = mode;
+            strncpy(handles[i].name_space, name, HOST_NVS_NAME_LEN - 1);
+            *handle = i + 1;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+    handles[handle - 1].used = false;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return ESP_OK;
+}
+
+static nvs_entry_t* find_entry(nvs_handle_t handle, const char *key, bool create)
+{
+    nvs_entry_t *free_entry = NULL;
+    const char *name_space = handles[handle - 1].name_space;
+
+    for(int i = 0; i < HOST_NVS_ENTRIES; i++)
+    {
+        if(entries[i].used && strcmp(entries[i].name_space, name_space) == 0 && strcmp(entries[i].key, key) == 0)
+            return &entries[i];
+        if(!entries[i].used && free_entry == NULL)
+            free_entry = &entries[i];
+    }
+
+    if(create && free_entry != NULL)
+    {
+        free_entry->used = true;
+        strncpy(free_entry->name_space, name_space, HOST_NVS_NAME_LEN - 1);
+        strncpy(free_entry->key, key, HOST_NVS_NAME_LEN - 1);
+        return free_entry;
+    }
+    return NULL;
+}
+
+static esp_err_t set_value(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    if(handles[handle - 1].mode != NVS_READWRITE)
+        return ESP_ERR_INVALID_STATE;
+
+    nvs_entry_t *entry = find_entry(handle, key, true);
+    if(entry == NULL)
+        return ESP_ERR_NVS_NO_FREE_PAGES;
+
+    free(entry->value);
+    entry->value = malloc(length > 0 ? length : 1);
+    memcpy(entry->value, value, length);
+    entry->length = length;
+    return ESP_OK;
+}
+
+static esp_err_t get_value(nvs_handle_t handle, const char *key, void *value, size_t length)
+{
+    nvs_entry_t *entry = find_entry(handle, key, false);
+    if(entry == NULL || entry->length != length)
+        return ESP_ERR_NVS_NOT_FOUND;
+
+    memcpy(value, entry->value, length);
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_u16(nvs_handle_t handle, const char *key, uint16_t value)
+{
+    return set_value(handle, key, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u16(nvs_handle_t handle, const char *key, uint16_t *value)
+{
+    return get_value(handle, key, value, sizeof(*value));
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+    return set_value(handle, key, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *value)
+{
+    return get_value(handle, key, value, sizeof(*value));
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    return set_value(handle, key, value, length);
+}
+
+/* With value NULL, only the length is returned */
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *value, size_t *length)
+{
+    nvs_entry_t *entry = find_entry(handle, key, false);
+    if(entry == NULL)
+        return ESP_ERR_NVS_NOT_FOUND;
+
+    if(value != NULL)
+    {
+        if(*length < entry->length)
+            return ESP_ERR_INVALID_SIZE;
+        memcpy(value, entry->value, entry->length);
+    }
+    *length = entry->length;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    nvs_entry_t *entry = find_entry(handle, key, false);
+    if(entry == NULL)
+        return ESP_ERR_NVS_NOT_FOUND;
+
+    free(entry->value);
+    memset(entry, 0, sizeof(nvs_entry_t));
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle)
+{
+    const char *name_space = handles[handle - 1].name_space;
+
+    for(int i = 0; i < HOST_NVS_ENTRIES; i++)
+    {
+        if(entries[i].used && strcmp(entries[i].name_space, name_space) == 0)
+        {
+            free(entries[i].value);
+            memset(&entries[i], 0, sizeof(nvs_entry_t));
+        }
+    }
+    return ESP_OK;
+}
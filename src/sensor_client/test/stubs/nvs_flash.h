@@ -0,0 +1,12 @@
+#ifndef _HOST_NVS_FLASH_H_
+#define _HOST_NVS_FLASH_H_
+
+#include "nvs.h"
+
+#define ESP_ERR_NVS_NO_FREE_PAGES     0x110d
+#define ESP_ERR_NVS_NEW_VERSION_FOUND 0x1110
+
+esp_err_t nvs_flash_init_partition(const char *part_name);
+esp_err_t nvs_flash_erase_partition(const char *part_name);
+
+#endif
@@ -0,0 +1,338 @@
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "esp_timer.h"
+
+#include "source/message_queue.h"
+#include "source/mqtt_outbox.h"
+#include "host.h"
+
+/*
+ * The publishing side of the gateway against a broker that acks at its own
+ * pace: NODES nodes send a reading every READING_US to the telemetry queue
+ * and the cli gets an answer every CONTROL_US. The sender takes telemetry
+ * only while the outbox has room, as task_send_response_mqtt does, so a slow
+ * broker leaves readings in the queue where the coalesce policy keeps the
+ * newest one of each node.
+ */
+#define NODES       20
+#define READING_US  2000000
+#define CONTROL_US  5000000
+#define STEP_US     10000
+#define SLOW_US     250000 // between acks of the slow broker
+#define BROKER_MAX  256
+
+/*
+ * Acks in order, one every service_us. Down, it keeps them: esp-mqtt sends
+ * its outbox again on reconnect, except the messages it has expired.
+ */
+typedef struct broker_t {
+    int msg_id[BROKER_MAX];
+    int head;
+    int count;
+    int64_t service_us;
+    int64_t next_ack;
+    bool down;
+} broker_t;
+
+static broker_t broker;
+static int next_msg_id = 1;
+
+/* Readings of the current phase */
+typedef struct phase_t {
+    uint32_t produced;
+    uint32_t published;
+    uint32_t lost;         // taken from the queue and not enqueued
+    uint32_t not_gated;    // telemetry taken while the outbox was full
+    int64_t max_age;       // of the readings published, us
+    int64_t max_control;   // latency of the cli answers, us
+    uint32_t outbox_max;
+    uint32_t queue_max;
+    uint32_t node_published[NODES];
+} phase_t;
+
+static phase_t phase;
+static int last_value[NODES];      // last reading of each node
+static int last_published[NODES];  // last reading of each node published
+static int64_t next_reading[NODES];
+static int64_t next_control;
+static int next_value = 1;
+
+static void broker_enqueue(int msg_id)
+{
+    if(broker.count == BROKER_MAX)
+        return;
+    if(broker.count == 0)
+        broker.next_ack = esp_timer_get_time() + broker.service_us;
+    broker.msg_id[(broker.head + broker.count) % BROKER_MAX] = msg_id;
+    broker.count++;
+}
+
+static void broker_ack()
+{
+    while(!broker.down && broker.count > 0 && esp_timer_get_time() >= broker.next_ack)
+    {
+        mqtt_outbox_acked(broker.msg_id[broker.head]);
+        broker.head = (broker.head + 1) % BROKER_MAX;
+        broker.count--;
+        broker.next_ack += broker.service_us;
+    }
+}
+
+/**
+ * @brief The broker goes up or down or changes its pace
+ */
+static void broker_set(bool down, int64_t service_us)
+{
+    broker.down = down;
+    broker.service_us = service_us;
+    broker.next_ack = esp_timer_get_time() + service_us;
+}
+
+static void produce()
+{
+    int64_t now = esp_timer_get_time();
+
+    for(int i = 0; i < NODES; i++)
+    {
+        if(now < next_reading[i])
+            continue;
+        next_reading[i] += READING_US;
+
+        message_t *message = create_message(GET_STATUS);
+        add_measure_to_message(message, 0x0100 + i, 0x0056, next_value);
+        message->enqueued = now;
+        last_value[i] = next_value++;
+        phase.produced++;
+        message_queue_push(message);
+    }
+
+    if(now >= next_control)
+    {
+        next_control += CONTROL_US;
+        message_t *message = create_message(PLAIN_TEXT);
+        add_message_text_plain(message, false, "Task list");
+        message->enqueued = now;
+        message_queue_push(message);
+    }
+}
+
+/**
+ * @brief Publish one message the way the MQTT task does: readings go out
+ * with QoS 1 and need a place in the outbox, cli answers with QoS 0 do not
+ * @retval whether a message was taken from the queue
+ */
+static bool publish_one()
+{
+    bool room = mqtt_outbox_wait(0);
+    message_t *message = message_queue_receive(0, room);
+    if(message == NULL)
+        return false;
+
+    int64_t age = esp_timer_get_time() - message->enqueued;
+    if(message->type == GET_STATUS)
+    {
+        if(!room)
+            phase.not_gated++;
+
+        if(mqtt_outbox_has_space())
+        {
+            int msg_id = next_msg_id++;
+            mqtt_outbox_enqueued(msg_id);
+            broker_enqueue(msg_id);
+            int node = message->m_content.measure.addr - 0x0100;
+            last_published[node] = message->m_content.measure.value;
+            phase.node_published[node]++;
+            phase.published++;
+            if(age > phase.max_age)
+                phase.max_age = age;
+        }
+        else
+        {
+            phase.lost++;
+        }
+    }
+    else if(age > phase.max_control)
+    {
+        phase.max_control = age;
+    }
+    free_message(message);
+    return true;
+}
+
+/**
+ * @brief Run the gateway and the broker for a while
+ */
+static void run(int64_t us)
+{
+    for(int64_t t = 0; t < us; t += STEP_US)
+    {
+        host_advance(STEP_US);
+        produce();
+        broker_ack();
+        while(publish_one());
+
+        if(mqtt_outbox_level() > phase.outbox_max)
+            phase.outbox_max = mqtt_outbox_level();
+        if(message_queue_level() > phase.queue_max)
+            phase.queue_max = message_queue_level();
+    }
+}
+
+static void phase_start()
+{
+    memset(&phase, 0, sizeof(phase));
+}
+
+static void phase_print(const char *name)
+{
+    printf("  %-8s %5u readings, %5u published, max age %4lld ms, cli max %3lld ms, queue hwm %u, outbox hwm %u\n",
+        name, phase.produced, phase.published, (long long) phase.max_age / 1000,
+        (long long) phase.max_control / 1000, phase.queue_max, phase.outbox_max);
+}
+
+static void check_common()
+{
+    CHECK_EQ(phase.not_gated, 0);
+    CHECK_EQ(phase.lost, 0);
+    CHECK(phase.outbox_max <= CONFIG_MQTT_OUTBOX_LIMIT);
+    CHECK(phase.queue_max <= CONFIG_CONTROL_QUEUE_SIZE + CONFIG_TELEMETRY_QUEUE_SIZE);
+    // the cli is answered within a step whatever the broker does
+    CHECK(phase.max_control <= STEP_US);
+}
+
+/* A broker faster than the readings: everything goes out as it comes */
+static void test_fast_broker()
+{
+    message_queue_stats_t before, after;
+    message_queue_get_stats(MESSAGE_TELEMETRY, &before);
+
+    phase_start();
+    broker_set(false, 20000);
+    run(60000000);
+    phase_print("fast");
+    check_common();
+
+    message_queue_get_stats(MESSAGE_TELEMETRY, &after);
+    CHECK_EQ(after.coalesced - before.coalesced, 0);
+    CHECK_EQ(after.dropped - before.dropped, 0);
+    CHECK_EQ(phase.published, phase.produced);
+    CHECK(phase.max_age <= STEP_US);
+}
+
+/*
+ * A broker at 4 acks per second for 10 readings per second: the outbox stays
+ * full and the readings wait in the queue. Once it is full a new reading
+ * replaces the queued one of its node, or the oldest, so what is published
+ * is never older than the queue takes to drain at the pace of the broker.
+ */
+static void test_slow_broker()
+{
+    message_queue_stats_t before, after;
+    mqtt_outbox_stats_t outbox;
+    message_queue_get_stats(MESSAGE_TELEMETRY, &before);
+
+    phase_start();
+    broker_set(false, SLOW_US);
+    run(120000000);
+    phase_print("slow");
+    check_common();
+
+    message_queue_get_stats(MESSAGE_TELEMETRY, &after);
+    uint32_t coalesced = after.coalesced - before.coalesced;
+    printf("  %-8s %u coalesced, %u oldest dropped\n", "", coalesced, after.dropped - before.dropped);
+    CHECK(coalesced > 0);
+    CHECK_EQ(phase.outbox_max, CONFIG_MQTT_OUTBOX_LIMIT);
+    // no node is starved by the others
+    for(int i = 0; i < NODES; i++)
+        CHECK(phase.node_published[i] > 0);
+    CHECK(phase.published < phase.produced / 2);
+    CHECK(phase.max_age <= CONFIG_TELEMETRY_QUEUE_SIZE * SLOW_US + STEP_US);
+
+    mqtt_outbox_get_stats(&outbox);
+    CHECK(outbox.full > 0);
+}
+
+/*
+ * The broker stops acking: the outbox is full until its entries expire,
+ * then the messages sent while it is still down fill it again.
+ */
+static void test_outage()
+{
+    mqtt_outbox_stats_t before, after;
+    mqtt_outbox_get_stats(&before);
+
+    phase_start();
+    broker_set(true, 0);
+    run((int64_t) CONFIG_MQTT_OUTBOX_EXPIRY_MS * 1000 + 5000000);
+    phase_print("outage");
+    check_common();
+
+    mqtt_outbox_get_stats(&after);
+    CHECK(after.expired - before.expired >= CONFIG_MQTT_OUTBOX_LIMIT);
+    CHECK_EQ(after.acked - before.acked, 0);
+}
+
+/* Back to a fast broker: the backlog goes out and then the newest reading of every node */
+static void test_recovery()
+{
+    phase_start();
+    broker_set(false, 20000);
+    run(2 * READING_US);
+    phase_print("recovery");
+    check_common();
+
+    CHECK(phase.published >= NODES);
+    for(int i = 0; i < NODES; i++)
+        CHECK_EQ(last_published[i], last_value[i]);
+    CHECK_EQ(message_queue_level(), 0);
+}
+
+/* A full control queue blocks the producer for a while, then drops the new answer */
+static void test_control_block()
+{
+    message_queue_stats_t before, after;
+    message_queue_get_stats(MESSAGE_CONTROL, &before);
+
+    for(int i = 0; i < CONFIG_CONTROL_QUEUE_SIZE + 1; i++)
+    {
+        message_t *message = create_message(PLAIN_TEXT);
+        message->enqueued = esp_timer_get_time();
+        message_queue_push(message);
+    }
+
+    message_queue_get_stats(MESSAGE_CONTROL, &after);
+    CHECK_EQ(after.blocked - before.blocked, 1);
+    CHECK_EQ(after.dropped - before.dropped, 1);
+    CHECK_EQ(message_queue_level(), CONFIG_CONTROL_QUEUE_SIZE);
+
+    // the sender takes them without telemetry, as with the outbox full
+    int taken = 0;
+    message_t *message;
+    while((message = message_queue_receive(0, false)) != NULL)
+    {
+        free_message(message);
+        taken++;
+    }
+    CHECK_EQ(taken, CONFIG_CONTROL_QUEUE_SIZE);
+    CHECK_EQ(message_queue_level(), 0);
+}
+
+int main()
+{
+    init_message_queue();
+    init_mqtt_outbox();
+
+    // the nodes are not polled at the same time
+    for(int i = 0; i < NODES; i++)
+        next_reading[i] = (int64_t) i * READING_US / NODES;
+
+    test_fast_broker();
+    test_slow_broker();
+    test_outage();
+    test_recovery();
+    test_control_block();
+
+    host_sent_clear();
+    return host_report("test_backpressure");
+}
@@ -0,0 +1,279 @@
+#include <math.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+#include "source/request_tracker.h"
+#include "source/node_registry.h"
+#include "host.h"
+
+/*
+ * Managed flooding: every relay that hears a message for the first time
+ * sends it again with the ttl decremented, if its ttl is 2 or more. The
+ * mesh is a random placement of nodes in a square with the gateway near a
+ * corner, a node hears the ones within RANGE. Requests are sent through the tracker, which
+ * takes the ttl the registry learned from the replies, and compared with
+ * the fixed ttl of CONFIG_MSG_SEND_TTL.
+ */
+#define NODES       60
+#define AREA        100.0 // m, side of the square the nodes are in
+#define RANGE       25.0  // m
+#define RELAY_ONE_IN 4    // one node in RELAY_ONE_IN is not a relay
+#define POLLS       20    // requests to each node
+#define GATEWAY     0
+#define SENSOR_GET  0x8231
+#define FIRST_ADDR  0x0100
+
+typedef struct sim_node_t {
+    double x;
+    double y;
+    bool relay;
+    bool reachable; // its replies, sent with CONFIG_NODE_DEFAULT_TTL, reach the gateway
+    int relays;     // on the shortest way to the gateway
+} sim_node_t;
+
+static sim_node_t nodes[NODES + 1]; // the gateway is 0
+
+typedef struct flood_t {
+    uint32_t transmissions;
+    int recv_ttl[NODES + 1]; // ttl of the first copy heard, -1 if none
+} flood_t;
+
+static bool hears(int a, int b)
+{
+    return a != b && hypot(nodes[a].x - nodes[b].x, nodes[a].y - nodes[b].y) <= RANGE;
+}
+
+/**
+ * @brief Flood a message from src. Breadth first, so the first copy a node
+ * hears is the one with the highest ttl, the later ones are in its cache.
+ */
+static void flood(int src, int ttl, flood_t *out)
+{
+    int queue[NODES + 1];
+    int head = 0, tail = 0;
+
+    for(int i = 0; i <= NODES; i++)
+        out->recv_ttl[i] = -1;
+    out->transmissions = 1;
+
+    // the source transmits once, every node it hears gets the ttl as sent
+    out->recv_ttl[src] = ttl;
+    queue[tail++] = src;
+    while(head < tail)
+    {
+        int from = queue[head++];
+        // the gateway does not relay, a relay sends with ttl - 1 if it got 2 or more
+        int sent_ttl = from == src ? ttl : out->recv_ttl[from] - 1;
+        if(from != src)
+        {
+            if(from == GATEWAY || !nodes[from].relay || out->recv_ttl[from] < 2)
+                continue;
+            out->transmissions++;
+        }
+        for(int to = 0; to <= NODES; to++)
+        {
+            if(out->recv_ttl[to] < 0 && hears(from, to))
+            {
+                out->recv_ttl[to] = sent_ttl;
+                queue[tail++] = to;
+            }
+        }
+    }
+}
+
+/* What the mesh did with the last request to each node */
+typedef struct outcome_t {
+    bool sent;
+    bool delivered;
+    uint32_t opcode;
+    int reply_ttl; // ttl of the reply at the gateway
+} outcome_t;
+
+/* Counters of a run, by the relays between the gateway and the node */
+typedef struct run_t {
+    uint32_t polls[CONFIG_NODE_DEFAULT_TTL];
+    uint32_t requests[CONFIG_NODE_DEFAULT_TTL]; // with the retries
+    uint32_t delivered[CONFIG_NODE_DEFAULT_TTL];
+    uint32_t transmissions[CONFIG_NODE_DEFAULT_TTL];
+} run_t;
+
+static outcome_t outcomes[NODES + 1];
+static run_t *current;
+static int fixed_ttl = -1; // send with it instead of the ttl of the tracker
+
+static int index_of(uint16_t addr)
+{
+    return addr - FIRST_ADDR + 1;
+}
+
+static esp_err_t mesh_send(const mesh_request_t *request)
+{
+    int node = index_of(request->addr);
+    flood_t f;
+    flood(GATEWAY, fixed_ttl >= 0 ? fixed_ttl : request->ttl, &f);
+    current->transmissions[nodes[node].relays] += f.transmissions;
+    current->requests[nodes[node].relays]++;
+
+    outcomes[node].sent = true;
+    outcomes[node].opcode = request->opcode;
+    outcomes[node].delivered = f.recv_ttl[node] >= 0;
+    if(outcomes[node].delivered)
+    {
+        flood(node, CONFIG_NODE_DEFAULT_TTL, &f);
+        outcomes[node].reply_ttl = f.recv_ttl[GATEWAY];
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Answer the request in flight to a node, or time it out, the way
+ * sensor_model_client.c does
+ * @retval whether it was given up
+ */
+static bool mesh_complete(int node)
+{
+    uint16_t addr = FIRST_ADDR + node - 1;
+    outcome_t outcome = outcomes[node];
+    bool delivered = outcome.delivered && outcome.reply_ttl >= 0;
+    bool gave_up = false;
+
+    outcomes[node].sent = false;
+    host_advance(delivered ? 300000 : (int64_t) CONFIG_RTO_INITIAL_MS * 1000);
+    request_tracker_complete(addr, outcome.opcode, esp_timer_get_time(), delivered ? REPLY_OK : REPLY_TIMEOUT, NULL, &gave_up);
+
+    if(delivered)
+    {
+        node_registry_lock();
+        node_link_ttl_sample(node_registry_get(addr), outcome.reply_ttl);
+        node_registry_unlock();
+    }
+    return gave_up;
+}
+
+/**
+ * @brief Poll every reachable node POLLS times through the tracker
+ */
+static void run(int ttl, run_t *out)
+{
+    host_reboot();
+    init_node_registry();
+    request_tracker_init(mesh_send);
+    memset(outcomes, 0, sizeof(outcomes));
+    memset(out, 0, sizeof(run_t));
+    current = out;
+    fixed_ttl = ttl;
+
+    for(int poll = 0; poll < POLLS; poll++)
+    {
+        for(int node = 1; node <= NODES; node++)
+        {
+            if(!nodes[node].reachable)
+                continue;
+            out->polls[nodes[node].relays]++;
+            request_tracker_submit(SENSOR_GET, FIRST_ADDR + node - 1, 0x0050);
+            bool gave_up = false;
+            while(outcomes[node].sent && !gave_up)
+            {
+                bool delivered = outcomes[node].delivered;
+                gave_up = mesh_complete(node);
+                if(delivered)
+                    out->delivered[nodes[node].relays]++;
+                else if(!gave_up) // the retry goes after its backoff
+                    host_advance((int64_t) CONFIG_RETRY_BACKOFF_MAX_MS * 2000);
+            }
+            // a node held off is polled again once the hold off is over
+            host_advance((int64_t) CONFIG_DEAD_NODE_HOLDOFF_MS * 1000 * 16);
+        }
+    }
+}
+
+static uint32_t sum(const uint32_t *counts)
+{
+    uint32_t total = 0;
+    for(int relays = 0; relays < CONFIG_NODE_DEFAULT_TTL; relays++)
+        total += counts[relays];
+    return total;
+}
+
+static void place_nodes()
+{
+    nodes[GATEWAY].x = 10.0;
+    nodes[GATEWAY].y = 10.0;
+    for(int i = 1; i <= NODES; i++)
+    {
+        nodes[i].x = (esp_random() % 1000) * AREA / 1000.0;
+        nodes[i].y = (esp_random() % 1000) * AREA / 1000.0;
+        nodes[i].relay = esp_random() % RELAY_ONE_IN != 0;
+    }
+
+    // links are symmetric: the replies of a node reach the gateway
+    // if a request with the same ttl reaches the node
+    flood_t f;
+    flood(GATEWAY, CONFIG_NODE_DEFAULT_TTL, &f);
+    for(int i = 1; i <= NODES; i++)
+    {
+        nodes[i].reachable = f.recv_ttl[i] >= 0;
+        nodes[i].relays = CONFIG_NODE_DEFAULT_TTL - f.recv_ttl[i];
+    }
+}
+
+int main()
+{
+    host_seed(29);
+    place_nodes();
+
+    int reachable = 0;
+    int by_relays[CONFIG_NODE_DEFAULT_TTL] = { 0 };
+    for(int i = 1; i <= NODES; i++)
+    {
+        if(!nodes[i].reachable)
+            continue;
+        reachable++;
+        by_relays[nodes[i].relays]++;
+    }
+    printf("  %d nodes, %d reachable, %d polls each\n", NODES, reachable, POLLS);
+
+    run_t fixed, learned;
+    run(CONFIG_MSG_SEND_TTL, &fixed);
+    run(-1, &learned);
+
+    printf("  relays nodes | fixed ttl %d answered, tx/request | learned ttl answered, tx/request\n", CONFIG_MSG_SEND_TTL);
+    for(int relays = 0; relays < CONFIG_NODE_DEFAULT_TTL; relays++)
+    {
+        if(by_relays[relays] == 0)
+            continue;
+        printf("  %6d %5d | %4u/%-4u %5.1f | %4u/%-4u %5.1f\n", relays, by_relays[relays],
+            fixed.delivered[relays], fixed.polls[relays], (double) fixed.transmissions[relays] / fixed.requests[relays],
+            learned.delivered[relays], learned.polls[relays], (double) learned.transmissions[relays] / learned.requests[relays]);
+    }
+    printf("  transmissions per poll answered: fixed ttl %.1f, learned %.1f\n",
+        (double) sum(fixed.transmissions) / sum(fixed.delivered), (double) sum(learned.transmissions) / sum(learned.delivered));
+
+    // the learned ttl reaches every node, neighbours with less flooding,
+    // and an answer costs less airtime than with the fixed ttl
+    CHECK_EQ(sum(learned.delivered), sum(learned.polls));
+    CHECK(learned.transmissions[0] < fixed.transmissions[0]);
+    CHECK((uint64_t) sum(learned.transmissions) * sum(fixed.delivered) < (uint64_t) sum(fixed.transmissions) * sum(learned.delivered));
+
+    // the ttl of a node is its relays + 1 + CONFIG_TTL_MARGIN, and 0 only without relays or margin
+    node_registry_lock();
+    for(int i = 1; i <= NODES; i++)
+    {
+        mesh_node_t *node = node_registry_find(FIRST_ADDR + i - 1);
+        if(!nodes[i].reachable || node == NULL)
+            continue;
+        CHECK(node->hops_known);
+        CHECK_EQ(node->hops, nodes[i].relays);
+        CHECK_EQ(node->ttl, nodes[i].relays + CONFIG_TTL_MARGIN == 0 ? 0 : nodes[i].relays + CONFIG_TTL_MARGIN + 1);
+    }
+    node_registry_unlock();
+
+    tracker_stats_t stats;
+    request_tracker_get_stats(&stats);
+    printf("  hops saved against fixed ttl: %u\n", stats.ttl_saved);
+
+    return host_report("test_flooding");
+}
@@ -0,0 +1,307 @@
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "esp_timer.h"
+
+#include "source/request_tracker.h"
+#include "source/node_registry.h"
+#include "host.h"
+
+/*
+ * The client model only takes one request per destination and rejects the
+ * next one until the first is answered (EBUSY). The mesh here does the same,
+ * so any request the tracker lets through while another is in flight to the
+ * same node is counted as busy.
+ */
+#define SENSOR_GET 0x8231
+
+typedef struct mesh_t {
+    pthread_mutex_t mutex;
+    bool outstanding[0x100];
+    mesh_request_t current[0x100];
+    uint32_t sent;
+    uint32_t busy;
+    uint32_t reject; // next sends to reject as if the model failed
+} mesh_t;
+
+static mesh_t mesh = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static esp_err_t mesh_send(const mesh_request_t *request)
+{
+    esp_err_t err = ESP_OK;
+
+    pthread_mutex_lock(&mesh.mutex);
+    if(mesh.reject > 0)
+    {
+        mesh.reject--;
+        err = ESP_FAIL;
+    }
+    else if(mesh.outstanding[request->addr])
+    {
+        mesh.busy++;
+        err = ESP_ERR_INVALID_STATE;
+    }
+    else
+    {
+        mesh.outstanding[request->addr] = true;
+        mesh.current[request->addr] = *request;
+        mesh.sent++;
+    }
+    pthread_mutex_unlock(&mesh.mutex);
+
+    return err;
+}
+
+/**
+ * @brief Answer the request in flight to addr, if any
+ * @retval whether there was one
+ */
+static bool mesh_answer(uint16_t addr, tracker_reply_t reply, bool *gave_up)
+{
+    pthread_mutex_lock(&mesh.mutex);
+    bool outstanding = mesh.outstanding[addr];
+    mesh_request_t request = mesh.current[addr];
+    mesh.outstanding[addr] = false;
+    pthread_mutex_unlock(&mesh.mutex);
+
+    if(outstanding)
+    {
+        bool ignored;
+        request_tracker_complete(addr, request.opcode, esp_timer_get_time(), reply, NULL, gave_up != NULL ? gave_up : &ignored);
+    }
+    return outstanding;
+}
+
+static void reset()
+{
+    memset(mesh.outstanding, 0, sizeof(mesh.outstanding));
+    mesh.sent = 0;
+    mesh.busy = 0;
+    mesh.reject = 0;
+    host_reboot();
+    init_node_registry();
+    request_tracker_init(mesh_send);
+}
+
+/* Polls to one node while another is in flight wait in its queue */
+static void test_queue_per_destination()
+{
+    reset();
+    int statuses[DROPPED + 1] = { 0 };
+    for(int i = 0; i < 10; i++)
+        statuses[request_tracker_submit(SENSOR_GET, 0x0005, 0x0050 + i)]++;
+
+    CHECK_EQ(statuses[DISPATCHED], 1);
+    CHECK_EQ(statuses[QUEUED], TRACKER_QUEUE_DEPTH);
+    CHECK_EQ(statuses[DROPPED], 10 - 1 - TRACKER_QUEUE_DEPTH);
+    CHECK(!request_tracker_has_room(0x0005));
+
+    // every answer sends the next one, in order
+    uint16_t expected = 0x0050;
+    while(mesh.outstanding[0x0005])
+    {
+        CHECK_EQ(mesh.current[0x0005].sensor_prop_id, expected++);
+        host_advance(200000);
+        mesh_answer(0x0005, REPLY_OK, NULL);
+    }
+    CHECK_EQ(mesh.sent, 1 + TRACKER_QUEUE_DEPTH);
+    CHECK_EQ(mesh.busy, 0);
+    CHECK(request_tracker_has_room(0x0005));
+}
+
+/* An identical poll is answered by the one in flight or queued */
+static void test_coalesce()
+{
+    reset();
+    CHECK_EQ(request_tracker_submit(SENSOR_GET, 0x0006, 0x0050), DISPATCHED);
+    CHECK_EQ(request_tracker_submit(SENSOR_GET, 0x0006, 0x0050), COALESCED);
+    CHECK_EQ(request_tracker_submit(SENSOR_GET, 0x0006, 0x0051), QUEUED);
+    CHECK_EQ(request_tracker_submit(SENSOR_GET, 0x0006, 0x0051), COALESCED);
+
+    while(mesh_answer(0x0006, REPLY_OK, NULL));
+    CHECK_EQ(mesh.sent, 2);
+    CHECK_EQ(mesh.busy, 0);
+
+    tracker_stats_t stats;
+    request_tracker_get_stats(&stats);
+    CHECK_EQ(stats.coalesced, 2);
+    CHECK_EQ(stats.completed, 2);
+}
+
+/* A timeout is sent again after a backoff, then given up */
+static void test_retry_and_give_up()
+{
+    reset();
+    CHECK_EQ(request_tracker_submit(SENSOR_GET, 0x0007, 0x0050), DISPATCHED);
+    CHECK_EQ(request_tracker_submit(SENSOR_GET, 0x0007, 0x0051), QUEUED);
+
+    bool gave_up = false;
+    for(int attempt = 0; attempt <= CONFIG_MAX_RETRIES; attempt++)
+    {
+        CHECK_EQ(mesh.current[0x0007].attempt, attempt);
+        CHECK_EQ(mesh.current[0x0007].sensor_prop_id, 0x0050);
+        mesh_answer(0x0007, REPLY_TIMEOUT, &gave_up);
+        CHECK_EQ(gave_up, attempt == CONFIG_MAX_RETRIES);
+        // nothing is sent before the backoff
+        CHECK_EQ(mesh.outstanding[0x0007], gave_up);
+        host_advance((int64_t) CONFIG_RETRY_BACKOFF_MAX_MS * 2000);
+    }
+
+    // the queued poll goes once the first one is given up
+    CHECK_EQ(mesh.current[0x0007].sensor_prop_id, 0x0051);
+    CHECK_EQ(mesh.current[0x0007].attempt, 0);
+    mesh_answer(0x0007, REPLY_OK, NULL);
+    CHECK_EQ(mesh.busy, 0);
+}
+
+/* A node that keeps failing is held off, its queued polls are not sent */
+static void test_dead_node()
+{
+    reset();
+    for(int failure = 0; failure < CONFIG_DEAD_NODE_FAILURES; failure++)
+    {
+        CHECK_EQ(request_tracker_submit(SENSOR_GET, 0x0008, 0x0050), DISPATCHED);
+        bool gave_up = false;
+        while(!gave_up)
+        {
+            mesh_answer(0x0008, REPLY_TIMEOUT, &gave_up);
+            host_advance((int64_t) CONFIG_RETRY_BACKOFF_MAX_MS * 2000);
+        }
+    }
+
+    CHECK_EQ(request_tracker_submit(SENSOR_GET, 0x0008, 0x0050), SUPPRESSED);
+    CHECK(!mesh.outstanding[0x0008]);
+
+    host_advance((int64_t) CONFIG_DEAD_NODE_HOLDOFF_MS * 1000);
+    CHECK_EQ(request_tracker_submit(SENSOR_GET, 0x0008, 0x0050), DISPATCHED);
+    mesh_answer(0x0008, REPLY_OK, NULL);
+    CHECK_EQ(request_tracker_submit(SENSOR_GET, 0x0008, 0x0050), DISPATCHED);
+    CHECK_EQ(mesh.busy, 0);
+}
+
+/* A request the model rejects does not block the ones behind it */
+static void test_send_rejected()
+{
+    reset();
+    mesh.reject = 1;
+    CHECK_EQ(request_tracker_submit(SENSOR_GET, 0x0009, 0x0050), DISPATCHED);
+    CHECK(!mesh.outstanding[0x0009]);
+    CHECK_EQ(request_tracker_submit(SENSOR_GET, 0x0009, 0x0051), DISPATCHED);
+    CHECK(mesh.outstanding[0x0009]);
+
+    tracker_stats_t stats;
+    request_tracker_get_stats(&stats);
+    CHECK_EQ(stats.send_errors, 1);
+}
+
+/* A request whose answer was lost does not block its destination for good */
+static void test_stale()
+{
+    reset();
+    CHECK_EQ(request_tracker_submit(SENSOR_GET, 0x000A, 0x0050), DISPATCHED);
+    mesh.outstanding[0x000A] = false; // the answer never reaches the tracker
+
+    CHECK_EQ(request_tracker_submit(SENSOR_GET, 0x000A, 0x0051), QUEUED);
+    host_advance(((int64_t) CONFIG_RTO_INITIAL_MS + CONFIG_TRACKER_STALE_TIMEOUT_MS) * 1000 + 1);
+    CHECK_EQ(request_tracker_submit(SENSOR_GET, 0x000A, 0x0052), DISPATCHED);
+    CHECK_EQ(mesh.busy, 0);
+}
+
+#define POLLERS        8
+#define POLLS          500
+#define POLLED_NODES   3
+
+static int pollers_done = 0;
+static uint32_t poll_statuses[DROPPED + 1];
+static uint32_t poll_waits = 0;
+static pthread_mutex_t statuses_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* A task polling the nodes the way the scheduler does: it waits while the queue of the node is full */
+static void* poller(void *arg)
+{
+    int id = (int) (intptr_t) arg;
+    uint32_t statuses[DROPPED + 1] = { 0 };
+    uint32_t waits = 0;
+
+    for(int i = 0; i < POLLS; i++)
+    {
+        uint16_t addr = 0x0010 + (i + id) % POLLED_NODES;
+        uint16_t prop = 0x0050 + (i * POLLERS + id) % 7;
+        tracker_status_t status = DROPPED;
+        // another poller may fill the queue between the check and the submit
+        while(!request_tracker_has_room(addr) || (status = request_tracker_submit(SENSOR_GET, addr, prop)) == DROPPED)
+        {
+            waits++;
+            sched_yield();
+        }
+        statuses[status]++;
+    }
+
+    pthread_mutex_lock(&statuses_mutex);
+    for(int s = 0; s <= DROPPED; s++)
+        poll_statuses[s] += statuses[s];
+    poll_waits += waits;
+    pollers_done++;
+    pthread_mutex_unlock(&statuses_mutex);
+    return NULL;
+}
+
+/* Pollers on several threads while the mesh answers from another */
+static void test_concurrent_pollers()
+{
+    reset();
+    pthread_t threads[POLLERS];
+    for(int i = 0; i < POLLERS; i++)
+        pthread_create(&threads[i], NULL, poller, (void *) (intptr_t) i);
+
+    uint32_t answered = 0;
+    for(;;)
+    {
+        pthread_mutex_lock(&statuses_mutex);
+        bool done = pollers_done == POLLERS;
+        pthread_mutex_unlock(&statuses_mutex);
+
+        bool any = false;
+        for(int n = 0; n < POLLED_NODES; n++)
+        {
+            if(mesh_answer(0x0010 + n, REPLY_OK, NULL))
+            {
+                any = true;
+                answered++;
+            }
+        }
+        if(done && !any)
+            break;
+        sched_yield();
+    }
+    for(int i = 0; i < POLLERS; i++)
+        pthread_join(threads[i], NULL);
+
+    tracker_stats_t stats;
+    request_tracker_get_stats(&stats);
+
+    // every poll was sent once and answered, or answered by an identical one
+    CHECK_EQ(mesh.busy, 0);
+    CHECK_EQ(poll_statuses[DISPATCHED] + poll_statuses[QUEUED] + poll_statuses[COALESCED], POLLERS * POLLS);
+    CHECK_EQ(mesh.sent, poll_statuses[DISPATCHED] + poll_statuses[QUEUED]);
+    CHECK_EQ(answered, mesh.sent);
+    CHECK_EQ(stats.completed, mesh.sent);
+    printf("  %d polls to %d nodes from %d threads: %u sent, %u coalesced, %u waits for room, 0 rejected busy\n",
+        POLLERS * POLLS, POLLED_NODES, POLLERS, mesh.sent, poll_statuses[COALESCED], poll_waits);
+}
+
+int main()
+{
+    host_seed(27);
+    test_queue_per_destination();
+    test_coalesce();
+    test_retry_and_give_up();
+    test_dead_node();
+    test_send_rejected();
+    test_stale();
+    test_concurrent_pollers();
+    host_sent_clear();
+    return host_report("test_request_tracker");
+}
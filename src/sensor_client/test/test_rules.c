@@ -0,0 +1,226 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "esp_timer.h"
+
+#include "source/rules.h"
+#include "source/node_registry.h"
+#include "host.h"
+
+/*
+ * Replay of traces of readings through the rules, the way the decode task
+ * evaluates them. A trace in traces/ is a list of lines:
+ *
+ *   rules [rule, ...]             load a table, as {"cmd": "rules"} does
+ *   <ms> <addr> <prop> <value>    a reading of addr received at ms
+ *   <ms>                          nothing received until ms
+ *   > <ms> <rule> firing|resolved <addr> <prop> <value>
+ *                                 an alert the line before has to send
+ *   ! <text>                      an error the line before has to answer
+ *
+ * and # comments. Times are from the start of the trace, the clock goes
+ * on in steps of CONFIG_RULES_CHECK_MS checking the missing rules as the
+ * idle decode task does. Any alert or error a line sends that the next
+ * lines do not expect is a failure too.
+ */
+#define LINE_MAX_LEN 1024
+#define OUTPUT_MAX   64
+
+static const char *traces[] = {
+    "rules_threshold.txt",
+    "rules_rate.txt",
+    "rules_missing.txt",
+    "rules_debounce.txt",
+    "rules_errors.txt",
+};
+
+static int64_t start_us;    // esp_timer time of the start of the trace
+static char output[OUTPUT_MAX][LINE_MAX_LEN]; // alerts and errors of the last line
+static int num_output;
+static int next_output;
+static int replayed;        // lines of readings and alerts
+
+static void advance_to(int64_t us)
+{
+    while(esp_timer_get_time() + CONFIG_RULES_CHECK_MS * 1000 <= us)
+    {
+        host_advance(CONFIG_RULES_CHECK_MS * 1000);
+        rules_check_missing();
+    }
+    host_advance(us - esp_timer_get_time());
+}
+
+/* A reading as it goes from the model callback to the decode task */
+static void reading(uint16_t addr, uint16_t sensor_prop_id, int value)
+{
+    int64_t now = esp_timer_get_time();
+
+    node_registry_lock();
+    mesh_node_t *node = node_registry_get(addr);
+    node_registry_seen(node, now, -50);
+    rules_evaluate(node, sensor_prop_id, value, now);
+    node_registry_set_value(node, sensor_prop_id, value, now);
+    node_registry_unlock();
+    rules_send_alerts();
+    rules_check_missing();
+}
+
+/**
+ * @brief Keep the alerts and the errors sent since the last line, as the
+ * lines of a trace would write them
+ */
+static void collect_output()
+{
+    int count;
+    message_t **sent = host_sent(&count);
+
+    num_output = 0;
+    next_output = 0;
+    for(int i = 0; i < count && num_output < OUTPUT_MAX; i++)
+    {
+        if(sent[i]->type == ALERT)
+        {
+            const alert_t *alert = &sent[i]->m_content.alert;
+            snprintf(output[num_output++], LINE_MAX_LEN, "%lld %s %s %04X %04X %d",
+                (long long) (alert->taken - start_us) / 1000, alert->rule, alert->firing ? "firing" : "resolved",
+                alert->addr, alert->sensor_prop_id, alert->value);
+        }
+        else if(sent[i]->type == PLAIN_TEXT && sent[i]->m_content.text_plain.error_message)
+        {
+            for(int j = 0; j < sent[i]->m_content.text_plain.num_messages && num_output < OUTPUT_MAX; j++)
+                snprintf(output[num_output++], LINE_MAX_LEN, "%s", sent[i]->m_content.text_plain.messages[j]);
+        }
+    }
+    host_sent_clear();
+}
+
+static void check_no_output_left(const char *trace, int line)
+{
+    for(; next_output < num_output; next_output++)
+    {
+        host_failures++;
+        fprintf(stderr, "%s:%d: not expected: %s\n", trace, line, output[next_output]);
+    }
+}
+
+// one space between words, none at the ends
+static void normalize(char *text)
+{
+    char *out = text;
+    for(char *in = text; *in != '\0'; in++)
+    {
+        if(isspace((unsigned char) *in))
+        {
+            if(out != text && out[-1] != ' ')
+                *out++ = ' ';
+        }
+        else
+        {
+            *out++ = *in;
+        }
+    }
+    if(out != text && out[-1] == ' ')
+        out--;
+    *out = '\0';
+}
+
+static void expect(const char *trace, int line, char kind, char *expected)
+{
+    normalize(expected);
+    if(next_output == num_output)
+    {
+        host_failures++;
+        fprintf(stderr, "%s:%d: expected %c %s, nothing sent\n", trace, line, kind, expected);
+        return;
+    }
+
+    const char *actual = output[next_output++];
+    bool ok = kind == '>' ? strcmp(actual, expected) == 0 : strstr(actual, expected) != NULL;
+    if(!ok)
+    {
+        host_failures++;
+        fprintf(stderr, "%s:%d: expected %c %s, sent %s\n", trace, line, kind, expected, actual);
+    }
+}
+
+static void replay(const char *name)
+{
+    char path[256];
+    char text[LINE_MAX_LEN];
+    int line = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", TRACES_DIR, name);
+    FILE *file = fopen(path, "r");
+    if(file == NULL)
+    {
+        host_failures++;
+        fprintf(stderr, "%s: can not be opened\n", path);
+        return;
+    }
+
+    // from a whole check period, so the checks fall on whole seconds of the trace
+    int64_t now = esp_timer_get_time();
+    start_us = now - now % (CONFIG_RULES_CHECK_MS * 1000) + 10 * CONFIG_RULES_CHECK_MS * 1000;
+    advance_to(start_us);
+    host_sent_clear();
+    num_output = next_output = 0;
+
+    while(fgets(text, sizeof(text), file) != NULL)
+    {
+        line++;
+        if(text[0] == '#' || text[0] == '\n')
+            continue;
+
+        if(text[0] == '>' || text[0] == '!')
+        {
+            expect(name, line, text[0], text + 1);
+            replayed++;
+            continue;
+        }
+
+        check_no_output_left(name, line);
+
+        long long ms;
+        unsigned int addr, sensor_prop_id;
+        int value;
+        int fields = sscanf(text, "%lld %x %x %d", &ms, &addr, &sensor_prop_id, &value);
+        if(strncmp(text, "rules ", 6) == 0)
+        {
+            cJSON *rules = cJSON_Parse(text + 6);
+            CHECK(rules != NULL);
+            rules_load(rules);
+            cJSON_Delete(rules);
+        }
+        else if(fields == 4 || fields == 1)
+        {
+            CHECK(start_us + ms * 1000 >= esp_timer_get_time());
+            advance_to(start_us + ms * 1000);
+            if(fields == 4)
+                reading(addr, sensor_prop_id, value);
+            replayed++;
+        }
+        else
+        {
+            host_failures++;
+            fprintf(stderr, "%s:%d: wrong line %s", name, line, text);
+        }
+        collect_output();
+    }
+    check_no_output_left(name, line);
+    fclose(file);
+}
+
+int main()
+{
+    host_nvs_erase();
+    init_node_registry();
+    init_rules();
+
+    for(size_t i = 0; i < sizeof(traces) / sizeof(traces[0]); i++)
+        replay(traces[i]);
+
+    printf("  %d lines of %d traces replayed\n", replayed, (int) (sizeof(traces) / sizeof(traces[0])));
+    return host_report("test_rules");
+}
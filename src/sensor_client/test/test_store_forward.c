@@ -0,0 +1,242 @@
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+
+#include "source/store_forward.h"
+#include "host.h"
+
+/*
+ * Outages of the broker: readings go to the RAM ring, are spilled to the
+ * telemetry partition and come back oldest first with the time they were
+ * taken. The partition is SECTORS sectors of RAM with the bits of NOR
+ * flash, so it can be torn and read back after a reboot.
+ */
+#define SECTORS         4
+#define SECTOR_RECORDS  (SPI_FLASH_SEC_SIZE / sizeof(sf_record_t))
+#define CAPACITY        (SECTORS * SECTOR_RECORDS)
+#define PERIOD_US       1000000 // between readings
+
+static uint8_t *flash;
+static int next_value = 0;  // value of the next reading, they count up
+static int next_check = 0;  // value expected from the next forwarded reading
+static int64_t taken[100000]; // esp_timer time of each reading, by value
+
+/**
+ * @brief Take n readings, one every PERIOD_US, while offline
+ */
+static void take(int n)
+{
+    for(int i = 0; i < n; i++)
+    {
+        host_advance(PERIOD_US);
+        message_t *message = create_message(GET_STATUS);
+        add_measure_to_message(message, 0x0005, 0x0056, next_value);
+        message->m_content.measure.taken = esp_timer_get_time();
+        taken[next_value++] = esp_timer_get_time();
+        store_forward_put(message);
+        free_message(message);
+    }
+}
+
+/**
+ * @brief Forward the readings in batches, the way mqtt.c drains them
+ * @param same_boot: they were taken in this boot, their age is known
+ * @retval readings forwarded
+ */
+static int drain(bool same_boot)
+{
+    message_t *messages[CONFIG_SF_DRAIN_BATCH];
+    int forwarded = 0;
+    int n;
+
+    host_advance(5 * PERIOD_US);
+    while((n = store_forward_peek(messages, CONFIG_SF_DRAIN_BATCH)) > 0)
+    {
+        for(int i = 0; i < n; i++)
+        {
+            measure_t *m = &messages[i]->m_content.measure;
+            // in order, the ones lost are the oldest
+            CHECK(m->value >= next_check);
+            CHECK_EQ(m->addr, 0x0005);
+            CHECK_EQ(m->sensor_prop_id, 0x0056);
+            next_check = m->value + 1;
+
+            if(same_boot)
+            {
+                CHECK_EQ(m->taken, taken[m->value]);
+                CHECK_EQ(m->age_ms, (esp_timer_get_time() - taken[m->value]) / 1000);
+            }
+            else
+            {
+                // the clock of the boot they were taken in is gone
+                CHECK_EQ(m->age_ms, -1);
+                CHECK_EQ(m->taken, 0);
+            }
+            free_message(messages[i]);
+        }
+        store_forward_commit(n);
+        forwarded += n;
+        host_advance(CONFIG_SF_DRAIN_PERIOD_MS * 1000);
+    }
+    CHECK(!store_forward_pending());
+    return forwarded;
+}
+
+static void reboot()
+{
+    host_reboot();
+    init_store_forward();
+}
+
+/* A short outage stays in RAM */
+static void test_ram_only()
+{
+    take(CONFIG_SF_RAM_RECORDS - 1);
+    CHECK_EQ(drain(true), CONFIG_SF_RAM_RECORDS - 1);
+    CHECK_EQ(next_check, next_value);
+}
+
+/* A longer one is spilled to flash and comes back in order with its times */
+static void test_spill()
+{
+    take(700);
+    CHECK_EQ(drain(true), 700);
+    CHECK_EQ(next_check, next_value);
+}
+
+/* Longer than the partition: the oldest sectors are erased for the new readings */
+static void test_wrap()
+{
+    int first = next_value;
+    take(3 * CAPACITY);
+    int forwarded = drain(true);
+    CHECK_EQ(next_check, next_value);
+    // at least the sectors that are not being written and the RAM ring
+    CHECK(forwarded >= (int) ((SECTORS - 1) * SECTOR_RECORDS) + CONFIG_SF_RAM_RECORDS);
+    CHECK(forwarded <= (int) CAPACITY + CONFIG_SF_RAM_RECORDS);
+    CHECK(next_check - forwarded > first);
+}
+
+/* Readings spilled before a reboot are forwarded after it, the RAM ring is lost */
+static void test_reboot()
+{
+    take(3 * CONFIG_SF_RAM_RECORDS + 10);
+    int spilled = 3 * CONFIG_SF_RAM_RECORDS;
+    int last_spilled = next_value - 11;
+    reboot();
+    CHECK_EQ(drain(false), spilled);
+    CHECK_EQ(next_check, last_spilled + 1);
+    next_check = next_value;
+}
+
+/* A reboot between a peek and its commit forwards them again, none is lost */
+static void test_reboot_before_commit()
+{
+    take(2 * CONFIG_SF_RAM_RECORDS);
+    message_t *messages[CONFIG_SF_DRAIN_BATCH];
+    int first = next_check;
+    int n = store_forward_peek(messages, CONFIG_SF_DRAIN_BATCH);
+    for(int i = 0; i < n; i++)
+        free_message(messages[i]);
+    store_forward_commit(n / 2);
+
+    reboot();
+    n = store_forward_peek(messages, CONFIG_SF_DRAIN_BATCH);
+    CHECK(n > 0);
+    CHECK_EQ(messages[0]->m_content.measure.value, first + CONFIG_SF_DRAIN_BATCH / 2);
+    for(int i = 0; i < n; i++)
+        free_message(messages[i]);
+    next_check = first + CONFIG_SF_DRAIN_BATCH / 2;
+    CHECK_EQ(drain(false), CONFIG_SF_RAM_RECORDS - CONFIG_SF_DRAIN_BATCH / 2);
+    next_check = next_value;
+}
+
+/*
+ * Power lost while a record was written: its value is in flash but not its
+ * seq. It is not forwarded, and the records written after the reboot are
+ * not written over it.
+ */
+static void test_torn_record()
+{
+    take(CONFIG_SF_RAM_RECORDS + 1);
+    int spilled_last = next_value - 2;
+
+    // find the slot after the last record and write half of a record in it
+    uint32_t slot = 0;
+    for(uint32_t i = 0; i < CAPACITY; i++)
+    {
+        sf_record_t record;
+        memcpy(&record, flash + i * sizeof(sf_record_t), sizeof(record));
+        if(record.seq != 0xFFFFFFFF && record.value == spilled_last)
+            slot = (i + 1) % CAPACITY;
+    }
+    sf_record_t torn = { .seq = 0xFFFFFFFF, .time = 0x12345678, .value = 0x00FF00FF, .addr = 0x0000, .sensor_prop_id = 0x0000 };
+    memcpy(flash + slot * sizeof(sf_record_t), &torn, sizeof(torn) / 2 + 4);
+
+    reboot();
+    CHECK_EQ(drain(false), CONFIG_SF_RAM_RECORDS);
+    CHECK_EQ(next_check, spilled_last + 1);
+
+    next_check = next_value;
+    take(2 * CONFIG_SF_RAM_RECORDS);
+    CHECK_EQ(drain(true), 2 * CONFIG_SF_RAM_RECORDS);
+    CHECK_EQ(next_check, next_value);
+}
+
+/* A record corrupted in flash is dropped, the rest are forwarded */
+static void test_corrupt_record()
+{
+    take(2 * CONFIG_SF_RAM_RECORDS + 1);
+    reboot();
+
+    // the seq of the fifth record to forward is no longer valid
+    for(uint32_t i = 0; i < CAPACITY; i++)
+    {
+        sf_record_t record;
+        memcpy(&record, flash + i * sizeof(sf_record_t), sizeof(record));
+        if(record.seq != 0xFFFFFFFF && record.value == next_check + 4)
+            memset(flash + i * sizeof(sf_record_t), 0x00, 2);
+    }
+    CHECK_EQ(drain(false), 2 * CONFIG_SF_RAM_RECORDS - 1);
+    CHECK_EQ(next_check, next_value - 1);
+    next_check = next_value;
+}
+
+/* Without the partition, the RAM ring keeps the newest readings */
+static void test_no_partition()
+{
+    // the partition is looked up by label
+    char label[sizeof(SF_PARTITION)];
+    esp_partition_t *partition = (esp_partition_t *) esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, SF_PARTITION);
+    memcpy(label, partition->label, sizeof(label));
+    partition->label[0] = '\0';
+
+    reboot();
+    take(3 * CONFIG_SF_RAM_RECORDS);
+    CHECK_EQ(drain(true), CONFIG_SF_RAM_RECORDS);
+    CHECK_EQ(next_check, next_value);
+
+    memcpy(partition->label, label, sizeof(label));
+}
+
+int main()
+{
+    flash = host_partition_add(SF_PARTITION, SECTORS * SPI_FLASH_SEC_SIZE);
+    init_store_forward();
+
+    test_ram_only();
+    test_spill();
+    test_wrap();
+    test_reboot();
+    test_reboot_before_commit();
+    test_torn_record();
+    test_corrupt_record();
+    test_no_partition();
+
+    printf("  %d readings through RAM and a %u record partition\n", next_value, (unsigned) CAPACITY);
+    host_sent_clear();
+    return host_report("test_store_forward");
+}
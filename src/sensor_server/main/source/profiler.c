@@ -0,0 +1,151 @@
+#include "sdkconfig.h"
+
+#if CONFIG_NODE_PROFILER
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include "source/profiler.h"
+
+#define PROFILER_TRACKED_TASKS 32
+
+static const char *TAG = "PROFILER";
+
+/* Run time counters of the previous record, to measure cpu between records */
+typedef struct task_run_time_t {
+    UBaseType_t number;
+    uint32_t run_time;
+} task_run_time_t;
+
+static task_run_time_t previous[PROFILER_TRACKED_TASKS];
+static int num_previous;
+static uint32_t previous_total;
+
+static void put_u16(uint8_t *buf, uint16_t value)
+{
+    buf[0] = value & 0xFF;
+    buf[1] = value >> 8;
+}
+
+static void put_u32(uint8_t *buf, uint32_t value)
+{
+    for(int i = 0; i < 4; i++)
+        buf[i] = (value >> (8 * i)) & 0xFF;
+}
+
+static uint32_t previous_run_time(UBaseType_t number)
+{
+    for(int i = 0; i < num_previous; i++)
+    {
+        if(previous[i].number == number)
+            return previous[i].run_time;
+    }
+    return 0; // task created after the previous record
+}
+
+static int compare_stack(const void *a, const void *b)
+{
+    const TaskStatus_t *ta = a;
+    const TaskStatus_t *tb = b;
+    return (int) ta->usStackHighWaterMark - (int) tb->usStackHighWaterMark;
+}
+
+static bool is_idle_task(const TaskStatus_t *task)
+{
+    return strncmp(task->pcTaskName, "IDLE", 4) == 0;
+}
+
+/**
+ * @brief Take a profile of the node and write it as a profile record
+ * @param buf: where the record is written
+ * @param size: size of buf, tasks that do not fit are left out
+ * @retval length of the record, 0 if it could not be taken
+ */
+uint16_t profiler_snapshot(uint8_t *buf, uint16_t size)
+{
+    if(size < PROFILE_HEADER_LEN)
+        return 0;
+
+    // some room for tasks created while the array is allocated
+    UBaseType_t num_tasks = uxTaskGetNumberOfTasks() + 2;
+    TaskStatus_t *tasks = malloc(sizeof(TaskStatus_t) * num_tasks);
+    if(tasks == NULL)
+    {
+        ESP_LOGE(TAG, "No memory for %d task status", num_tasks);
+        return 0;
+    }
+
+    uint32_t total = 0;
+    num_tasks = uxTaskGetSystemState(tasks, num_tasks, &total);
+
+    // the total is the run time of one core, tasks run on all of them
+    uint64_t elapsed = (uint64_t) (total - previous_total) * portNUM_PROCESSORS;
+    uint32_t idle = 0;
+    uint32_t *cpu = malloc(sizeof(uint32_t) * num_tasks);
+    if(cpu == NULL)
+    {
+        free(tasks);
+        return 0;
+    }
+
+    for(UBaseType_t i = 0; i < num_tasks; i++)
+    {
+        cpu[i] = tasks[i].ulRunTimeCounter - previous_run_time(tasks[i].xTaskNumber);
+        if(is_idle_task(&tasks[i]))
+            idle += cpu[i];
+    }
+
+    // keep the counters for the next record, then reuse them as the cpu of this one
+    num_previous = 0;
+    for(UBaseType_t i = 0; i < num_tasks; i++)
+    {
+        if(num_previous < PROFILER_TRACKED_TASKS)
+        {
+            previous[num_previous].number = tasks[i].xTaskNumber;
+            previous[num_previous].run_time = tasks[i].ulRunTimeCounter;
+            num_previous++;
+        }
+        tasks[i].ulRunTimeCounter = cpu[i];
+    }
+    free(cpu);
+    previous_total = total;
+
+    qsort(tasks, num_tasks, sizeof(TaskStatus_t), compare_stack);
+
+    uint16_t length = PROFILE_HEADER_LEN;
+    uint8_t listed = 0;
+    for(UBaseType_t i = 0; i < num_tasks && length + PROFILE_TASK_LEN <= size; i++)
+    {
+        if(is_idle_task(&tasks[i]))
+            continue;
+
+        uint8_t *record = buf + length;
+        memset(record, 0, PROFILE_TASK_NAME);
+        strncpy((char *) record, tasks[i].pcTaskName, PROFILE_TASK_NAME);
+        record[PROFILE_TASK_NAME] = elapsed == 0 ? PROFILE_UNKNOWN_CPU :
+            (uint8_t) ((uint64_t) tasks[i].ulRunTimeCounter * 100 / elapsed);
+        put_u16(record + PROFILE_TASK_NAME + 1,
+            tasks[i].usStackHighWaterMark > UINT16_MAX ? UINT16_MAX : tasks[i].usStackHighWaterMark);
+
+        length += PROFILE_TASK_LEN;
+        listed++;
+    }
+    free(tasks);
+
+    buf[0] = PROFILE_VERSION;
+    uint64_t idle_share = elapsed == 0 ? 0 : (uint64_t) idle * 100 / elapsed;
+    buf[1] = elapsed == 0 ? PROFILE_UNKNOWN_CPU : (uint8_t) (idle_share > 100 ? 0 : 100 - idle_share);
+    buf[2] = listed;
+    put_u32(buf + 3, heap_caps_get_free_size(MALLOC_CAP_8BIT));
+    put_u32(buf + 7, heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+    put_u32(buf + 11, heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+
+    return length;
+}
+
+#endif
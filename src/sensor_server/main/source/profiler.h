@@ -0,0 +1,43 @@
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+/*
+ * Sensor property with the profile of the node. It is not in the mesh
+ * device properties, so it is only sent when it is asked for explicitly.
+ */
+#define SENSOR_PROPERTY_PROFILE 0xFFF0
+
+/*
+ * Profile record, the gateway publishes it as json. Little endian, packed:
+ *  header: version (1), cpu load % (1), number of tasks (1),
+ *          free heap (4), minimum free heap (4), largest free block (4)
+ *  task:   name (6, zero padded), cpu % (1), stack high water mark in bytes (2)
+ * Cpu is measured since the previous record, 255 if unknown. Idle tasks are
+ * not listed and tasks are sorted from the least free stack to the most.
+ */
+#define PROFILE_VERSION      1
+#define PROFILE_HEADER_LEN   15
+#define PROFILE_TASK_NAME    6
+#define PROFILE_TASK_LEN     (PROFILE_TASK_NAME + 3)
+#define PROFILE_UNKNOWN_CPU  255
+
+// a profile has to fit in a Format B sensor data (128 bytes)
+#define PROFILE_MAX_LEN      (PROFILE_HEADER_LEN + CONFIG_PROFILER_MAX_TASKS * PROFILE_TASK_LEN)
+
+#if CONFIG_NODE_PROFILER
+
+/**
+ * @brief Take a profile of the node and write it as a profile record
+ * @param buf: where the record is written
+ * @param size: size of buf, tasks that do not fit are left out
+ * @retval length of the record, 0 if it could not be taken
+ */
+uint16_t profiler_snapshot(uint8_t *buf, uint16_t size);
+
+#endif
+
+#endif
@@ -13,6 +13,7 @@
 
 #include "source/sensor_model_server.h"
 #include "source/si7021_i2c.h"
+#include "source/profiler.h"
 
 static const char* TAG = "SensorServer";
 
@@ -387,6 +388,34 @@ static uint16_t ble_mesh_get_sensor_data(esp_ble_mesh_sensor_state_t *state, uin
     return (mpid_len + data_len);
 }
 
+#if CONFIG_NODE_PROFILER
+static void ble_mesh_send_sensor_profile_status(esp_ble_mesh_sensor_server_cb_param_t *param){
+
+    uint8_t status[ESP_BLE_MESH_SENSOR_DATA_FORMAT_B_MPID_LEN + PROFILE_MAX_LEN];
+    uint32_t mpid = 0;
+    uint16_t length = 0;
+    esp_err_t err;
+
+    length = profiler_snapshot(status + ESP_BLE_MESH_SENSOR_DATA_FORMAT_B_MPID_LEN, PROFILE_MAX_LEN);
+    if (length == 0) {
+        ESP_LOGE(TAG, "Failed to take the profile");
+        return;
+    }
+    ESP_LOG_BUFFER_HEX("Profile", status + ESP_BLE_MESH_SENSOR_DATA_FORMAT_B_MPID_LEN, length);
+
+    /* The profile is longer than 16 bytes, only Format B can carry it */
+    mpid = ESP_BLE_MESH_SENSOR_DATA_FORMAT_B_MPID(length - 1, SENSOR_PROPERTY_PROFILE);
+    memcpy(status, &mpid, ESP_BLE_MESH_SENSOR_DATA_FORMAT_B_MPID_LEN);
+    length += ESP_BLE_MESH_SENSOR_DATA_FORMAT_B_MPID_LEN;
+
+    err = esp_ble_mesh_server_model_send_msg(param->model, &param->ctx,
+            ESP_BLE_MESH_MODEL_OP_SENSOR_STATUS, length, status);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to send Sensor Status");
+    }
+}
+#endif
+
 static void ble_mesh_send_sensor_status(esp_ble_mesh_sensor_server_cb_param_t *param){
 
     uint8_t *status = NULL;
@@ -396,6 +425,15 @@ static void ble_mesh_send_sensor_status(esp_ble_mesh_sensor_server_cb_param_t *p
     esp_err_t err;
     int i;
 
+#if CONFIG_NODE_PROFILER
+    /* The profile is not a sensor state, it is only sent when it is asked for */
+    if (param->value.get.sensor_data.op_en &&
+        param->value.get.sensor_data.property_id == SENSOR_PROPERTY_PROFILE) {
+        ble_mesh_send_sensor_profile_status(param);
+        return;
+    }
+#endif
+
     /**
      * Sensor Data state from Mesh Model Spec
      * |--------Field--------|-Size (octets)-|------------------------Notes-------------------------|